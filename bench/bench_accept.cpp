@@ -0,0 +1,106 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include "../src/server.hpp"
+#include "bench_utils.hpp"
+
+/*
+ * Connection storm: many client threads open a connection,
+ * send one request, read the response and close it, over and
+ * over. The server's client pool is smaller than the number
+ * of concurrent clients so accepting has to pause and resume.
+ *
+ * Reports accepted connections per second and the number of
+ * connections that never got a response (stranded in the
+ * backlog).
+ */
+
+constexpr int    POOL_SIZE      = 64;
+constexpr int    CLIENT_THREADS = 128;
+constexpr double DURATION_SEC   = 3.0;
+
+static void run_server(int port, ServerConfig config)
+{
+    std::clog.setstate(std::ios::failbit);
+    auto *server = new Server<POOL_SIZE>(config);
+    if (!server->listen(port, "127.0.0.1"))
+        exit(-1);
+    for (;;) {
+        Request req;
+        server->wait(req);
+        server->status(200);
+        server->header("Connection", "Close");
+        server->write("Hello, world!");
+        server->send();
+    }
+}
+
+static void bench(const char *name, int port, ServerConfig config)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_server(port, config);
+        exit(0);
+    }
+    usleep(200000);
+
+    std::atomic<bool> stop(false);
+    std::atomic<long> served(0);
+    std::atomic<long> stranded(0);
+
+    std::vector<std::thread> clients;
+    for (int i = 0; i < CLIENT_THREADS; i++)
+        clients.emplace_back([&]() {
+            while (!stop) {
+                int fd = connect_to(port);
+                if (fd < 0)
+                    continue;
+
+                // A connection that doesn't get a response in
+                // this time is considered stranded.
+                struct timeval tv = {2, 0};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+                static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                send(fd, request, sizeof(request)-1, 0);
+
+                char buf[1024];
+                int n = recv(fd, buf, sizeof(buf), 0);
+                if (n > 0)
+                    served++;
+                else if (!stop)
+                    stranded++;
+                close(fd);
+            }
+        });
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(DURATION_SEC));
+    stop = true;
+    for (std::thread& t : clients)
+        t.join();
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    std::cout << name << ": " << (long) (served / DURATION_SEC)
+              << " connections/sec, " << stranded << " stranded\n";
+}
+
+int main()
+{
+    ServerConfig config;
+    bench("default", 8300, config);
+
+    config.defer_accept = 1;
+    bench("defer accept", 8301, config);
+
+    config.defer_accept = 0;
+    config.max_accepts_per_event = 1;
+    bench("one accept per event", 8302, config);
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include "../src/buffer.hpp"
+
+/*
+ * Measures the cost of draining a buffer in small steps.
+ *
+ * A 64 KiB response is written into a buffer and drained
+ * 1460 bytes (one TCP segment) at a time, as when a client
+ * reads it slowly. A second case consumes many pipelined
+ * requests one by one from the same buffer.
+ *
+ * "Buffer" is compared with the previous design, that moved
+ * the remaining bytes to the front at each consume.
+ *
+ * Lastly, the buffers of short-lived connections (one request
+ * and one response each) are allocated with and without a
+ * "BufferSlab".
+ */
+
+constexpr int RESPONSE_SIZE = 64 * 1024;
+constexpr int SEGMENT_SIZE  = 1460;
+constexpr int ITERATIONS    = 20000;
+
+constexpr int PIPELINED     = 256;
+constexpr int REQUEST_SIZE  = 200;
+
+// Minimal version of the previous design
+struct MemmoveBuffer {
+
+    char data[RESPONSE_SIZE + PIPELINED * REQUEST_SIZE];
+    int  used = 0;
+
+    void write(const char *src, int len)
+    {
+        memcpy(data + used, src, len);
+        used += len;
+    }
+
+    int read(char *dst, int max)
+    {
+        int copy = std::min(used, max);
+        memcpy(dst, data, copy);
+        memmove(data, data + copy, used - copy);
+        used -= copy;
+        return copy;
+    }
+
+    void consume(int num)
+    {
+        memmove(data, data + num, used - num);
+        used -= num;
+    }
+};
+
+static char response[RESPONSE_SIZE];
+static char requests[PIPELINED * REQUEST_SIZE];
+
+template <typename B>
+static double drain_response(B& buffer)
+{
+    char segment[SEGMENT_SIZE];
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        buffer.write(response, sizeof(response));
+        while (buffer.read(segment, sizeof(segment)) > 0);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / ITERATIONS;
+}
+
+template <typename B>
+static double consume_pipelined(B& buffer)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        buffer.write(requests, sizeof(requests));
+        for (int j = 0; j < PIPELINED; j++)
+            buffer.consume(REQUEST_SIZE);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / ITERATIONS;
+}
+
+static double connection_churn(BufferSlab *slab)
+{
+    constexpr int CONNECTIONS = 64;
+    Buffer *in  = new Buffer[CONNECTIONS];
+    Buffer *out = new Buffer[CONNECTIONS];
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+
+        // Connections come and go in batches
+        for (int j = 0; j < CONNECTIONS; j++) {
+            in[j]  = Buffer();
+            out[j] = Buffer();
+            in[j].use_slab(slab);
+            out[j].use_slab(slab);
+            in[j].write(requests, REQUEST_SIZE);
+            out[j].write(response, 4096);
+        }
+        for (int j = 0; j < CONNECTIONS; j++) {
+            in[j].consume(REQUEST_SIZE);
+            out[j].consume(4096);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    delete[] in;
+    delete[] out;
+    return std::chrono::duration<double, std::micro>(end - start).count() / ITERATIONS;
+}
+
+int main()
+{
+    memset(response, 'x', sizeof(response));
+    memset(requests, 'y', sizeof(requests));
+
+    static MemmoveBuffer old_buffer;
+    Buffer buffer;
+
+    std::cout << "drain 64 KiB in 1460 byte steps (us):\n";
+    std::cout << "  memmove " << drain_response(old_buffer) << "\n";
+    std::cout << "  offsets " << drain_response(buffer) << "\n";
+
+    std::cout << "consume " << PIPELINED << " pipelined requests (us):\n";
+    std::cout << "  memmove " << consume_pipelined(old_buffer) << "\n";
+    std::cout << "  offsets " << consume_pipelined(buffer) << "\n";
+
+    BufferSlab slab;
+    std::cout << "64 connections, one request each (us):\n";
+    std::cout << "  new[]   " << connection_churn(nullptr) << "\n";
+    std::cout << "  slab    " << connection_churn(&slab) << "\n";
+    std::cout << "  slab hit rate " << slab.stats().hit_rate() << "\n";
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <iostream>
+#include "../src/cache.hpp"
+#include "../src/response.hpp"
+
+/*
+ * Measures the cost of answering a GET request, once it
+ * was parsed, until the response is in the output chain,
+ * which is then cleared as if it was sent. Bodies of 1 KiB
+ * and 16 KiB are used.
+ *
+ * Building the response with "Response" is compared with
+ * a hit in the "ResponseCache", which makes the key, looks
+ * it up and references the cached blob from the chain, as
+ * the event loop does, so it doesn't depend on the size of
+ * the body. A plain "memcpy" of the response into the
+ * chain is given for reference.
+ *
+ * The best of a few rounds is reported.
+ */
+
+constexpr int ITERATIONS = 1000000;
+constexpr int ROUNDS     = 5;
+
+template <typename F>
+static double measure(F answer)
+{
+    OutputChain chain;
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < ITERATIONS; i++) {
+            answer(chain);
+            chain.clear();
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / ITERATIONS;
+        if (round == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+static bool run(const Request& req, int body_len)
+{
+    std::string body(body_len, 'x');
+    CommonHeaders common;
+    common.date = true;
+
+    auto respond = [&](Response& res) {
+        res.status(200);
+        res.header("Content-Type", "text/html");
+        res.write(body.data(), body.size());
+        res.finish();
+    };
+
+    auto build = [&](OutputChain& chain) {
+        Response res;
+        res.begin(chain, true, &common);
+        respond(res);
+    };
+
+    // Fill the cache with the same response
+    ResponseCache cache;
+    cache.vary(H::AcceptEncoding);
+    {
+        std::string key;
+        cache.make_key(req, key);
+
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true, &common);
+        res.cache(60000);
+        respond(res);
+
+        CachedResponse cached;
+        if (!res.take_cached(cached))
+            return false;
+        cache.insert(key, cached, 0);
+    }
+
+    std::string key;
+    auto hit = [&](OutputChain& chain) {
+        cache.make_key(req, key);
+        const CachedResponse *cached = cache.find(key, 0);
+        Response::write_cached(chain, *cached, true);
+    };
+
+    OutputChain serialized;
+    build(serialized);
+    std::string bytes(serialized.length(), '\0');
+    serialized.copy(0, &bytes[0], bytes.size());
+
+    auto copy = [&](OutputChain& chain) {
+        chain.write(bytes.data(), bytes.size());
+    };
+
+    std::cout << "Response with a " << body_len / 1024 << " KiB body (ns):\n";
+    std::cout << "  built     " << measure(build) << "\n";
+    std::cout << "  cache hit " << measure(hit) << "\n";
+    std::cout << "  memcpy    " << measure(copy) << "\n";
+    return true;
+}
+
+int main()
+{
+    const char src[] = "GET /articles/latest?page=2 HTTP/1.1\r\nHost: example.com\r\nAccept-Encoding: gzip\r\n\r\n";
+    Request req;
+    if (!req.parse(src, sizeof(src)-1)) {
+        std::cout << "Couldn't parse the request\n";
+        return -1;
+    }
+
+    if (!run(req, 1024) || !run(req, 16 * 1024)) {
+        std::cout << "The response wasn't cached\n";
+        return -1;
+    }
+    return 0;
+}
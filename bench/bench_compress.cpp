@@ -0,0 +1,106 @@
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <iostream>
+#include "../src/compress.hpp"
+
+/*
+ * Measures the CPU time it takes to compress response
+ * bodies with gzip, in milliseconds per MB of input, and
+ * the bytes it saves, at a few zlib levels. The bodies are
+ * generated JSON and HTML of 64 KiB.
+ *
+ * A hit in the cache of compressed bodies is measured too.
+ * It costs a hash and a comparison of the body instead of
+ * its compression.
+ *
+ * The best of a few rounds is reported.
+ */
+
+constexpr int BODY_LEN = 64 * 1024;
+constexpr int ROUNDS   = 5;
+
+static std::string make_json()
+{
+    std::string body = "[";
+    for (int i = 0; body.size() < BODY_LEN; i++)
+        body += "{\"id\": " + std::to_string(i * 7919 % 100000)
+              + ", \"name\": \"user" + std::to_string(i * 31 % 977)
+              + "\", \"active\": " + (i % 3 ? "true" : "false")
+              + ", \"score\": " + std::to_string(i * 2654435761u % 10000) + "},";
+    body.resize(BODY_LEN);
+    return body;
+}
+
+static std::string make_html()
+{
+    std::string body = "<!DOCTYPE html><html><head><title>Items</title></head><body><ul>";
+    for (int i = 0; body.size() < BODY_LEN; i++)
+        body += "<li class=\"item\"><a href=\"/items/" + std::to_string(i * 7919 % 100000)
+              + "\">Item number " + std::to_string(i) + "</a> <span class=\"price\">"
+              + std::to_string(i * 31 % 977) + ".99</span></li>\n";
+    body.resize(BODY_LEN);
+    return body;
+}
+
+// Milliseconds per MB it takes to run "f" on a body
+template <typename F>
+static double measure(F f)
+{
+    int iterations = 0;
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        auto start = std::chrono::steady_clock::now();
+        auto end = start;
+        iterations = 0;
+        do {
+            f();
+            iterations++;
+            end = std::chrono::steady_clock::now();
+        } while (end - start < std::chrono::milliseconds(100));
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        double per_mb = ms / iterations * (1024.0 * 1024.0 / BODY_LEN);
+        if (round == 0 || per_mb < best)
+            best = per_mb;
+    }
+    return best;
+}
+
+static void run(const char *name, const std::string& body)
+{
+    std::cout << name << " body of " << BODY_LEN / 1024 << " KiB:\n";
+    std::cout << "  level   ms/MB   saved\n";
+
+    for (int level : { 1, 6, 9 }) {
+
+        // A cache of 0 bytes compresses every time
+        Compressor compressor(level, 0);
+        int compressed_len = 0;
+        double ms = measure([&]() {
+            SharedBlob *blob = compressor.compress(Encoding::GZIP, body.data(), body.size());
+            compressed_len = blob->length();
+            blob->unref();
+        });
+
+        char line[64];
+        snprintf(line, sizeof(line), "  %-7d %-7.2f %.1f%%\n", level, ms, 100.0 * (body.size() - compressed_len) / body.size());
+        std::cout << line;
+    }
+
+    Compressor compressor(6);
+    double ms = measure([&]() {
+        SharedBlob *blob = compressor.compress(Encoding::GZIP, body.data(), body.size());
+        blob->unref();
+    });
+
+    char line[64];
+    snprintf(line, sizeof(line), "  cached  %.2f\n", ms);
+    std::cout << line;
+}
+
+int main()
+{
+    run("JSON", make_json());
+    run("HTML", make_html());
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <climits>
+#include <cstdio>
+#include <iostream>
+#include <algorithm>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include "../src/server.hpp"
+#include "bench_utils.hpp"
+
+/*
+ * Handlers that wait for something, like a query to another
+ * service, for DELAY_MS before responding. Many connections
+ * send a request each at the same time and the time until
+ * all of them got their response is measured, ROUNDS times.
+ *
+ * With "serve", a handler holds a worker thread while it
+ * waits, so at most as many requests as there are workers
+ * are waited for at the same time. With "serve_async", the
+ * handler is a coroutine that awaits "Server::sleep" and all
+ * requests wait together on the I/O thread.
+ *
+ * The server, which runs in a child process, reports how
+ * many handlers were suspended at most and the bytes of
+ * coroutine frames they held.
+ */
+
+constexpr int CONNECTIONS = 1000;
+constexpr int DELAY_MS    = 20;
+constexpr int ROUNDS      = 3;
+constexpr int WORKERS     = 16;
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+typedef Server<2 * CONNECTIONS> BenchServer;
+
+struct Report {
+    int max_pending;
+    int64_t frame_bytes; // Frame bytes in use at that time
+};
+
+static BenchServer *server;
+static Report report;
+static std::atomic<long> served; // Handlers may run on worker threads
+static int report_fd;
+
+static void respond(Response& res)
+{
+    res.status(200);
+    res.header("Content-Type", "text/plain");
+    res.write("Hello, world!");
+
+    if (++served == (long) CONNECTIONS * ROUNDS)
+        if (write(report_fd, &report, sizeof(report)) != sizeof(report))
+            exit(-1);
+}
+
+static Task<void> handle_async(Request&, Response& res)
+{
+    co_await server->sleep(DELAY_MS);
+
+    if (server->pending_handlers() > report.max_pending) {
+        report.max_pending = server->pending_handlers();
+        report.frame_bytes = server->frame_stats().bytes_in_use;
+    }
+    respond(res);
+}
+
+static void handle_blocking(Request&, Response& res)
+{
+    usleep(DELAY_MS * 1000);
+    respond(res);
+}
+
+static void run_server(int port, bool async)
+{
+    std::clog.setstate(std::ios::failbit);
+
+    ServerConfig config;
+    config.keep_alive_requests = INT_MAX;
+    server = new BenchServer(config);
+    if (!server->listen(port, "127.0.0.1"))
+        exit(-1);
+
+    // Let the parent know that the server is listening
+    char ready = 0;
+    if (write(report_fd, &ready, 1) != 1)
+        exit(-1);
+
+    if (async)
+        server->serve_async(handle_async);
+    else
+        server->serve(WORKERS, handle_blocking);
+    exit(-1);
+}
+
+// Send a request on every connection and wait for all the
+// responses, ROUNDS times. Returns the duration of the
+// fastest round in milliseconds.
+static double run_client(int port)
+{
+    int epfd = epoll_create1(0);
+    std::vector<int> fds(CONNECTIONS);
+    for (int& fd : fds) {
+        fd = connect_to(port);
+        if (fd < 0)
+            abort();
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+
+        auto start = std::chrono::steady_clock::now();
+        for (int fd : fds)
+            if (send(fd, request, sizeof(request)-1, 0) != sizeof(request)-1)
+                abort();
+
+        // Responses are short, so each arrives in one piece
+        int received = 0;
+        while (received < CONNECTIONS) {
+            struct epoll_event events[256];
+            int num = epoll_wait(epfd, events, 256, -1);
+            for (int i = 0; i < num; i++) {
+                char buf[4096];
+                int n = recv(*(int*) events[i].data.ptr, buf, sizeof(buf), 0);
+                if (n == 0)
+                    abort(); // The server closed the connection
+                if (n > 0)
+                    received++;
+            }
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (round == 0 || ms < best)
+            best = ms;
+    }
+
+    for (int fd : fds)
+        close(fd);
+    close(epfd);
+    return best;
+}
+
+static void bench(const char *name, int port, bool async)
+{
+    int fds[2];
+    if (pipe(fds))
+        abort();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        report_fd = fds[1];
+        run_server(port, async);
+    }
+    close(fds[1]);
+
+    char ready;
+    if (read(fds[0], &ready, 1) != 1)
+        abort();
+
+    double ms = run_client(port);
+
+    Report result;
+    if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+        abort();
+    close(fds[0]);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    char line[128];
+    if (async)
+        snprintf(line, sizeof(line), "  %-12s %-10.0f %-10d %.0f\n", name, ms,
+                 result.max_pending, (double) result.frame_bytes / result.max_pending);
+    else
+        snprintf(line, sizeof(line), "  %-12s %-10.0f %-10d -\n", name, ms, WORKERS);
+    std::cout << line;
+}
+
+int main()
+{
+    std::cout << CONNECTIONS << " concurrent requests whose handler waits " << DELAY_MS << " ms:\n";
+    std::cout << "               time (ms)  waiting    frame bytes per handler\n";
+
+    bench("workers", 8410, false);
+    bench("coroutines", 8411, true);
+    return 0;
+}
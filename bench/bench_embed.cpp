@@ -0,0 +1,205 @@
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <climits>
+#include <cstdio>
+#include <iostream>
+#include <condition_variable>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "../src/server.hpp"
+#include "bench_utils.hpp"
+
+/*
+ * A service with its own event loop, which owns the state
+ * the responses are made of, also serves HTTP.
+ *
+ * With a dedicated thread, the server thread blocks in "wait"
+ * and hands each request to the service loop, which wakes up
+ * through an eventfd, builds the body and hands it back.
+ *
+ * When embedded, the service loop polls the server's
+ * descriptor along with its own and calls "try_wait(req, 0)"
+ * when it's readable, so requests are answered right away
+ * by the thread that owns the state.
+ *
+ * A client sends requests one at a time on a connection and
+ * the mean round trip is reported, the best of a few rounds.
+ */
+
+constexpr int REQUESTS = 20000;
+constexpr int ROUNDS   = 5;
+
+typedef Server<64> BenchServer;
+
+// State of the service, only accessed by its loop
+static long counter;
+
+static void fill_body(std::string& body)
+{
+    body = "Request number " + std::to_string(++counter);
+}
+
+static ServerConfig make_config()
+{
+    ServerConfig config;
+    config.keep_alive_requests = INT_MAX;
+    return config;
+}
+
+// A request handed from the server thread to the service loop
+struct Handoff {
+    std::mutex mutex;
+    std::condition_variable answered;
+    bool pending = false;
+    bool done = false;
+    std::string body;
+};
+
+static void run_threaded(int port, int ready_fd)
+{
+    static Handoff handoff;
+    int wake_fd = eventfd(0, EFD_CLOEXEC);
+
+    std::thread http([port, ready_fd, wake_fd]() {
+        BenchServer server(make_config());
+        if (!server.listen(port, "127.0.0.1"))
+            exit(-1);
+        char ready = 0;
+        if (write(ready_fd, &ready, 1) != 1)
+            exit(-1);
+
+        for (;;) {
+            Request req;
+            server.wait(req);
+
+            std::unique_lock<std::mutex> lock(handoff.mutex);
+            handoff.pending = true;
+            handoff.done = false;
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+                exit(-1);
+            handoff.answered.wait(lock, []() { return handoff.done; });
+
+            server.status(200);
+            server.header("Content-Type", "text/plain");
+            server.write(handoff.body.c_str());
+            server.send();
+        }
+    });
+    http.detach();
+
+    // Service loop
+    int epfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+    for (;;) {
+        struct epoll_event events[8];
+        int num = epoll_wait(epfd, events, 8, -1);
+        for (int i = 0; i < num; i++) {
+            uint64_t n;
+            if (read(wake_fd, &n, sizeof(n)) != sizeof(n))
+                exit(-1);
+            std::lock_guard<std::mutex> lock(handoff.mutex);
+            if (handoff.pending) {
+                fill_body(handoff.body);
+                handoff.pending = false;
+                handoff.done = true;
+                handoff.answered.notify_one();
+            }
+        }
+    }
+}
+
+static void run_embedded(int port, int ready_fd)
+{
+    static BenchServer server(make_config());
+    if (!server.listen(port, "127.0.0.1"))
+        exit(-1);
+    char ready = 0;
+    if (write(ready_fd, &ready, 1) != 1)
+        exit(-1);
+
+    // Service loop
+    int epfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = server.pollable_fd();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server.pollable_fd(), &ev);
+
+    std::string body;
+    for (;;) {
+        struct epoll_event events[8];
+        epoll_wait(epfd, events, 8, server.poll_timeout());
+
+        Request req;
+        while (server.try_wait(req, 0)) {
+            fill_body(body);
+            server.status(200);
+            server.header("Content-Type", "text/plain");
+            server.write(body.c_str());
+            server.send();
+        }
+    }
+}
+
+static void bench(const char *name, int port, bool embedded)
+{
+    int fds[2];
+    if (pipe(fds))
+        abort();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        std::clog.setstate(std::ios::failbit);
+        if (embedded)
+            run_embedded(port, fds[1]);
+        else
+            run_threaded(port, fds[1]);
+        exit(0);
+    }
+    close(fds[1]);
+
+    char ready;
+    if (read(fds[0], &ready, 1) != 1)
+        abort();
+    close(fds[0]);
+
+    int fd = connect_to(port);
+    if (fd < 0)
+        abort();
+
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < REQUESTS; i++)
+            if (!roundtrip(fd))
+                abort();
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / REQUESTS;
+        if (round == 0 || us < best)
+            best = us;
+    }
+    close(fd);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    char line[64];
+    snprintf(line, sizeof(line), "  %-18s %.1f\n", name, best);
+    std::cout << line;
+}
+
+int main()
+{
+    std::cout << "Sequential requests on one connection:\n";
+    std::cout << "                     round trip (us)\n";
+
+    bench("dedicated thread", 8420, false);
+    bench("embedded", 8421, true);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <chrono>
+#include <cassert>
+#include <iostream>
+#include <sys/resource.h>
+#include "../src/evloop.hpp"
+
+/*
+ * Measures the cost of delivering a single event while a
+ * growing number of idle sockets is registered in the loop.
+ *
+ * Each idle connection is one end of a socketpair. One more
+ * pair is kept busy by writing a byte into it and waiting
+ * for the RECV event.
+ */
+
+constexpr int MAX_IDLE   = 50000;
+constexpr int ITERATIONS = 20000;
+
+// Raise the descriptor limit as much as we're allowed to
+// and return how many idle pairs fit in it.
+static int max_idle_pairs()
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim))
+        return 0;
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    getrlimit(RLIMIT_NOFILE, &lim);
+
+    long pairs = ((long) lim.rlim_cur - 64) / 2;
+    return pairs < MAX_IDLE ? (int) pairs : MAX_IDLE;
+}
+
+template <template <int> class Loop>
+static double bench(int num_idle)
+{
+    auto *loop = new Loop<MAX_IDLE+1>();
+    auto *idle = new Socket[2 * num_idle];
+
+    for (int i = 0; i < num_idle; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            std::cout << "socketpair failed\n";
+            abort();
+        }
+        idle[2*i+0] = Socket(fds[0]);
+        idle[2*i+1] = Socket(fds[1]);
+        loop->add(idle[2*i], Event::RECV, &idle[2*i]);
+    }
+
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    Socket busy(fds[0]), peer(fds[1]);
+    loop->add(busy, Event::RECV, &busy);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        char c = 'x';
+        peer.write(&c, 1);
+        Event event = loop->wait();
+        assert(event.type == Event::RECV && event.data == &busy);
+        busy.read(&c, 1);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    delete[] idle;
+    delete loop;
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / ITERATIONS;
+}
+
+int main()
+{
+    int limit = max_idle_pairs();
+
+    std::cout << "idle     poll (ns/event)   epoll (ns/event)\n";
+
+    int sizes[] = {100, 1000, 5000, 10000, 50000};
+    for (int num_idle : sizes) {
+
+        if (num_idle > limit) {
+            std::cout << num_idle << ": skipped (descriptor limit allows "
+                      << limit << " idle connections)\n";
+            continue;
+        }
+
+        double poll_ns  = bench<PollEventLoop>(num_idle);
+        double epoll_ns = bench<EpollEventLoop>(num_idle);
+        std::cout << num_idle << "\t " << poll_ns << "\t\t   " << epoll_ns << "\n";
+    }
+    return 0;
+}
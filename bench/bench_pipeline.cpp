@@ -0,0 +1,211 @@
+#include <chrono>
+#include <vector>
+#include <climits>
+#include <cstdio>
+#include <iostream>
+#include <algorithm>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include "../src/server.hpp"
+#include "bench_utils.hpp"
+
+/*
+ * Many connections pipelining requests: each one sends
+ * DEPTH requests at once, waits for all the responses, and
+ * starts over, ROUNDS times.
+ *
+ * The server, which runs in a child process, reports the
+ * system calls it performed per request. The client reports
+ * the time from sending a batch of requests to receiving
+ * its last response.
+ *
+ * With "pipeline_batch" set to 0, a client goes back to the
+ * end of the queue after each of its requests and the event
+ * loop writes the responses. With batches, the requests of
+ * a connection are served in a row and their responses are
+ * written together.
+ */
+
+constexpr int CONNECTIONS = 1000;
+constexpr int DEPTH       = 16;
+constexpr int ROUNDS      = 5;
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static void run_server(int port, ServerConfig config, int report_fd)
+{
+    std::clog.setstate(std::ios::failbit);
+    auto *server = new Server<2 * CONNECTIONS>(config);
+    if (!server->listen(port, "127.0.0.1"))
+        exit(-1);
+
+    // Let the parent know that the server is listening
+    char ready = 0;
+    if (write(report_fd, &ready, 1) != 1)
+        exit(-1);
+
+    // The first request measures the length of a response
+    uint64_t start = syscall_count;
+    for (long served = -1; ; served++) {
+
+        if (served == 0)
+            start = syscall_count;
+
+        if (served == (long) CONNECTIONS * DEPTH * ROUNDS) {
+            double per_request = (double) (syscall_count - start) / served;
+            if (write(report_fd, &per_request, sizeof(per_request)) != sizeof(per_request))
+                exit(-1);
+        }
+
+        Request req;
+        server->wait(req);
+        server->status(200);
+        server->header("Content-Type", "text/plain");
+        server->write("Hello, world!");
+        server->send();
+    }
+}
+
+struct Connection {
+    int fd;
+    int received; // Bytes of the current batch's responses
+    int rounds;
+    std::chrono::steady_clock::time_point sent;
+};
+
+// Drive all connections from a single thread. Returns the
+// latency of each batch in microseconds.
+static std::vector<double> run_client(int port, int response_len)
+{
+    std::string batch;
+    for (int i = 0; i < DEPTH; i++)
+        batch += request;
+
+    int epfd = epoll_create1(0);
+    std::vector<Connection> conns(CONNECTIONS);
+    for (Connection& conn : conns) {
+        conn.fd = connect_to(port);
+        if (conn.fd < 0)
+            abort();
+        fcntl(conn.fd, F_SETFL, O_NONBLOCK);
+        conn.received = 0;
+        conn.rounds = 0;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conn;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+    }
+
+    auto send_batch = [&](Connection& conn) {
+        conn.sent = std::chrono::steady_clock::now();
+        if (send(conn.fd, batch.data(), batch.size(), 0) != (int) batch.size())
+            abort();
+    };
+    for (Connection& conn : conns)
+        send_batch(conn);
+
+    std::vector<double> latencies;
+    int done = 0;
+    while (done < CONNECTIONS) {
+
+        struct epoll_event events[256];
+        int num = epoll_wait(epfd, events, 256, -1);
+        for (int i = 0; i < num; i++) {
+
+            Connection& conn = *(Connection*) events[i].data.ptr;
+
+            char buf[65536];
+            int n;
+            while ((n = recv(conn.fd, buf, sizeof(buf), 0)) > 0)
+                conn.received += n;
+            if (n == 0)
+                abort(); // The server closed the connection
+
+            if (conn.received < DEPTH * response_len)
+                continue;
+
+            auto now = std::chrono::steady_clock::now();
+            latencies.push_back(std::chrono::duration<double, std::micro>(now - conn.sent).count());
+            conn.received = 0;
+            if (++conn.rounds == ROUNDS)
+                done++;
+            else
+                send_batch(conn);
+        }
+    }
+
+    for (Connection& conn : conns)
+        close(conn.fd);
+    close(epfd);
+    return latencies;
+}
+
+static void bench(const char *name, int port, ServerConfig config)
+{
+    int fds[2];
+    if (pipe(fds))
+        abort();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        run_server(port, config, fds[1]);
+        exit(0);
+    }
+    close(fds[1]);
+
+    char ready;
+    if (read(fds[0], &ready, 1) != 1)
+        abort();
+
+    // All responses have the same length
+    int response_len = 0;
+    {
+        int fd = connect_to(port);
+        send(fd, request, sizeof(request)-1, 0);
+        char buf[1024];
+        usleep(100000);
+        response_len = recv(fd, buf, sizeof(buf), 0);
+        close(fd);
+    }
+
+    std::vector<double> latencies = run_client(port, response_len);
+
+    double syscalls;
+    if (read(fds[0], &syscalls, sizeof(syscalls)) != sizeof(syscalls))
+        abort();
+    close(fds[0]);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (double l : latencies)
+        mean += l;
+    mean /= latencies.size();
+    double p99 = latencies[latencies.size() * 99 / 100];
+
+    char line[128];
+    snprintf(line, sizeof(line), "  %-12s %-10.2f %-10.0f %.0f\n", name, syscalls, mean, p99);
+    std::cout << line;
+}
+
+int main()
+{
+    ServerConfig config;
+    config.keep_alive_requests = INT_MAX;
+
+    std::cout << CONNECTIONS << " connections pipelining " << DEPTH << " requests:\n";
+    std::cout << "               syscalls   mean (us)  p99 (us)\n";
+
+    config.pipeline_batch = 0;
+    bench("round robin", 8400, config);
+
+    config.pipeline_batch = DEPTH;
+    bench("batched", 8401, config);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include "../src/router.hpp"
+
+/*
+ * Measures the cost of finding the handler of a request
+ * path with 5, 50 and 500 routes. Half of the routes are
+ * static ("/pages/page17") and half capture an id
+ * ("/api/v1/items17/:id"). Each round looks up every
+ * route once.
+ *
+ * "Router" is compared with a chain of comparisons tried
+ * in order, which is how requests were dispatched before.
+ * Routes with a capture compare the static prefix and
+ * check that a single segment follows.
+ *
+ * The best of a few rounds is reported.
+ */
+
+constexpr int ROUNDS  = 5;
+constexpr int LOOKUPS = 1000000;
+
+// Minimal version of the previous dispatch
+struct Chain {
+
+    struct Entry {
+        std::string text;
+        bool capture;
+        int  handler;
+    };
+    std::vector<Entry> entries;
+
+    int find(Slice path) const
+    {
+        for (const Entry& entry : entries) {
+            if (!entry.capture) {
+                if (path == entry.text.c_str())
+                    return entry.handler;
+                continue;
+            }
+            int len = entry.text.size();
+            if (path.len > len && !memcmp(path.str + path.off, entry.text.data(), len)
+             && !memchr(path.str + path.off + len, '/', path.len - len))
+                return entry.handler;
+        }
+        return -1;
+    }
+};
+
+template <typename F>
+static double measure(const std::vector<std::string>& paths, F find)
+{
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        long sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < LOOKUPS; i++) {
+            const std::string& path = paths[i % paths.size()];
+            sum += find(Slice(path.data(), path.size()));
+        }
+        auto end = std::chrono::steady_clock::now();
+        if (sum < 0)
+            std::cout << "Lookup failed\n";
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / LOOKUPS;
+        if (round == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+int main()
+{
+    std::cout << "Lookup (ns):\n";
+    std::cout << "  routes  chain   router\n";
+
+    for (int num : {5, 50, 500}) {
+
+        Router<int> router;
+        Chain chain;
+        std::vector<std::string> paths;
+
+        for (int i = 0; i < num; i++) {
+            std::string n = std::to_string(i);
+            if (i % 2 == 0) {
+                std::string pattern = "/pages/page" + n;
+                router.add(GET, pattern.c_str(), i);
+                chain.entries.push_back({pattern, false, i});
+                paths.push_back(pattern);
+            } else {
+                std::string prefix = "/api/v1/items" + n + "/";
+                router.add(GET, (prefix + ":id").c_str(), i);
+                chain.entries.push_back({prefix, true, i});
+                paths.push_back(prefix + "12345");
+            }
+        }
+
+        double chain_ns = measure(paths, [&](Slice path) {
+            return chain.find(path);
+        });
+
+        double router_ns = measure(paths, [&](Slice path) {
+            const int *handler;
+            RouteParams params;
+            if (router.find(GET, path, handler, params) != 200)
+                return -1;
+            return *handler;
+        });
+
+        printf("  %-6d  %-6.1f  %.1f\n", num, chain_ns, router_ns);
+    }
+    return 0;
+}
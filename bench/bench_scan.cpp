@@ -0,0 +1,94 @@
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <iostream>
+#include "../src/buffer.hpp"
+
+/*
+ * Measures the cost of finding the end of a request head.
+ *
+ * A 16 KiB head is received 512 bytes at a time and the
+ * buffer is searched after each piece, as the server does
+ * on every read. The previous approach, that searched the
+ * whole buffer from the start every time with "memcmp", is
+ * compared with the resumable search of "Buffer::seek".
+ *
+ * The second case searches a complete head once, with the
+ * byte-by-byte loop, the "memchr" fallback and the SSE2 and
+ * AVX2 versions (the latter if the CPU supports it), one of
+ * which "find_crlfcrlf" picks at runtime.
+ */
+
+constexpr int HEAD_SIZE  = 16 * 1024;
+constexpr int PIECE_SIZE = 512;
+constexpr int ITERATIONS = 2000;
+
+static std::string head;
+
+static int naive_seek(const char *src, int len)
+{
+    int i = 0;
+    while (i < len - 3 && memcmp(src + i, "\r\n\r\n", 4))
+        i++;
+    return i < len - 3 ? i : -1;
+}
+
+template <typename F>
+static double trickle(F seek)
+{
+    int found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        Buffer buffer;
+        for (size_t off = 0; off < head.size(); off += PIECE_SIZE) {
+            buffer.write(head.data() + off, std::min<size_t>(PIECE_SIZE, head.size() - off));
+            if (seek(buffer) >= 0)
+                found++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (found != ITERATIONS)
+        std::cout << "Wrong result\n";
+    return std::chrono::duration<double, std::micro>(end - start).count() / ITERATIONS;
+}
+
+template <typename F>
+static double scan_once(F find)
+{
+    int sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS * 10; i++) {
+        // Hide the input from the compiler so that the search
+        // isn't hoisted out of the loop
+        const char *src = head.data();
+        asm volatile("" : "+r"(src));
+        sum += find(src, (int) head.size());
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (sum != ITERATIONS * 10 * ((int) head.size() - 4))
+        std::cout << "Wrong result\n";
+    return std::chrono::duration<double, std::micro>(end - start).count() / (ITERATIONS * 10);
+}
+
+int main()
+{
+    // Header lines of about 40 bytes
+    head = "GET /index.html HTTP/1.1\r\n";
+    for (int i = 0; (int) head.size() < HEAD_SIZE - 64; i++)
+        head += "X-Header-" + std::to_string(i) + ": some-header-value\r\n";
+    head += "\r\n";
+
+    std::cout << "16 KiB head in " << PIECE_SIZE << " byte pieces (us):\n";
+    std::cout << "  rescan  " << trickle([](Buffer& b) { return naive_seek(b.content(), b.length()); }) << "\n";
+    std::cout << "  resume  " << trickle([](Buffer& b) { return b.seek("\r\n\r\n"); }) << "\n";
+
+    std::cout << "16 KiB head at once (us):\n";
+    std::cout << "  memcmp  " << scan_once(naive_seek) << "\n";
+    std::cout << "  memchr  " << scan_once([](const char *s, int n) { return find_crlfcrlf_scalar(s, 0, n); }) << "\n";
+#ifdef SCAN_X86
+    std::cout << "  sse2    " << scan_once([](const char *s, int n) { return find_crlfcrlf_sse2(s, 0, n); }) << "\n";
+    if (__builtin_cpu_supports("avx2"))
+        std::cout << "  avx2    " << scan_once([](const char *s, int n) { return find_crlfcrlf_avx2(s, 0, n); }) << "\n";
+#endif
+    return 0;
+}
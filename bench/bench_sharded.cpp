@@ -0,0 +1,86 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <signal.h>
+#include <sys/wait.h>
+#include "../src/sharded.hpp"
+#include "bench_utils.hpp"
+
+/*
+ * Measures the throughput of a sharded server with an
+ * increasing number of shards. The server runs in a child
+ * process and the parent generates keep-alive load from a
+ * number of client threads.
+ */
+
+constexpr int    CLIENT_THREADS = 16;
+constexpr double DURATION_SEC   = 2.0;
+
+static void respond(Server<1024>& shard, Request&)
+{
+    shard.status(200);
+    shard.header("Content-Type", "text/plain");
+    shard.write("Hello, world!");
+    shard.send();
+}
+
+static double bench(int port, int num_shards)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::clog.setstate(std::ios::failbit);
+        ShardedServer<1024> server;
+        server.run(port, "127.0.0.1", num_shards, respond);
+        exit(-1);
+    }
+
+    // Give the shards time to start listening
+    usleep(200000);
+
+    std::atomic<bool> stop(false);
+    std::atomic<long> total(0);
+
+    std::vector<std::thread> clients;
+    for (int i = 0; i < CLIENT_THREADS; i++)
+        clients.emplace_back([&]() {
+            long count = 0;
+            int fd = -1;
+            while (!stop) {
+                if (fd < 0 && (fd = connect_to(port)) < 0)
+                    continue;
+                if (roundtrip(fd))
+                    count++;
+                else {
+                    close(fd);
+                    fd = -1;
+                    count++; // The "Connection: Close" response still counts
+                }
+            }
+            if (fd >= 0) close(fd);
+            total += count;
+        });
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(DURATION_SEC));
+    stop = true;
+    for (std::thread& t : clients)
+        t.join();
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    return total / DURATION_SEC;
+}
+
+int main()
+{
+    int cores = (int) std::thread::hardware_concurrency();
+    if (cores <= 0) cores = 1;
+
+    std::cout << "shards  requests/sec\n";
+    int port = 8200;
+    for (int k = 1; k <= cores; k *= 2)
+        std::cout << k << "\t" << (long) bench(port++, k) << "\n";
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <cstdlib>
+#include <iostream>
+#include <signal.h>
+#include <sys/wait.h>
+#include "../src/server.hpp"
+#include "bench_utils.hpp"
+
+/*
+ * Counts the system calls the server performs for each
+ * request when using the different event loops.
+ *
+ * A child process sends keep-alive requests over a few
+ * connections while the parent serves them.
+ */
+
+constexpr int NUM_REQUESTS = 20000;
+constexpr int PIPELINE_CONNECTIONS = 8;
+
+static void client(int port)
+{
+    int fds[PIPELINE_CONNECTIONS];
+    for (int i = 0; i < PIPELINE_CONNECTIONS; i++)
+        fds[i] = -1;
+
+    for (int i = 0; ; i++) {
+        int& fd = fds[i % PIPELINE_CONNECTIONS];
+        if (fd < 0) fd = connect_to(port);
+        if (fd < 0) exit(0);
+        if (!roundtrip(fd)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+}
+
+template <template <int> class Loop>
+static double bench(int port)
+{
+    auto *server = new Server<64, Loop>();
+    if (!server->listen(port, "127.0.0.1"))
+        abort();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        client(port);
+        exit(0);
+    }
+
+    uint64_t start = syscall_count;
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        Request req;
+        server->wait(req);
+        server->status(200);
+        server->header("Content-Type", "text/plain");
+        server->write("Hello, world!");
+        server->send();
+    }
+    uint64_t end = syscall_count;
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    delete server;
+
+    return (double) (end - start) / NUM_REQUESTS;
+}
+
+int main()
+{
+    std::clog.setstate(std::ios::failbit);
+
+    std::cout << "syscalls per request:\n";
+    std::cout << "  poll     " << bench<PollEventLoop>(8181) << "\n";
+    std::cout << "  epoll    " << bench<EpollEventLoop>(8182) << "\n";
+
+    UringEventLoop<1> probe;
+    if (probe.using_io_uring())
+        std::cout << "  io_uring " << bench<UringEventLoop>(8183) << "\n";
+    else
+        std::cout << "  io_uring not available\n";
+    return 0;
+}
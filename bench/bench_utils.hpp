@@ -0,0 +1,63 @@
+#ifndef BENCH_UTILS_HPP
+#define BENCH_UTILS_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+/*
+ * Blocking HTTP client helpers shared by the benchmarks
+ */
+
+inline int connect_to(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read a single response. Returns false if the server
+// closed the connection or asked to close it.
+inline bool read_response(int fd)
+{
+    char buf[4096];
+    int used = 0;
+    while (1) {
+        int n = recv(fd, buf + used, sizeof(buf) - used - 1, 0);
+        if (n <= 0)
+            return false;
+        used += n;
+        buf[used] = '\0';
+
+        char *end = strstr(buf, "\r\n\r\n");
+        if (end == nullptr)
+            continue;
+
+        char *cl = strstr(buf, "Content-Length:");
+        int body = cl ? atoi(cl + 15) : 0;
+        if (used >= (end - buf) + 4 + body)
+            return strstr(buf, "Connection: Close") == nullptr;
+    }
+}
+
+// Send a request and read the response. Returns false if
+// the connection can't be reused.
+inline bool roundtrip(int fd)
+{
+    static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (send(fd, request, sizeof(request)-1, 0) < 0)
+        return false;
+    return read_response(fd);
+}
+
+#endif /* BENCH_UTILS_HPP */
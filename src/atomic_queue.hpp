@@ -0,0 +1,97 @@
+#ifndef ATOMIC_QUEUE_HPP
+#define ATOMIC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Bounded lock-free queue that can be used by any number
+ * of producer and consumer threads at the same time. It's
+ * the array-based design by Dmitry Vyukov: each cell holds
+ * a sequence number that tells producers and consumers
+ * whether it's their turn to use it, so the only contended
+ * operations are one compare-and-swap per push or pop.
+ *
+ * N must be a power of two and at least 2.
+ */
+template <typename T, int N>
+class AtomicQueue {
+
+    static_assert(N > 1 && (N & (N - 1)) == 0, "The capacity must be a power of two greater than 1");
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    // Keep the cursors on different cache lines so that
+    // producers and consumers don't slow each other down.
+    alignas(64) Cell cells[N];
+    alignas(64) std::atomic<size_t> push_cursor;
+    alignas(64) std::atomic<size_t> pop_cursor;
+
+public:
+
+    AtomicQueue()
+    {
+        for (int i = 0; i < N; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        push_cursor.store(0, std::memory_order_relaxed);
+        pop_cursor.store(0, std::memory_order_relaxed);
+    }
+
+    AtomicQueue(AtomicQueue&  other) = delete;
+    AtomicQueue(AtomicQueue&& other) = delete;
+    AtomicQueue& operator=(AtomicQueue& other) = delete;
+    AtomicQueue& operator=(AtomicQueue&& other) = delete;
+
+    // Returns false if the queue is full
+    bool push(const T& item)
+    {
+        Cell  *cell;
+        size_t pos = push_cursor.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & (N - 1)];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                // The cell is free. Try to claim it.
+                if (push_cursor.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0)
+                return false; // The cell still holds an item from the previous lap
+            else
+                pos = push_cursor.load(std::memory_order_relaxed);
+        }
+
+        cell->item = item;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the queue is empty
+    bool pop(T& item)
+    {
+        Cell  *cell;
+        size_t pos = pop_cursor.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & (N - 1)];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (pop_cursor.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0)
+                return false; // The cell wasn't written yet
+            else
+                pos = pop_cursor.load(std::memory_order_relaxed);
+        }
+
+        item = cell->item;
+        cell->sequence.store(pos + N, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif /* ATOMIC_QUEUE_HPP */
@@ -1,41 +1,109 @@
+#ifndef BUFFER_HPP
+#define BUFFER_HPP
+
 
 #include <cassert>
 #include <utility>
 #include <new>
 #include <limits>
 #include <algorithm>
+#include "scan.hpp"
+#include "slab.hpp"
 #include "slice.hpp"
 #include "socket.hpp"
 
 #define MAX_VALUE(X) std::numeric_limits<decltype(X)>::max()
 
+/*
+ * Growable byte queue. Bytes are appended at the tail and
+ * consumed from the head. Consuming only moves the head
+ * offset, so draining the buffer in small steps doesn't
+ * shift the remaining bytes every time. The contents are
+ * moved back to the start of the memory only when a write
+ * doesn't fit in the free space after the tail.
+ *
+ * Offsets taken and returned by the methods are relative
+ * to the head. Slices of the contents stay valid until
+ * the next "consume" or until a write needs to move or
+ * grow the buffer.
+ *
+ * If a slab is set with "use_slab", memory is allocated
+ * from it and given back to it as soon as the buffer is
+ * drained, so that idle buffers don't hold any memory.
+ */
 struct Buffer {
 
-    char *data; // Buffer content (or NULL when size=0)
-    int   size; // Number of bytes stored in the buffer
-    int   used; // Allocated bytes
+    char *data; // Buffer memory (or NULL when size=0)
+    int   size; // Allocated bytes
+    int   head; // Offset of the first byte of the contents
+    int   used; // Offset after the last byte of the contents
     bool  fail; // True if at least one read or write operation failed at one point. No read or write operations can be performed after this is set.
 
-    int crlfcrlf; // Cache for the result of seek(\r\n\r\n)
+    // State of the search of "\r\n\r\n" in the contents, so
+    // that a head received in many pieces is scanned once.
+    int crlfcrlf; // Offset of the first occurrence, or -1 if not found yet
+    int scanned;  // No occurrence starts before this offset
+
+    BufferSlab *slab; // Allocator of "data", or NULL for new[]
+
+    char *allocate(int num)
+    {
+        if (slab)
+            return slab->allocate(num);
+        return new (std::nothrow) char[num];
+    }
+
+    void release()
+    {
+        if (slab)
+            slab->release(data, size);
+        else
+            delete[] data;
+        data = nullptr;
+        size = 0;
+    }
 
     bool ensure_unused_space(int min)
     {
         assert(!fail);
 
-        if (used + min > size) {
-            // Allocation of a new buffer is necessary
-            int   new_size = size > 0 ? 2 * size : 256;
-            char *new_data = new (std::nothrow) char[new_size];
-            if (new_data == nullptr) {
+        if (used + min <= size)
+            return true;
+
+        int len = used - head;
+
+        // If moving the contents to the start of the memory
+        // makes enough room and leaves at least half of the
+        // memory free, do that instead of growing.
+        if (2 * (len + min) <= size) {
+            if (len > 0)
+                memmove(data, data + head, len);
+            head = 0;
+            used = len;
+            return true;
+        }
+
+        // Allocation of a new buffer is necessary
+        int   new_size = size > 0 ? 2 * size : 256;
+        while (len + min > new_size) {
+            if (new_size > MAX_VALUE(new_size) / 2) {
                 fail = true;
                 return false;
             }
-            memcpy(new_data, data, used);
-            delete[] data;
-            data = new_data;
-            size = new_size;
+            new_size *= 2;
         }
-
+        char *new_data = allocate(new_size);
+        if (new_data == nullptr) {
+            fail = true;
+            return false;
+        }
+        if (len > 0)
+            memcpy(new_data, data + head, len);
+        release();
+        data = new_data;
+        size = new_size;
+        head = 0;
+        used = len;
         return true;
     }
 
@@ -44,50 +112,82 @@ public:
     {
         data = nullptr;
         size = 0;
+        head = 0;
         used = 0;
         fail = false;
         crlfcrlf = -1;
+        scanned = 0;
+        slab = nullptr;
     }
 
     Buffer(Buffer&) = delete;
     Buffer& operator=(Buffer& other) = delete;
-    
+
     Buffer(Buffer&& other)
     {
         data = other.data;
         size = other.size;
+        head = other.head;
         used = other.used;
         fail = other.fail;
+        crlfcrlf = other.crlfcrlf;
+        scanned = other.scanned;
+        slab = other.slab;
         other.data = nullptr;
         other.size = 0;
+        other.head = 0;
         other.used = 0;
         other.fail = false;
+        other.crlfcrlf = -1;
+        other.scanned = 0;
     }
 
     Buffer& operator=(Buffer&& other)
     {
         if (this != &other) {
-            delete[] data;
+            release();
             data = other.data;
             size = other.size;
+            head = other.head;
             used = other.used;
             fail = other.fail;
+            crlfcrlf = other.crlfcrlf;
+            scanned = other.scanned;
+            slab = other.slab;
             other.data = nullptr;
             other.size = 0;
+            other.head = 0;
             other.used = 0;
             other.fail = false;
+            other.crlfcrlf = -1;
+            other.scanned = 0;
         }
         return *this;
     }
 
     ~Buffer()
     {
-        delete[] data;
+        release();
+    }
+
+    // Allocate the buffer's memory from "slab" from now on.
+    // It must be called while the buffer is empty and the
+    // slab must outlive the buffer.
+    void use_slab(BufferSlab *slab_)
+    {
+        assert(size == 0);
+        slab = slab_;
+    }
+
+    // Pointer to the first byte of the contents
+    const char *content() const
+    {
+        return data + head;
     }
 
     int length() const
     {
-        return used;
+        return used - head;
     }
 
     bool failed() const
@@ -99,64 +199,77 @@ public:
     {
         if (fail) return;
 
-        if (off < 0 || off + len > used) {
+        if (off < 0 || off + len > length()) {
             // Slice (off, len) isn't fully contained by
             // the buffer.
             fail = true;
             return;
         }
 
-        memmove(data + off, src, len);        
+        memmove(data + head + off, src, len);
+        crlfcrlf = -1;
+        scanned = 0;
     }
 
     void write(const char *src, int len=-1)
     {
-        // Only perform the write if no allocations failed previously
-        if (fail) return;
-
         if (len < 0) len = strlen(src);
+        if (len == 0) return;
+
+        char *dst = extend(len);
+        if (dst)
+            memcpy(dst, src, len);
+    }
+
+    // Append "len" bytes and return a pointer to them so
+    // that the caller can fill them in. Returns NULL if
+    // the buffer failed.
+    char *extend(int len)
+    {
+        // Only perform the write if no allocations failed previously
+        if (fail) return nullptr;
 
         // Check for overflows
-        if (used > MAX_VALUE(used) - len) {
+        if (length() > MAX_VALUE(used) - len) {
             fail = true;
-            return;
+            return nullptr;
         }
 
         if (!ensure_unused_space(len))
-            return;
-        
-        memcpy(data + used, src, len);
+            return nullptr;
+
+        char *dst = data + used;
         used += len;
+        return dst;
     }
 
     int read(char *dst, int max)
     {
         if (fail) return 0;
 
-        crlfcrlf = -1; // Invalidate cache
-
-        int copy = std::min(used, max);
-        memcpy(dst, data, copy);
-        memmove(data, data + copy, used - copy);
-        used -= copy;
+        int copy = std::min(length(), max);
+        memcpy(dst, data + head, copy);
+        consume(copy);
         return copy;
     }
 
     // Moves byte from the socket to the buffer and
-    // returns true iff the peer closed the connection
-    bool write(Socket& sock)
+    // returns true iff the peer closed the connection.
+    // No more bytes are read once the buffer holds "max".
+    bool write(Socket& sock, int max=std::numeric_limits<int>::max())
     {
         if (fail) return false;
 
         bool closed = false;
-        while (1) {
+        while (length() < max) {
 
             // Make sure the buffer has at least a certain amount of free memory
             // to avoid small copies
             constexpr int min_read = 256;
             if (!ensure_unused_space(min_read))
                 break;
-            int res = sock.read(data + used, size - used);
+            int space = std::min(size - used, max - length());
+            int res = sock.read(data + used, space);
             if (res == Socket::WOULD_BLOCK)
                 break;
             if (res == Socket::OTHER_ERROR) {
@@ -167,18 +280,29 @@ public:
                 closed = true;
                 break;
             }
-            
+
             assert(res > 0);
 
             // Check for overflow
-            if (used > MAX_VALUE(used) - res) {
+            if (length() > MAX_VALUE(used) - res) {
                 fail = true;
                 return false;
             }
 
             used += res;
+
+            // A short read means the socket was drained. The event
+            // loops are level-triggered so if more bytes arrive in
+            // the meantime we'll be notified again, and trying to
+            // read until EWOULDBLOCK would only cost a syscall.
+            if (res < space)
+                break;
         }
 
+        // Nothing was received. Don't hold the memory.
+        if (length() == 0 && slab)
+            release();
+
         return closed;
     }
 
@@ -188,15 +312,9 @@ public:
         if (fail) return 0;
 
         int copied = 0;
-        while (copied < used) {
-
-            // Make sure the buffer has at least a certain amount
-            // of free memory to avoid small copies
-            constexpr int min_read = 256;
-            if (!ensure_unused_space(min_read))
-                break;
+        while (head < used) {
 
-            int res = sock.write(data + copied, used - copied);
+            int res = sock.write(data + head, used - head);
             if (res == Socket::WOULD_BLOCK)
                 break;
             if (res == Socket::OTHER_ERROR || res == 0) {
@@ -205,56 +323,75 @@ public:
             }
 
             assert(res > 0);
+
+            // A short write means the socket's send buffer is
+            // full, so the next write would block.
+            bool short_write = res < used - head;
+
+            consume(res);
             copied += res;
-        }
 
-        crlfcrlf = -1; // Invalidate cache
+            if (short_write)
+                break;
+        }
 
-        memmove(data + copied, data, used - copied);
-        used -= copied;
         return copied;
     }
 
     // Find the index of the first occurrence of "needle"
     // in the buffer's contents. Return -1 if it wasn't
     // found.
+    //
+    // Searches of "\r\n\r\n" resume where the previous one
+    // stopped, so they only cost the bytes written since.
     int seek(const char *needle)
     {
         int len = strlen(needle);
 
-        bool is_crlfcrlf = false;
         if (len == 4 && !strcmp(needle, "\r\n\r\n")) {
-            if (crlfcrlf > -1) return crlfcrlf;
-            is_crlfcrlf = true;
+            if (crlfcrlf < 0) {
+                crlfcrlf = find_crlfcrlf(data + head, scanned, length());
+                scanned = crlfcrlf < 0 ? std::max(scanned, length() - 3) : crlfcrlf;
+            }
+            return crlfcrlf;
         }
 
         // If the token is contained by the buffer, its index
         // must be lower than:
-        int lim = used - len + 1;
+        int lim = length() - len + 1;
 
         // If the needle is larger than the buffer, then the
         // limit is negative
         int i = 0;
 
-        while (i < lim && memcmp(data+i, needle, len))
+        const char *src = data + head;
+        while (i < lim && memcmp(src+i, needle, len))
             i++;
 
-        if (i > lim)
+        if (i >= lim)
             return -1;
-        else {
-            if (is_crlfcrlf) crlfcrlf = i;
-            return i;
-        }
+        return i;
     }
-    
+
     // Removed "num" bytes from the head of the buffer
     void consume(int num)
     {
-        assert(num <= used);
-        memmove(data, data + num, used - num);
-        used -= num;
+        assert(num <= length());
+        head += num;
+
+        // When the buffer is drained, start over from the
+        // beginning of the memory for free, or give it back
+        // to the slab.
+        if (head == used) {
+            head = 0;
+            used = 0;
+            if (slab)
+                release();
+        }
 
-        crlfcrlf = -1; // Invalidate cache
+        // Offsets of the search state are relative to the head
+        crlfcrlf = crlfcrlf >= num ? crlfcrlf - num : -1;
+        scanned  = std::max(0, scanned - num);
     }
 
     bool contains(const char *needle)
@@ -272,15 +409,17 @@ public:
             return Slice("", 0);
         else {
             if (include_token) end += strlen(token);
-            return Slice(data, end);
+            return Slice(data + head, end);
         }
     }
 
     Slice slice(int off, int end)
     {
-        if (end < off || off < 0 || end >= used)
+        if (end < off || off < 0 || end > length())
             return Slice("", 0);
-        
-        return Slice(data + off, end - off);
+
+        return Slice(data + head + off, end - off);
     }
 };
+
+#endif /* BUFFER_HPP */
@@ -0,0 +1,259 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include "parse.hpp"
+#include "output.hpp"
+
+/*
+ * Serialized copy of a response (see "Response::cache").
+ * Its "Connection" header depends on the request that is
+ * answered, so the blob always holds the keep-alive line
+ * at offset "split". Copies that close the connection
+ * replace it.
+ */
+struct CachedResponse {
+    SharedBlob *blob = nullptr;
+    int split = 0;
+    int ttl = 0; // Milliseconds
+};
+
+/*
+ * Cache of serialized responses indexed by the path and
+ * query of GET requests, and by the values of the request
+ * headers passed to "vary". Entries expire after their TTL
+ * and the least recently used ones are evicted when the
+ * cached bytes exceed "max_bytes".
+ *
+ * A blob stays valid for the output chains that reference
+ * it after its entry was evicted. The cache isn't
+ * thread-safe.
+ */
+class ResponseCache {
+
+public:
+
+    ResponseCache(int64_t max_bytes_=64*1024*1024)
+    {
+        max_bytes = max_bytes_;
+        used_bytes = 0;
+        first = nullptr;
+        last = nullptr;
+        hits = 0;
+        misses = 0;
+    }
+
+    ~ResponseCache()
+    {
+        clear();
+    }
+
+    ResponseCache(ResponseCache&) = delete;
+    ResponseCache& operator=(ResponseCache&) = delete;
+
+    /*
+     * Make the value of the request header "name" part of
+     * the key, so that requests that differ by it get
+     * different responses. It must be called while the
+     * cache is empty.
+     */
+    void vary(H name)
+    {
+        for (H other : varying)
+            if (other == name)
+                return;
+        varying.push_back(name);
+    }
+
+    bool empty() const
+    {
+        return first == nullptr;
+    }
+
+    /*
+     * Write the key of "req" into "key". Returns false if
+     * the request's response can't be cached, which is the
+     * case for any method other than GET.
+     */
+    bool make_key(const Request& req, std::string& key) const
+    {
+        if (!req.valid || req.method != GET)
+            return false;
+
+        const URL& url = req.url;
+        key.assign(url.path.str + url.path.off, url.path.len);
+        if (url.query.len > 0) {
+            key += '?';
+            key.append(url.query.str + url.query.off, url.query.len);
+        }
+
+        // Values are preceded by a byte that can't be
+        // in the path, and by a different one when the
+        // header is missing.
+        for (H name : varying) {
+            Slice value;
+            if (req.get(name, value)) {
+                key += '\n';
+                key.append(value.str + value.off, value.len);
+            } else
+                key += '\r';
+        }
+        return true;
+    }
+
+    /*
+     * Returns the response stored under "key", or null if
+     * there's none or it expired. "now" is the time in
+     * milliseconds of a monotonic clock.
+     */
+    const CachedResponse *find(const std::string& key, uint64_t now)
+    {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            misses++;
+            return nullptr;
+        }
+
+        Entry *entry = it->second;
+        if (now >= entry->expires) {
+            evict(entry);
+            misses++;
+            return nullptr;
+        }
+
+        // Move to the front of the LRU list
+        unlink(entry);
+        link_first(entry);
+        hits++;
+        return &entry->response;
+    }
+
+    /*
+     * Store "response" under "key", replacing the previous
+     * response, if any. The cache takes the reference to
+     * the blob, so "response.blob" is set to null.
+     */
+    void insert(const std::string& key, CachedResponse& response, uint64_t now)
+    {
+        SharedBlob *blob = response.blob;
+        response.blob = nullptr;
+        if (blob == nullptr)
+            return;
+
+        auto it = entries.find(key);
+        if (it != entries.end())
+            evict(it->second);
+
+        int64_t cost = entry_cost(key, blob);
+        if (response.ttl <= 0 || cost > max_bytes) {
+            blob->unref();
+            return;
+        }
+
+        while (used_bytes + cost > max_bytes)
+            evict(last);
+
+        Entry *entry = new (std::nothrow) Entry;
+        if (entry == nullptr) {
+            blob->unref();
+            return;
+        }
+        entry->key = key;
+        entry->response = response;
+        entry->response.blob = blob;
+        entry->expires = now + response.ttl;
+        entry->prev = nullptr;
+        entry->next = nullptr;
+        entries[entry->key] = entry;
+        link_first(entry);
+        used_bytes += cost;
+    }
+
+    /*
+     * Drop all entries
+     */
+    void clear()
+    {
+        while (first)
+            evict(first);
+    }
+
+    /*
+     * Bytes held by the cached entries
+     */
+    int64_t size() const
+    {
+        return used_bytes;
+    }
+
+    // Number of lookups that found a valid entry and
+    // that didn't
+    uint64_t hits;
+    uint64_t misses;
+
+private:
+
+    struct Entry {
+        std::string key;
+        CachedResponse response;
+        uint64_t expires;
+        Entry *prev;
+        Entry *next;
+    };
+
+    std::unordered_map<std::string, Entry*> entries;
+    std::vector<H> varying;
+
+    int64_t max_bytes;
+    int64_t used_bytes;
+
+    // LRU list, from the most recently used entry
+    Entry *first;
+    Entry *last;
+
+    // Bytes an entry counts for, including an estimate
+    // of the bookkeeping
+    static int64_t entry_cost(const std::string& key, SharedBlob *blob)
+    {
+        return (int64_t) blob->length() + 2 * key.size() + sizeof(Entry) + 64;
+    }
+
+    void evict(Entry *entry)
+    {
+        unlink(entry);
+        entries.erase(entry->key);
+        used_bytes -= entry_cost(entry->key, entry->response.blob);
+        entry->response.blob->unref();
+        delete entry;
+    }
+
+    void unlink(Entry *entry)
+    {
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            first = entry->next;
+        if (entry->next)
+            entry->next->prev = entry->prev;
+        else
+            last = entry->prev;
+        entry->prev = nullptr;
+        entry->next = nullptr;
+    }
+
+    void link_first(Entry *entry)
+    {
+        entry->prev = nullptr;
+        entry->next = first;
+        if (first)
+            first->prev = entry;
+        else
+            last = entry;
+        first = entry;
+    }
+};
+
+#endif /* CACHE_HPP */
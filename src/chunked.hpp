@@ -0,0 +1,207 @@
+#ifndef CHUNKED_HPP
+#define CHUNKED_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/*
+ * Incremental decoder of a body sent with the chunked
+ * transfer encoding:
+ *
+ *     1a;ext=value\r\n
+ *     ... 26 bytes of data ...\r\n
+ *     0\r\n
+ *     Trailer: value\r\n
+ *     \r\n
+ *
+ * The encoded bytes can be fed in pieces of any size. Chunk
+ * extensions and trailers are skipped.
+ */
+class ChunkedDecoder {
+
+public:
+
+    ChunkedDecoder()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        state = SIZE;
+        digits = 0;
+        chunk_left = 0;
+        line_len = 0;
+    }
+
+    /*
+     * Decode the bytes of "src" and copy the data they hold
+     * to "dst", stopping when "max" bytes were copied, when
+     * "src" is over or at the end of the body. The number of
+     * copied bytes is stored in "copied".
+     *
+     * Returns the number of bytes of "src" that were used,
+     * or -1 if the encoding is invalid.
+     */
+    int decode(const char *src, int len, char *dst, int max, int& copied)
+    {
+        copied = 0;
+
+        int i = 0;
+        while (i < len && state != DONE) {
+
+            if (state == DATA) {
+                int n = (int) std::min<int64_t>(chunk_left, std::min(len - i, max - copied));
+                if (n == 0)
+                    break; // No room left in "dst"
+                memcpy(dst + copied, src + i, n);
+                copied += n;
+                i += n;
+                chunk_left -= n;
+                if (chunk_left == 0)
+                    state = DATA_CR;
+                continue;
+            }
+
+            char c = src[i++];
+            switch (state) {
+
+                case SIZE:
+                {
+                    int digit = hex_value(c);
+                    if (digit >= 0) {
+                        // Sizes up to 2^60-1 can't overflow
+                        if (digits == 15)
+                            return fail();
+                        chunk_left = chunk_left * 16 + digit;
+                        digits++;
+                        break;
+                    }
+                    if (digits == 0)
+                        return fail(); // Missing size
+                    if (c == ';' || c == ' ' || c == '\t')
+                        state = EXTENSION;
+                    else if (c == '\r')
+                        state = SIZE_LF;
+                    else
+                        return fail();
+                    break;
+                }
+
+                case EXTENSION:
+                if (c == '\r')
+                    state = SIZE_LF;
+                else if (++line_len > MAX_LINE)
+                    return fail();
+                break;
+
+                case SIZE_LF:
+                if (c != '\n')
+                    return fail();
+                digits = 0;
+                line_len = 0;
+                state = chunk_left > 0 ? DATA : TRAILER_START;
+                break;
+
+                case DATA_CR:
+                if (c != '\r')
+                    return fail();
+                state = DATA_LF;
+                break;
+
+                case DATA_LF:
+                if (c != '\n')
+                    return fail();
+                state = SIZE;
+                break;
+
+                case TRAILER_START:
+                if (c == '\r')
+                    state = END_LF;
+                else
+                    state = TRAILER;
+                break;
+
+                case TRAILER:
+                if (c == '\r')
+                    state = TRAILER_LF;
+                else if (++line_len > MAX_LINE)
+                    return fail();
+                break;
+
+                case TRAILER_LF:
+                if (c != '\n')
+                    return fail();
+                line_len = 0;
+                state = TRAILER_START;
+                break;
+
+                case END_LF:
+                if (c != '\n')
+                    return fail();
+                state = DONE;
+                break;
+
+                default:
+                return fail();
+            }
+        }
+
+        return i;
+    }
+
+    /*
+     * True iff the whole body was decoded
+     */
+    bool done() const
+    {
+        return state == DONE;
+    }
+
+    bool failed() const
+    {
+        return state == ERROR;
+    }
+
+private:
+
+    // Maximum length of a chunk extension or of a trailer
+    static const int MAX_LINE = 4096;
+
+    enum State {
+        SIZE,          // Hex digits of the size of a chunk
+        EXTENSION,     // Chunk extension, up to the \r
+        SIZE_LF,       // \n after the size line
+        DATA,          // Data of the chunk
+        DATA_CR,       // \r after the data
+        DATA_LF,       // \n after the data
+        TRAILER_START, // Start of a trailer or of the final empty line
+        TRAILER,       // Trailer, up to the \r
+        TRAILER_LF,    // \n after a trailer
+        END_LF,        // \n of the final empty line
+        DONE,
+        ERROR,
+    };
+
+    State state;
+    int digits;         // Digits of the current size that were read
+    int64_t chunk_left; // Size of the current chunk, then bytes of it left to read
+    int line_len;       // Bytes of the current extension or trailer
+
+    int fail()
+    {
+        state = ERROR;
+        return -1;
+    }
+
+    static int hex_value(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+};
+
+#endif /* CHUNKED_HPP */
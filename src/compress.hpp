@@ -0,0 +1,278 @@
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <new>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <zlib.h>
+#include "encoding.hpp"
+#include "output.hpp"
+
+/*
+ * Hash of the bytes at "src", 8 at a time. It's only used
+ * to find candidates, which are then compared in full.
+ */
+inline uint64_t hash_bytes(const char *src, int len)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (uint64_t) len;
+    auto mix = [&h](uint64_t word) {
+        h = (h ^ word) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+    };
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        mix(word);
+        src += 8;
+        len -= 8;
+    }
+
+    if (len > 0) {
+        uint64_t word = 0;
+        memcpy(&word, src, len);
+        mix(word);
+    }
+    return h;
+}
+
+/*
+ * Compresses response bodies with zlib. The streams are
+ * reset between bodies instead of being allocated again.
+ *
+ * Compressed bodies are kept in an LRU cache keyed by a
+ * hash of the original bytes, so bodies that are sent many
+ * times are only compressed once. Entries hold a copy of
+ * the original to rule out hash collisions. The cache is
+ * bounded by "max_bytes", counting both copies.
+ *
+ * It's not thread-safe.
+ */
+class Compressor {
+
+public:
+
+    Compressor(int level_=6, int64_t max_bytes_=16*1024*1024)
+    {
+        level = level_;
+        max_bytes = max_bytes_;
+        used_bytes = 0;
+        first = nullptr;
+        last = nullptr;
+        hits = 0;
+        misses = 0;
+        ready[0] = false;
+        ready[1] = false;
+    }
+
+    ~Compressor()
+    {
+        clear();
+        for (int i = 0; i < 2; i++)
+            if (ready[i])
+                deflateEnd(&streams[i]);
+    }
+
+    Compressor(Compressor&) = delete;
+    Compressor& operator=(Compressor&) = delete;
+
+    /*
+     * Returns a blob holding "src" compressed with
+     * "encoding", or null if it failed or if the result
+     * wouldn't be smaller than the original. The caller
+     * owns a reference to the blob.
+     */
+    SharedBlob *compress(Encoding encoding, const char *src, int len)
+    {
+        if (encoding == Encoding::IDENTITY || len <= 0)
+            return nullptr;
+
+        uint64_t hash = hash_bytes(src, len) ^ (uint64_t) encoding;
+
+        auto it = entries.find(hash);
+        if (it != entries.end()) {
+            Entry *entry = it->second;
+            if (entry->encoding == encoding && (int) entry->original.size() == len
+             && !memcmp(entry->original.data(), src, len)) {
+                hits++;
+                unlink(entry);
+                link_first(entry);
+                if (entry->compressed == nullptr)
+                    return nullptr; // Known not to shrink
+                entry->compressed->ref();
+                return entry->compressed;
+            }
+            evict(entry);
+        }
+
+        misses++;
+        SharedBlob *blob = nullptr;
+        int compressed_len = run(encoding, src, len);
+        if (compressed_len < 0)
+            return nullptr;
+        if (compressed_len < len) {
+            blob = SharedBlob::create(output.data(), compressed_len);
+            if (blob == nullptr)
+                return nullptr;
+        }
+
+        // Bodies that don't shrink are remembered too, so
+        // that they're not compressed again.
+        store(hash, encoding, src, len, blob);
+        return blob;
+    }
+
+    /*
+     * Drop all cached bodies
+     */
+    void clear()
+    {
+        while (first)
+            evict(first);
+    }
+
+    /*
+     * Bytes held by the cached entries
+     */
+    int64_t size() const
+    {
+        return used_bytes;
+    }
+
+    // Number of bodies that were found in the cache and
+    // that had to be compressed
+    uint64_t hits;
+    uint64_t misses;
+
+private:
+
+    struct Entry {
+        uint64_t hash;
+        Encoding encoding;
+        std::string original;
+        SharedBlob *compressed; // Null if it didn't shrink
+        Entry *prev;
+        Entry *next;
+    };
+
+    int level;
+
+    // Stream of each encoding, initialized when first used
+    z_stream streams[2];
+    bool ready[2];
+
+    std::vector<char> output; // Result of the last "run"
+
+    std::unordered_map<uint64_t, Entry*> entries;
+
+    int64_t max_bytes;
+    int64_t used_bytes;
+
+    // LRU list, from the most recently used entry
+    Entry *first;
+    Entry *last;
+
+    // Compress "src" into "output", returning the length of
+    // the result or -1 on failure
+    int run(Encoding encoding, const char *src, int len)
+    {
+        int index = (encoding == Encoding::GZIP) ? 0 : 1;
+        z_stream& stream = streams[index];
+
+        if (!ready[index]) {
+            memset(&stream, 0, sizeof(stream));
+            // Gzip wraps the data with a header and a CRC,
+            // while the "deflate" coding is the zlib format.
+            int window_bits = (encoding == Encoding::GZIP) ? 15 + 16 : 15;
+            if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                std::clog << "Couldn't initialize zlib\n";
+                return -1;
+            }
+            ready[index] = true;
+        } else if (deflateReset(&stream) != Z_OK)
+            return -1;
+
+        output.resize(deflateBound(&stream, len));
+        stream.next_in   = (Bytef*) src;
+        stream.avail_in  = len;
+        stream.next_out  = (Bytef*) output.data();
+        stream.avail_out = output.size();
+
+        // The output buffer is large enough for a single call
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+            return -1;
+        return output.size() - stream.avail_out;
+    }
+
+    static int64_t entry_cost(const Entry *entry)
+    {
+        int64_t cost = entry->original.size() + sizeof(Entry) + 64;
+        if (entry->compressed)
+            cost += entry->compressed->length();
+        return cost;
+    }
+
+    void store(uint64_t hash, Encoding encoding, const char *src, int len, SharedBlob *blob)
+    {
+        int64_t cost = len + sizeof(Entry) + 64 + (blob ? blob->length() : 0);
+        if (cost > max_bytes)
+            return;
+
+        while (used_bytes + cost > max_bytes)
+            evict(last);
+
+        Entry *entry = new (std::nothrow) Entry;
+        if (entry == nullptr)
+            return;
+        entry->hash = hash;
+        entry->encoding = encoding;
+        entry->original.assign(src, len);
+        entry->compressed = blob;
+        if (blob)
+            blob->ref();
+        link_first(entry);
+        entries[hash] = entry;
+        used_bytes += entry_cost(entry);
+    }
+
+    void evict(Entry *entry)
+    {
+        unlink(entry);
+        entries.erase(entry->hash);
+        used_bytes -= entry_cost(entry);
+        if (entry->compressed)
+            entry->compressed->unref();
+        delete entry;
+    }
+
+    void unlink(Entry *entry)
+    {
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            first = entry->next;
+        if (entry->next)
+            entry->next->prev = entry->prev;
+        else
+            last = entry->prev;
+        entry->prev = nullptr;
+        entry->next = nullptr;
+    }
+
+    void link_first(Entry *entry)
+    {
+        entry->prev = nullptr;
+        entry->next = first;
+        if (first)
+            first->prev = entry;
+        else
+            last = entry;
+        first = entry;
+    }
+};
+
+#endif /* COMPRESS_HPP */
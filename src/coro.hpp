@@ -0,0 +1,472 @@
+#ifndef CORO_HPP
+#define CORO_HPP
+
+/*
+ * Coroutine handlers (see "Server::serve_async"). They need
+ * C++20, so this header is empty when it's compiled with an
+ * older standard, and HTTP_COROUTINES is only defined when
+ * coroutines are available.
+ *
+ * All the translation units of a program that include
+ * "server.hpp" must be compiled with the same standard,
+ * since the layout of "Server" depends on it.
+ */
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#define HTTP_COROUTINES
+
+#include <new>
+#include <utility>
+#include <climits>
+#include <cstddef>
+#include <exception>
+#include <coroutine>
+#include "slab.hpp"
+
+/*
+ * Allocator of the coroutine frames created on this thread.
+ * The server points it to its own slab while it serves
+ * requests, so that a suspended handler costs a slab block
+ * instead of a heap allocation. When it's null, frames are
+ * allocated from the heap.
+ *
+ * Each frame records where it was allocated from, so it
+ * may be destroyed after this pointer changed.
+ */
+inline thread_local BufferSlab *frame_slab = nullptr;
+
+/*
+ * Header placed before each coroutine frame. Its size keeps
+ * the frame aligned like memory returned by "new".
+ */
+struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) FrameHeader {
+    BufferSlab *slab; // Null if the frame was allocated from the heap
+    int size;         // Size of the slab block
+};
+
+inline void *allocate_frame(std::size_t size)
+{
+    std::size_t total = size + sizeof(FrameHeader);
+    if (total > INT_MAX)
+        return nullptr;
+
+    BufferSlab *slab = frame_slab;
+    int block = -1;
+    char *mem;
+    if (slab && (block = BufferSlab::block_size(total)) > 0)
+        mem = slab->allocate(block);
+    else {
+        slab = nullptr;
+        mem = new (std::nothrow) char[total];
+    }
+    if (mem == nullptr)
+        return nullptr;
+
+    FrameHeader *header = (FrameHeader*) mem;
+    header->slab = slab;
+    header->size = block;
+    return mem + sizeof(FrameHeader);
+}
+
+inline void release_frame(void *ptr)
+{
+    char *mem = (char*) ptr - sizeof(FrameHeader);
+    FrameHeader *header = (FrameHeader*) mem;
+    if (header->slab)
+        header->slab->release(mem, header->size);
+    else
+        delete[] mem;
+}
+
+template <typename T=void>
+class Task;
+
+// Part of the promise of "Task" that doesn't depend on
+// the type of the result.
+struct TaskPromiseBase {
+
+    // Coroutine awaiting this task, resumed when it completes
+    std::coroutine_handle<> continuation;
+
+    // Called when a task that nobody awaits completes (see
+    // "Task::start")
+    void (*on_done)(void *arg) = nullptr;
+    void *done_arg = nullptr;
+
+    // When the task completes, the coroutine that awaits it
+    // is resumed in its place, so chains of tasks don't grow
+    // the stack.
+    struct FinalAwaiter {
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            TaskPromiseBase& promise = handle.promise();
+            if (promise.continuation)
+                return promise.continuation;
+            if (promise.on_done)
+                promise.on_done(promise.done_arg);
+            return std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    // Tasks don't run until they're awaited or started
+    std::suspend_always initial_suspend() const noexcept
+    {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept
+    {
+        return {};
+    }
+
+    // The server doesn't use exceptions, handlers shouldn't
+    // throw either.
+    void unhandled_exception() const noexcept
+    {
+        std::terminate();
+    }
+
+    static void *operator new(std::size_t size) noexcept
+    {
+        return allocate_frame(size);
+    }
+
+    static void operator delete(void *ptr) noexcept
+    {
+        release_frame(ptr);
+    }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+
+    alignas(T) char storage[sizeof(T)];
+    bool has_value = false;
+
+    ~TaskPromise()
+    {
+        if (has_value)
+            value().~T();
+    }
+
+    T& value()
+    {
+        return *(T*) storage;
+    }
+
+    Task<T> get_return_object();
+
+    // The frame couldn't be allocated
+    static Task<T> get_return_object_on_allocation_failure();
+
+    template <typename U>
+    void return_value(U&& result)
+    {
+        new (storage) T(std::forward<U>(result));
+        has_value = true;
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+
+    Task<void> get_return_object();
+
+    static Task<void> get_return_object_on_allocation_failure();
+
+    void return_void() const noexcept
+    {
+    }
+};
+
+/*
+ * Result of a coroutine that can be awaited by another one,
+ * which is resumed with the value it returns once it's done.
+ *
+ * Tasks are lazy: the coroutine only starts running when
+ * it's awaited, or when "start" is called on a task that
+ * nobody awaits, like the handlers started by the server.
+ * The frame is destroyed with the task.
+ *
+ * If the frame couldn't be allocated the task is empty
+ * ("valid" returns false) and awaiting it returns right
+ * away, with a default-constructed value.
+ */
+template <typename T>
+class Task {
+
+public:
+
+    typedef TaskPromise<T> promise_type;
+
+    Task()
+    {
+    }
+
+    Task(Task&& other) : handle(other.handle)
+    {
+        other.handle = nullptr;
+    }
+
+    Task& operator=(Task&& other)
+    {
+        if (this != &other) {
+            if (handle)
+                handle.destroy();
+            handle = other.handle;
+            other.handle = nullptr;
+        }
+        return *this;
+    }
+
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    Task(Task&) = delete;
+    Task& operator=(Task&) = delete;
+
+    bool valid() const
+    {
+        return (bool) handle;
+    }
+
+    /*
+     * True iff the coroutine ran until its end
+     */
+    bool done() const
+    {
+        return handle && handle.done();
+    }
+
+    /*
+     * Run the coroutine until it first suspends. Once it
+     * completes, "on_done(arg)" is called, possibly from
+     * within the resumption of some other coroutine. It
+     * must not destroy the task.
+     */
+    void start(void (*on_done)(void*)=nullptr, void *arg=nullptr)
+    {
+        if (!handle || handle.done())
+            return;
+        handle.promise().on_done = on_done;
+        handle.promise().done_arg = arg;
+        handle.resume();
+    }
+
+    struct Awaiter {
+
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() const noexcept
+        {
+            return !handle || handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+
+        T await_resume()
+        {
+            if constexpr (!std::is_void<T>::value) {
+                if (!handle || !handle.promise().has_value)
+                    return T();
+                return std::move(handle.promise().value());
+            }
+        }
+    };
+
+    Awaiter operator co_await() const noexcept
+    {
+        return Awaiter{handle};
+    }
+
+private:
+
+    friend promise_type;
+
+    explicit Task(std::coroutine_handle<promise_type> handle_) : handle(handle_)
+    {
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object_on_allocation_failure()
+{
+    return Task<T>();
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object_on_allocation_failure()
+{
+    return Task<void>();
+}
+
+/*
+ * Lets coroutines wait for something that another one does,
+ * for instance a handler waiting for the request of another
+ * connection to publish some data.
+ *
+ * "co_await trigger.wait()" suspends the caller until the
+ * next "notify". Coroutines that start waiting after it
+ * was called wait for the following one. The waiters are
+ * resumed by "notify" itself, in the order they started
+ * waiting, before it returns.
+ *
+ * A waiter that is destroyed while suspended, because its
+ * handler was dropped, leaves the list. The trigger must
+ * outlive its waiters and isn't thread-safe.
+ */
+class Trigger {
+
+public:
+
+    class Waiter {
+
+    public:
+
+        Waiter(Trigger& trigger_) : trigger(trigger_)
+        {
+        }
+
+        ~Waiter()
+        {
+            if (linked)
+                trigger.unlink(this);
+        }
+
+        Waiter(Waiter&) = delete;
+        Waiter& operator=(Waiter&) = delete;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle_) noexcept
+        {
+            handle = handle_;
+            trigger.link(this);
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+
+    private:
+
+        friend class Trigger;
+
+        Trigger& trigger;
+        std::coroutine_handle<> handle;
+        uint64_t generation = 0; // Value of "Trigger::generation" when it started waiting
+        bool linked = false;
+        Waiter *prev = nullptr;
+        Waiter *next = nullptr;
+    };
+
+    Trigger()
+    {
+    }
+
+    Trigger(Trigger&) = delete;
+    Trigger& operator=(Trigger&) = delete;
+
+    Waiter wait()
+    {
+        return Waiter(*this);
+    }
+
+    /*
+     * Resume all coroutines that are waiting
+     */
+    void notify()
+    {
+        // Waiters are appended, so the ones that started
+        // waiting before this call are at the front. A
+        // resumed coroutine may wait again or drop other
+        // waiters, so the list is read again each time.
+        uint64_t current = generation++;
+        while (first && first->generation <= current) {
+            Waiter *waiter = first;
+            unlink(waiter);
+            waiter->handle.resume();
+        }
+    }
+
+    /*
+     * Number of coroutines that are waiting
+     */
+    int waiting() const
+    {
+        return count;
+    }
+
+private:
+
+    Waiter *first = nullptr;
+    Waiter *last = nullptr;
+    uint64_t generation = 0;
+    int count = 0;
+
+    void link(Waiter *waiter)
+    {
+        waiter->generation = generation;
+        waiter->linked = true;
+        waiter->prev = last;
+        waiter->next = nullptr;
+        if (last)
+            last->next = waiter;
+        else
+            first = waiter;
+        last = waiter;
+        count++;
+    }
+
+    void unlink(Waiter *waiter)
+    {
+        if (waiter->prev)
+            waiter->prev->next = waiter->next;
+        else
+            first = waiter->next;
+        if (waiter->next)
+            waiter->next->prev = waiter->prev;
+        else
+            last = waiter->prev;
+        waiter->prev = nullptr;
+        waiter->next = nullptr;
+        waiter->linked = false;
+        count--;
+    }
+};
+
+#endif /* coroutines */
+#endif /* CORO_HPP */
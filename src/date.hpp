@@ -0,0 +1,87 @@
+#ifndef DATE_HPP
+#define DATE_HPP
+
+#include <ctime>
+#include <cstring>
+
+/*
+ * Write the date of "t" in the format of the HTTP "Date"
+ * header (RFC 7231, section 7.1.1.1), which is always 29
+ * characters long:
+ *
+ *     Sun, 06 Nov 1994 08:49:37 GMT
+ *
+ * No null terminator is written.
+ */
+inline void format_http_date(time_t t, char *dst)
+{
+    static const char days[][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char months[][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+    struct tm tm;
+    #ifdef _WIN32
+    gmtime_s(&tm, &t);
+    #else
+    gmtime_r(&t, &tm);
+    #endif
+
+    auto two_digits = [](char *p, int n) {
+        p[0] = '0' + n / 10;
+        p[1] = '0' + n % 10;
+    };
+
+    memcpy(dst, days[tm.tm_wday], 3);
+    memcpy(dst + 3, ", ", 2);
+    two_digits(dst + 5, tm.tm_mday);
+    dst[7] = ' ';
+    memcpy(dst + 8, months[tm.tm_mon], 3);
+    dst[11] = ' ';
+    int year = tm.tm_year + 1900;
+    two_digits(dst + 12, year / 100 % 100);
+    two_digits(dst + 14, year % 100);
+    dst[16] = ' ';
+    two_digits(dst + 17, tm.tm_hour);
+    dst[19] = ':';
+    two_digits(dst + 20, tm.tm_min);
+    dst[22] = ':';
+    two_digits(dst + 23, tm.tm_sec);
+    memcpy(dst + 25, " GMT", 4);
+}
+
+/*
+ * "Date" header line of the current second. It's only
+ * formatted again when the second changes. Each thread
+ * must use its own cache.
+ */
+class DateCache {
+
+public:
+
+    static const int LINE_LEN = 37; // "Date: " + 29 + "\r\n"
+
+    /*
+     * The line of the time "now", with its "\r\n" and
+     * without a null terminator
+     */
+    const char *line(time_t now)
+    {
+        if (now != second || !valid) {
+            memcpy(text, "Date: ", 6);
+            format_http_date(now, text + 6);
+            memcpy(text + 35, "\r\n", 2);
+            second = now;
+            valid = true;
+        }
+        return text;
+    }
+
+private:
+
+    // Zero-initialized, so that a thread-local cache needs
+    // no constructor call.
+    time_t second;
+    bool   valid;
+    char   text[LINE_LEN];
+};
+
+#endif /* DATE_HPP */
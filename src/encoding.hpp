@@ -0,0 +1,151 @@
+#ifndef ENCODING_HPP
+#define ENCODING_HPP
+
+#include <cstring>
+#include "parse.hpp"
+
+/*
+ * Content codings a response body can be compressed with
+ * (see "compress.hpp")
+ */
+enum class Encoding { IDENTITY, GZIP, DEFLATE };
+
+inline const char *encoding_name(Encoding encoding)
+{
+    switch (encoding) {
+        case Encoding::GZIP: return "gzip";
+        case Encoding::DEFLATE: return "deflate";
+        default: return "identity";
+    }
+}
+
+// True iff the bytes at "str" start with the lowercase
+// "prefix", ignoring case
+inline bool starts_with_ignore_case(const char *str, int len, const char *prefix)
+{
+    int i = 0;
+    for (; prefix[i]; i++) {
+        if (i == len)
+            return false;
+        char c = str[i];
+        if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+        if (c != prefix[i])
+            return false;
+    }
+    return true;
+}
+
+/*
+ * True iff a body of type "type" (the value of a
+ * "Content-Type" header) is worth compressing. Media that
+ * is already compressed, like most images, audio, video,
+ * fonts and archives, isn't.
+ */
+inline bool compressible_type(const char *type, int len)
+{
+    static const char *const compressed[] = {
+        "image/", "audio/", "video/", "font/woff",
+        "application/zip", "application/gzip", "application/x-gzip",
+        "application/x-bzip2", "application/x-xz", "application/zstd",
+        "application/x-7z-compressed", "application/x-rar-compressed",
+        "application/pdf", "application/octet-stream",
+    };
+
+    while (len > 0 && (*type == ' ' || *type == '\t')) {
+        type++;
+        len--;
+    }
+
+    // SVG is text
+    if (starts_with_ignore_case(type, len, "image/svg+xml"))
+        return true;
+
+    for (const char *prefix : compressed)
+        if (starts_with_ignore_case(type, len, prefix))
+            return false;
+    return len > 0;
+}
+
+/*
+ * The coding to compress the response to "req" with,
+ * according to its "Accept-Encoding" header (RFC 7231,
+ * section 5.3.4). Gzip is preferred to deflate when both
+ * have the same weight, and codings with a weight of 0
+ * are never chosen.
+ */
+inline Encoding accepted_encoding(const Request& req)
+{
+    Slice value;
+    if (!req.get(H::AcceptEncoding, value))
+        return Encoding::IDENTITY;
+
+    const char *str = value.str + value.off;
+    int len = value.len;
+
+    // Weights are compared in thousandths. -1 means that
+    // the coding wasn't listed.
+    int gzip = -1;
+    int deflate = -1;
+    int any = -1;
+
+    int i = 0;
+    while (i < len) {
+
+        auto skip_spaces = [&]() {
+            while (i < len && (str[i] == ' ' || str[i] == '\t'))
+                i++;
+        };
+
+        skip_spaces();
+        int start = i;
+        while (i < len && str[i] != ',' && str[i] != ';' && str[i] != ' ' && str[i] != '\t')
+            i++;
+        const char *name = str + start;
+        int name_len = i - start;
+
+        // Weight, as in ";q=0.5"
+        int weight = 1000;
+        skip_spaces();
+        if (i < len && str[i] == ';') {
+            i++;
+            skip_spaces();
+            if (i + 1 < len && (str[i] == 'q' || str[i] == 'Q') && str[i+1] == '=') {
+                i += 2;
+                weight = 0;
+                if (i < len && str[i] == '1')
+                    weight = 1000;
+                else if (i + 1 < len && str[i] == '0' && str[i+1] == '.') {
+                    i += 2;
+                    for (int scale = 100; scale > 0 && i < len && str[i] >= '0' && str[i] <= '9'; scale /= 10)
+                        weight += (str[i++] - '0') * scale;
+                }
+            }
+        }
+
+        // Ignore anything else up to the next coding
+        while (i < len && str[i] != ',')
+            i++;
+        i++;
+
+        if (name_len == 4 && starts_with_ignore_case(name, name_len, "gzip"))
+            gzip = weight;
+        else if (name_len == 6 && starts_with_ignore_case(name, name_len, "x-gzip"))
+            gzip = weight;
+        else if (name_len == 7 && starts_with_ignore_case(name, name_len, "deflate"))
+            deflate = weight;
+        else if (name_len == 1 && name[0] == '*')
+            any = weight;
+    }
+
+    if (gzip < 0) gzip = any;
+    if (deflate < 0) deflate = any;
+
+    if (gzip > 0 && gzip >= deflate)
+        return Encoding::GZIP;
+    if (deflate > 0)
+        return Encoding::DEFLATE;
+    return Encoding::IDENTITY;
+}
+
+#endif /* ENCODING_HPP */
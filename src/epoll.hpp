@@ -0,0 +1,345 @@
+#ifndef EPOLL_HPP
+#define EPOLL_HPP
+
+#ifdef __linux__
+
+#include <new>
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <sys/epoll.h>
+#include "socket.hpp"
+
+/*
+ * Event loop based on Linux's epoll. It has the same interface
+ * of "PollEventLoop" but registration changes and readiness
+ * delivery cost O(1) regardless of how many sockets are
+ * registered, so idle connections are free.
+ *
+ * The user pointer associated to a socket is stored directly
+ * in the "epoll_data" of its kernel registration.
+ */
+template <int N>
+class EpollEventLoop {
+
+    // Registration state of a single descriptor. The
+    // table is indexed by file descriptor, which the
+    // kernel always allocates as the lowest free number,
+    // so it stays dense.
+    struct Entry {
+        void    *ptr;
+        uint32_t events; // Current epoll event mask
+        bool     active;
+    };
+
+    // Maximum number of events returned by a single
+    // "epoll_wait" call.
+    static const int MAX_READY = N < 1024 ? N : 1024;
+
+    int epfd;
+
+    Entry *entries;
+    int    num_entries; // Capacity of "entries"
+
+    int count; // Number of registered sockets
+
+    // Events returned by the last "epoll_wait" that
+    // weren't delivered to the caller yet. The events
+    // field of each entry is cleared as they're reported.
+    struct epoll_event ready[MAX_READY];
+    int num_ready;
+    int cursor;
+
+    static uint32_t convert_event_flags(int in)
+    {
+        uint32_t out = 0;
+        if (in & Event::RECV) out |= EPOLLIN;
+        if (in & Event::SEND) out |= EPOLLOUT;
+        return out;
+    }
+
+    static Event::Type convert_revents(uint32_t revents)
+    {
+        int type = 0;
+        if (revents & EPOLLIN)  type |= Event::RECV;
+        if (revents & EPOLLOUT) type |= Event::SEND;
+        return (Event::Type) type;
+    }
+
+    Entry* find_entry(const Socket& sock)
+    {
+        int fd = sock.fd_;
+        if (fd < 0 || fd >= num_entries || !entries[fd].active)
+            return nullptr;
+        return &entries[fd];
+    }
+
+    // Make sure the entry table can be indexed by "fd"
+    bool ensure_entry(int fd)
+    {
+        if (fd < num_entries)
+            return true;
+
+        int new_size = num_entries > 0 ? 2 * num_entries : 1024;
+        while (new_size <= fd)
+            new_size *= 2;
+
+        Entry *new_entries = new (std::nothrow) Entry[new_size];
+        if (new_entries == nullptr)
+            return false;
+
+        if (num_entries > 0)
+            memcpy(new_entries, entries, num_entries * sizeof(Entry));
+        for (int i = num_entries; i < new_size; i++)
+            new_entries[i].active = false;
+
+        delete[] entries;
+        entries = new_entries;
+        num_entries = new_size;
+        return true;
+    }
+
+    bool update(int fd, Entry& entry, uint32_t events)
+    {
+        if (entry.events == events)
+            return true; // Nothing changed, don't bother the kernel
+
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = entry.ptr;
+        syscall_count++;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev))
+            return false;
+
+        entry.events = events;
+        return true;
+    }
+
+    // Move the cursor forward until an event with
+    // some unreported flags is found.
+    void skip()
+    {
+        while (cursor < num_ready && ready[cursor].events == 0)
+            cursor++;
+    }
+
+public:
+
+    EpollEventLoop()
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        entries = nullptr;
+        num_entries = 0;
+        count = 0;
+        num_ready = 0;
+        cursor = 0;
+    }
+
+    ~EpollEventLoop()
+    {
+        if (epfd >= 0)
+            close(epfd);
+        delete[] entries;
+    }
+
+    EpollEventLoop(EpollEventLoop&) = delete;
+    EpollEventLoop& operator=(EpollEventLoop&) = delete;
+
+    bool add(const Socket& sock, int events, void *ptr=nullptr)
+    {
+        if (epfd < 0 || count == N)
+            return false;
+
+        int fd = sock.fd_;
+        if (fd < 0 || !ensure_entry(fd))
+            return false;
+
+        Entry& entry = entries[fd];
+        if (entry.active)
+            return false; // Already registered
+
+        struct epoll_event ev;
+        ev.events = convert_event_flags(events);
+        ev.data.ptr = ptr;
+        syscall_count++;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+            return false;
+
+        entry.ptr = ptr;
+        entry.events = ev.events;
+        entry.active = true;
+        count++;
+        return true;
+    }
+
+    void add_events(const Socket& sock, int events)
+    {
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr) return; // Not found
+
+        update(sock.fd_, *entry, entry->events | convert_event_flags(events));
+    }
+
+    void remove_events(const Socket& sock, int events)
+    {
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr) return; // Not found
+
+        uint32_t flags = convert_event_flags(events);
+        if (!update(sock.fd_, *entry, entry->events & ~flags))
+            return;
+
+        // Like "remove", drop the flags from the events that
+        // weren't reported yet
+        if (entry->ptr != nullptr)
+            for (int i = cursor; i < num_ready; i++)
+                if (ready[i].data.ptr == entry->ptr)
+                    ready[i].events &= ~flags;
+    }
+
+    bool remove(const Socket& sock)
+    {
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr) return false; // Not found
+
+        // Older kernels require a non-null event
+        // pointer even though it's ignored.
+        struct epoll_event ev;
+        syscall_count++;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, sock.fd_, &ev);
+
+        // Drop the events that were already returned by
+        // the kernel but not reported yet, or the caller
+        // may receive events for a socket it removed.
+        // Sockets with no user pointer can't be told apart
+        // so their events are left as they are.
+        if (entry->ptr != nullptr)
+            for (int i = cursor; i < num_ready; i++)
+                if (ready[i].data.ptr == entry->ptr)
+                    ready[i].events = 0;
+
+        entry->active = false;
+        count--;
+        return true;
+    }
+
+    /*
+     * See "PollEventLoop::accept".
+     */
+    bool accept(Socket& listener, Socket& dst)
+    {
+        return listener.accept(dst);
+    }
+
+    template <typename B>
+    bool recv(Socket& sock, B& dst, int limit)
+    {
+        return dst.write(sock, limit);
+    }
+
+    template <typename C>
+    int send(Socket& sock, C& chain)
+    {
+        return chain.flush(sock);
+    }
+
+    Event wait()
+    {
+        skip();
+
+        // If no more events are buffered, wait for more
+        while (cursor == num_ready) {
+
+            syscall_count++;
+            int n = epoll_wait(epfd, ready, MAX_READY, -1);
+            if (n < 0) {
+                num_ready = 0;
+                cursor = 0;
+                return Event(Event::FAILURE);
+            }
+
+            num_ready = n;
+            cursor = 0;
+            skip();
+        }
+        assert(cursor < num_ready);
+
+        // "epoll_event" is packed on some architectures, so
+        // its fields can't be bound to references.
+        void* ptr = ready[cursor].data.ptr;
+        uint32_t revents = ready[cursor].events;
+        assert(revents != 0);
+
+        // Like "PollEventLoop", report RECV events first
+        // and SEND events at the following call.
+
+        Event event;
+        if (revents & EPOLLIN) {
+            revents &= ~EPOLLIN;
+            event = Event(Event::RECV, ptr);
+        } else if (revents & EPOLLOUT) {
+            revents &= ~EPOLLOUT;
+            event = Event(Event::SEND, ptr);
+        } else {
+            // Report other events as errors
+            revents = 0;
+            event = Event(Event::FAILURE, ptr);
+        }
+
+        ready[cursor].events = revents;
+        return event;
+    }
+
+    /*
+     * The epoll descriptor itself, which is readable while
+     * registered sockets are ready.
+     */
+    int fd() const
+    {
+        return epfd;
+    }
+
+    bool pending() const
+    {
+        for (int i = cursor; i < num_ready; i++)
+            if (ready[i].events)
+                return true;
+        return false;
+    }
+
+    /*
+     * See "PollEventLoop::wait_batch".
+     */
+    int wait_batch(Event* out, int max, int timeout_ms)
+    {
+        skip();
+
+        if (cursor == num_ready) {
+
+            syscall_count++;
+            int n = epoll_wait(epfd, ready, MAX_READY, timeout_ms);
+            if (n < 0) {
+                num_ready = 0;
+                cursor = 0;
+                return -1;
+            }
+
+            num_ready = n;
+            cursor = 0;
+        }
+
+        int num = 0;
+        while (cursor < num_ready && num < max) {
+            uint32_t revents = ready[cursor].events;
+            if (revents) {
+                out[num++] = Event(convert_revents(revents), ready[cursor].data.ptr);
+                ready[cursor].events = 0;
+            }
+            cursor++;
+        }
+        return num;
+    }
+};
+
+#endif /* __linux__ */
+#endif /* EPOLL_HPP */
@@ -0,0 +1,30 @@
+#ifndef EVLOOP_HPP
+#define EVLOOP_HPP
+
+#include "socket.hpp"
+#include "epoll.hpp"
+#include "uring.hpp"
+
+/*
+ * Default event loop implementation. All implementations
+ * expose the same "add", "add_events", "remove_events",
+ * "remove" and "wait" interface, so any of them can be
+ * passed to "Server" as its second template argument. The
+ * server also performs its I/O through the loop ("accept",
+ * "recv" and "send"), so that the io_uring loop can do it
+ * with completions.
+ *
+ * On Linux epoll is used unless HTTP_USE_POLL is defined
+ * at build time. Defining HTTP_USE_IO_URING selects the
+ * io_uring loop, which falls back to epoll at runtime when
+ * the kernel doesn't support it.
+ */
+#if !defined(__linux__) || defined(HTTP_USE_POLL)
+template <int N> using EventLoop = PollEventLoop<N>;
+#elif defined(HTTP_USE_IO_URING)
+template <int N> using EventLoop = UringEventLoop<N>;
+#else
+template <int N> using EventLoop = EpollEventLoop<N>;
+#endif
+
+#endif /* EVLOOP_HPP */
@@ -0,0 +1,446 @@
+#ifndef FILES_HPP
+#define FILES_HPP
+
+#ifndef _WIN32
+
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "slice.hpp"
+#include "socket.hpp"
+
+/*
+ * A regular file opened for reading, along with the
+ * metadata it had when it was opened. The descriptor
+ * is closed when the last reference is dropped, so a
+ * file can be evicted from the cache while responses
+ * are still being sent from it.
+ */
+class OpenFile {
+
+public:
+
+    int fd() const
+    {
+        return fd_;
+    }
+
+    int64_t size() const
+    {
+        return size_;
+    }
+
+    time_t mtime() const
+    {
+        return mtime_;
+    }
+
+    void ref()
+    {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void unref()
+    {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    /*
+     * Open "path" and return a reference to it, or null
+     * if it couldn't be opened or isn't a regular file.
+     */
+    static OpenFile* open(const char *path)
+    {
+        syscall_count++;
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat info;
+        syscall_count++;
+        if (fstat(fd, &info) || !S_ISREG(info.st_mode)) {
+            close(fd);
+            return nullptr;
+        }
+
+        OpenFile *file = new (std::nothrow) OpenFile(fd, info);
+        if (file == nullptr)
+            close(fd);
+        return file;
+    }
+
+    /*
+     * True iff "info" describes the same file with the
+     * same contents (as far as the metadata can tell).
+     */
+    bool matches(const struct stat& info) const
+    {
+        return info.st_ino == ino && info.st_dev == dev
+            && info.st_size == size_ && info.st_mtime == mtime_;
+    }
+
+private:
+
+    std::atomic<int> refs;
+
+    int     fd_;
+    int64_t size_;
+    time_t  mtime_;
+    ino_t   ino;
+    dev_t   dev;
+
+    OpenFile(int fd, const struct stat& info) : refs(1)
+    {
+        fd_    = fd;
+        size_  = info.st_size;
+        mtime_ = info.st_mtime;
+        ino    = info.st_ino;
+        dev    = info.st_dev;
+    }
+
+    ~OpenFile()
+    {
+        close(fd_);
+    }
+};
+
+/*
+ * Least-recently-used cache of open files indexed by path,
+ * so that serving a hot file doesn't require an "open" and
+ * an "fstat" per request.
+ *
+ * Cached entries are trusted for "revalidate_ms" milliseconds.
+ * After that the path is checked again with "stat" and the
+ * file is reopened if it was changed or replaced.
+ *
+ * The cache isn't thread-safe.
+ */
+class FileCache {
+
+public:
+
+    FileCache(int max_files_=256, int revalidate_ms_=1000)
+    {
+        max_files = max_files_;
+        revalidate_ms = revalidate_ms_;
+        first = nullptr;
+        last = nullptr;
+    }
+
+    ~FileCache()
+    {
+        while (first)
+            evict(first);
+    }
+
+    FileCache(FileCache&) = delete;
+    FileCache& operator=(FileCache&) = delete;
+
+    /*
+     * Returns a new reference to the file at "path", which
+     * the caller must drop with "unref", or null if it can't
+     * be opened.
+     */
+    OpenFile* open(const char *path)
+    {
+        int64_t now = now_ms();
+
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+
+            Entry *entry = it->second;
+
+            bool valid = true;
+            if (now - entry->checked >= revalidate_ms) {
+                struct stat info;
+                syscall_count++;
+                valid = !stat(path, &info) && entry->file->matches(info);
+                entry->checked = now;
+            }
+
+            if (valid) {
+                // Move to the front of the LRU list
+                unlink(entry);
+                link_first(entry);
+                entry->file->ref();
+                return entry->file;
+            }
+
+            evict(entry);
+        }
+
+        OpenFile *file = OpenFile::open(path);
+        if (file == nullptr)
+            return nullptr;
+
+        if (max_files > 0) {
+
+            if ((int) entries.size() >= max_files)
+                evict(last);
+
+            Entry *entry = new (std::nothrow) Entry;
+            if (entry) {
+                entry->path = path;
+                entry->file = file;
+                entry->checked = now;
+                entry->prev = nullptr;
+                entry->next = nullptr;
+                entries[entry->path] = entry;
+                link_first(entry);
+                file->ref(); // Reference held by the cache
+            }
+        }
+
+        return file;
+    }
+
+    int size() const
+    {
+        return entries.size();
+    }
+
+private:
+
+    struct Entry {
+        std::string path;
+        OpenFile *file;
+        int64_t checked; // Time of the last check, in milliseconds
+        Entry *prev;
+        Entry *next;
+    };
+
+    int max_files;
+    int revalidate_ms;
+
+    std::unordered_map<std::string, Entry*> entries;
+
+    // LRU list. The most recently used entry is the first.
+    Entry *first;
+    Entry *last;
+
+    static int64_t now_ms()
+    {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    void link_first(Entry *entry)
+    {
+        entry->prev = nullptr;
+        entry->next = first;
+        if (first)
+            first->prev = entry;
+        else
+            last = entry;
+        first = entry;
+    }
+
+    void unlink(Entry *entry)
+    {
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            first = entry->next;
+
+        if (entry->next)
+            entry->next->prev = entry->prev;
+        else
+            last = entry->prev;
+    }
+
+    void evict(Entry *entry)
+    {
+        unlink(entry);
+        entries.erase(entry->path);
+        entry->file->unref();
+        delete entry;
+    }
+};
+
+enum class ByteRange {
+    NONE,          // No range, or one that must be ignored
+    SATISFIABLE,   // A valid range within the file
+    UNSATISFIABLE, // A valid range outside of the file
+};
+
+/*
+ * Parse the value of a "Range" header for a file of
+ * "size" bytes. Only single ranges are supported, as
+ * in "bytes=first-last", "bytes=first-" or "bytes=-suffix".
+ * Anything else is ignored so that the whole file is sent.
+ *
+ * On success "first" and "last" are the inclusive bounds
+ * of the range.
+ */
+inline ByteRange parse_byte_range(Slice value, int64_t size, int64_t& first, int64_t& last)
+{
+    const char *src = value.str + value.off;
+    int len = value.len;
+    int i = 0;
+
+    const char prefix[] = "bytes=";
+    int prefix_len = sizeof(prefix)-1;
+    if (len < prefix_len || strncmp(src, prefix, prefix_len))
+        return ByteRange::NONE;
+    i = prefix_len;
+
+    // Parse a number. Returns -1 if there is none
+    // and -2 if it overflows.
+    auto parse_number = [&]() -> int64_t {
+        if (i == len || src[i] < '0' || src[i] > '9')
+            return -1;
+        int64_t num = 0;
+        do {
+            if (num > (INT64_MAX - 9) / 10)
+                return -2;
+            num = num * 10 + (src[i] - '0');
+            i++;
+        } while (i < len && src[i] >= '0' && src[i] <= '9');
+        return num;
+    };
+
+    int64_t a = parse_number();
+    if (a == -2 || i == len || src[i] != '-')
+        return ByteRange::NONE;
+    i++;
+    int64_t b = parse_number();
+    if (b == -2 || i != len)
+        return ByteRange::NONE; // Multiple ranges or garbage
+
+    if (a == -1) {
+        // Suffix range
+        if (b <= 0)
+            return b == 0 ? ByteRange::UNSATISFIABLE : ByteRange::NONE;
+        first = size > b ? size - b : 0;
+        last  = size - 1;
+    } else {
+        if (b != -1 && b < a)
+            return ByteRange::NONE;
+        first = a;
+        last  = (b == -1 || b >= size) ? size - 1 : b;
+    }
+
+    if (first >= size)
+        return ByteRange::UNSATISFIABLE;
+
+    return ByteRange::SATISFIABLE;
+}
+
+/*
+ * Map the path of a request URL to a file under "root",
+ * decoding percent-encoded bytes. The result is stored in
+ * "dst" as a zero-terminated string. Paths that would
+ * escape "root" are rejected. Paths ending with a slash
+ * are mapped to the "index.html" file of that directory.
+ *
+ * Returns false if the path is invalid or too long.
+ */
+inline bool resolve_path(const char *root, Slice path, char *dst, int max)
+{
+    int len = strlen(root);
+    while (len > 0 && root[len-1] == '/')
+        len--;
+    if (len >= max)
+        return false;
+    memcpy(dst, root, len);
+
+    const char *src = path.str + path.off;
+    if (path.len == 0 || src[0] != '/')
+        return false;
+
+    auto hex = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+
+    int segment = len; // Start of the current path segment in "dst"
+    for (int i = 0; i < path.len; i++) {
+
+        char c = src[i];
+        if (c == '%') {
+            if (i + 2 >= path.len || hex(src[i+1]) < 0 || hex(src[i+2]) < 0)
+                return false;
+            c = hex(src[i+1]) * 16 + hex(src[i+2]);
+            i += 2;
+            if (c == '\0' || c == '/')
+                return false;
+        }
+
+        if (c == '/') {
+            // Reject "." and ".." segments
+            int seg_len = len - segment - 1;
+            if (seg_len >= 0 && seg_len <= 2 && !strncmp(dst + segment + 1, "..", seg_len))
+                return false;
+            segment = len;
+        }
+
+        if (len + 1 >= max)
+            return false;
+        dst[len++] = c;
+    }
+
+    // Check the last segment
+    int seg_len = len - segment - 1;
+    if (seg_len > 0 && seg_len <= 2 && !strncmp(dst + segment + 1, "..", seg_len))
+        return false;
+
+    if (dst[len-1] == '/') {
+        const char index[] = "index.html";
+        if (len + (int) sizeof(index) > max)
+            return false;
+        memcpy(dst + len, index, sizeof(index));
+        return true;
+    }
+
+    dst[len] = '\0';
+    return true;
+}
+
+/*
+ * Guess the "Content-Type" of a file from its extension
+ */
+inline const char *mime_type(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (dot == nullptr || strchr(dot, '/'))
+        return "application/octet-stream";
+
+    static const struct { const char *ext, *type; } table[] = {
+        { ".html", "text/html" },
+        { ".htm",  "text/html" },
+        { ".css",  "text/css" },
+        { ".js",   "text/javascript" },
+        { ".json", "application/json" },
+        { ".txt",  "text/plain" },
+        { ".xml",  "application/xml" },
+        { ".svg",  "image/svg+xml" },
+        { ".png",  "image/png" },
+        { ".jpg",  "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".gif",  "image/gif" },
+        { ".ico",  "image/x-icon" },
+        { ".webp", "image/webp" },
+        { ".wasm", "application/wasm" },
+        { ".pdf",  "application/pdf" },
+        { ".woff2","font/woff2" },
+    };
+
+    for (const auto& entry : table)
+        if (!strcasecmp(dot, entry.ext))
+            return entry.type;
+    return "application/octet-stream";
+}
+
+#endif /* _WIN32 */
+#endif /* FILES_HPP */
@@ -0,0 +1,300 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+/*
+ * Counter written by a single thread and read by any. The
+ * increment is a relaxed load and store rather than an
+ * atomic read-modify-write, so it costs as much as on a
+ * plain integer, while readers never see a torn value.
+ */
+class Counter {
+
+public:
+
+    void add(uint64_t n=1)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    std::atomic<uint64_t> value{0};
+};
+
+/*
+ * Like "Counter" but holds the current value of something
+ */
+class Gauge {
+
+public:
+
+    void set(int64_t n)
+    {
+        value.store(n, std::memory_order_relaxed);
+    }
+
+    int64_t get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    std::atomic<int64_t> value{0};
+};
+
+/*
+ * Histogram of values such as latencies in nanoseconds, with
+ * the buckets of an HDR histogram: every power of two range
+ * is split in SUB_BUCKETS linear buckets, so a value is known
+ * within 1/SUB_BUCKETS of itself (12.5%) however large it is.
+ * Values below SUB_BUCKETS are exact and those of MAX_BITS
+ * bits or more are all counted in the last bucket.
+ *
+ * Like the counters, it's written by a single thread and
+ * may be read by any.
+ */
+class Histogram {
+
+public:
+
+    static const int SUB_BITS    = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS    = 40; // About 18 minutes in nanoseconds
+    static const int NUM_BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+    void record(uint64_t value)
+    {
+        add(counts[index(value)], 1);
+        add(total, 1);
+        add(sum_, value);
+    }
+
+    /*
+     * Add the counts of "other" to this histogram
+     */
+    void merge(const Histogram& other)
+    {
+        for (int i = 0; i < NUM_BUCKETS; i++)
+            add(counts[i], other.bucket(i));
+        add(total, other.count());
+        add(sum_, other.sum());
+    }
+
+    uint64_t count() const
+    {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const
+    {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bucket(int i) const
+    {
+        return counts[i].load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Index of the bucket of "value"
+     */
+    static int index(uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+            return value;
+
+        int msb = 63 - __builtin_clzll(value);
+        if (msb >= MAX_BITS)
+            return NUM_BUCKETS - 1;
+
+        int shift = msb - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    /*
+     * Smallest value of bucket "i" and the smallest one of
+     * the next bucket
+     */
+    static uint64_t lower_bound(int i)
+    {
+        if (i < SUB_BUCKETS)
+            return i;
+        int shift = (i >> SUB_BITS) - 1;
+        return (uint64_t) (SUB_BUCKETS + (i & (SUB_BUCKETS - 1))) << shift;
+    }
+
+    static uint64_t upper_bound(int i)
+    {
+        if (i < SUB_BUCKETS)
+            return i + 1;
+        int shift = (i >> SUB_BITS) - 1;
+        return lower_bound(i) + (1ULL << shift);
+    }
+
+    /*
+     * Value below which "fraction" (0 to 1) of the recorded
+     * values are, rounded up to the end of its bucket. It's
+     * 0 if nothing was recorded.
+     */
+    uint64_t percentile(double fraction) const
+    {
+        uint64_t n = count();
+        if (n == 0)
+            return 0;
+
+        uint64_t rank = (uint64_t) (fraction * n);
+        if (rank >= n)
+            rank = n - 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            seen += bucket(i);
+            if (seen > rank)
+                return upper_bound(i) - 1;
+        }
+        return upper_bound(NUM_BUCKETS - 1) - 1;
+    }
+
+private:
+
+    std::atomic<uint64_t> counts[NUM_BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum_{0};
+
+    static void add(std::atomic<uint64_t>& cell, uint64_t n)
+    {
+        cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Measurements of a "Server", recorded by its thread
+ */
+struct ServerMetrics {
+    Counter accepted;           // Connections accepted
+    Counter parse_failures;     // Requests rejected because their head was invalid
+    Counter keep_alive_refused; // Responses that closed the connection because of the server's limits
+    Gauge active_clients;
+    Gauge queue_depth;          // Clients with a request waiting to be served
+    Gauge buffer_bytes_held;    // Released buffer memory kept for reuse
+    Gauge buffer_bytes_in_use;
+    Histogram response_time;    // Nanoseconds from the head of a request being received to its response
+};
+
+/*
+ * Set of the metrics of servers running on different threads,
+ * such as the shards of a "ShardedServer", which are reported
+ * together. Servers are added before they start and stay
+ * registered until the registry is cleared or destroyed.
+ */
+class MetricsRegistry {
+
+public:
+
+    void add(const ServerMetrics *metrics)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        servers.push_back(metrics);
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        servers.clear();
+    }
+
+    /*
+     * Append the sum of the metrics of all servers to "out",
+     * in the Prometheus text format.
+     */
+    void write_prometheus(std::string& out) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        write_prometheus(out, servers.data(), (int) servers.size());
+    }
+
+    static void write_prometheus(std::string& out, const ServerMetrics *const *list, int count);
+
+private:
+
+    mutable std::mutex mutex;
+    std::vector<const ServerMetrics*> servers;
+};
+
+inline void MetricsRegistry::write_prometheus(std::string& out, const ServerMetrics *const *list, int count)
+{
+    char line[512];
+
+    auto counter = [&](const char *name, const char *help, Counter ServerMetrics::*field) {
+        uint64_t total = 0;
+        for (int i = 0; i < count; i++)
+            total += (list[i]->*field).get();
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                 name, help, name, name, (unsigned long long) total);
+        out += line;
+    };
+
+    auto gauge = [&](const char *name, const char *help, Gauge ServerMetrics::*field) {
+        int64_t total = 0;
+        for (int i = 0; i < count; i++)
+            total += (list[i]->*field).get();
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n",
+                 name, help, name, name, (long long) total);
+        out += line;
+    };
+
+    counter("http_connections_accepted_total", "Connections accepted.", &ServerMetrics::accepted);
+    counter("http_parse_failures_total", "Requests rejected because their head was invalid.", &ServerMetrics::parse_failures);
+    counter("http_keep_alive_refused_total", "Connections closed after a response because of the server's limits.", &ServerMetrics::keep_alive_refused);
+    gauge("http_active_clients", "Open connections.", &ServerMetrics::active_clients);
+    gauge("http_queue_depth", "Clients with a request waiting to be served.", &ServerMetrics::queue_depth);
+    gauge("http_buffer_bytes_held", "Released buffer memory kept for reuse.", &ServerMetrics::buffer_bytes_held);
+    gauge("http_buffer_bytes_in_use", "Buffer memory used by the connections.", &ServerMetrics::buffer_bytes_in_use);
+
+    // The histogram's buckets are reported with Prometheus'
+    // usual bounds. A bucket is counted under the first bound
+    // it's entirely below, so the counts are at most 12.5%
+    // off in value.
+    Histogram merged;
+    for (int i = 0; i < count; i++)
+        merged.merge(list[i]->response_time);
+
+    static const double bounds[] = {
+        0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001,
+        0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+    };
+
+    const char *name = "http_response_time_seconds";
+    snprintf(line, sizeof(line), "# HELP %s Time from the head of a request being received to its response.\n"
+                                 "# TYPE %s histogram\n", name, name);
+    out += line;
+
+    int next = 0;
+    uint64_t cumulative = 0;
+    for (double bound : bounds) {
+        uint64_t limit = (uint64_t) (bound * 1e9);
+        while (next < Histogram::NUM_BUCKETS && Histogram::upper_bound(next) <= limit)
+            cumulative += merged.bucket(next++);
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, bound, (unsigned long long) cumulative);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+             name, (unsigned long long) merged.count(), name, merged.sum() / 1e9,
+             name, (unsigned long long) merged.count());
+    out += line;
+}
+
+#endif /* METRICS_HPP */
@@ -0,0 +1,738 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <new>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include "files.hpp"
+#include "buffer.hpp"
+#include "socket.hpp"
+
+/*
+ * Function called when the bytes passed to "write_ref"
+ * are no longer referenced by the output chain, either
+ * because they were sent or because the chain was dropped.
+ */
+typedef void (*ReleaseFunc)(void *arg);
+
+/*
+ * Immutable bytes that can be referenced by the output
+ * chains of many clients at the same time, for instance
+ * a static file served over and over. The blob is freed
+ * when the last reference is dropped.
+ *
+ * References may be dropped concurrently by different
+ * threads.
+ */
+class SharedBlob {
+
+public:
+
+    /*
+     * Create a blob holding a copy of "src". The caller
+     * owns the only reference. Returns null if the
+     * allocation failed.
+     */
+    static SharedBlob* create(const char *src, int len)
+    {
+        SharedBlob *blob = create(len);
+        if (blob)
+            memcpy(blob->bytes(), src, len);
+        return blob;
+    }
+
+    /*
+     * Create a blob of "len" bytes that the caller fills
+     * in through "bytes" before sharing it.
+     */
+    static SharedBlob* create(int len)
+    {
+        assert(len >= 0);
+
+        char *mem = new (std::nothrow) char[sizeof(SharedBlob) + len];
+        if (mem == nullptr)
+            return nullptr;
+
+        return new (mem) SharedBlob(len);
+    }
+
+    const char *data() const
+    {
+        return (const char*) (this + 1);
+    }
+
+    int length() const
+    {
+        return len;
+    }
+
+    void ref()
+    {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void unref()
+    {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~SharedBlob();
+            delete[] (char*) this;
+        }
+    }
+
+    char *bytes()
+    {
+        return (char*) (this + 1);
+    }
+
+    // Release function for "OutputChain::write_ref" that
+    // drops a reference to the blob passed as argument
+    static void release(void *arg)
+    {
+        ((SharedBlob*) arg)->unref();
+    }
+
+private:
+
+    std::atomic<int> refs;
+    int len;
+
+    SharedBlob(int len_) : refs(1), len(len_) {}
+};
+
+/*
+ * Queue of bytes to be sent to a socket, made of a chain
+ * of segments:
+ *
+ *     - Owned segments, whose bytes were copied into the
+ *       chain's own buffer (typically the response head).
+ *
+ *     - Borrowed segments, that point to memory owned by
+ *       the user. A release function is called when the
+ *       chain is done with it.
+ *
+ *     - Shared segments, that hold a reference to a
+ *       "SharedBlob".
+ *
+ *     - File segments, that hold a reference to an
+ *       "OpenFile" and a range of its bytes.
+ *
+ * Consecutive memory segments are flushed with a single
+ * scatter-gather write, so borrowed and shared bytes are
+ * never copied in user space. File segments are sent with
+ * "sendfile". Partial writes only advance an offset instead
+ * of moving the unsent bytes.
+ */
+class OutputChain {
+
+public:
+
+    OutputChain()
+    {
+        segs = nullptr;
+        capacity = 0;
+        head = 0;
+        tail = 0;
+        head_sent = 0;
+        pending = 0;
+        fail = false;
+    }
+
+    ~OutputChain()
+    {
+        clear();
+        delete[] segs;
+    }
+
+    OutputChain(OutputChain&) = delete;
+    OutputChain& operator=(OutputChain&) = delete;
+
+    /*
+     * Allocate the owned bytes from "slab" (see "Buffer::use_slab")
+     */
+    void use_slab(BufferSlab *slab)
+    {
+        bytes.use_slab(slab);
+    }
+
+    /*
+     * Number of bytes that weren't sent yet
+     */
+    int length() const
+    {
+        return pending;
+    }
+
+    bool failed() const
+    {
+        return fail || bytes.failed();
+    }
+
+    /*
+     * Append a copy of "src"
+     */
+    void write(const char *src, int len=-1)
+    {
+        if (len < 0) len = strlen(src);
+        if (len == 0) return;
+
+        char *dst = extend(len);
+        if (dst)
+            memcpy(dst, src, len);
+    }
+
+    /*
+     * Append "len" owned bytes and return a pointer to them
+     * so that the caller can fill them in before anything
+     * else is appended. Returns null on failure.
+     */
+    char *extend(int len)
+    {
+        if (failed()) return nullptr;
+
+        if (pending > MAX_VALUE(pending) - len) {
+            fail = true;
+            return nullptr;
+        }
+
+        int off = bytes.length();
+        char *dst = bytes.extend(len);
+        if (dst == nullptr)
+            return nullptr;
+
+        // Extend the last segment if it's the owned one
+        // that ends where these bytes were written.
+        if (tail > head) {
+            Segment& last = segs[tail-1];
+            if (last.type == Segment::OWNED && last.off + last.len == off) {
+                last.len += len;
+                pending += len;
+                return dst;
+            }
+        }
+
+        Segment seg;
+        seg.type = Segment::OWNED;
+        seg.off  = off;
+        seg.len  = len;
+        if (!push(seg))
+            return nullptr;
+        pending += len;
+        return dst;
+    }
+
+    /*
+     * Append "len" bytes at "ptr" without copying them.
+     * The memory must stay valid until "release(arg)" is
+     * called, which happens exactly once (immediately if
+     * the chain already failed). "release" may be null.
+     */
+    void write_ref(const char *ptr, int len, ReleaseFunc release=nullptr, void *arg=nullptr)
+    {
+        if (failed() || len <= 0 || pending > MAX_VALUE(pending) - len) {
+            if (len > 0 && !failed())
+                fail = true;
+            if (release)
+                release(arg);
+            return;
+        }
+
+        Segment seg;
+        seg.type    = Segment::BORROWED;
+        seg.ptr     = ptr;
+        seg.len     = len;
+        seg.release = release;
+        seg.arg     = arg;
+        if (push(seg))
+            pending += len;
+        else if (release)
+            release(arg);
+    }
+
+    /*
+     * Append the contents of "blob". The chain takes a new
+     * reference, so the caller keeps its own.
+     */
+    void write_shared(SharedBlob *blob)
+    {
+        int len = blob->length();
+        if (failed() || len == 0)
+            return;
+
+        if (pending > MAX_VALUE(pending) - len) {
+            fail = true;
+            return;
+        }
+
+        Segment seg;
+        seg.type = Segment::SHARED;
+        seg.blob = blob;
+        seg.ptr  = blob->data();
+        seg.len  = len;
+        if (push(seg)) {
+            blob->ref();
+            pending += len;
+        }
+    }
+
+    #ifndef _WIN32
+    /*
+     * Append "len" bytes of "file" starting at "offset".
+     * The chain takes a new reference to the file. The
+     * range must be within the file.
+     */
+    void write_file(OpenFile *file, int64_t offset, int len)
+    {
+        if (failed() || len == 0)
+            return;
+
+        if (len < 0 || offset < 0 || offset + len > file->size()
+         || pending > MAX_VALUE(pending) - len) {
+            fail = true;
+            return;
+        }
+
+        Segment seg;
+        seg.type     = Segment::FILE;
+        seg.file     = file;
+        seg.file_off = offset;
+        seg.len      = len;
+        if (push(seg)) {
+            file->ref();
+            pending += len;
+        }
+    }
+    #endif
+
+    /*
+     * Offset at which the next owned bytes will be stored.
+     * It stays valid as long as the chain isn't flushed
+     * and can be used with "overwrite_owned".
+     */
+    int owned_length() const
+    {
+        return bytes.length();
+    }
+
+    /*
+     * Overwrite owned bytes that were already appended
+     */
+    void overwrite_owned(int off, const char *src, int len)
+    {
+        bytes.overwrite(off, src, len);
+    }
+
+    /*
+     * Insert a copy of "src" at "pos" bytes from the first
+     * pending byte. The position may be inside an owned
+     * segment but not inside any other kind of segment, in
+     * which case nothing is inserted and false is returned.
+     */
+    bool insert(int pos, const char *src, int len)
+    {
+        if (failed()) return false;
+
+        assert(pos >= 0 && pos <= pending);
+
+        if (len <= 0) return true;
+
+        if (pending > MAX_VALUE(pending) - len) {
+            fail = true;
+            return false;
+        }
+
+        // Find the segment that holds the position
+        int i = head;
+        int before = 0; // Pending bytes before segment "i"
+        while (i < tail) {
+            int left = segs[i].len - (i == head ? head_sent : 0);
+            if (pos < before + left)
+                break;
+            before += left;
+            i++;
+        }
+
+        // Split it in two unless the position is its start
+        int split = pos - before + (i == head ? head_sent : 0);
+        if (i < tail && split > 0) {
+            if (segs[i].type != Segment::OWNED)
+                return false;
+            Segment rest = segs[i];
+            rest.off += split;
+            rest.len -= split;
+            i = insert_segment(i + 1, rest);
+            if (i < 0)
+                return false;
+            segs[i - 1].len = split;
+        }
+
+        int off = bytes.length();
+        bytes.write(src, len);
+        if (bytes.failed())
+            return false;
+
+        Segment seg;
+        seg.type = Segment::OWNED;
+        seg.off  = off;
+        seg.len  = len;
+        if (insert_segment(i, seg) < 0)
+            return false;
+        pending += len;
+        return true;
+    }
+
+    /*
+     * Copy "len" pending bytes into "dst", starting "pos"
+     * bytes after the first one. Returns false if some of
+     * them are in a file segment, which aren't in memory.
+     */
+    bool copy(int pos, char *dst, int len) const
+    {
+        assert(pos >= 0 && len >= 0 && pos + len <= pending);
+
+        int before = 0; // Pending bytes before segment "i"
+        for (int i = head; i < tail && len > 0; i++) {
+
+            const Segment& seg = segs[i];
+            int skip = (i == head) ? head_sent : 0;
+            int left = seg.len - skip;
+
+            if (pos < before + left) {
+
+                #ifndef _WIN32
+                if (seg.type == Segment::FILE)
+                    return false;
+                #endif
+
+                int from = pos - before;
+                int num = std::min(left - from, len);
+                memcpy(dst, segment_data(seg) + skip + from, num);
+                dst += num;
+                pos += num;
+                len -= num;
+            }
+            before += left;
+        }
+        return len == 0;
+    }
+
+    /*
+     * Drop the pending bytes that follow the first "len"
+     * ones, releasing the segments that aren't needed
+     * anymore. Owned bytes stay allocated until the chain
+     * is flushed.
+     */
+    void truncate(int len)
+    {
+        assert(len >= 0 && len <= pending);
+
+        int i = head;
+        int before = 0; // Pending bytes before segment "i"
+        while (i < tail) {
+            int skip = (i == head) ? head_sent : 0;
+            int left = segs[i].len - skip;
+            if (len < before + left) {
+                // Keep the start of this segment, if any
+                if (len > before) {
+                    segs[i].len = skip + len - before;
+                    i++;
+                }
+                break;
+            }
+            before += left;
+            i++;
+        }
+
+        for (int j = i; j < tail; j++)
+            drop(segs[j]);
+        tail = i;
+        pending = len;
+
+        if (head == tail) {
+            head = 0;
+            tail = 0;
+            head_sent = 0;
+            bytes.consume(bytes.length());
+        }
+    }
+
+    /*
+     * Move all segments of "other" at the end of this chain.
+     * Owned bytes are copied while the other segments are
+     * transferred. After the call "other" is empty.
+     */
+    void append(OutputChain& other)
+    {
+        if (other.failed())
+            fail = true;
+
+        for (int i = other.head; i < other.tail; i++) {
+
+            Segment& seg = other.segs[i];
+            int skip = (i == other.head) ? other.head_sent : 0;
+
+            if (seg.type == Segment::OWNED) {
+                write(other.bytes.content() + seg.off + skip, seg.len - skip);
+                continue;
+            }
+
+            if (failed() || pending > MAX_VALUE(pending) - (seg.len - skip) || !push(seg)) {
+                fail = true;
+                drop(seg);
+                continue;
+            }
+
+            // The segment now belongs to this chain
+            Segment& moved = segs[tail-1];
+            if (moved.type == Segment::FILE)
+                moved.file_off += skip;
+            else
+                moved.ptr += skip;
+            moved.len -= skip;
+            pending += moved.len;
+        }
+
+        other.head = 0;
+        other.tail = 0;
+        other.head_sent = 0;
+        other.pending = 0;
+        other.bytes.consume(other.bytes.length());
+    }
+
+    /*
+     * Send as many bytes as possible to the socket. Returns
+     * the number of bytes sent. On failure the chain is
+     * marked as failed.
+     */
+    int flush(Socket& sock)
+    {
+        if (failed()) return 0;
+
+        int sent = 0;
+        while (head < tail) {
+
+            int res;
+            int total = 0;
+
+            #ifndef _WIN32
+            if (segs[head].type == Segment::FILE) {
+                const Segment& seg = segs[head];
+                total = seg.len - head_sent;
+                res = sock.send_file(seg.file->fd(), seg.file_off + head_sent, total);
+            } else
+            #endif
+            {
+                // Send all memory segments up to the next file
+                IoVec vecs[MAX_IOVECS];
+                int count = gather(vecs, MAX_IOVECS, pending, total);
+                res = sock.writev(vecs, count);
+            }
+
+            if (res == Socket::WOULD_BLOCK)
+                break;
+            if (res == Socket::OTHER_ERROR || res == 0) {
+                fail = true;
+                return 0;
+            }
+
+            assert(res > 0);
+            advance(res);
+            sent += res;
+
+            // A short write means the socket's send buffer is
+            // full, so the next write would block.
+            if (res < total)
+                break;
+        }
+
+        return sent;
+    }
+
+    /*
+     * Fill "vecs" with up to "max" regions holding the first
+     * "limit" pending bytes, stopping at the first file
+     * segment, and store their total length in "total".
+     * Returns the number of regions, which is 0 if the chain
+     * is empty or starts with a file. The regions are only
+     * valid until the chain is modified.
+     */
+    int gather(IoVec *vecs, int max, int limit, int& total) const
+    {
+        int count = 0;
+        total = 0;
+        for (int i = head; i < tail && count < max && total < limit; i++) {
+            const Segment& seg = segs[i];
+            if (seg.type == Segment::FILE)
+                break;
+            int skip = (i == head) ? head_sent : 0;
+            int len = std::min(seg.len - skip, limit - total);
+            vecs[count++] = make_iovec(segment_data(seg) + skip, len);
+            total += len;
+        }
+        return count;
+    }
+
+    /*
+     * Drop the first "num" pending bytes, which were sent
+     * without "flush" (see "UringEventLoop::send").
+     */
+    void consume(int num)
+    {
+        advance(num);
+    }
+
+    void mark_failed()
+    {
+        fail = true;
+    }
+
+    /*
+     * Drop all pending segments, releasing the ones that
+     * aren't owned.
+     */
+    void clear()
+    {
+        for (int i = head; i < tail; i++)
+            drop(segs[i]);
+        head = 0;
+        tail = 0;
+        head_sent = 0;
+        pending = 0;
+        bytes.consume(bytes.length());
+    }
+
+private:
+
+    struct Segment {
+
+        enum Type { OWNED, BORROWED, SHARED, FILE };
+
+        Type type;
+        int  len;
+
+        int off; // OWNED: Offset of the bytes in "OutputChain::bytes"
+
+        const char *ptr; // BORROWED and SHARED: First byte of the segment
+
+        ReleaseFunc release; // BORROWED
+        void       *arg;
+
+        SharedBlob *blob; // SHARED
+
+        #ifndef _WIN32
+        OpenFile *file; // FILE
+        int64_t file_off;
+        #endif
+    };
+
+    // Maximum number of segments sent with a single system
+    // call. It's well below the IOV_MAX of every platform.
+    static const int MAX_IOVECS = 64;
+
+    Buffer bytes; // Storage of the owned segments
+
+    // Segments are stored in [head, tail) of this array.
+    Segment *segs;
+    int capacity;
+    int head;
+    int tail;
+
+    int head_sent; // Bytes of the head segment that were already sent
+    int pending;   // Bytes of all segments that weren't sent yet
+
+    bool fail;
+
+    const char *segment_data(const Segment& seg) const
+    {
+        if (seg.type == Segment::OWNED)
+            return bytes.content() + seg.off;
+        return seg.ptr;
+    }
+
+    static void drop(Segment& seg)
+    {
+        switch (seg.type) {
+            case Segment::OWNED: break;
+            case Segment::BORROWED: if (seg.release) seg.release(seg.arg); break;
+            case Segment::SHARED: seg.blob->unref(); break;
+            #ifndef _WIN32
+            case Segment::FILE: seg.file->unref(); break;
+            #endif
+        }
+    }
+
+    bool push(const Segment& seg)
+    {
+        if (tail == capacity) {
+
+            if (head > 0) {
+                // Reuse the space of the segments that were sent
+                for (int i = head; i < tail; i++)
+                    segs[i - head] = segs[i];
+                tail -= head;
+                head = 0;
+            } else {
+                int new_capacity = capacity > 0 ? 2 * capacity : 8;
+                Segment *new_segs = new (std::nothrow) Segment[new_capacity];
+                if (new_segs == nullptr) {
+                    fail = true;
+                    return false;
+                }
+                for (int i = 0; i < tail; i++)
+                    new_segs[i] = segs[i];
+                delete[] segs;
+                segs = new_segs;
+                capacity = new_capacity;
+            }
+        }
+
+        segs[tail++] = seg;
+        return true;
+    }
+
+    // Insert "seg" before the one at "index". Returns the
+    // index of the inserted segment, which is different from
+    // "index" if the array was compacted, or -1 on failure.
+    int insert_segment(int index, const Segment& seg)
+    {
+        int relative = index - head;
+        if (!push(seg))
+            return -1;
+        index = head + relative;
+        for (int i = tail - 1; i > index; i--)
+            segs[i] = segs[i-1];
+        segs[index] = seg;
+        return index;
+    }
+
+    // Drop the first "num" pending bytes
+    void advance(int num)
+    {
+        assert(num <= pending);
+        pending -= num;
+
+        while (num > 0) {
+            Segment& seg = segs[head];
+            int left = seg.len - head_sent;
+            if (num < left) {
+                head_sent += num;
+                break;
+            }
+            num -= left;
+            drop(seg);
+            head++;
+            head_sent = 0;
+        }
+
+        if (head == tail) {
+            // Everything was sent. Start over from the
+            // beginning of the owned storage.
+            head = 0;
+            tail = 0;
+            bytes.consume(bytes.length());
+        }
+    }
+};
+
+#endif /* OUTPUT_HPP */
@@ -1,21 +1,233 @@
 #include <cassert>
 #include <limits>
+#include <algorithm>
 #include <type_traits>
 #include "parse.hpp"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DELIMITER_MASK_X86
+#include <immintrin.h>
+#endif
+
 #define MAX_VALUE(X) std::numeric_limits<decltype(X)>::max()
 
+/*
+ * Functions computing the masks of the bytes of "str" that
+ * are ':' or '\r', which are the bytes that delimit the
+ * tokens of header lines, one mask per block of 64 bytes.
+ * Bit i of "colons[k]" is set iff byte i of the k-th block
+ * is ':', and the same goes for "crs". The last block may
+ * be partial, in which case nothing is read past the end.
+ *
+ * The vectorized versions compare 16 or 32 bytes at a time.
+ * The best version the CPU supports is picked at startup.
+ */
+typedef void (*DelimiterMaskFunc)(const char *str, intptr_t len, uint64_t *colons, uint64_t *crs);
+
+static void delimiter_mask_scalar(const char *str, intptr_t len, uint64_t *colons, uint64_t *crs)
+{
+	for (intptr_t k = 0; 64 * k < len; k++) {
+		const char *block = str + 64 * k;
+		intptr_t size = std::min<intptr_t>(len - 64 * k, 64);
+		colons[k] = 0;
+		crs[k] = 0;
+		for (int i = 0; i < size; i++) {
+			if (block[i] == ':') colons[k] |= (uint64_t) 1 << i;
+			if (block[i] == '\r') crs[k] |= (uint64_t) 1 << i;
+		}
+	}
+}
+
+#ifdef DELIMITER_MASK_X86
+__attribute__((target("sse2")))
+static void delimiter_mask_sse2(const char *str, intptr_t len, uint64_t *colons, uint64_t *crs)
+{
+	__m128i colon = _mm_set1_epi8(':');
+	__m128i cr    = _mm_set1_epi8('\r');
+	for (intptr_t k = 0; 64 * k < len; k++) {
+
+		const char *block = str + 64 * k;
+		char padded[64];
+		if (len - 64 * k < 64) {
+			memset(padded, 0, sizeof(padded));
+			memcpy(padded, block, len - 64 * k);
+			block = padded;
+		}
+
+		colons[k] = 0;
+		crs[k] = 0;
+		for (int i = 0; i < 64; i += 16) {
+			__m128i bytes = _mm_loadu_si128((const __m128i*) (block + i));
+			colons[k] |= (uint64_t) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, colon)) << i;
+			crs[k]    |= (uint64_t) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, cr)) << i;
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void delimiter_mask_avx2(const char *str, intptr_t len, uint64_t *colons, uint64_t *crs)
+{
+	__m256i colon = _mm256_set1_epi8(':');
+	__m256i cr    = _mm256_set1_epi8('\r');
+	for (intptr_t k = 0; 64 * k < len; k++) {
+
+		const char *block = str + 64 * k;
+		char padded[64];
+		if (len - 64 * k < 64) {
+			memset(padded, 0, sizeof(padded));
+			memcpy(padded, block, len - 64 * k);
+			block = padded;
+		}
+
+		__m256i lo = _mm256_loadu_si256((const __m256i*) block);
+		__m256i hi = _mm256_loadu_si256((const __m256i*) (block + 32));
+		colons[k] = (uint64_t) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, colon))
+		          | (uint64_t) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, colon)) << 32;
+		crs[k]    = (uint64_t) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cr))
+		          | (uint64_t) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cr)) << 32;
+	}
+}
+#endif
+
+static DelimiterMaskFunc select_delimiter_mask()
+{
+#ifdef DELIMITER_MASK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return delimiter_mask_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return delimiter_mask_sse2;
+#endif
+	return delimiter_mask_scalar;
+}
+
+static const DelimiterMaskFunc delimiter_mask = select_delimiter_mask();
+
+/*
+ * Set of characters stored as two tables indexed by the low
+ * and high nibble of a byte, so that SSSE3 can look up 16
+ * bytes at a time with "pshufb". A byte belongs to the set
+ * iff "low[b & 15] & high[b >> 4]" isn't zero. Each bit is
+ * a group of high nibbles whose bytes in the set share the
+ * same low nibbles, so any set made of at most 8 groups can
+ * be represented, which covers all the URL components.
+ */
+struct CharClass {
+
+	alignas(16) uint8_t low[16];
+	alignas(16) uint8_t high[16];
+
+	bool contains(char c) const
+	{
+		uint8_t b = c;
+		return low[b & 15] & high[b >> 4];
+	}
+};
+
+typedef bool (*CharTestFunc)(char c);
+
+static CharClass make_char_class(CharTestFunc testfn)
+{
+	CharClass cls = {};
+
+	uint16_t groups[8]; // Low nibbles of each group
+	int num_groups = 0;
+
+	for (int h = 0; h < 16; h++) {
+
+		uint16_t lows = 0;
+		for (int l = 0; l < 16; l++)
+			if (testfn((char) (h << 4 | l)))
+				lows |= 1 << l;
+
+		if (lows == 0)
+			continue;
+
+		int g = 0;
+		while (g < num_groups && groups[g] != lows)
+			g++;
+
+		if (g == num_groups) {
+			assert(num_groups < 8);
+			groups[num_groups++] = lows;
+			for (int l = 0; l < 16; l++)
+				if (lows & (1 << l))
+					cls.low[l] |= 1 << g;
+		}
+		cls.high[h] = 1 << g;
+	}
+	return cls;
+}
+
+/*
+ * Functions returning the number of leading bytes of "str"
+ * that belong to a class. Like the delimiter masks, the
+ * best version the CPU supports is picked at startup.
+ */
+typedef intptr_t (*CharClassSpanFunc)(const char *str, intptr_t len, const CharClass& cls);
+
+static intptr_t char_class_span_scalar(const char *str, intptr_t len, const CharClass& cls)
+{
+	intptr_t i = 0;
+	while (i < len && cls.contains(str[i]))
+		i++;
+	return i;
+}
+
+#ifdef DELIMITER_MASK_X86
+__attribute__((target("ssse3")))
+static intptr_t char_class_span_ssse3(const char *str, intptr_t len, const CharClass& cls)
+{
+	__m128i low    = _mm_load_si128((const __m128i*) cls.low);
+	__m128i high   = _mm_load_si128((const __m128i*) cls.high);
+	__m128i nibble = _mm_set1_epi8(0x0f);
+
+	intptr_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*) (str + i));
+		__m128i l = _mm_shuffle_epi8(low,  _mm_and_si128(bytes, nibble));
+		__m128i h = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+		__m128i outside = _mm_cmpeq_epi8(_mm_and_si128(l, h), _mm_setzero_si128());
+		unsigned mask = _mm_movemask_epi8(outside);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	// Less than 16 bytes are left
+	return i + char_class_span_scalar(str + i, len - i, cls);
+}
+#endif
+
+static CharClassSpanFunc select_char_class_span()
+{
+#ifdef DELIMITER_MASK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+		return char_class_span_ssse3;
+#endif
+	return char_class_span_scalar;
+}
+
+static const CharClassSpanFunc char_class_span = select_char_class_span();
+
 struct Scanner {
 
 	const char *str;
 	intptr_t len;
 	intptr_t off;
 
+	// Delimiters of the 64 bytes starting at "mask_base"
+	// (see "skip_until")
+	intptr_t mask_base;
+	uint64_t mask;
+
 	Scanner(const char *s, int l)
 	{
 		str = s;
 		len = l;
 		off = 0;
+		mask_base = -64;
+		mask = 0;
 	}
 
 	bool end() const
@@ -55,44 +267,81 @@ struct Scanner {
 		return true;
 	}
 
-	bool consume(const char *s)
+	// Literals are only compared with "memcmp" since
+	// their length is known at compile time.
+	template <size_t N>
+	bool consume(const char (&s)[N])
 	{
-		intptr_t l = strlen(s);
+		constexpr intptr_t l = N-1;
 		if (off + l > len)
 			return false;
-		if (strncmp(str + off, s, l))
+		if (memcmp(str + off, s, l))
 			return false;
 		off += l;
 		return true;
 	}
 
-	typedef bool (*CharTestFunc)(char c);
+	/*
+	 * Moves the cursor to the next occurrence of "c",
+	 * or to the end if there is none. The character must
+	 * be ':' or '\r'.
+	 *
+	 * The mask of the delimiters of a block is reused by
+	 * the following calls, so the short tokens of many
+	 * header lines are found with a single pass.
+	 */
+	void skip_until(char c)
+	{
+		assert(c == ':' || c == '\r');
+
+		while (off < len) {
+
+			if (off < mask_base || off - mask_base >= 64) {
+				uint64_t colons, crs;
+				mask_base = off;
+				delimiter_mask(str + off, std::min<intptr_t>(len - off, 64), &colons, &crs);
+				mask = colons | crs;
+			}
+
+			uint64_t candidates = mask >> (off - mask_base);
+			while (candidates) {
+				int skip = __builtin_ctzll(candidates);
+				off += skip;
+				if (str[off] == c)
+					return;
+				candidates >>= skip;
+				candidates >>= 1;
+				off++;
+			}
+
+			off = std::min(mask_base + 64, len);
+		}
+	}
 
 	/*
-	 * Consumes a substring that starts with a character
-	 * c such that testfn_head(c) is true and following
-	 * chars are such that testfn_body(c) is true.
+	 * Consumes the longest substring of characters of
+	 * the class "cls".
 	 *
 	 * Returns true iff at least a character was consumed.
 	 */
-	bool consume(CharTestFunc testfn_head, CharTestFunc testfn_body)
+	bool consume(const CharClass& cls)
 	{
-		if (end() || !testfn_head(curr()))
-			return false;
-
-		do
-			consume();
-		while (!end() && testfn_body(curr()));
-		return true;
+		intptr_t n = char_class_span(str + off, len - off, cls);
+		off += n;
+		return n > 0;
 	}
 
 	/*
-	 * It's like the previous function but uses the same
-	 * function for head of the substring and body.
+	 * It's like the previous function but the first
+	 * character must be of the class "head".
 	 */
-	bool consume(CharTestFunc testfn)
+	bool consume(const CharClass& head, const CharClass& body)
 	{
-		return consume(testfn, testfn);
+		if (end() || !head.contains(curr()))
+			return false;
+		consume();
+		consume(body);
+		return true;
 	}
 };
 
@@ -111,6 +360,24 @@ bool is_digit(char c)
 	return (c >= '0' && c <= '9');
 }
 
+bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static char to_lower(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	return c;
+}
+
+static const CharClass upper_alpha_chars = make_char_class(is_upper_alpha);
+
+static const CharClass scheme_chars = make_char_class([](char c) {
+	return is_upper_alpha(c) || is_digit(c) || c == '+' || c == '-' || c == '.';
+});
+
 /*
  * Parse the scheme token of the following URL in "src" if present
  */
@@ -118,10 +385,7 @@ void parse_scheme(Scanner &src, Slice &dst)
 {
 	intptr_t start = src.off;
 
-	auto schema_testfn_head = [](auto c) { return is_upper_alpha(c); };
-	auto schema_testfn_body = [](auto c) { return is_upper_alpha(c) || is_digit(c) || c == '+' || c == '-' || c == '.'; };
-
-	if (!src.consume(schema_testfn_head, schema_testfn_body))
+	if (!src.consume(upper_alpha_chars, scheme_chars))
 		dst.whipe();
 	else {
 		// May have a schema if ':' follows
@@ -173,10 +437,17 @@ bool is_pchar(char c)
 	return is_unreserved(c) || is_subdelim(c) || c == ':' || c == '@';
 }
 
+// Classes of the characters of the URL components
+static const CharClass userinfo_chars = make_char_class([](char c) { return is_unreserved(c) || is_subdelim(c) || c == ':'; });
+static const CharClass reg_name_chars = make_char_class([](char c) { return is_unreserved(c) || is_subdelim(c); });
+static const CharClass segment_chars  = make_char_class(is_pchar);
+static const CharClass path_chars     = make_char_class([](char c) { return is_pchar(c) || c == '/'; });
+static const CharClass query_chars    = make_char_class([](char c) { return is_pchar(c) || c == '/' || c == '?'; });
+
 void parse_user_info(Scanner &src, Slice &dst)
 {
 	intptr_t start = src.off;
-	if (src.consume([](char c) { return is_unreserved(c) || is_subdelim(c) || c == ':'; })) {
+	if (src.consume(userinfo_chars)) {
 		dst.str = src.str;
 		dst.off = start;
 		dst.len = src.len - start;
@@ -420,7 +691,7 @@ bool parse_host(Scanner &src, Host &dst)
 			// It's worth noting that the registered name may be empty.
 
 			intptr_t start = src.off;
-			src.consume([](char c) { return is_unreserved(c) || is_subdelim(c); });
+			src.consume(reg_name_chars);
 			dst.type = Host::NAME;
 			dst.text.str = src.str;
 			dst.text.off = start;
@@ -469,7 +740,7 @@ Slice parse_query_or_fragment(Scanner& src)
 	Slice res;
 	res.str = src.str;
 	res.off = src.off;
-	src.consume([](char c) { return is_pchar(c) || c == '/' || c == '?'; });
+	src.consume(query_chars);
 	res.len = src.off - res.off;
 	return res;
 }
@@ -480,7 +751,7 @@ Slice parse_path_abempty(Scanner& src)
 	path.str = src.str;
 	path.off = src.off;
 	while (src.consume('/'))
-		src.consume(is_pchar);
+		src.consume(segment_chars);
 	path.len = src.off - path.off;
 	return path;
 }
@@ -490,7 +761,7 @@ Slice parse_path(Scanner& src)
 	Slice path;
 	path.str = src.str;
 	path.off = src.off;
-	src.consume([](char c) { return is_pchar(c) || c == '/'; });
+	src.consume(path_chars);
 	path.len = src.off - path.off;
 	return path;
 }
@@ -531,7 +802,7 @@ bool parse_url(Scanner &src, URL &dst)
 bool parse_method(Scanner& src, Method& dst, ParseError& error)
 {
 	intptr_t start = src.off;
-	if (!src.consume(is_upper_alpha)) {
+	if (!src.consume(upper_alpha_chars)) {
 		error.write("Missing method");
 		return false;
 	}
@@ -553,6 +824,479 @@ bool parse_method(Scanner& src, Method& dst, ParseError& error)
 	return true;
 }
 
+// Names of the known headers, in lowercase and in the
+// order of "H". They are padded with zeros so that they
+// can be read 8 bytes at a time.
+static constexpr char known_header_names[NUM_KNOWN_HEADERS][24] = {
+	"host",
+	"connection",
+	"content-length",
+	"content-type",
+	"transfer-encoding",
+	"expect",
+	"accept",
+	"accept-encoding",
+	"authorization",
+	"cache-control",
+	"cookie",
+	"if-modified-since",
+	"if-none-match",
+	"range",
+	"upgrade",
+	"user-agent",
+};
+
+// Compare "len" bytes of "str" with a lowercase string,
+// ignoring case
+static bool equals_lowercase(const char *str, const char *lower, int len)
+{
+	for (int i = 0; i < len; i++)
+		if (to_lower(str[i]) != lower[i])
+			return false;
+	return true;
+}
+
+/*
+ * Compare the "len" bytes of "str" with the name of a
+ * known header, ignoring case. Names only hold lowercase
+ * letters and '-', so setting bit 0x20 of the bytes where
+ * the name has a letter folds "str" to lowercase. Bytes
+ * are compared 8 (or 4) at a time, with the last load
+ * overlapping the previous one. The name must be at least
+ * 4 bytes long.
+ */
+static bool equals_known_name(const char *str, const char *name, int len)
+{
+	assert(len >= 4);
+
+	if (len < 8) {
+		uint32_t a, b;
+		memcpy(&a, str, 4);
+		memcpy(&b, name, 4);
+		if ((a | ((b >> 1) & 0x20202020)) != b)
+			return false;
+		memcpy(&a, str + len - 4, 4);
+		memcpy(&b, name + len - 4, 4);
+		return (a | ((b >> 1) & 0x20202020)) == b;
+	}
+
+	for (int i = 0;; i += 8) {
+		if (i > len - 8)
+			i = len - 8;
+		uint64_t a, b;
+		memcpy(&a, str + i, 8);
+		memcpy(&b, name + i, 8);
+		if ((a | ((b >> 1) & 0x2020202020202020)) != b)
+			return false;
+		if (i == len - 8)
+			return true;
+	}
+}
+
+// Hash of a header name that has no collisions between the
+// known names. It only looks at the length and at the first
+// and last characters, folded to lowercase.
+static constexpr int known_header_hash(const char *name, int len)
+{
+	return (len + (name[0] | 0x20) + ((name[len-1] | 0x20) << 2)) & 31;
+}
+
+struct KnownHeaderTable {
+	int8_t  slots[32]; // Index in "H" of each hash, or -1
+	uint8_t lengths[NUM_KNOWN_HEADERS];
+	uint32_t length_set; // Bit "n" is set iff a name is "n" bytes long
+	int min_len;
+	int max_len;
+};
+
+static constexpr KnownHeaderTable make_known_header_table()
+{
+	KnownHeaderTable table = {};
+	for (int i = 0; i < 32; i++)
+		table.slots[i] = -1;
+	table.min_len = 24;
+	table.max_len = 0;
+
+	for (int i = 0; i < NUM_KNOWN_HEADERS; i++) {
+		const char *name = known_header_names[i];
+		int len = 0;
+		while (name[len])
+			len++;
+
+		int hash = known_header_hash(name, len);
+		if (table.slots[hash] >= 0)
+			throw "Collision between the hashes of two known headers";
+		table.slots[hash] = i;
+		table.lengths[i] = len;
+		table.length_set |= (uint32_t) 1 << len;
+		table.min_len = std::min(table.min_len, len);
+		table.max_len = std::max(table.max_len, len);
+	}
+	return table;
+}
+
+static constexpr KnownHeaderTable known_headers = make_known_header_table();
+static_assert(known_headers.min_len >= 4, "See \"equals_known_name\"");
+static_assert(known_headers.max_len < 32, "See \"length_set\"");
+
+/*
+ * Returns the index in "H" of the header called "name", or
+ * -1 if it's not a known header. The hash picks the only
+ * known name it can be, so at most one name is compared.
+ */
+static int classify_header(const char *name, int len)
+{
+	if ((unsigned) len >= 32 || !(known_headers.length_set >> len & 1))
+		return -1;
+
+	int index = known_headers.slots[known_header_hash(name, len)];
+	if (index < 0 || known_headers.lengths[index] != len)
+		return -1;
+
+	if (!equals_known_name(name, known_header_names[index], len))
+		return -1;
+	return index;
+}
+
+/*
+ * Parse the value of a "Content-Length" header. Returns
+ * 0 if it doesn't start with a number and -1 if the
+ * number is too big.
+ */
+static int64_t parse_content_length(Slice value)
+{
+	int j = 0; // Header value cursor
+
+	// Consume optional spaces
+	while (j < value.len && is_space(value[j]))
+		j++;
+	
+	// After the spaces is expected a number
+	if (j == value.len || !is_digit(value[j]))
+		return 0; // No number, assume 0 length
+
+	// Found a digit. Parse the entire number until
+	// no more digits are found
+	int64_t length = 0;
+	do {
+		char c = value[j];
+		assert(is_digit(c));
+		int digit = c - '0';
+		if (length > (MAX_VALUE(length) - digit) / 10) {
+			// Overflow. The reported length is too big.
+			return -1;
+		}
+		length = length * 10 + digit;
+		j++;
+	} while (j < value.len && is_digit(value[j]));
+
+	return length;
+}
+
+/*
+ * Returns the options of a "Connection" header, which
+ * is a list of comma separated tokens.
+ */
+static uint8_t parse_connection(Slice value)
+{
+	auto is_separator = [](char c) { return c == ',' || c == ' ' || c == '\t'; };
+
+	uint8_t options = 0;
+	const char *str = value.str + value.off;
+	int i = 0;
+	while (i < value.len) {
+
+		while (i < value.len && is_separator(str[i]))
+			i++;
+		int start = i;
+		while (i < value.len && !is_separator(str[i]))
+			i++;
+
+		int len = i - start;
+		if (len == 5 && equals_lowercase(str + start, "close", 5))
+			options |= Request::CONNECTION_CLOSE;
+		else if (len == 10 && equals_lowercase(str + start, "keep-alive", 10))
+			options |= Request::CONNECTION_KEEP_ALIVE;
+		else if (len == 7 && equals_lowercase(str + start, "upgrade", 7))
+			options |= Request::CONNECTION_UPGRADE;
+	}
+	return options;
+}
+
+/*
+ * Apply the codings listed by a "Transfer-Encoding" header,
+ * which follow those of the previous ones, to the request's
+ * "transfer" state. Parameters of the codings are ignored.
+ */
+static uint8_t parse_transfer_encoding(Slice value, uint8_t state)
+{
+	// The header is there even if it lists nothing
+	if (state == Request::TRANSFER_NONE)
+		state = Request::TRANSFER_OTHER;
+
+	auto is_separator = [](char c) { return c == ',' || c == ' ' || c == '\t'; };
+
+	const char *str = value.str + value.off;
+	int i = 0;
+	for (;;) {
+
+		while (i < value.len && is_separator(str[i]))
+			i++;
+		if (i == value.len)
+			break;
+
+		int start = i;
+		while (i < value.len && !is_separator(str[i]) && str[i] != ';')
+			i++;
+		int len = i - start;
+
+		while (i < value.len && str[i] != ',')
+			i++;
+
+		// Nothing may be applied after "chunked"
+		if (state == Request::TRANSFER_CHUNKED || state == Request::TRANSFER_INVALID)
+			state = Request::TRANSFER_INVALID;
+		else if (len == 7 && equals_lowercase(str + start, "chunked", 7))
+			state = Request::TRANSFER_CHUNKED;
+		else
+			state = Request::TRANSFER_OTHER;
+	}
+	return state;
+}
+
+/*
+ * Add the header at "index" in "dst.headers", whose name
+ * is the known header "name" (an index in "H") or -1, to
+ * the index of the known headers and decode it if it
+ * tells how the body is framed.
+ */
+static void index_header(Request &dst, int index, int name)
+{
+	if (name < 0)
+		return;
+
+	Slice value = dst.headers[index].value;
+
+	bool first = dst.known[name] < 0;
+	if (first)
+		dst.known[name] = index;
+
+	switch ((H) name) {
+
+		case H::ContentLength:
+		{
+			int64_t length = parse_content_length(value);
+			if (first)
+				dst.length = length;
+			else if (length != dst.length)
+				dst.length = -1; // Conflicting lengths
+			break;
+		}
+
+		case H::Connection:
+		dst.connection |= parse_connection(value);
+		break;
+
+		case H::TransferEncoding:
+		dst.transfer = parse_transfer_encoding(value, dst.transfer);
+		break;
+
+		default:
+		break;
+	}
+}
+
+/*
+ * Count a header that comes after the first
+ * MAX_REQUEST_HEADERS ones. It's dropped unless it tells
+ * the length of the body, in which case false is returned
+ * since the request can't be framed.
+ */
+static bool drop_header(Request &dst, Slice name)
+{
+	int index = classify_header(name.str + name.off, name.len);
+	if (index == (int) H::ContentLength || index == (int) H::TransferEncoding)
+		return false;
+	dst.ignored_count++;
+	return true;
+}
+
+// Index the known headers of the request. It's done in a
+// loop of its own rather than while splitting the lines,
+// whose branches are then easier to predict.
+static void index_headers(Request &dst)
+{
+	for (int i = 0; i < dst.count; i++) {
+		const Slice& name = dst.headers[i].name;
+		index_header(dst, i, classify_header(name.str + name.off, name.len));
+	}
+}
+
+// Blocks of 64 bytes whose delimiters are found at once
+// while splitting the header lines
+constexpr int HEADER_WINDOW_BLOCKS = 16;
+
+/*
+ * Delimiters of a window of the head that starts at "base"
+ * and is "size" bytes long, as one mask of colons and one
+ * of line ends ('\r') per block of 64 bytes, followed by
+ * zero ones.
+ *
+ * Finding the delimiters of many blocks at once lets the
+ * header lines be split with few branches that depend on
+ * the bytes. The line ends are taken from the masks one
+ * after the other, while the colon of a line is found by
+ * joining the two masks that cover its first 64 bytes.
+ */
+struct HeaderWindow {
+
+	intptr_t base;
+	intptr_t size;
+	int      num; // Blocks holding the window
+	uint64_t colons[HEADER_WINDOW_BLOCKS + 1];
+	uint64_t crs[HEADER_WINDOW_BLOCKS + 1];
+
+	void load(const char *str, intptr_t off, intptr_t len)
+	{
+		base = off;
+		size = std::min<intptr_t>(len - off, 64 * HEADER_WINDOW_BLOCKS);
+		num = (size + 63) / 64;
+		delimiter_mask(str + off, size, colons, crs);
+		colons[num] = 0;
+		crs[num] = 0;
+	}
+
+	// Offset of the first colon in the 64 bytes starting
+	// at "off", or -1 if there is none. The offset must be
+	// inside the window.
+	intptr_t colon_after(intptr_t off) const
+	{
+		intptr_t rel = off - base;
+		assert(rel >= 0 && rel < size);
+		int k = rel / 64;
+		int shift = rel % 64;
+		uint64_t found = (colons[k] >> shift) | ((colons[k+1] << 1) << (63 - shift));
+		return found ? off + __builtin_ctzll(found) : -1;
+	}
+};
+
+// Split the header line at the cursor into its name and
+// value one delimiter at a time, leaving the cursor on the
+// '\r' that ends it
+static bool split_header_line(Scanner &src, Slice &name, Slice &value, ParseError& error)
+{
+	name.str = src.str;
+	name.off = src.off;
+	src.skip_until(':');
+	name.len = src.off - name.off;
+
+	if (!src.consume(':')) {
+		error.write("Missing ':' after header name");
+		return false;
+	}
+
+	value.str = src.str;
+	value.off = src.off;
+	src.skip_until('\r');
+	value.len = src.off - value.off;
+	return true;
+}
+
+/*
+ * Parse the header lines and the empty line that follows
+ * them. Lines are split with the delimiters of a window
+ * (see "HeaderWindow"). Those that aren't a name, a colon,
+ * a value and a CRLF, which are invalid or longer than
+ * the window, are left to "split_header_line".
+ */
+static bool parse_headers(Scanner &src, Request &dst, ParseError& error)
+{
+	if (src.consume("\r\n"))
+		return true; // No headers
+
+	const char *str = src.str;
+	intptr_t len = src.len;
+	intptr_t off = src.off; // Start of the current line
+
+	// Headers stored in "dst.headers". It's only written
+	// back to "dst.count" at the end, so that it can stay
+	// in a register.
+	int count = 0;
+
+	HeaderWindow window;
+	window.load(str, off, len);
+	int k = 0;                    // Block of the next line end
+	uint64_t crs = window.crs[0]; // Line ends of block "k" not reached yet
+
+	for (;;) {
+
+		while (crs == 0 && k + 1 < window.num)
+			crs = window.crs[++k];
+
+		intptr_t end = -1;
+		if (crs)
+			end = window.base + 64 * k + __builtin_ctzll(crs);
+
+		if (end < 0 && window.base + window.size < len && window.base < off) {
+			// The line goes past the window
+			window.load(str, off, len);
+			k = 0;
+			crs = window.crs[0];
+			continue;
+		}
+
+		if (end == off && end + 1 < len && str[end + 1] == '\n')
+			break; // Empty line
+
+		intptr_t colon = -1;
+		if (end > off)
+			colon = window.colon_after(off);
+
+		bool split = colon >= 0 && colon < end && end + 1 < len && str[end + 1] == '\n';
+
+		Slice name;
+		Slice value;
+		if (split) {
+			name.str = str;
+			name.off = off;
+			name.len = colon - off;
+			value.str = str;
+			value.off = colon + 1;
+			value.len = end - colon - 1;
+		} else {
+			src.off = off;
+			if (!split_header_line(src, name, value, error))
+				return false;
+		}
+
+		if (count < MAX_REQUEST_HEADERS)
+			dst.headers.set(count++, (Header) {name, value});
+		else if (!drop_header(dst, name)) {
+			error.write("Too many headers before the body's length");
+			return false;
+		}
+
+		if (split) {
+			off = end + 2;
+			crs &= crs - 1;
+		} else {
+			if (!src.consume("\r\n")) {
+				error.write("Missing CRLF after header body");
+				return false;
+			}
+			off = src.off;
+			window.load(str, off, len);
+			k = 0;
+			crs = window.crs[0];
+		}
+	}
+
+	dst.count = count;
+	index_headers(dst);
+	src.off = off + 2;
+	return true;
+}
+
 bool parse_request(Scanner &src, Request &dst, ParseError& error)
 {
 	if (!parse_method(src, dst.method, error))
@@ -571,50 +1315,19 @@ bool parse_request(Scanner &src, Request &dst, ParseError& error)
 	}
 	dst.url = url;
 
-	if (!src.consume(" HTTP/1\r\n") && 
-		!src.consume(" HTTP/1.0\r\n") && 
-		!src.consume(" HTTP/1.1\r\n")) {
+	if (src.consume(" HTTP/1.1\r\n"))
+		dst.minor_version = 1;
+	else if (src.consume(" HTTP/1.0\r\n") || src.consume(" HTTP/1\r\n"))
+		dst.minor_version = 0;
+	else {
 		error.write("Invalid HTTP version token\n");
 		return false;
 	}
 	
 	// Parse headers
-	if (!src.consume("\r\n")) {
-
-		do {
-			Slice name;
-			Slice value;
-
-			name.str = src.str;
-			name.off = src.off;
-			src.consume([](char c) { return c != ':'; });
-			name.len = src.off - name.off;
-
-			if (!src.consume(':')) {
-				error.write("Missing ':' after header name");
-				return false;
-			}
-
-			value.str = src.str;
-			value.off = src.off;
-			src.consume([](char c) { return c != '\r'; });
-			value.len = src.off - value.off;
-
-			// Add the parsed header to the request structure.
-			// If the header limit was reached, report that
-			// the header was dropped.
-			if (dst.count < MAX_REQUEST_HEADERS)
-				dst.headers[dst.count++] = (Header) {name, value};
-			else
-				dst.ignored_count++;
-			
-			if (!src.consume("\r\n")) {
-				error.write("Missing CRLF after header body");
-				return false;
-			}
-
-		} while (!src.consume("\r\n")); // Parse headers until you find and empty line.
-	}
+	dst.clear_headers();
+	if (!parse_headers(src, dst, error))
+		return false;
 
 	// Now the cursor points to after the final CRLF. Lets make sure
 	// that nothing comes after that.
@@ -652,6 +1365,42 @@ bool Request::parse(Slice src, ParseError& error)
 	return parse(src.str, src.len, error);
 }
 
+struct Rebase {
+
+	const char *old_base;
+	const char *new_base;
+	intptr_t    len;
+
+	// Slices that don't point inside the original bytes
+	// (like empty slices that refer to a literal) are
+	// left as they are.
+	void operator()(Slice& slice) const
+	{
+		if (slice.str >= old_base && slice.str <= old_base + len)
+			slice.str = new_base + (slice.str - old_base);
+	}
+};
+
+void Request::rebase(const char *old_base, int len, const char *new_base)
+{
+	Rebase fix = {old_base, new_base, len};
+
+	fix(url.full);
+	fix(url.scheme);
+	fix(url.path);
+	fix(url.query);
+	fix(url.fragment);
+	fix(url.authority.userinfo);
+	fix(url.authority.host.text);
+
+	for (int i = 0; i < count; i++) {
+		fix(headers[i].name);
+		fix(headers[i].value);
+	}
+
+	fix(body);
+}
+
 bool IPv4::parse(const char *str, int len)
 {
 	if (len < 0) len = strlen(str);
@@ -666,48 +1415,93 @@ bool IPv6::parse(const char *str, int len)
 	return parse_ipv6(scanner, *this);
 }
 
-bool is_space(char c)
+int64_t Request::content_length() const
 {
-	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+	if (!valid)
+		return 0;
+	return length;
 }
 
-int Request::content_length() const
+// Value of a header without the optional whitespace
+// around it
+static Slice trimmed_value(const Header& header)
+{
+	Slice value = header.value;
+	while (value.len > 0 && is_space(value[0])) {
+		value.off++;
+		value.len--;
+	}
+	while (value.len > 0 && is_space(value[value.len-1]))
+		value.len--;
+	return value;
+}
+
+bool Request::get(H name, Slice& value) const
 {
 	if (!valid)
-		return 0;
-	
-	int i; // Header index
-	for (i = 0; i < count; i++)
-		if (headers[i].name == "Content-Length")
-			break;
-	if (i == count)
-		return 0; // Content-Length not found, assume 0
+		return false;
 
-	Slice value = headers[i].value;
-	int j = 0; // Header value cursor
+	int i = known[(int) name];
+	if (i < 0)
+		return false;
 
-	// Consume optional spaces
-	while (j < value.len && is_space(value[j]))
-		j++;
-	
-	// After the spaces is expected a number
-	if (j == value.len || !is_digit(value[j]))
-		return 0; // No number, assume 0 length
+	value = trimmed_value(headers[i]);
+	return true;
+}
 
-	// Found a digit. Parse the entire number until
-	// no more digits are found
-	int length = 0;
-	do {
-		char c = value[j];
-		assert(is_digit(c));
-		int digit = c - '0';
-		if (length > (MAX_VALUE(length) - digit) / 10) {
-			// Overflow. The reported length is too big.
-			return -1;
+bool Request::find_header(const char *name, Slice& value) const
+{
+	if (!valid)
+		return false;
+
+	int len = strlen(name);
+
+	int index = classify_header(name, len);
+	if (index >= 0)
+		return get((H) index, value);
+
+	for (int i = 0; i < count; i++) {
+
+		const Slice& other = headers[i].name;
+		if (other.len != len)
+			continue;
+
+		int j = 0;
+		while (j < len && to_lower(other[j]) == to_lower(name[j]))
+			j++;
+
+		if (j == len) {
+			value = trimmed_value(headers[i]);
+			return true;
 		}
-		length = length * 10 + digit;
-		j++;
-	} while (j < value.len && is_digit(value[j]));
+	}
+	return false;
+}
 
-	return length;
-}
\ No newline at end of file
+// Compare a slice with a lowercase string, ignoring case
+static bool equals_ignore_case(Slice slice, const char *str)
+{
+	int len = strlen(str);
+	if (slice.len != len)
+		return false;
+	for (int i = 0; i < len; i++)
+		if (to_lower(slice[i]) != str[i])
+			return false;
+	return true;
+}
+
+bool Request::chunked() const
+{
+	return valid && transfer == TRANSFER_CHUNKED;
+}
+
+bool Request::bad_transfer_encoding() const
+{
+	return valid && (transfer == TRANSFER_OTHER || transfer == TRANSFER_INVALID);
+}
+
+bool Request::expects_continue() const
+{
+	Slice value;
+	return get(H::Expect, value) && equals_ignore_case(value, "100-continue");
+}
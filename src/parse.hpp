@@ -1,3 +1,8 @@
+#ifndef PARSE_HPP
+#define PARSE_HPP
+
+#include <new>
+#include <type_traits>
 #include "slice.hpp"
 #include "netutils.hpp"
 
@@ -45,6 +50,8 @@ enum Method {
 	GET, POST,
 };
 
+constexpr int NUM_METHODS = POST + 1;
+
 #include <cstdio>
 #include <cstdarg>
 
@@ -61,6 +68,75 @@ struct ParseError {
 
 constexpr int MAX_REQUEST_HEADERS = 32;
 
+/*
+ * Array of "N" elements of type "T" whose storage is left
+ * uninitialized, so that creating it doesn't write all of
+ * its bytes. Elements are created by "set" and only those
+ * may be accessed. They're never destroyed, and the array
+ * can't be copied since it doesn't know which elements
+ * exist, so its owner copies those itself.
+ */
+template <typename T, int N>
+class UninitializedArray {
+
+	static_assert(std::is_trivially_copyable<T>::value
+		&& std::is_trivially_destructible<T>::value,
+		"Elements are copied and dropped without their constructors and destructor");
+
+	alignas(T) unsigned char storage[N * sizeof(T)];
+
+public:
+
+	UninitializedArray() {}
+
+	UninitializedArray(const UninitializedArray&) = delete;
+	UninitializedArray& operator=(const UninitializedArray&) = delete;
+
+	void set(int i, const T& value)
+	{
+		assert(i >= 0 && i < N);
+		new (storage + i * sizeof(T)) T(value);
+	}
+
+	T& operator[](int i)
+	{
+		assert(i >= 0 && i < N);
+		return *std::launder(reinterpret_cast<T*>(storage + i * sizeof(T)));
+	}
+
+	const T& operator[](int i) const
+	{
+		assert(i >= 0 && i < N);
+		return *std::launder(reinterpret_cast<const T*>(storage + i * sizeof(T)));
+	}
+};
+
+/*
+ * Headers that are recognized while the head is parsed, so
+ * that they can be looked up in constant time (see
+ * "Request::get"). Names are matched ignoring case.
+ */
+enum class H {
+	Host,
+	Connection,
+	ContentLength,
+	ContentType,
+	TransferEncoding,
+	Expect,
+	Accept,
+	AcceptEncoding,
+	Authorization,
+	CacheControl,
+	Cookie,
+	IfModifiedSince,
+	IfNoneMatch,
+	Range,
+	Upgrade,
+	UserAgent,
+};
+
+constexpr int NUM_KNOWN_HEADERS = (int) H::UserAgent + 1;
+
 struct Request {
 
 	bool valid;
@@ -68,22 +144,126 @@ struct Request {
 	Method method;
 	URL  url;
 
-	Header headers[MAX_REQUEST_HEADERS];
+	// 0 for HTTP/1.0 and 1 for HTTP/1.1
+	int minor_version;
+
+	// Only the first "count" headers exist. The others aren't
+	// cleared by the constructor, nor copied with the request,
+	// which would otherwise write all of the array's 1.5 KiB.
+	UninitializedArray<Header, MAX_REQUEST_HEADERS> headers;
 	int count, ignored_count;
 
+	// Index in "headers" of the first occurrence of each
+	// known header, or -1 if it's missing
+	int8_t known[NUM_KNOWN_HEADERS];
+
+	// Value of "Content-Length", decoded while parsing. It's
+	// 0 if the header is missing and -1 if it's too big or
+	// if its occurrences don't agree.
+	int64_t length;
+
+	// Options listed by the "Connection" headers
+	enum {
+		CONNECTION_CLOSE      = 1,
+		CONNECTION_KEEP_ALIVE = 2,
+		CONNECTION_UPGRADE    = 4,
+	};
+	uint8_t connection;
+
+	// Framing given by the "Transfer-Encoding" headers, whose
+	// codings are applied in order, decoded while parsing
+	enum {
+		TRANSFER_NONE,    // No "Transfer-Encoding"
+		TRANSFER_CHUNKED, // "chunked" is the last coding
+		TRANSFER_OTHER,   // Another coding is the last one
+		TRANSFER_INVALID, // Something follows "chunked"
+	};
+	uint8_t transfer;
+
 	Slice body;
 
 	Request()
 	{
 		valid = false;
 		method = GET;
+		minor_version = 1;
+		clear_headers();
+	}
+
+	Request(const Request& other)
+	{
+		*this = other;
+	}
+
+	// Members are listed one by one so that only "count"
+	// headers are copied. New members must be added here.
+	Request& operator=(const Request& other)
+	{
+		valid = other.valid;
+		method = other.method;
+		url = other.url;
+		minor_version = other.minor_version;
+		for (int i = 0; i < other.count; i++)
+			headers.set(i, other.headers[i]);
+		count = other.count;
+		ignored_count = other.ignored_count;
+		memcpy(known, other.known, sizeof(known));
+		length = other.length;
+		connection = other.connection;
+		transfer = other.transfer;
+		body = other.body;
+		return *this;
+	}
+
+	void clear_headers()
+	{
 		count = 0;
 		ignored_count = 0;
+		memset(known, -1, sizeof(known));
+		length = 0;
+		connection = 0;
+		transfer = TRANSFER_NONE;
 	}
 
 	bool parse(const char *str, int len);
 	bool parse(const char *str, int len, ParseError& error);
 	bool parse(Slice slice);
 	bool parse(Slice slice, ParseError& error);
-	int content_length() const;
+	int64_t content_length() const;
+
+	// True iff the body is sent with the chunked transfer
+	// encoding, which must be the last one applied.
+	bool chunked() const;
+
+	// True iff there are "Transfer-Encoding" headers but the
+	// body isn't chunked by the last coding, so its length
+	// can't be known. Such requests must be rejected rather
+	// than framed by "Content-Length" (RFC 7230, 3.3.3).
+	bool bad_transfer_encoding() const;
+
+	// True iff the client waits for a "100 Continue" before
+	// sending the body ("Expect: 100-continue").
+	bool expects_continue() const;
+
+	// Look for a header by name, ignoring case. If found,
+	// its value (without surrounding whitespace) is stored
+	// in "value" and true is returned.
+	bool find_header(const char *name, Slice& value) const;
+
+	// Same as "find_header" for a known header, without
+	// scanning the headers.
+	bool get(H name, Slice& value) const;
+
+	bool has(H name) const
+	{
+		return valid && known[(int) name] >= 0;
+	}
+
+	// Make the request's slices refer to a copy of the
+	// parsed bytes. "old_base" is the address of the
+	// first byte of the original request, "len" its
+	// length and "new_base" the address of the copy.
+	void rebase(const char *old_base, int len, const char *new_base);
 };
+
+#endif /* PARSE_HPP */
@@ -1,3 +1,6 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
 #include <cstdint>
 
 template <typename T, int N>
@@ -203,4 +206,6 @@ public:
 
         mark_not_allocated(addr);
     }
-};
\ No newline at end of file
+};
+
+#endif /* POOL_HPP */
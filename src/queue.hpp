@@ -1,3 +1,6 @@
+#ifndef QUEUE_HPP
+#define QUEUE_HPP
+
 #include <utility>
 
 template <typename T, int N>
@@ -42,6 +45,21 @@ public:
         return true;
     }
 
+    // Insert an item before all others, so that it's
+    // popped next
+    template <typename U>
+    bool push_front(U&& item)
+    {
+        if (used == N)
+            return false;
+
+        head = (head + N - 1) % N;
+        items[head] = std::forward<U>(item);
+        used++;
+
+        return true;
+    }
+
     bool pop()
     {
         if (used == 0)
@@ -77,6 +95,9 @@ public:
             items[j] = std::move(items[(j+1) % N]);
         }
         items[(head + used - 1) % N] = T();
+        used--;
         return true;
     }
 };
+
+#endif /* QUEUE_HPP */
@@ -0,0 +1,978 @@
+#ifndef RESPONSE_HPP
+#define RESPONSE_HPP
+
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include "date.hpp"
+#include "cache.hpp"
+#include "encoding.hpp"
+#include "output.hpp"
+
+constexpr const char* http_status_text(int code)
+{
+    switch(code) {
+
+        case 100: return "Continue";
+        case 101: return "Switching Protocols";
+        case 102: return "Processing";
+
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 203: return "Non-Authoritative Information";
+        case 204: return "No Content";
+        case 205: return "Reset Content";
+        case 206: return "Partial Content";
+        case 207: return "Multi-Status";
+        case 208: return "Already Reported";
+
+        case 300: return "Multiple Choices";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 305: return "Use Proxy";
+        case 306: return "Switch Proxy";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 402: return "Payment Required";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 406: return "Not Acceptable";
+        case 407: return "Proxy Authentication Required";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 410: return "Gone";
+        case 411: return "Length Required";
+        case 412: return "Precondition Failed";
+        case 413: return "Request Entity Too Large";
+        case 414: return "Request-URI Too Long";
+        case 415: return "Unsupported Media Type";
+        case 416: return "Requested Range Not Satisfiable";
+        case 417: return "Expectation Failed";
+        case 418: return "I'm a teapot";
+        case 420: return "Enhance your calm";
+        case 422: return "Unprocessable Entity";
+        case 426: return "Upgrade Required";
+        case 429: return "Too many requests";
+        case 431: return "Request Header Fields Too Large";
+        case 449: return "Retry With";
+        case 451: return "Unavailable For Legal Reasons";
+
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 505: return "HTTP Version Not Supported";
+        case 509: return "Bandwidth Limit Exceeded";
+    }
+    return "???";
+}
+
+/*
+ * Status line of each code from 100 to 599, built at
+ * compile time:
+ *
+ *     HTTP/1.1 200 OK\r\n
+ */
+struct StatusLine {
+    char text[48];
+    int  len;
+};
+
+struct StatusLineTable {
+
+    static const int FIRST = 100;
+    static const int COUNT = 500;
+
+    StatusLine lines[COUNT];
+
+    const StatusLine *find(int code) const
+    {
+        if (code < FIRST || code >= FIRST + COUNT)
+            return nullptr;
+        return &lines[code - FIRST];
+    }
+};
+
+constexpr StatusLineTable make_status_lines()
+{
+    StatusLineTable table {};
+    for (int i = 0; i < StatusLineTable::COUNT; i++) {
+
+        int code = StatusLineTable::FIRST + i;
+        StatusLine& line = table.lines[i];
+
+        int n = 0;
+        for (const char *p = "HTTP/1.1 "; *p; p++)
+            line.text[n++] = *p;
+        line.text[n++] = '0' + code / 100;
+        line.text[n++] = '0' + code / 10 % 10;
+        line.text[n++] = '0' + code % 10;
+        line.text[n++] = ' ';
+        for (const char *p = http_status_text(code); *p; p++) {
+            if (n + 2 >= (int) sizeof(line.text))
+                throw "Status text too long"; // Stops the compilation
+            line.text[n++] = *p;
+        }
+        line.text[n++] = '\r';
+        line.text[n++] = '\n';
+        line.len = n;
+    }
+    return table;
+}
+
+inline constexpr StatusLineTable STATUS_LINES = make_status_lines();
+
+/*
+ * Headers added to every response after the status line:
+ * a block of lines that is serialized once and, if "date"
+ * is set, a "Date" header with the current time.
+ */
+struct CommonHeaders {
+
+    std::string block;
+    bool date;
+
+    CommonHeaders()
+    {
+        date = false;
+    }
+
+    void add(const char *name, const char *value)
+    {
+        block += name;
+        block += ": ";
+        block += value;
+        block += "\r\n";
+    }
+};
+
+/*
+ * Builds an HTTP response into an output chain using an
+ * immediate-mode interface: "status", then any number of
+ * "header", then any number of "write" (or "write_ref" and
+ * "write_shared") and lastly "finish".
+ *
+ * The "Connection" and "Content-Length" headers are added
+ * automatically. By default the body is buffered until
+ * "finish" fills in its length. If "content_length" is
+ * called before the body, or "stream" after some of it
+ * was written, the bytes in the output chain can be sent
+ * before the response is finished. In the second case the
+ * body is sent with the chunked transfer encoding, or is
+ * delimited by closing the connection if the client doesn't
+ * support it (see "disable_chunked").
+ */
+class Response {
+
+public:
+
+    Response()
+    {
+        out = nullptr;
+        common = nullptr;
+        state = NOTARGET;
+        keep_alive = -1;
+        allow_keep_alive = false;
+        offset_length_line = -1;
+        offset_content = -1;
+        declared_length = -1;
+        content_written = 0;
+        chunked = false;
+        head_written = 0;
+        offset_connection = -1;
+        connection_len = 0;
+        cache_ttl = 0;
+        compressible = false;
+        encoded = false;
+        chunked_allowed = true;
+        close_delimited = false;
+    }
+
+    ~Response()
+    {
+        drop_cached();
+    }
+
+    Response(Response&) = delete;
+    Response& operator=(Response&) = delete;
+
+    /*
+     * Start building a response at the end of "dst". If
+     * "allow" is false the response will have a
+     * "Connection: Close" header regardless of what the
+     * user asks for. The "common" headers, if any, must
+     * not change until the response is finished.
+     */
+    void begin(OutputChain& dst, bool allow, const CommonHeaders *common_=nullptr)
+    {
+        out = &dst;
+        common = common_;
+        state = STATUS;
+        keep_alive = -1;
+        allow_keep_alive = allow;
+        offset_length_line = -1;
+        offset_content = -1;
+        declared_length = -1;
+        content_written = 0;
+        chunked = false;
+        head_written = 0;
+        offset_connection = -1;
+        connection_len = 0;
+        cache_ttl = 0;
+        compressible = false;
+        encoded = false;
+        chunked_allowed = true;
+        close_delimited = false;
+        drop_cached();
+    }
+
+    /*
+     * Tell that the client doesn't support the chunked
+     * encoding, like HTTP/1.0 ones. If the response is
+     * streamed without a declared length, its body ends
+     * when the connection is closed instead. It must be
+     * called after "begin".
+     */
+    void disable_chunked()
+    {
+        chunked_allowed = false;
+    }
+
+    /*
+     * Close the connection after the response, even if the
+     * user asked to keep it alive. A "Connection" header
+     * that was already written is replaced, unless the head
+     * may have been sent already.
+     */
+    void close_connection()
+    {
+        if (state == NOTARGET)
+            return;
+
+        if (state == CONTENT && keep_alive == 1 && !can_flush()) {
+            // The line is followed by the "Content-Length" one.
+            // It's replaced by a "Connection: Close" padded with
+            // spaces.
+            char line[sizeof(KEEP_ALIVE_LINE)];
+            int name_len = sizeof(CLOSE_LINE)-3;
+            memcpy(line, CLOSE_LINE, name_len);
+            memset(line + name_len, ' ', connection_len - name_len - 2);
+            memcpy(line + connection_len - 2, "\r\n", 2);
+            out->overwrite_owned(offset_length_line - connection_len, line, connection_len);
+        }
+        keep_alive = 0;
+    }
+
+    /*
+     * Drop the response without finishing it, for instance
+     * because the connection was lost. The bytes that were
+     * already appended to the output chain are left there.
+     */
+    void abort()
+    {
+        state = NOTARGET;
+        out = nullptr;
+        keep_alive = -1;
+    }
+
+    /*
+     * True iff "begin" was called but "finish" wasn't
+     */
+    bool active() const
+    {
+        return state != NOTARGET;
+    }
+
+    /*
+     * True iff some of the response was written
+     */
+    bool started() const
+    {
+        return state == HEADERS || state == CONTENT;
+    }
+
+    /*
+     * True iff the bytes written so far won't be modified
+     * by "finish", so they can already be sent
+     */
+    bool can_flush() const
+    {
+        return !started() || declared_length >= 0 || chunked || close_delimited;
+    }
+
+    /*
+     * Set the status code of the response. It must be
+     * called at most once, before "header" and "write".
+     */
+    void status(int code)
+    {
+        if (state != STATUS)
+            return; // No target or "status" called twice
+
+        assert(out);
+
+        // Codes out of the table are formatted
+        char buf[256];
+        const char *line = buf;
+        int line_len;
+        if (const StatusLine *entry = STATUS_LINES.find(code)) {
+            line = entry->text;
+            line_len = entry->len;
+        } else {
+            line_len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", code, status_text(code));
+            assert(line_len > 0);
+        }
+
+        // The date changes once per second, so it's cached.
+        // Each worker thread has its own cache.
+        const char *date = nullptr;
+        int date_len = 0;
+        if (common && common->date) {
+            static thread_local DateCache cache;
+            date = cache.line(time(nullptr));
+            date_len = DateCache::LINE_LEN;
+        }
+
+        int block_len = common ? common->block.size() : 0;
+
+        // No need to check for errors. The caller will do
+        // it after "finish".
+        head_written += line_len + date_len + block_len;
+        if (char *dst = out->extend(line_len + date_len + block_len)) {
+            memcpy(dst, line, line_len);
+            dst += line_len;
+            if (date_len > 0)
+                memcpy(dst, date, date_len);
+            dst += date_len;
+            if (block_len > 0)
+                memcpy(dst, common->block.data(), block_len);
+        }
+
+        state = HEADERS;
+    }
+
+    /*
+     * Add a header. It can't be called after "write".
+     */
+    void header(const char *name, const char *value)
+    {
+        if (state == NOTARGET)
+            return;
+
+        if (state == STATUS)
+            // Header added before a status, so first
+            // add a 200 for correctness sake
+            status(200);
+
+        if (state == CONTENT)
+            // Can't add a header after the start of
+            // the response's body.
+            return;
+
+        assert(state == HEADERS);
+
+        int name_len  = strlen(name);
+        int value_len = strlen(value);
+
+        // Make sure that the caller isn't writing
+        // a header that must be added automatically
+        // by this class.
+        if (equals_ignore_case(name, name_len, "Content-Length"))
+            return;
+
+        if (equals_ignore_case(name, name_len, "Connection")) {
+            if (equals_ignore_case(value, value_len, "Close"))
+                keep_alive = 0;
+            else
+                keep_alive = 1;
+            return;
+        }
+
+        // Remember what "can_encode" depends on
+        if (equals_ignore_case(name, name_len, "Content-Type"))
+            compressible = compressible_type(value, value_len);
+        else if (equals_ignore_case(name, name_len, "Content-Encoding"))
+            encoded = true;
+
+        // The line is copied in one go
+        head_written += name_len + value_len + 4;
+        char *dst = out->extend(name_len + value_len + 4);
+        if (dst == nullptr)
+            return;
+        memcpy(dst, name, name_len);
+        dst += name_len;
+        memcpy(dst, ": ", 2);
+        dst += 2;
+        memcpy(dst, value, value_len);
+        dst += value_len;
+        memcpy(dst, "\r\n", 2);
+    }
+
+    /*
+     * Declare the length of the body. The "Content-Length"
+     * header is written with this value instead of being
+     * filled in by "finish", so the response can be sent
+     * while it's being written. It must be called before
+     * the body is written.
+     *
+     * Bytes written past the declared length are dropped.
+     * If fewer bytes are written, the connection is closed
+     * after the response so that the client can tell.
+     */
+    void content_length(int64_t len)
+    {
+        if (state != STATUS && state != HEADERS)
+            return;
+        if (len >= 0)
+            declared_length = len;
+    }
+
+    /*
+     * Allow the bytes written so far to be sent before
+     * "finish". If no length was declared, the response
+     * switches to the chunked transfer encoding and the
+     * body written so far becomes the first chunk. If it
+     * can't be used, the response loses its length and
+     * the connection is closed after it.
+     *
+     * Returns false if the response can't be streamed,
+     * in which case it stays buffered.
+     */
+    bool stream()
+    {
+        if (state == NOTARGET)
+            return false;
+
+        begin_content();
+
+        if (declared_length >= 0 || chunked || close_delimited)
+            return true;
+
+        if (out->failed())
+            return false;
+
+        if (!chunked_allowed) {
+            // The "Connection" and "Content-Length" lines are
+            // adjacent, they're replaced by a "Connection: Close"
+            // padded with spaces
+            char lines[sizeof(KEEP_ALIVE_LINE) + sizeof(LENGTH_LINE)];
+            int len = connection_len + sizeof(LENGTH_LINE)-1;
+            int name_len = sizeof(CLOSE_LINE)-3;
+            memcpy(lines, CLOSE_LINE, name_len);
+            memset(lines + name_len, ' ', len - name_len - 2);
+            memcpy(lines + len - 2, "\r\n", 2);
+            out->overwrite_owned(offset_length_line - connection_len, lines, len);
+
+            keep_alive = 0;
+            close_delimited = true;
+            return true;
+        }
+
+        if (content_written > 0) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%llx\r\n", (unsigned long long) content_written);
+            if (!out->insert(offset_content, buf, len))
+                return false;
+            out->write("\r\n");
+        }
+
+        static const char line[] = "Transfer-Encoding: chunked\r\n";
+        static_assert(sizeof(line) == sizeof(LENGTH_LINE), "The header lines must have the same length");
+        out->overwrite_owned(offset_length_line, line, sizeof(line)-1);
+
+        chunked = true;
+        return true;
+    }
+
+    /*
+     * Append bytes to the response's body
+     */
+    void write(const char *str, int len=-1)
+    {
+        if (len < 0) len = strlen(str);
+
+        if (!begin_chunk(len))
+            return;
+
+        out->write(str, len);
+        end_chunk(len);
+    }
+
+    /*
+     * Append "len" bytes at "ptr" to the response's body
+     * without copying them. The memory must stay valid until
+     * "release(arg)" is called, which happens once the bytes
+     * were sent or dropped (see "OutputChain::write_ref").
+     */
+    void write_ref(const char *ptr, int len, ReleaseFunc release=nullptr, void *arg=nullptr)
+    {
+        if (!begin_chunk(len)) {
+            if (release)
+                release(arg);
+            return;
+        }
+
+        out->write_ref(ptr, len, release, arg);
+        end_chunk(len);
+    }
+
+    /*
+     * Append the contents of a shared blob to the response's
+     * body. The caller keeps its reference to the blob.
+     */
+    void write_shared(SharedBlob *blob)
+    {
+        int len = blob->length();
+        if (!begin_chunk(len))
+            return;
+
+        if (len < blob->length()) {
+            // Only a prefix fits in the declared length
+            blob->ref();
+            out->write_ref(blob->data(), len, SharedBlob::release, blob);
+        } else
+            out->write_shared(blob);
+        end_chunk(len);
+    }
+
+    #ifndef _WIN32
+    /*
+     * Append "len" bytes of "file" starting at "offset" to
+     * the response's body. They're sent from the page cache
+     * without being copied into the output chain. The caller
+     * keeps its reference to the file.
+     */
+    void write_file(OpenFile *file, int64_t offset, int len)
+    {
+        if (!begin_chunk(len))
+            return;
+
+        out->write_file(file, offset, len);
+        end_chunk(len);
+    }
+    #endif
+
+    /*
+     * Ask "finish" to make a serialized copy of the response
+     * that can be stored in a "ResponseCache" for "ttl_ms"
+     * milliseconds (see "take_cached"). Only responses that
+     * are buffered until "finish" and whose body is in memory
+     * can be copied, so it does nothing for the ones with a
+     * declared length, streamed ones or files.
+     */
+    void cache(int ttl_ms)
+    {
+        if (state != NOTARGET)
+            cache_ttl = ttl_ms;
+    }
+
+    /*
+     * Move the copy made by the last "finish" into "dst".
+     * Returns false if there's none. The caller owns the
+     * reference to the blob.
+     */
+    bool take_cached(CachedResponse& dst)
+    {
+        if (cached.blob == nullptr)
+            return false;
+        dst = cached;
+        cached.blob = nullptr;
+        return true;
+    }
+
+    /*
+     * True iff the body is buffered until "finish" and may
+     * be replaced by an encoded version of it (see
+     * "encode_body"), which requires a compressible
+     * "Content-Type" and no "Content-Encoding" header.
+     */
+    bool can_encode() const
+    {
+        return buffered() && compressible && !encoded;
+    }
+
+    /*
+     * Bytes of the body written so far
+     */
+    int64_t body_length() const
+    {
+        return content_written;
+    }
+
+    /*
+     * Copy the buffered body into "dst", which must have
+     * room for "body_length" bytes. Returns false if the
+     * body isn't buffered or isn't in memory.
+     */
+    bool copy_body(char *dst) const
+    {
+        if (!buffered() || out->failed())
+            return false;
+        return out->copy(out->length() - content_written, dst, content_written);
+    }
+
+    /*
+     * Add a header after some of the body was written, which
+     * is only possible while the body is buffered. Returns
+     * false if it isn't.
+     */
+    bool insert_header(const char *name, const char *value)
+    {
+        if (!buffered() || out->failed())
+            return false;
+
+        std::string line;
+        line += name;
+        line += ": ";
+        line += value;
+        line += "\r\n";
+
+        // The line goes before the "Content-Length" one
+        int pos = out->length() - content_written - 2 - (sizeof(LENGTH_LINE)-1);
+        if (!out->insert(pos, line.data(), line.size()))
+            return false;
+        head_written += line.size();
+        return true;
+    }
+
+    /*
+     * Replace the buffered body by the contents of "blob",
+     * which holds it encoded with "encoding", and add the
+     * matching "Content-Encoding" header. The caller keeps
+     * its reference to the blob.
+     */
+    bool encode_body(SharedBlob *blob, Encoding encoding)
+    {
+        if (!buffered() || encoded || out->failed())
+            return false;
+
+        out->truncate(out->length() - content_written);
+        content_written = 0;
+        if (!insert_header("Content-Encoding", encoding_name(encoding)))
+            return false;
+
+        out->write_shared(blob);
+        content_written = blob->length();
+        encoded = true;
+        return true;
+    }
+
+    /*
+     * Complete the response. After this call the response
+     * is no longer active. Returns true iff the connection
+     * can be kept alive after this response.
+     *
+     * The caller must check the output buffer for failures.
+     */
+    bool finish()
+    {
+        if (state == NOTARGET)
+            return false;
+
+        // Make sure the previous response parts are written
+        begin_content();
+
+        if (chunked) {
+            // Last chunk, with no trailers
+            out->write("0\r\n\r\n");
+        } else if (close_delimited) {
+            // The body ends with the connection
+        } else if (declared_length >= 0) {
+            // The client would wait for the missing bytes
+            if (content_written != declared_length)
+                keep_alive = 0;
+        } else if (!out->failed()) {
+
+            // Update the Content-Length header's vale now
+            // that we know the content's length.
+            char buf[32];
+            char *digits = buf + sizeof(buf);
+            int64_t n = content_written;
+            do {
+                *--digits = '0' + n % 10;
+                n /= 10;
+            } while (n > 0);
+            int len = buf + sizeof(buf) - digits;
+            assert(len <= LENGTH_DIGITS);
+
+            out->overwrite_owned(offset_length_line + LENGTH_PREFIX, digits, len);
+
+            if (cache_ttl > 0)
+                make_cached_copy();
+        }
+
+        // NOTE: "keep_alive" can't be -1 at this point because
+        //       it was set to either 0 or 1 when writing the
+        //       "Connection" header.
+        bool result = (keep_alive == 1);
+
+        state = NOTARGET;
+        out = nullptr;
+        keep_alive = -1;
+        return result;
+    }
+
+    static const char* status_text(int code);
+
+    /*
+     * Append the response cached by "cache" to "out", with
+     * the "Connection" header of "keep_alive". The blob is
+     * referenced, not copied.
+     */
+    static void write_cached(OutputChain& out, const CachedResponse& cached, bool keep_alive)
+    {
+        SharedBlob *blob = cached.blob;
+        if (keep_alive) {
+            out.write_shared(blob);
+            return;
+        }
+
+        int after = cached.split + sizeof(KEEP_ALIVE_LINE)-1;
+        blob->ref();
+        out.write_ref(blob->data(), cached.split, SharedBlob::release, blob);
+        out.write(CLOSE_LINE, sizeof(CLOSE_LINE)-1);
+        blob->ref();
+        out.write_ref(blob->data() + after, blob->length() - after, SharedBlob::release, blob);
+    }
+
+private:
+
+    // True iff the body was started and is kept in the
+    // output chain until "finish"
+    bool buffered() const
+    {
+        return state == CONTENT && declared_length < 0 && !chunked && !close_delimited;
+    }
+
+    // Make sure the head of the response was written so that
+    // body bytes can be appended. Returns false if there's no
+    // active response.
+    bool begin_content()
+    {
+        if (state == NOTARGET)
+            return false;
+
+        if (state == STATUS)
+            status(200);
+
+        // If this is the first time we append to the
+        // body of the response, append special headers
+        if (state == HEADERS) {
+
+            // This is the start of the response body, so
+            // add any special header and the empty line
+            // separator.
+
+            if (keep_alive == -1) keep_alive = 1;
+
+            // If the user wants to keep the connection alive
+            // (or didn't specify it) then check first if it's
+            // allowed.
+            if (!allow_keep_alive)
+                keep_alive = 0;
+
+            offset_connection = head_written;
+            if (keep_alive) {
+                connection_len = sizeof(KEEP_ALIVE_LINE)-1;
+                out->write(KEEP_ALIVE_LINE, connection_len);
+            } else {
+                connection_len = sizeof(CLOSE_LINE)-1;
+                out->write(CLOSE_LINE, connection_len);
+            }
+            head_written += connection_len;
+
+            if (declared_length >= 0) {
+                char buf[64];
+                int len = snprintf(buf, sizeof(buf), "Content-Length: %lld\r\n\r\n", (long long) declared_length);
+                out->write(buf, len);
+                head_written += len;
+            } else {
+                // Append the Content-Length header with an empty value,
+                // and the empty line. When the response content is known
+                // we'll fill the value in, unless the response is streamed,
+                // in which case the line is replaced by a "Transfer-Encoding"
+                // header.
+                offset_length_line = out->owned_length();
+                out->write(LENGTH_LINE, sizeof(LENGTH_LINE)-1);
+                out->write("\r\n", 2);
+                head_written += sizeof(LENGTH_LINE)-1 + 2;
+            }
+
+            offset_content = out->length();
+            state = CONTENT;
+        }
+
+        return true;
+    }
+
+    // Prepare to append "len" bytes to the body, returning
+    // false if none must be appended. If only some of them
+    // fit in the declared length, "len" is reduced.
+    bool begin_chunk(int& len)
+    {
+        if (!begin_content())
+            return false;
+
+        // Bytes past the declared length can't be sent
+        if (declared_length >= 0 && len > declared_length - content_written)
+            len = declared_length - content_written;
+
+        if (len <= 0)
+            return false;
+
+        if (chunked) {
+            char buf[32];
+            int n = snprintf(buf, sizeof(buf), "%x\r\n", len);
+            out->write(buf, n);
+        }
+        return true;
+    }
+
+    void end_chunk(int len)
+    {
+        content_written += len;
+        if (chunked)
+            out->write("\r\n");
+    }
+
+    // Copy the response, which is made of the last bytes
+    // of the output chain, into "cached" with the keep-alive
+    // "Connection" line
+    void make_cached_copy()
+    {
+        int64_t total = head_written + content_written;
+        if (total > out->length())
+            return; // Some bytes were already sent
+
+        int start = out->length() - total;
+        int line_len = sizeof(KEEP_ALIVE_LINE)-1;
+        int rest = total - offset_connection - connection_len;
+
+        SharedBlob *blob = SharedBlob::create(offset_connection + line_len + rest);
+        if (blob == nullptr)
+            return;
+
+        char *dst = blob->bytes();
+        memcpy(dst + offset_connection, KEEP_ALIVE_LINE, line_len);
+        if (!out->copy(start, dst, offset_connection)
+         || !out->copy(start + offset_connection + connection_len, dst + offset_connection + line_len, rest)) {
+            blob->unref();
+            return;
+        }
+
+        drop_cached();
+        cached.blob  = blob;
+        cached.split = offset_connection;
+        cached.ttl   = cache_ttl;
+    }
+
+    void drop_cached()
+    {
+        if (cached.blob) {
+            cached.blob->unref();
+            cached.blob = nullptr;
+        }
+    }
+
+    static constexpr char KEEP_ALIVE_LINE[] = "Connection: Keep-Alive\r\n";
+    static constexpr char CLOSE_LINE[]      = "Connection: Close\r\n";
+
+    // Placeholder of the "Content-Length" header. Buffered
+    // bodies are shorter than INT_MAX so 10 digits are enough,
+    // which also makes it as long as the line it's replaced
+    // with when the response is streamed.
+    static constexpr char LENGTH_LINE[] = "Content-Length:           \r\n";
+
+    // True iff str[0, len) equals the null-terminated
+    // "other", ignoring case
+    static bool equals_ignore_case(const char *str, int len, const char *other)
+    {
+        auto lower = [](char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; };
+        if (len != (int) strlen(other))
+            return false;
+        for (int i = 0; i < len; i++)
+            if (lower(str[i]) != lower(other[i]))
+                return false;
+        return true;
+    }
+    static const int LENGTH_PREFIX = 16; // Length of "Content-Length: "
+    static const int LENGTH_DIGITS = 10;
+
+    // Since responses are built using a kind of
+    // immediate-mode API ("status", "header", "write"
+    // and "finish"), the builder needs to hold a state
+    // to discriminate between valid and invalid calls.
+    enum State {
+
+        NOTARGET, // No response is being built. This is both the
+                  // starting value and that set by "finish".
+
+        STATUS,   // "begin" was called but no "status" call was
+                  // done
+
+        HEADERS,  // "status" has been called. Now either "header"
+                  // or "write" are allowed.
+
+        CONTENT,  // A call to "write" has been done, so only other
+                  // calls to it are allowed.
+
+        // After any of these states you can "finish" and
+        // go to the "NOTARGET" state.
+    };
+
+    State state;
+
+    OutputChain *out; // Chain the response is appended to
+
+    const CommonHeaders *common; // Headers added after the status line, or NULL
+
+    int offset_length_line; // Offset (in bytes) of the "Content-Length" header line in
+                            // the owned bytes of the output chain. This is set during
+                            // the first "write" call after "begin", if no length was
+                            // declared.
+
+    int offset_content; // Length of the output chain when the response body started.
+                        // It's set at the first "write" call after "begin".
+
+    int64_t declared_length; // Length passed to "content_length", or -1
+
+    int64_t content_written; // Bytes of the body appended so far
+
+    bool chunked; // True iff the body is sent with the chunked encoding
+
+    bool chunked_allowed; // False if "disable_chunked" was called
+    bool close_delimited; // True iff the body was streamed without a length or chunks
+
+    int keep_alive; // This is 1 if the user set the "Connection: Keep-Alive" header or
+                    // 0 if it set "Connection: Close". Its initial value is -1, so reading
+                    // -1 means the user didn't specify anything yet.
+
+    bool allow_keep_alive; // If false, the connection is closed regardless of "keep_alive"
+
+    int64_t head_written;  // Bytes of the head appended so far
+    int offset_connection; // Bytes of the head before the "Connection" line
+    int connection_len;    // Length of the "Connection" line
+
+    int cache_ttl;         // Set by "cache", or 0
+
+    bool compressible; // True iff the "Content-Type" is worth compressing
+    bool encoded;      // True iff the body has a "Content-Encoding"
+    CachedResponse cached; // Copy made by "finish" (see "take_cached")
+};
+
+inline const char* Response::status_text(int code)
+{
+    return http_status_text(code);
+}
+
+#endif /* RESPONSE_HPP */
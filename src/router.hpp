@@ -0,0 +1,394 @@
+#ifndef ROUTER_HPP
+#define ROUTER_HPP
+
+#include <memory>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include "parse.hpp"
+
+constexpr int MAX_ROUTE_PARAMS = 8;
+
+/*
+ * Values captured by the ":name" and "*name" segments of
+ * the route that matched a path. They refer to the bytes
+ * of the path, so nothing is allocated.
+ */
+struct RouteParams {
+
+    Slice values[MAX_ROUTE_PARAMS];
+    int   count = 0;
+
+    // Names of the captures, in the order of "values"
+    const std::vector<std::string> *names = nullptr;
+
+    /*
+     * Look for the capture called "name". If found, its
+     * value is stored in "value" and true is returned.
+     */
+    bool get(const char *name, Slice& value) const
+    {
+        for (int i = 0; i < count; i++)
+            if ((*names)[i] == name) {
+                value = values[i];
+                return true;
+            }
+        return false;
+    }
+};
+
+/*
+ * A route that can be declared in a constant table, which
+ * is checked at compile time with "valid_routes":
+ *
+ *     constexpr Route<Handler> routes[] = {
+ *         { GET,  "/users/:id",       get_user },
+ *         { POST, "/users/:id/posts", add_post },
+ *     };
+ *     static_assert(valid_routes(routes));
+ *
+ *     Router<Handler> router(routes);
+ */
+template <typename T>
+struct Route {
+    Method      method;
+    const char *pattern;
+    T           handler;
+};
+
+/*
+ * True iff "pattern" is a valid route. It must start with
+ * '/'. A segment that starts with ':' captures the bytes
+ * up to the next '/', one that starts with '*' captures
+ * the rest of the path and must be the last. Captures
+ * must have a name and there can be up to
+ * MAX_ROUTE_PARAMS of them.
+ */
+constexpr bool valid_route_pattern(const char *pattern)
+{
+    if (pattern == nullptr || pattern[0] != '/')
+        return false;
+
+    int params = 0;
+    int i = 1;
+    while (pattern[i]) {
+
+        char c = pattern[i];
+        if (c != ':' && c != '*') {
+            i++;
+            continue;
+        }
+
+        if (pattern[i-1] != '/' || ++params > MAX_ROUTE_PARAMS)
+            return false;
+
+        int start = ++i;
+        while (pattern[i] && pattern[i] != '/') {
+            if (pattern[i] == ':' || pattern[i] == '*')
+                return false;
+            i++;
+        }
+
+        if (i == start)
+            return false; // Missing name
+
+        if (c == '*' && pattern[i])
+            return false; // Not the last segment
+    }
+    return true;
+}
+
+template <typename T, size_t N>
+constexpr bool valid_routes(const Route<T> (&routes)[N])
+{
+    for (size_t i = 0; i < N; i++)
+        if (!valid_route_pattern(routes[i].pattern))
+            return false;
+    return true;
+}
+
+/*
+ * Maps the method and the path of a request to a handler
+ * of type T (a function pointer, an index or anything that
+ * is copyable).
+ *
+ * Static parts of the routes are stored in a compressed
+ * radix tree, so a lookup only depends on the length of
+ * the path and not on the number of routes. Static edges
+ * are preferred over ":name" captures, which are preferred
+ * over "*name" captures. If a preferred edge leads to no
+ * route, the others are tried.
+ *
+ * Routes must be added before the router is used.
+ */
+template <typename T>
+class Router {
+
+public:
+
+    Router() = default;
+
+    template <size_t N>
+    Router(const Route<T> (&routes)[N])
+    {
+        for (size_t i = 0; i < N; i++)
+            add(routes[i].method, routes[i].pattern, routes[i].handler);
+    }
+
+    Router(Router&) = delete;
+    Router& operator=(Router&) = delete;
+
+    /*
+     * Route requests with "method" and a path matching
+     * "pattern" (see "valid_route_pattern") to "handler".
+     *
+     * Returns false if the pattern is invalid or if it
+     * conflicts with a previous route.
+     */
+    bool add(Method method, const char *pattern, T handler);
+
+    /*
+     * Look for the handler of a request. If one is found,
+     * it's stored in "handler" with the captures in "params"
+     * and 200 is returned. If the path only has handlers for
+     * other methods 405 is returned, else 404.
+     */
+    int find(Method method, Slice path, const T*& handler, RouteParams& params) const;
+
+private:
+
+    struct Node {
+
+        std::string prefix;  // Static bytes of the edge from the parent
+        std::string indices; // First byte of the prefix of each child
+        std::vector<std::unique_ptr<Node>> children;
+
+        std::unique_ptr<Node> param;    // ":name" child
+        std::unique_ptr<Node> wildcard; // "*name" child
+
+        // Index in "values" of the handler of each
+        // method, or -1
+        int handlers[NUM_METHODS];
+
+        // Names of the captures of the routes that end here
+        std::vector<std::string> names;
+
+        Node()
+        {
+            for (int i = 0; i < NUM_METHODS; i++)
+                handlers[i] = -1;
+        }
+
+        // Index of the static child whose prefix starts
+        // with "c", or -1. Nodes have few children, so a
+        // plain loop beats a call to "memchr".
+        int child_index(char c) const
+        {
+            for (int i = 0; i < (int) indices.size(); i++)
+                if (indices[i] == c)
+                    return i;
+            return -1;
+        }
+
+        // True iff a route ends here for "method", or for
+        // any method if it's negative
+        bool handles(int method) const
+        {
+            if (method >= 0)
+                return handlers[method] >= 0;
+            for (int i = 0; i < NUM_METHODS; i++)
+                if (handlers[i] >= 0)
+                    return true;
+            return false;
+        }
+    };
+
+    Node root;
+    std::vector<T> values;
+
+    Node *insert_static(Node *node, const char *text, int len);
+    const Node *lookup(const Node *node, Slice path, int pos, int method, RouteParams& params) const;
+};
+
+template <typename T>
+bool Router<T>::add(Method method, const char *pattern, T handler)
+{
+    if (!valid_route_pattern(pattern)) {
+        std::clog << "Invalid route \"" << (pattern ? pattern : "") << "\"\n";
+        return false;
+    }
+
+    std::vector<std::string> names;
+    Node *node = &root;
+
+    const char *p = pattern;
+    while (*p) {
+
+        if (*p == ':' || *p == '*') {
+
+            bool wildcard = (*p == '*');
+
+            const char *start = ++p;
+            while (*p && *p != '/')
+                p++;
+            names.emplace_back(start, p - start);
+
+            std::unique_ptr<Node>& child = wildcard ? node->wildcard : node->param;
+            if (!child)
+                child.reset(new Node());
+            node = child.get();
+
+        } else {
+
+            const char *start = p;
+            while (*p && *p != ':' && *p != '*')
+                p++;
+            node = insert_static(node, start, p - start);
+        }
+    }
+
+    if (node->handlers[method] >= 0) {
+        std::clog << "Route \"" << pattern << "\" was already added\n";
+        return false;
+    }
+
+    // Routes that only differ by method share the node, so
+    // they must name their captures the same way.
+    if (node->handles(-1) && node->names != names) {
+        std::clog << "Route \"" << pattern << "\" names its captures differently from a previous one\n";
+        return false;
+    }
+
+    node->names = std::move(names);
+    node->handlers[method] = values.size();
+    values.push_back(handler);
+    return true;
+}
+
+/*
+ * Walk down the static edges that spell "text", splitting
+ * the edge where the text diverges and adding a new child
+ * for the remaining bytes. Returns the node at the end of
+ * the text.
+ */
+template <typename T>
+typename Router<T>::Node *Router<T>::insert_static(Node *node, const char *text, int len)
+{
+    while (len > 0) {
+
+        int i = node->child_index(text[0]);
+        if (i < 0) {
+            Node *child = new Node();
+            child->prefix.assign(text, len);
+            node->indices += text[0];
+            node->children.emplace_back(child);
+            return child;
+        }
+
+        std::unique_ptr<Node>& child = node->children[i];
+
+        int common = 0;
+        int max = std::min(len, (int) child->prefix.size());
+        while (common < max && child->prefix[common] == text[common])
+            common++;
+
+        if (common < (int) child->prefix.size()) {
+
+            // Split the edge. The new node takes the
+            // common bytes and the old child the rest.
+            std::unique_ptr<Node> middle(new Node());
+            middle->prefix = child->prefix.substr(0, common);
+            child->prefix.erase(0, common);
+            middle->indices += child->prefix[0];
+            middle->children.push_back(std::move(child));
+            child = std::move(middle);
+        }
+
+        node = child.get();
+        text += common;
+        len  -= common;
+    }
+    return node;
+}
+
+/*
+ * Returns the node of the route matching the bytes of
+ * "path" after "pos" under "node", or null. Captures are
+ * appended to "params" and removed again when a branch
+ * leads to no route. A negative "method" matches routes
+ * of any method.
+ */
+template <typename T>
+const typename Router<T>::Node *Router<T>::lookup(const Node *node, Slice path, int pos, int method, RouteParams& params) const
+{
+    const char *str = path.str + path.off;
+    int len = path.len;
+
+    if (pos == len && node->handles(method))
+        return node;
+
+    if (pos < len) {
+
+        int i = node->child_index(str[pos]);
+        if (i >= 0) {
+            const Node *child = node->children[i].get();
+            int prefix_len = child->prefix.size();
+            if (len - pos >= prefix_len && !memcmp(str + pos, child->prefix.data(), prefix_len)) {
+                const Node *match = lookup(child, path, pos + prefix_len, method, params);
+                if (match)
+                    return match;
+            }
+        }
+
+        if (node->param && str[pos] != '/') {
+
+            const char *slash = (const char*) memchr(str + pos, '/', len - pos);
+            int end = slash ? slash - str : len;
+
+            assert(params.count < MAX_ROUTE_PARAMS);
+            Slice& value = params.values[params.count++];
+            value.str = path.str;
+            value.off = path.off + pos;
+            value.len = end - pos;
+
+            const Node *match = lookup(node->param.get(), path, end, method, params);
+            if (match)
+                return match;
+            params.count--;
+        }
+    }
+
+    if (node->wildcard && node->wildcard->handles(method)) {
+        assert(params.count < MAX_ROUTE_PARAMS);
+        Slice& value = params.values[params.count++];
+        value.str = path.str;
+        value.off = path.off + pos;
+        value.len = len - pos;
+        return node->wildcard.get();
+    }
+
+    return nullptr;
+}
+
+template <typename T>
+int Router<T>::find(Method method, Slice path, const T*& handler, RouteParams& params) const
+{
+    params.count = 0;
+    const Node *node = lookup(&root, path, 0, method, params);
+    if (node) {
+        handler = &values[node->handlers[method]];
+        params.names = &node->names;
+        return 200;
+    }
+
+    params.count = 0;
+    if (lookup(&root, path, 0, -1, params)) {
+        params.count = 0;
+        return 405;
+    }
+    return 404;
+}
+
+#endif /* ROUTER_HPP */
@@ -0,0 +1,109 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <cstring>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+// Portable version of "find_crlfcrlf". It jumps from one
+// carriage return to the next with "memchr".
+inline int find_crlfcrlf_scalar(const char *src, int from, int len)
+{
+    int i = from;
+    while (i + 3 < len) {
+        const char *cr = (const char*) memchr(src + i, '\r', len - 3 - i);
+        if (cr == nullptr)
+            return -1;
+        i = cr - src;
+        if (cr[1] == '\n' && cr[2] == '\r' && cr[3] == '\n')
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+#ifdef SCAN_X86
+
+// Vectorized versions of "find_crlfcrlf", which compare a
+// block of positions at once. A position matches if it holds
+// a '\r', the next one a '\n' and so on, so the block is
+// loaded at four consecutive offsets. Lines of a request head
+// all end with "\r\n" so looking for '\r' alone would stop at
+// every line. The remaining positions are searched by the
+// portable version.
+__attribute__((target("sse2")))
+inline int find_crlfcrlf_sse2(const char *src, int from, int len)
+{
+    int i = from;
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 3 + 16 <= len; i += 16) {
+        const char *p = src + i;
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 0)), cr);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 1)), lf);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 2)), cr);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 3)), lf);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return find_crlfcrlf_scalar(src, i, len);
+}
+
+__attribute__((target("avx2")))
+inline int find_crlfcrlf_avx2(const char *src, int from, int len)
+{
+    int i = from;
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    for (; i + 3 + 32 <= len; i += 32) {
+        const char *p = src + i;
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 0)), cr);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 1)), lf);
+        __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 2)), cr);
+        __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 3)), lf);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return find_crlfcrlf_scalar(src, i, len);
+}
+
+#endif
+
+typedef int (*FindCrlfcrlfFunc)(const char *src, int from, int len);
+
+// Fastest version of "find_crlfcrlf" supported by the CPU
+inline FindCrlfcrlfFunc select_find_crlfcrlf()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_crlfcrlf_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return find_crlfcrlf_sse2;
+#endif
+    return find_crlfcrlf_scalar;
+}
+
+/*
+ * Index of the first "\r\n\r\n" of src[0, len) that starts
+ * at or after "from", or -1 if there is none. Callers that
+ * receive the bytes in pieces can resume the search where
+ * the previous one stopped by passing "len - 3" (or 0) of
+ * the previous call as "from", so that a terminator split
+ * between two pieces is still found.
+ *
+ * Uses AVX2 or SSE2 when the CPU supports them, whatever
+ * the compiler targets. The version is chosen at the first
+ * call.
+ */
+inline int find_crlfcrlf(const char *src, int from, int len)
+{
+    static const FindCrlfcrlfFunc find = select_find_crlfcrlf();
+    return find(src, from, len);
+}
+
+#endif /* SCAN_HPP */
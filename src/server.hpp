@@ -1,11 +1,29 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <vector>
 #include <utility>
 #include <cassert>
+#include <climits>
 #include <iostream>
+#include <functional>
 #include "pool.hpp"
 #include "queue.hpp"
 #include "parse.hpp"
-#include "socket.hpp"
+#include "evloop.hpp"
 #include "buffer.hpp"
+#include "cache.hpp"
+#include "chunked.hpp"
+#include "compress.hpp"
+#include "coro.hpp"
+#include "files.hpp"
+#include "metrics.hpp"
+#include "output.hpp"
+#include "response.hpp"
+#include "timers.hpp"
+#include "workers.hpp"
+
+struct Job;
 
 /*
  * Structure that represents the connection with a client
@@ -14,26 +32,129 @@ struct Client {
 
     Socket sock;
     Buffer in;
-    Buffer out;
+    OutputChain out;
 
     // Number of requests from this client that were
     // handled.
     int num_served;
 
+    // Number of its pipelined requests that were served
+    // in a row (see "ServerConfig::pipeline_batch")
+    int batch;
+
     // True iff the client's reference is in the
     // server's candidate queue
     bool queued;
 
+    // Request at the start of the input buffer. Its head
+    // is parsed once, as soon as it's fully received (see
+    // "Server::parse_head"), and "req" is null until then.
+    // It's allocated from "slab" so that only the clients
+    // with a request in progress hold one. Since the buffer
+    // may move when more bytes arrive, "req_base" is the
+    // address the head had when parsed.
+    Request *req;
+    const char *req_base;
+    int head_len;
+    int total_len; // Length of the head and the body, or of the head alone if the body is streamed
+
+    // The body is read through "Server::read_body" while
+    // it's received instead of being received before the
+    // request is served (see "ServerConfig::max_buffered_body").
+    bool body_streamed;
+    int64_t body_len; // Length of the body, or -1 if it's chunked
+
+    BufferSlab *slab;
+
     // Tells the server that the connection with this
     // client should be terminated when the output
     // buffer is fully flushed.
     bool close_when_flushed;
 
+    // The request that follows the ones in "jobs_head" was
+    // rejected. Its error response is written after theirs
+    // (see "Server::reject_request").
+    bool rejected;
+
+    // Requests of this client that were handed to the
+    // worker threads or to coroutine handlers, in the
+    // order they were received (see "Server::serve" and
+    // "Server::serve_async"). Their responses are moved
+    // to the output buffer in this order.
+    Job* jobs_head;
+    Job* jobs_tail;
+
+    // Deadline of the client's current state (see
+    // "Server::update_timer").
+    Timer timer;
+
+    // Time at which the first byte of the request that
+    // is being received arrived, or 0 if none did.
+    uint64_t request_start;
+
+    // Time at which the event loop received the bytes
+    // that completed the head of "req", in nanoseconds
+    // (see "ServerMetrics::response_time")
+    uint64_t head_time;
+
+    // Time of the last write progress while output is
+    // pending, or 0 if no output is pending.
+    uint64_t write_start;
+
     Client()
     {
         queued = false;
+        req = nullptr;
+        req_base = nullptr;
+        head_len = 0;
+        total_len = 0;
+        body_streamed = false;
+        body_len = 0;
+        slab = nullptr;
         num_served = 0;
+        batch = 0;
         close_when_flushed = false;
+        rejected = false;
+        jobs_head = nullptr;
+        jobs_tail = nullptr;
+        timer.data = this;
+        request_start = 0;
+        write_start = 0;
+        head_time = 0;
+    }
+
+    ~Client()
+    {
+        drop_request();
+    }
+
+    static int request_block_size()
+    {
+        return BufferSlab::block_size(sizeof(Request));
+    }
+
+    // Allocate "req", returning false on failure
+    bool allocate_request()
+    {
+        assert(req == nullptr && slab);
+        char *mem = slab->allocate(request_block_size());
+        if (mem == nullptr)
+            return false;
+        req = new (mem) Request();
+        return true;
+    }
+
+    void drop_request()
+    {
+        if (req) {
+            req->~Request();
+            slab->release((char*) req, request_block_size());
+            req = nullptr;
+        }
+        head_len = 0;
+        total_len = 0;
+        body_streamed = false;
+        body_len = 0;
     }
 
     Client(Client&) = delete;
@@ -42,14 +163,181 @@ struct Client {
     Client& operator=(Client&&) = delete;
 };
 
-template <int MAX_CLIENTS>
+/*
+ * Tunable parameters of a "Server". The constructor sets
+ * the default values.
+ */
+struct ServerConfig {
+
+    // Maximum number of connections the kernel holds
+    // while waiting for them to be accepted.
+    int backlog;
+
+    // If positive, the kernel only reports a connection as
+    // ready to be accepted once the client sent some data
+    // or this many seconds have passed (TCP_DEFER_ACCEPT).
+    // This way idle connections don't occupy client slots.
+    // Only supported on Linux.
+    int defer_accept;
+
+    // Maximum number of connections accepted each time the
+    // listening socket is reported as ready, so that a storm
+    // of connections doesn't starve the ones that are already
+    // established. The remaining ones are accepted at the
+    // following iterations of the event loop.
+    int max_accepts_per_event;
+
+    // Timeouts in milliseconds after which a client is
+    // dropped. A value of 0 disables the timeout.
+    //
+    // "idle_timeout" is how long a connection may stay
+    // open between requests. "request_timeout" is the time
+    // allowed to receive a full request from its first byte
+    // (or from the connection, for the first request), which
+    // stops clients that send their requests very slowly.
+    // "write_timeout" is how long a client may not read any
+    // of the bytes it's being sent.
+    int idle_timeout;
+    int request_timeout;
+    int write_timeout;
+
+    // Maximum number of bytes of released buffer memory
+    // kept by the server for reuse (see "BufferSlab").
+    int64_t slab_max_held;
+
+    // Maximum number of bytes of a response built through
+    // "wait" that are buffered before they're sent. When a
+    // response grows past it, it's streamed (see "Server::
+    // write") and the writes block until the buffered bytes
+    // were sent, so a large body only takes this much memory.
+    // A value of 0 disables streaming.
+    int response_window;
+
+    // Requests with a longer body than this, or with a
+    // chunked one, are returned by "wait" as soon as their
+    // head is received. Their body is read with "Server::
+    // read_body" as it arrives, and at most this many bytes
+    // of it are buffered at a time. Other bodies are fully
+    // received first. The workers (see "Server::serve")
+    // always receive the whole body and don't accept
+    // chunked ones. It must be positive.
+    int max_buffered_body;
+
+    // If true, every response has a "Date" header. Its
+    // value is formatted once per second.
+    bool date_header;
+
+    // Maximum number of bytes of the responses held by the
+    // response cache (see "Server::cache"). The least
+    // recently used ones are evicted past it.
+    int64_t response_cache_bytes;
+
+    // If positive, the bodies of the responses built through
+    // "wait" are compressed with gzip or deflate at this zlib
+    // level (1 to 9) when the client accepts it, they're at
+    // least "compression_min_length" bytes long and their type
+    // isn't already compressed (see "compressible_type"). Up
+    // to "compression_cache_bytes" bytes of compressed bodies
+    // are cached (see "Compressor"), so that a body that is
+    // sent many times is only compressed once.
+    int compression_level;
+    int compression_min_length;
+    int64_t compression_cache_bytes;
+
+    // Maximum number of pipelined requests of a connection
+    // that "wait" returns in a row before serving the other
+    // clients. Their responses are written with a single
+    // system call after the last one, which is done right
+    // away instead of waiting for the event loop to report
+    // the socket as writable. If 0, a client goes back to
+    // the end of the queue after each request and its
+    // responses are written by the event loop.
+    int pipeline_batch;
+
+    // Number of responses after which a connection isn't kept
+    // alive anymore. The one that follows closes it.
+    int keep_alive_requests;
+
+    // If not null, GET requests for this path are answered
+    // by the server itself with its metrics, in the
+    // Prometheus text format (see "Server::metrics").
+    const char *metrics_path;
+
+    ServerConfig()
+    {
+        backlog = 512;
+        defer_accept = 0;
+        max_accepts_per_event = 64;
+        idle_timeout = 5000;
+        request_timeout = 10000;
+        write_timeout = 30000;
+        slab_max_held = 16 * 1024 * 1024;
+        response_window = 256 * 1024;
+        max_buffered_body = 1024 * 1024;
+        date_header = true;
+        response_cache_bytes = 64 * 1024 * 1024;
+        compression_level = 0;
+        compression_min_length = 1024;
+        compression_cache_bytes = 16 * 1024 * 1024;
+        pipeline_batch = 16;
+        keep_alive_requests = 5;
+        metrics_path = nullptr;
+    }
+};
+
+/*
+ * The event loop implementation can be chosen through the
+ * second template argument (see "evloop.hpp"). By default
+ * epoll is used on Linux and poll everywhere else.
+ */
+template <int MAX_CLIENTS, template <int> class Loop = EventLoop>
 class Server {
 
 public:
 
-    Server()
+    Server(const ServerConfig& config_ = ServerConfig())
+        : slab(config_.slab_max_held),
+          #if defined(__linux__) && defined(HTTP_COROUTINES)
+          frames(config_.slab_max_held),
+          #endif
+          response_cache(config_.response_cache_bytes),
+          compressor(config_.compression_level, config_.compression_cache_bytes)
+    {
+        config = config_;
+        now_ns = monotonic_ns();
+        now = now_ns / 1000000;
+        accepting = false;
+        common.date = config.date_header;
+        target = nullptr;
+        target_request = nullptr;
+        target_removed = false;
+        streaming = false;
+        req_bytes = -1;
+        reset_body();
+        #ifdef __linux__
+        workers = nullptr;
+        #endif
+        #if defined(__linux__) && defined(HTTP_COROUTINES)
+        num_calls = 0;
+        #endif
+        batch_count = 0;
+        batch_cursor = 0;
+        registry = nullptr;
+
+        // Clients get different variants of the same response
+        if (config.compression_level > 0)
+            response_cache.vary(H::AcceptEncoding);
+    }
+
+    ~Server()
     {
-        state = NOTARGET;
+        #ifdef __linux__
+        delete workers;
+        #endif
+        #if defined(__linux__) && defined(HTTP_COROUTINES)
+        if (frame_slab == &frames)
+            frame_slab = nullptr;
+        #endif
     }
 
     Server(Server&  other) = delete;
@@ -64,8 +352,21 @@ public:
      * The "addr" argument must be an ipv4 address in
      * dotted decimal notation. If it's NULL, the server
      * will listen on all available interfaces.
+     *
+     * If "reuse_port" is true, the listening socket is
+     * created with SO_REUSEPORT so that other servers
+     * can listen on the same address and the kernel will
+     * distribute the connections between them (see
+     * "ShardedServer").
+     */
+    bool listen(int port=8080, const char *addr=nullptr, bool reuse_port=false);
+
+    /*
+     * Add a header to every response, after the status line.
+     * The line is serialized once, so it costs a copy per
+     * response. It must be called before "wait" or "serve".
      */
-    bool listen(int port=8080, const char *addr=nullptr);
+    void common_header(const char *name, const char *value);
 
     /*
      * Get an HTTP request to handle. If a request was
@@ -74,6 +375,50 @@ public:
      */
     void wait(Request& req);
 
+    /*
+     * Like "wait", but give up if no request was received
+     * within "timeout_ms" milliseconds, in which case false
+     * is returned. With a timeout of 0 it never blocks: the
+     * events that are ready are handled and the call returns.
+     * A negative timeout waits forever.
+     *
+     * Together with "pollable_fd" and "poll_timeout", this
+     * lets another event loop drive the server: when the
+     * descriptor is readable, or "poll_timeout" expired, call
+     * "try_wait(req, 0)" and respond until it returns false.
+     *
+     * Only waiting for requests is bounded. Streamed writes
+     * and "read_body" still handle the I/O until the client
+     * makes progress.
+     */
+    bool try_wait(Request& req, int timeout_ms);
+
+    /*
+     * Descriptor that becomes readable when the server has
+     * events to handle, to be registered in another event
+     * loop for reading. It's -1 if the event loop has none,
+     * like the poll one, in which case "try_wait" should be
+     * called every "poll_timeout" milliseconds.
+     */
+    int pollable_fd() const
+    {
+        return evloop.fd();
+    }
+
+    /*
+     * Milliseconds after which "try_wait" must be called even
+     * if "pollable_fd" isn't readable, so that the clients'
+     * timeouts expire, or -1 if there's no such deadline. It's
+     * 0 if requests or events are already waiting, since the
+     * descriptor doesn't tell about them.
+     */
+    int poll_timeout() const
+    {
+        if (!queue.empty() || evloop.pending())
+            return 0;
+        return timers.timeout(monotonic_ms());
+    }
+
     /*
      * This function can only be called between two 
      * "wait" calls and it sets the HTTP status code 
@@ -96,67 +441,415 @@ public:
      */
     void header(const char *name, const char *value);
 
+    /*
+     * Declare the length of the response's body, so that
+     * it's sent as it's written instead of when "send" is
+     * called. It must be called before "write". The writes
+     * past this length are dropped, and if fewer bytes are
+     * written the connection is closed after the response.
+     */
+    void content_length(int64_t len);
+
     /*
      * Similar to "header" but appends bytes to the
      * response's body. It must be called after "send".
+     *
+     * If more than "ServerConfig::response_window" bytes are
+     * waiting to be sent, the response is streamed: the call
+     * handles the I/O of all clients until the client being
+     * responded to received the pending bytes. If no length
+     * was declared, the body is sent with the chunked
+     * encoding, or to HTTP/1.0 clients without a length and
+     * followed by the end of the connection. Other requests
+     * aren't returned by "wait" in the meantime.
+     *
+     * If the client is dropped while this happens, the
+     * following writes do nothing. The request stays
+     * valid until the next "wait".
      */
     void write(const char *str, int len=-1);
 
+    /*
+     * Like "write" but the bytes aren't copied. They're
+     * sent directly from "ptr", which must stay valid until
+     * "release(arg)" is called. That happens once the bytes
+     * were sent or the connection was dropped, so possibly
+     * after later "wait" calls. "release" may be null for
+     * memory that is never freed.
+     */
+    void write_ref(const char *ptr, int len, ReleaseFunc release=nullptr, void *arg=nullptr);
+
+    /*
+     * Append the contents of a shared blob to the response's
+     * body without copying it. The response holds its own
+     * reference until the bytes are sent, so the caller may
+     * drop its own at any time.
+     */
+    void write_shared(SharedBlob *blob);
+
+    /*
+     * Read up to "max" bytes of the body of the request
+     * returned by the last "wait" into "dst". Returns the
+     * number of bytes read, 0 once the whole body was read
+     * or -1 if the body is malformed or the client was
+     * dropped.
+     *
+     * If the body wasn't received yet the call handles the
+     * I/O of all clients until some of it arrives. Chunked
+     * bodies are decoded. If the client sent "Expect: 100-
+     * continue", it's told to send the body the first time
+     * this happens, unless the response was started, so a
+     * request can be refused without receiving its body.
+     *
+     * Bodies that were fully received before "wait" returned
+     * are also available as "req.body". If the rest of the
+     * body wasn't read when "send" is called, the connection
+     * is closed after the response.
+     */
+    int read_body(char *dst, int max);
+
+    #ifndef _WIN32
+    /*
+     * Respond to "req" with the contents of the file at
+     * "path". This sets the status, the "Content-Type" and
+     * the body of the response, so it must be called right
+     * after "wait" and before "status", "header" or "write".
+     *
+     * Single byte-range requests are answered with a 206
+     * (or a 416 if the range is outside the file). The body
+     * is sent with "sendfile" directly from the page cache.
+     * Open files are cached (see "FileCache").
+     *
+     * Returns false if the file couldn't be opened or is
+     * too big, in which case nothing was written and the
+     * caller should respond with an error.
+     */
+    bool serve_file(const Request& req, const char *path);
+
+    /*
+     * Like "serve_file" but the file is the one under the
+     * "root" directory at the path of the request's URL.
+     * Returns false if the path is invalid or the file
+     * couldn't be opened.
+     */
+    bool serve_directory(const Request& req, const char *root);
+    #endif
+
+    /*
+     * Store the response to the last request returned by
+     * "wait" in the response cache for "ttl_ms" milliseconds
+     * once it's sent. Until then, GET requests with the same
+     * path and query (and the same values of the headers
+     * passed to "cache_vary") are answered by the event loop
+     * with a copy of it, without being returned by "wait" or
+     * handed to the workers. It must be called before "send".
+     *
+     * Only responses to GET requests that are buffered until
+     * "send" and whose body is in memory are cached (see
+     * "Response::cache"). Handlers run by the workers can ask
+     * for the same through "Response::cache".
+     */
+    void cache(int ttl_ms);
+
+    /*
+     * Cache different responses for requests that differ by
+     * the value of the header "name". It must be called
+     * before "wait" or "serve".
+     */
+    void cache_vary(H name);
+
     /*
      * Mark a request as handled. You can no longer
      * modify the response after you call this function.
      */
     void send();
 
-private:
+    #ifdef __linux__
+    /*
+     * Serve requests forever using "num_workers" threads
+     * to run the handler, instead of returning them through
+     * "wait".
+     *
+     * The calling thread only does I/O and parsing. Each
+     * complete request is handed to a worker, which calls
+     * "handler(request, response)" and builds the response
+     * with the "Response" methods. Since the handler runs
+     * on other threads, a slow one doesn't stall the other
+     * connections.
+     *
+     * Responses to pipelined requests are sent in the order
+     * the requests were received even if they're handled
+     * concurrently by different workers.
+     *
+     * Returns false if the workers couldn't be started. It
+     * can only be called after "listen" and instead of
+     * "wait".
+     */
+    template <typename Handler>
+    bool serve(int num_workers, Handler handler);
 
-    // Since responses are built using a kind of
-    // immediate-mode API ("status", "header", "write"
-    // and "send"), the server needs to hold a state 
-    // to discriminate between valid and invalid calls
-    // for the response creation.
-    enum State {
+    /*
+     * Like "serve" but only start the workers. The requests
+     * are served by the following calls to "serve_step", so
+     * the caller decides when to stop.
+     */
+    template <typename Handler>
+    bool start_workers(int num_workers, Handler handler);
 
-        NOTARGET, // No request is being handled. This is both the 
-                  // starting value and that set by "send".
-        
-        STATUS,   // A request was returned though "wait" but no 
-                  // "status" call was done
-        
-        HEADERS,  // "status" has been called. Now either "header" 
-                  // or "write" are allowed.
-        
-        CONTENT,  // A call to "write" has been done, so only other 
-                  // calls to it are allowed.
-        
-        // After any of these states you can "send" and
-        // go to the "NOTARGET" state.
+    /*
+     * An iteration of the loop of "serve" and "serve_async":
+     * handle the events that are ready within "timeout_ms"
+     * milliseconds (forever if it's negative) and hand the
+     * complete requests to the handlers. It can only be called
+     * after "start_workers" or "start_async".
+     */
+    void serve_step(int timeout_ms);
+    #endif
+
+    #if defined(__linux__) && defined(HTTP_COROUTINES)
+    /*
+     * Serve requests forever by running the coroutine
+     * "handler(request, response)" on each of them, on the
+     * calling thread. The handler returns a "Task<void>" and
+     * builds the response with the "Response" methods.
+     *
+     * Unlike the handlers of "wait", it may suspend itself
+     * by awaiting "sleep", "readable", "writable", a "Trigger"
+     * or any other task, and the server handles the other
+     * connections in the meantime. Any number of handlers
+     * may be suspended at the same time. Each costs its
+     * coroutine frames, which are allocated from a slab of
+     * the server (see "frame_stats"), and the copy of its
+     * request.
+     *
+     * As with "serve", the response is sent once the
+     * handler completes, responses to pipelined requests
+     * are sent in order and they aren't compressed. If the
+     * client is dropped, its suspended handlers are
+     * destroyed where they're suspended.
+     *
+     * Returns false if it can't be started. It can only be
+     * called after "listen" and instead of "wait" or "serve".
+     * It requires C++20.
+     */
+    template <typename Handler>
+    bool serve_async(Handler handler);
+
+    /*
+     * Like "serve_async" but only set the handler. The
+     * requests are served by the following calls to
+     * "serve_step".
+     */
+    template <typename Handler>
+    bool start_async(Handler handler);
+
+    /*
+     * What a coroutine handler awaits to be resumed after a
+     * delay or when a socket is ready. It must be awaited
+     * right away, by a handler run by "serve_async". The
+     * result of "co_await" is true iff the socket is ready
+     * (or the delay elapsed), and false if it timed out,
+     * failed or couldn't be waited for.
+     */
+    class Wait {
+
+    public:
+
+        ~Wait()
+        {
+            cancel();
+        }
+
+        Wait(Wait&) = delete;
+        Wait& operator=(Wait&) = delete;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle_)
+        {
+            handle = handle_;
+            if (sock) {
+                if (!server.evloop.add(*sock, events, this))
+                    return false; // Resume right away
+                registered = true;
+            }
+            if (timeout > 0)
+                server.timers.set(&timer, server.now + timeout);
+            return true;
+        }
+
+        bool await_resume() const noexcept
+        {
+            return ok;
+        }
+
+    private:
+
+        friend class Server;
+
+        Server& server;
+        const Socket *sock; // Null for "sleep"
+        int events;
+        int timeout;
+        Timer timer;
+        std::coroutine_handle<> handle;
+        bool registered;
+        bool ok;
+
+        Wait(Server& server_, const Socket *sock_, int events_, int timeout_)
+            : server(server_)
+        {
+            sock = sock_;
+            events = events_;
+            timeout = timeout_;
+            timer.data = this;
+            registered = false;
+            ok = false;
+        }
+
+        void cancel()
+        {
+            if (registered) {
+                server.evloop.remove(*sock);
+                server.forget_events(this);
+                registered = false;
+            }
+            server.timers.cancel(&timer);
+        }
+
+        void wake(bool ok_)
+        {
+            cancel();
+            ok = ok_;
+            handle.resume();
+        }
     };
 
-    State state;
+    /*
+     * Let the awaiting handler resume after "ms" milliseconds
+     * (at least one).
+     */
+    Wait sleep(int ms)
+    {
+        return Wait(*this, nullptr, 0, ms > 0 ? ms : 1);
+    }
+
+    /*
+     * Let the awaiting handler resume when "sock" is ready to
+     * be read from or written to, or after "timeout_ms" if
+     * it's positive. The socket must not be registered in
+     * the server already.
+     */
+    Wait readable(const Socket& sock, int timeout_ms=0)
+    {
+        return Wait(*this, &sock, Event::RECV, timeout_ms);
+    }
+
+    Wait writable(const Socket& sock, int timeout_ms=0)
+    {
+        return Wait(*this, &sock, Event::SEND, timeout_ms);
+    }
+
+    /*
+     * Number of requests handed to coroutine handlers whose
+     * response wasn't moved to the client's output yet
+     */
+    int pending_handlers() const
+    {
+        return num_calls;
+    }
+
+    /*
+     * Statistics of the memory used by coroutine frames
+     */
+    const SlabStats& frame_stats() const
+    {
+        return frames.stats();
+    }
+    #endif
+
+    /*
+     * Statistics of the memory used by the clients' buffers
+     */
+    const SlabStats& buffer_stats() const
+    {
+        return slab.stats();
+    }
+
+    /*
+     * Counters and latencies of the server. They're updated
+     * by the thread that runs it and may be read by others.
+     * The gauges are updated once per iteration of the event
+     * loop.
+     */
+    const ServerMetrics& metrics() const
+    {
+        return metrics_;
+    }
+
+    /*
+     * Make "ServerConfig::metrics_path" report the metrics of
+     * all servers in "reg" instead of this one's. The server
+     * must be in it, and it must outlive the server.
+     */
+    void report_metrics_to(MetricsRegistry *reg)
+    {
+        registry = reg;
+    }
+
+private:
+
+    ServerConfig config;
 
     // Listening socket.
     Socket socket_;
 
+    // True iff the event loop reports when the listening
+    // socket is ready. It's turned off when the client pool
+    // is full, so that pending connections don't wake up the
+    // loop continuously, and back on when a slot frees up.
+    bool accepting;
+
+    // Memory of the clients' buffers. It must be declared
+    // before the pool so that it's destroyed after it.
+    BufferSlab slab;
+
+    #if defined(__linux__) && defined(HTTP_COROUTINES)
+    // Memory of the coroutine frames (see "frame_slab")
+    BufferSlab frames;
+    #endif
+
     // Pool of client structures
     Pool<Client, MAX_CLIENTS> pool;
     
     // The eventloop must be able to hold one entry per
     // client and one more for the listening socket.
-    //
-    // It may be necessary to hold some timers for each
-    // client.
-    EventLoop<MAX_CLIENTS+1> evloop;
+    Loop<MAX_CLIENTS+1> evloop;
+
+    // Deadlines of the clients. The event loop is given the
+    // time until the nearest one as timeout.
+    TimerWheel timers;
+
+    // Time read from the monotonic clock once per iteration
+    // of the event loop, in milliseconds and in nanoseconds.
+    uint64_t now;
+    uint64_t now_ns;
+
+    // Events returned by the last "wait_batch" call. They
+    // are all handled before looking at the candidate queue
+    // again. When a client is removed, its events in the
+    // unprocessed part of the batch are dropped.
+    static const int MAX_BATCH = MAX_CLIENTS+1 < 256 ? MAX_CLIENTS+1 : 256;
+    Event batch[MAX_BATCH];
+    int batch_count;
+    int batch_cursor;
 
     // This queue holds references to clients that are
     // "response candidates". A candidate is a client
-    // for which a request head was received, but the
-    // body may or may not.
-    //
-    // When a client is sending to the server a request, 
-    // the moment the server receives the "\r\n\r\n" token 
-    // it considers the client a "candidate" for being 
-    // responded to.
+    // for which a full request was received.
     //
     // An HTTP request has this general structure:
     //
@@ -168,62 +861,157 @@ private:
     //     ... Content ...
     //
     // So the \r\n\r\n determines the end of the request's 
-    // head and start of the body. There is no way of knowing 
-    // if the request body was also received without parsing 
-    // the entire request and getting the value of the 
-    // "Content-Length" header. To avoid parsing the request 
-    // twice or having to cache the result, we just mark the 
-    // client as "candidate" and push it to this queue. The 
-    // "wait" function will pop elements of this queue looking 
-    // for one that's actually ready and return that to the
-    // user.
+    // head and start of the body. As soon as it's received
+    // the head is parsed into the client structure, which
+    // gives the length of the body. From then on, the bytes
+    // that arrive only need to be counted until the body is
+    // complete, at which point the client is pushed to this
+    // queue. This way a head is parsed only once, however
+    // many pieces it and its body arrive in.
     Queue<Client*, MAX_CLIENTS> queue;
 
     // The following fields are state necessary when responding
-    // to a request. They only hold meaning when the state isn't
-    // NOTARGET.
-    
+    // to a request. They only hold meaning while the response
+    // is active.
+
+    // Builds the response of the request returned by the last
+    // "wait" into the output buffer of "target".
+    Response response;
+
+    // Headers added to every response (see "common_header")
+    CommonHeaders common;
+
     Client* target; // Current client that's being responded to
-    
-    int offset_content_length; // Offset (in bytes) of the "Content-Length" header's value
-                               // in the output buffer of the target client. This is set
-                               // during the first "write" call after a "wait".
-    
-    int offset_content; // Offset (in bytes) of the response body in the output buffer
-                        // of the target client. It's set at the first "write" call after
-                        // "wait".
 
-    int keep_alive; // This is 1 if the user set the "Connection: Keep-Alive" header or
-                    // 0 if it set "Connection: Close". Its initial value is -1, so reading
-                    // -1 means the user didn't specify anything yet.
-    
+    const Request *target_request; // Request returned by the last "wait"
+
+    bool target_removed; // True iff "target" was removed while the response was streamed.
+                         // It's deallocated at the next "send" so that the request stays valid.
+
+    bool streaming; // True iff the response was streamed. Input events of the target are ignored
+                    // meanwhile since reading may move the buffer the request refers to.
+
     int req_bytes; // Size (in bytes) of the request that's being served. This is necessary
                    // when the response is completed and the request bytes can be dropped.
 
-    static const char* status_text(int code);
+    // State of the body of the target's request, which is read by "read_body". When it's
+    // streamed, the head is moved to "head_copy" since receiving the body may move the
+    // input buffer, and the unread body is at the start of the input buffer.
+    bool body_pending;    // True iff some of the body wasn't read yet
+    bool body_streamed;   // True iff the body is received while it's read
+    bool body_chunked;    // True iff the body is decoded by "decoder"
+    int64_t body_left;    // Bytes of the body that weren't read yet, unless it's chunked
+    int body_offset;      // Offset of the unread body in the input buffer
+    bool expect_continue; // True iff the client waits for a "100 Continue"
+    bool waiting_body;    // True while "read_body" waits for bytes of the body
+    ChunkedDecoder decoder;
+    Buffer head_copy;
+
+    #ifndef _WIN32
+    // Files opened by "serve_file"
+    FileCache files;
+    #endif
+
+    // Responses stored by "cache"
+    ResponseCache response_cache;
+    std::string cache_key;  // Key of the target's response, set by "cache"
+    std::string lookup_key; // Key of a request that may be answered by the cache
+
+    // See "ServerConfig::compression_level"
+    Compressor compressor;
+    std::string compress_input; // Copy of the body that is compressed
+
+    ServerMetrics metrics_;
+    MetricsRegistry *registry; // Servers reported at "ServerConfig::metrics_path", if not only this one
+    std::string metrics_text;  // Body of the last metrics response
+
+    #ifdef __linux__
+    // Maximum number of requests handed to the workers
+    // and not yet moved to the clients' output buffers.
+    static const int MAX_JOBS = 1024;
+
+    // Only allocated when "serve" is called
+    WorkerPool<MAX_JOBS>* workers;
+
+    void dispatch_candidates();
+    void handle_completed_jobs();
+    void append_completed_responses(Client* client);
+    void drop_jobs(Client* client);
+    Job* allocate_job();
+    void submit_job(Job* job);
+    void release_job(Job* job);
+    #endif
+
+    #if defined(__linux__) && defined(HTTP_COROUTINES)
+    // A request handed to the coroutine handler. The
+    // response is built in the job's output chain.
+    struct Call : Job {
+        Server *server;
+        Response response;
+        Task<void> task;
+    };
+
+    // Handler passed to "serve_async", or null
+    std::function<Task<void>(Request&, Response&)> async_handler;
+
+    // Calls whose handler completed since "finish_calls"
+    // was last called
+    std::vector<Call*> finished_calls;
+
+    int num_calls; // Calls that weren't released
+
+    static void call_done(void *arg);
+    void finish_calls();
+    #endif
 
     // Choose if a given connection can be kept alive.
     // This is a function of:
     //     1. num_clients: The number of curretly connected clients
     //     2. max_clients: The client limit
     //     3. How many responses were previously served to this client
-    static bool should_keep_alive(int num_clients, int max_clients, int num_served);
-
+    bool should_keep_alive(int num_clients, int max_clients, int num_served) const;
+    bool keep_alive_allowed(Client* client, const Request& req);
+
+    bool is_metrics_request(const Request& req) const;
+    bool write_metrics(OutputChain& out, bool allow_keep_alive);
+    void record_response(uint64_t head_time);
+
+    // Response to the requests that are rejected
+    static constexpr const char *BAD_REQUEST = "HTTP/1.1 400 Bad Request\r\n"
+                                               "Content-Length: 0\r\n"
+                                               "Connection: Close\r\n\r\n";
+
+    bool parse_head(Client* client);
+    void reject_request(Client* client);
+    bool request_received(Client* client);
+    int  take_request(Client* client, Request& req);
+    bool begin_body(Client* client, Request& req);
+    bool wait_for_body();
+    void reset_body();
+    int  input_limit(Client* client);
+    void update_timer(Client* client);
+    void apply_backpressure();
     void remove_client(Client* client);
+    void free_client(Client* client);
+    void forget_events(void *data);
     void accept_incoming_connections();
+    void handle_events(int max_wait=-1);
     void handle_single_event(Event event);
-    void handle_client_data_and_queue_if_candidate(Client* client);
-    void flush_buffered_bytes_to_client_and_close_if_done(Client* client);
+    bool handle_client_data_and_queue_if_candidate(Client* client);
+    bool send_internal_response(Client* client);
+    bool flush_output(Client* client);
+    void compress_response();
+    bool flush_buffered_bytes_to_client_and_close_if_done(Client* client);
 };
 
-template <int N>
-bool Server<N>::listen(int port, const char *addr)
+template <int N, template <int> class L>
+bool Server<N, L>::listen(int port, const char *addr, bool reuse_port)
 {
     if (socket_.active())
         return false; // Already listening
     
     Socket socket;
-    if (!socket.start_server(port, addr))
+    if (!socket.start_server(port, addr, reuse_port, config.backlog, config.defer_accept))
         return false;
 
     // We want to know when calling "accept" on the socket
@@ -239,6 +1027,7 @@ bool Server<N>::listen(int port, const char *addr)
 
     // Commit the socket structure
     socket_ = std::move(socket);
+    accepting = true;
 
     return true;
 }
@@ -246,340 +1035,1109 @@ bool Server<N>::listen(int port, const char *addr)
 /*
  * See the forward declaration.
  */
-template <int N>
-void Server<N>::wait(Request& req)
+template <int N, template <int> class L>
+void Server<N, L>::wait(Request& req)
+{
+    try_wait(req, -1);
+}
+
+/*
+ * See the forward declaration.
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::try_wait(Request& req, int timeout_ms)
 {
     // Make sure any pending response is sent and
-    // the state is NOTARGET.
+    // no response is active.
     send();
 
-    assert(state == NOTARGET);
+    assert(!response.active());
 
-    /*
-     * Basically what this loop is doing is handling
-     * TCP level I/O until one or more clients become
-     * response candidates. When that's true it pops
-     * a client, parses the request into the user-provided
-     * structure and checks that the request body was
-     * fully received. If it wasn't it drops the client
-     * and gets or waits for a new candidate. If the body
-     * was received, it returns to the user.
-     * 
-     * Clients that were considered candidates but 
-     * couldn't be served yet may receive more bytes
-     * in the future. Whenever they receive bytes they
-     * will be considered candidates again until they're
-     * served.
-     */
-    do {
+    uint64_t deadline = 0;
+    if (timeout_ms > 0) {
+        now = monotonic_ms();
+        deadline = now + timeout_ms;
+    }
+
+    // Handle TCP level I/O until one or more clients
+    // received a full request, then return the request
+    // of the first one to the user. Events are handled
+    // at least once, even when the timeout is 0.
+    Client* candidate;
+    bool handled = false;
+    for (;;) {
 
         while (queue.empty()) {
-            Event event = evloop.wait();
-            handle_single_event(event);
+            int max_wait = -1;
+            if (timeout_ms >= 0) {
+                if (handled && now >= deadline)
+                    return false;
+                max_wait = deadline > now ? deadline - now : 0;
+            }
+            handle_events(max_wait);
+            handled = true;
         }
 
-        Client* candidate;
         queue.pop(candidate);
         candidate->queued = false;
         assert(pool.allocated(candidate));
-    
-        // It's known that the input buffer contains
-        // a \r\n\r\n or the client wouldn't have been
-        // inserted in the queue.
-        Slice head = candidate->in.slice_until("\r\n\r\n", true);
-
-        ParseError error;
-        if (!req.parse(head, error)) {
-            // Invalid request
-            // TODO: Send a message to the client before removing it
-            std::clog << "Parsing Error: " << error.text << "\n";
-            remove_client(candidate);
-            continue;
-        }
-        
-        int head_len = head.len;
-        int body_len = req.content_length();
-        if (body_len < 0) {
-            // Malformed Content-Length header
-            std::clog << "Malformed Content-Length header\n";
-            remove_client(candidate);
-            continue;
-        }
 
-        int total_len = head_len + body_len;
-
-        // We know the head of the request was received, but
-        // if the body wasn't we can't respond yet.
-        if (candidate->in.length() >= total_len) {
-            // Request was fully received
-            req.body = candidate->in.slice(head_len, total_len);
-            target = candidate;
-            state = STATUS;
-            req_bytes = total_len;
-            keep_alive = -1;
+        if (begin_body(candidate, req))
             break;
-        }
 
-        // Still waiting for the request's body.
-        // Go back to waiting for a candidate.
-    } while (1);
-}
+        // Out of memory
+        remove_client(candidate);
+    }
 
-template <int N>
-bool Server<N>::should_keep_alive(int num_clients, int max_clients, int num_served)
-{
-    // If the server is about 70% full, don't keep connections alive
-    if (10 * num_clients > 7 * max_clients)
-        return false;
-    
-    // Only keep alive if less than 5 responses were served
-    if (num_served >= 5)
-        return false;
-    
+    target = candidate;
+    target_request = &req;
+    timers.cancel(&candidate->timer);
+
+    // If the user wants to keep the connection alive
+    // (or doesn't specify it) then the response will
+    // check first if it's reasonable given the server's
+    // state and if the client didn't ask to close it.
+    response.begin(candidate->out, keep_alive_allowed(candidate, req), &common);
+    if (req.minor_version == 0)
+        response.disable_chunked();
     return true;
 }
 
-template <int N>
-void Server<N>::remove_client(Client* client)
-{
-    assert(pool.allocated(client));
-    evloop.remove(client->sock);
-    if (client->queued)
-        queue.remove(client);
-    pool.deallocate(client);
-    assert(!pool.allocated(client));
-}
-
-template <int N>
-void Server<N>::accept_incoming_connections()
+/*
+ * Parse the head of the request at the start of the
+ * client's input buffer if it was fully received and
+ * wasn't parsed already. The search of its end resumes
+ * where the previous call stopped (see "Buffer::seek").
+ *
+ * Returns false if the request is invalid, in which case
+ * the client was removed or will be closed after an error
+ * response (see "reject_request").
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::parse_head(Client* client)
 {
-    // TODO: Since we're leaving some connections in the queue
-    //       when the client limit is reached, we need to make
-    //       sure to serve them when some client structs are freed.
+    if (client->req)
+        return true; // Already parsed
 
-    // Accept all incoming connections until the client pool is full
-    for (Socket sock; pool.have_free_space() && socket_.accept(sock); ) {
-
-        Client* client = pool.allocate();
-        assert(client);
+    int end = client->in.seek("\r\n\r\n");
+    if (end < 0)
+        return true; // Not received yet
 
-        // At first only register for receive events since
-        // there's nothing to be sent.
-        if (!evloop.add(sock, Event::RECV, client)) {
-            pool.deallocate(client);
-            continue;
-        }
+    if (!client->allocate_request()) {
+        remove_client(client);
+        return false;
+    }
 
-        // Commit socket
-        client->sock = std::move(sock);
+    int head_len = end + 4;
+    Slice head = client->in.slice(0, head_len);
 
-        // The newly accepted client may already have some
-        // data to be read. Generate a RECV event manually.
-        handle_single_event(Event(Event::RECV, client));
+    ParseError error;
+    if (!client->req->parse(head, error)) {
+        std::clog << "Parsing Error: " << error.text << "\n";
+        reject_request(client);
+        return false;
     }
-}
 
-template <int N>
-void Server<N>::handle_client_data_and_queue_if_candidate(Client* client)
-{
-    // Client sent data. Copy it into the buffer
-    bool closed = client->in.write(client->sock);
-    if (closed || client->in.failed()) {
-        remove_client(client);
-        return;
+    // Transfer codings other than chunked don't tell where
+    // the body ends. Framing it by "Content-Length" instead
+    // could disagree with a proxy in front of the server.
+    if (client->req->bad_transfer_encoding()) {
+        std::clog << "Unsupported Transfer-Encoding\n";
+        reject_request(client);
+        return false;
     }
 
-    // If the client isn't already ready to be served,
-    // it may be now. Check wether the head of the request
-    // was fully received.
-
-    // The head of a request is terminated by a CRLF CRLF 
-    // token.
-    if (client->in.contains("\r\n\r\n")) {
-
-        // Head was received! Push the client into the queue if
-        // it wasn't already.
+    bool chunked = client->req->chunked();
+    int64_t body_len = chunked ? -1 : client->req->content_length();
 
-        if (!client->queued) {
-            queue.push(client);
-            client->queued = true;
+    // Long or chunked bodies are streamed, except to the
+    // workers, which get the whole request.
+    bool streamed = chunked || body_len > config.max_buffered_body;
+    #ifdef __linux__
+    if (workers) {
+        if (chunked) {
+            std::clog << "Chunked request bodies aren't supported by the workers\n";
+            remove_client(client);
+            return false;
         }
+        streamed = false;
+    }
+    #endif
 
-        // It's possible to avoid to check wether the client is
-        // contained in the queue by caching the information.
-        // This would speed up the process but also add redundancy
-        // to the class and possible bugs.
+    if (!chunked && (body_len < 0 || (!streamed && body_len > INT_MAX - head_len))) {
+        // Malformed Content-Length header
+        std::clog << "Malformed Content-Length header\n";
+        reject_request(client);
+        return false;
+    }
+
+    client->req_base  = client->in.content();
+    client->head_len  = head_len;
+    client->total_len = streamed ? head_len : head_len + body_len;
+    client->body_streamed = streamed;
+    client->body_len = body_len;
+    client->head_time = now_ns;
+
+    // A client that sent "Expect: 100-continue" waits for a
+    // go-ahead before sending the body. If it's buffered, it
+    // can be given right away, unless the responses to the
+    // previous requests weren't all appended to the output.
+    // Streamed bodies wait for the handler (see "read_body").
+    if (!streamed && client->in.length() < client->total_len && client->jobs_head == nullptr
+     && client->req->expects_continue()) {
+        client->out.write("HTTP/1.1 100 Continue\r\n\r\n");
+        evloop.add_events(client->sock, Event::SEND);
     }
+    return true;
 }
 
-template <int N>
-void Server<N>::flush_buffered_bytes_to_client_and_close_if_done(Client* client)
+/*
+ * Answer the invalid request at the start of the client's
+ * input buffer with a "400 Bad Request" and close the
+ * connection once it's sent, dropping whatever the client
+ * sent after it since it can't be told where it starts.
+ * If responses to previous requests are in flight, the
+ * error is written after them.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::reject_request(Client* client)
 {
-    // Client is ready to receive data
-    client->out.read(client->sock);
-    if (client->out.failed()) {
-        remove_client(client);
-        return;
+    metrics_.parse_failures.add();
+
+    client->drop_request();
+    client->in.consume(client->in.length());
+    client->request_start = 0;
+    client->close_when_flushed = true;
+    evloop.remove_events(client->sock, Event::RECV);
+
+    if (client->jobs_head)
+        client->rejected = true;
+    else {
+        client->out.write(BAD_REQUEST);
+        evloop.add_events(client->sock, Event::SEND);
     }
+    update_timer(client);
+}
 
-    if (client->out.length() == 0) {
-        
-        // Nothing more to send.
+/*
+ * True iff the head and the body of the request at the
+ * start of the client's input buffer were received. The
+ * head must have been parsed with "parse_head".
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::request_received(Client* client)
+{
+    return client->req && client->in.length() >= client->total_len;
+}
+
+/*
+ * Copy the fully received request at the start of the
+ * client's input buffer into "req" and return its length.
+ * The request's slices refer to the input buffer, so they
+ * are valid until the request is consumed from it. The
+ * client is ready to parse the following request.
+ */
+template <int N, template <int> class L>
+int Server<N, L>::take_request(Client* client, Request& req)
+{
+    assert(request_received(client));
+
+    req = *client->req;
+
+    // The buffer was moved by the writes that came after the head
+    const char *base = client->in.content();
+    if (base != client->req_base)
+        req.rebase(client->req_base, client->head_len, base);
+
+    req.body = client->in.slice(client->head_len, client->total_len);
+
+    int total_len = client->total_len;
+    client->drop_request();
+    return total_len;
+}
+
+/*
+ * Take the request of a candidate that is about to be
+ * served and prepare the reading of its body. Returns
+ * false if the head couldn't be copied.
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::begin_body(Client* client, Request& req)
+{
+    reset_body();
+
+    body_streamed   = client->body_streamed;
+    body_chunked    = client->body_len < 0;
+    body_left       = body_chunked ? 0 : client->body_len;
+    body_offset     = client->head_len;
+    body_pending    = body_chunked || body_left > 0;
+    expect_continue = body_streamed && client->req->expects_continue();
+
+    req_bytes = take_request(client, req);
+
+    if (body_streamed) {
+
+        // Make the request refer to a copy of the head,
+        // so that the input buffer only holds the body.
+        if (head_copy.failed())
+            head_copy = Buffer();
+        head_copy.consume(head_copy.length());
+        head_copy.write(client->in.content(), req_bytes);
+        if (head_copy.failed())
+            return false;
+
+        req.rebase(client->in.content(), req_bytes, head_copy.content());
+        client->in.consume(req_bytes);
+        req_bytes = 0;
+        body_offset = 0;
+    }
+    return true;
+}
+
+/*
+ * Handle events until more bytes of the target's
+ * body are received. Returns false if the target
+ * was removed meanwhile.
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::wait_for_body()
+{
+    if (expect_continue) {
+        // It must come before the response
+        if (!response.started())
+            target->out.write("HTTP/1.1 100 Continue\r\n\r\n");
+        expect_continue = false;
+    }
+
+    // Bytes of a buffered response may still change,
+    // so they can't be sent yet.
+    if (response.can_flush() && target->out.length() > 0)
+        evloop.add_events(target->sock, Event::RECV | Event::SEND);
+    else {
+        evloop.remove_events(target->sock, Event::SEND);
+        evloop.add_events(target->sock, Event::RECV);
+    }
+
+    // The client must send some of the body within
+    // "request_timeout"
+    target->request_start = now;
+    waiting_body = true;
+    update_timer(target);
+    handle_events();
+    waiting_body = false;
+
+    return !target_removed;
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::reset_body()
+{
+    body_pending = false;
+    body_streamed = false;
+    body_chunked = false;
+    body_left = 0;
+    body_offset = 0;
+    expect_continue = false;
+    waiting_body = false;
+    decoder.reset();
+}
+
+/*
+ * Number of bytes of the input buffer of a client
+ * past which no more are read, so that at most
+ * "max_buffered_body" bytes of a streamed body are
+ * buffered.
+ */
+template <int N, template <int> class L>
+int Server<N, L>::input_limit(Client* client)
+{
+    if (client == target)
+        return body_streamed ? config.max_buffered_body : INT_MAX;
+
+    if (client->req && client->body_streamed)
+        return client->head_len + config.max_buffered_body;
+
+    return INT_MAX;
+}
+
+template <int N, template <int> class L>
+int Server<N, L>::read_body(char *dst, int max)
+{
+    if (target == nullptr)
+        return 0;
+
+    if (target_removed)
+        return -1;
+
+    if (!body_pending || max <= 0)
+        return 0;
+
+    if (!body_streamed) {
+        // The body is in the input buffer after the head
+        int num = (int) std::min<int64_t>(body_left, max);
+        memcpy(dst, target->in.content() + body_offset, num);
+        body_offset += num;
+        body_left -= num;
+        body_pending = body_left > 0;
+        return num;
+    }
+
+    for (;;) {
+
+        const char *src = target->in.content();
+        int len = target->in.length();
+
+        int num;
+        if (body_chunked) {
+            int used = decoder.decode(src, len, dst, max, num);
+            if (used < 0) {
+                std::clog << "Malformed chunked request body\n";
+                remove_client(target);
+                return -1;
+            }
+            target->in.consume(used);
+            body_pending = !decoder.done();
+        } else {
+            num = (int) std::min<int64_t>(body_left, std::min(len, max));
+            if (num > 0) {
+                memcpy(dst, src, num);
+                target->in.consume(num);
+            }
+            body_left -= num;
+            body_pending = body_left > 0;
+        }
+
+        if (num > 0 || !body_pending)
+            return num;
+
+        if (!wait_for_body())
+            return -1;
+    }
+}
+
+template <int N, template <int> class L>
+bool Server<N, L>::should_keep_alive(int num_clients, int max_clients, int num_served) const
+{
+    // If the server is about 70% full, don't keep connections alive
+    if (10 * num_clients > 7 * max_clients)
+        return false;
+    
+    // Only keep alive if fewer responses than the limit
+    // were served
+    if (num_served >= config.keep_alive_requests)
+        return false;
+    
+    return true;
+}
+
+/*
+ * Like "should_keep_alive" for the client's next response,
+ * also honoring the request's "Connection: close". The
+ * connections that the server doesn't keep alive itself
+ * are counted.
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::keep_alive_allowed(Client* client, const Request& req)
+{
+    if (req.connection & Request::CONNECTION_CLOSE)
+        return false;
+
+    // HTTP/1.0 connections are only kept alive on request
+    if (req.minor_version == 0 && !(req.connection & Request::CONNECTION_KEEP_ALIVE))
+        return false;
+
+    // A request with both "Transfer-Encoding" and "Content-Length"
+    // may have been framed differently by an intermediary, so
+    // what follows it can't be trusted (RFC 7230, 3.3.3).
+    if (req.transfer != Request::TRANSFER_NONE && req.has(H::ContentLength))
+        return false;
+
+    if (!should_keep_alive(pool.currently_allocated_count(), N, client->num_served)) {
+        metrics_.keep_alive_refused.add();
+        return false;
+    }
+    return true;
+}
+
+template <int N, template <int> class L>
+bool Server<N, L>::is_metrics_request(const Request& req) const
+{
+    return config.metrics_path && req.method == GET && req.url.path == config.metrics_path;
+}
+
+/*
+ * Append the response to a metrics request to "out". Returns
+ * true iff the connection is kept alive after it.
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::write_metrics(OutputChain& out, bool allow_keep_alive)
+{
+    metrics_text.clear();
+    if (registry)
+        registry->write_prometheus(metrics_text);
+    else {
+        const ServerMetrics *self = &metrics_;
+        MetricsRegistry::write_prometheus(metrics_text, &self, 1);
+    }
+
+    Response res;
+    res.begin(out, allow_keep_alive, &common);
+    res.status(200);
+    res.header("Content-Type", "text/plain; version=0.0.4");
+    res.write(metrics_text.c_str(), (int) metrics_text.size());
+    return res.finish();
+}
+
+/*
+ * Count a response that was appended to a client's output,
+ * whose request head was received at "head_time". Only the
+ * end of the interval reads the clock.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::record_response(uint64_t head_time)
+{
+    metrics_.response_time.record(monotonic_ns() - head_time);
+}
+
+/*
+ * Schedule the timer of a client given its state:
+ *
+ *   - While output is pending, the client must read some
+ *     of it within "write_timeout".
+ *
+ *   - While a request is being received, it must be fully
+ *     received within "request_timeout" of its first byte.
+ *     While the handler waits for a streamed body, some of
+ *     it must be received within that time.
+ *
+ *   - While nothing is being received or sent, the client
+ *     is idle and is dropped after "idle_timeout".
+ *
+ * No timer is scheduled while a request is being handled.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::update_timer(Client* client)
+{
+    uint64_t start = 0;
+    int timeout = 0;
+
+    if (client->out.length() > 0) {
+        if (client->write_start == 0)
+            client->write_start = now;
+        start = client->write_start;
+        timeout = config.write_timeout;
+    } else {
+        client->write_start = 0;
+        if (client == target && waiting_body) {
+            // The handler waits for the body
+            start = client->request_start;
+            timeout = config.request_timeout;
+        } else if (client == target || client->queued || client->jobs_head) {
+            // The request is being handled
+        } else if (client->request_start > 0) {
+            start = client->request_start;
+            timeout = config.request_timeout;
+        } else {
+            start = now;
+            timeout = config.idle_timeout;
+        }
+    }
+
+    if (timeout > 0 && start > 0)
+        timers.set(&client->timer, start + timeout);
+    else
+        timers.cancel(&client->timer);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::remove_client(Client* client)
+{
+    assert(pool.allocated(client));
+    evloop.remove(client->sock);
+    timers.cancel(&client->timer);
+    if (client->queued)
+        queue.remove(client);
+
+    #ifdef __linux__
+    drop_jobs(client);
+    #endif
+
+    forget_events(client);
+
+    // The client's response is being streamed. The user
+    // still holds a request that refers to its buffer, so
+    // it's only freed by the next "send".
+    if (client == target && response.active()) {
+        response.abort();
+        client->sock = Socket();
+        target_removed = true;
+        return;
+    }
+
+    free_client(client);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::free_client(Client* client)
+{
+    pool.deallocate(client);
+    assert(!pool.allocated(client));
+
+    // If accepting was paused because the pool was full,
+    // connections waiting in the backlog can be accepted
+    // now that a slot is free.
+    if (!accepting && socket_.active()) {
+        evloop.add_events(socket_, Event::RECV);
+        accepting = true;
+    }
+}
+
+/*
+ * Drop the events relative to "data" that are still
+ * to be handled in the current batch.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::forget_events(void *data)
+{
+    for (int i = batch_cursor+1; i < batch_count; i++)
+        if (batch[i].data == data)
+            batch[i].data = nullptr;
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::accept_incoming_connections()
+{
+    // Accept incoming connections until there are none left,
+    // the client pool is full or the per-event limit is reached.
+    // Since the event loop is level-triggered, connections left
+    // in the backlog because of the limit will be reported again
+    // at the next iteration.
+    int accepted = 0;
+    for (Socket sock; accepted < config.max_accepts_per_event && pool.have_free_space() && evloop.accept(socket_, sock); ) {
+
+        accepted++;
+
+        Client* client = pool.allocate();
+        assert(client);
+
+        // At first only register for receive events since
+        // there's nothing to be sent.
+        if (!evloop.add(sock, Event::RECV, client)) {
+            pool.deallocate(client);
+            continue;
+        }
+
+        // Commit socket
+        client->sock = std::move(sock);
+        metrics_.accepted.add();
+
+        client->in.use_slab(&slab);
+        client->out.use_slab(&slab);
+        client->slab = &slab;
+
+        // The first request must arrive within the
+        // request timeout.
+        client->request_start = now;
+
+        // The newly accepted client may already have some
+        // data to be read. Generate a RECV event manually.
+        handle_single_event(Event(Event::RECV, client));
+    }
+
+    // Stop listening for connections until a client is removed
+    if (!pool.have_free_space() && accepting) {
+        evloop.remove_events(socket_, Event::RECV);
+        accepting = false;
+    }
+}
+
+/*
+ * Returns false if the client was removed
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::handle_client_data_and_queue_if_candidate(Client* client)
+{
+    // Client sent data. Copy it into the buffer
+    int limit = input_limit(client);
+    bool closed = evloop.recv(client->sock, client->in, limit);
+    if (closed || client->in.failed()) {
+        remove_client(client);
+        return false;
+    }
+
+    // Stop reading a streamed body until it's read by
+    // the handler (see "read_body").
+    if (client->in.length() >= limit)
+        evloop.remove_events(client->sock, Event::RECV);
+
+    // The request that follows the target's is parsed
+    // when its response is sent.
+    if (client == target)
+        return true;
+
+    // First bytes of a new request
+    if (client->request_start == 0 && client->in.length() > 0)
+        client->request_start = now;
+
+    // If the client isn't already ready to be served,
+    // it may be now. Parse the head of the request if it
+    // was completed by these bytes, then check whether the
+    // body was fully received.
+    if (!parse_head(client))
+        return false;
+
+    // Requests with a cached response are answered right
+    // away. Pipelined ones may follow.
+    int num_served = client->num_served;
+    while (request_received(client) && !client->queued && send_internal_response(client))
+        if (!parse_head(client))
+            return false;
+
+    if (request_received(client) && !client->queued) {
+        queue.push(client);
+        client->queued = true;
+    }
+
+    // The responses from the cache are written together
+    if (client->num_served != num_served) {
+        if (config.pipeline_batch == 0)
+            evloop.add_events(client->sock, Event::SEND);
+        else if (!flush_output(client))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * If the fully received request at the start of the
+ * client's input buffer asks for the metrics or its
+ * response is in the response cache, append the response
+ * to the client's output and consume the request. Returns
+ * true iff this happened and the connection is kept alive.
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::send_internal_response(Client* client)
+{
+    if (client->body_streamed || client->close_when_flushed)
+        return false;
+
+    if (response_cache.empty() && config.metrics_path == nullptr)
+        return false;
+
+    #ifdef __linux__
+    // The responses of the jobs in flight must come first
+    if (client->jobs_head)
+        return false;
+    #endif
+
+    // The request's slices refer to the address the buffer
+    // had when the head was parsed
+    const char *base = client->in.content();
+    if (base != client->req_base) {
+        client->req->rebase(client->req_base, client->head_len, base);
+        client->req_base = base;
+    }
+
+    // Failures are handled when the output is flushed
+    bool keep_alive;
+    if (is_metrics_request(*client->req))
+        keep_alive = write_metrics(client->out, keep_alive_allowed(client, *client->req));
+    else {
+        if (!response_cache.make_key(*client->req, lookup_key))
+            return false;
+
+        const CachedResponse *cached = response_cache.find(lookup_key, now);
+        if (cached == nullptr)
+            return false;
+
+        keep_alive = keep_alive_allowed(client, *client->req);
+        Response::write_cached(client->out, *cached, keep_alive);
+    }
+    record_response(client->head_time);
+
+    client->in.consume(client->total_len);
+    client->drop_request();
+    client->num_served++;
+    client->request_start = client->in.length() > 0 ? now : 0;
+
+    if (!keep_alive) {
+        // Drop whatever follows
+        client->in.consume(client->in.length());
+        client->close_when_flushed = true;
+        evloop.remove_events(client->sock, Event::RECV);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Returns false if the client was removed
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::flush_buffered_bytes_to_client_and_close_if_done(Client* client)
+{
+    // Client is ready to receive data
+    int sent = evloop.send(client->sock, client->out);
+    if (client->out.failed()) {
+        remove_client(client);
+        return false;
+    }
+
+    if (sent > 0)
+        client->write_start = now;
+
+    if (client->out.length() == 0) {
         
-        if (client->close_when_flushed) {
+        // Nothing more to send.
+
+        // Responses of the workers may still have to be
+        // appended to the buffer. The client will be closed
+        // when the last one is flushed.
+        if (client->close_when_flushed && client->jobs_head == nullptr) {
             remove_client(client);
-            return;
+            return false;
         }
 
         // Tell the eventloop we're not interested
         // in output events for this client
         evloop.remove_events(client->sock, Event::SEND);
     }
+
+    return true;
 }
 
-template <int N>
-void Server<N>::handle_single_event(Event event)
+/*
+ * Write the client's output right away instead of waiting
+ * for the event loop to report the socket as writable,
+ * which it usually is. What doesn't fit in the socket's
+ * buffer is written when it is. Returns false if the
+ * client was removed.
+ */
+template <int N, template <int> class L>
+bool Server<N, L>::flush_output(Client* client)
+{
+    if (!flush_buffered_bytes_to_client_and_close_if_done(client))
+        return false;
+
+    if (client->out.length() > 0)
+        evloop.add_events(client->sock, Event::SEND);
+    return true;
+}
+
+/*
+ * Wait for a batch of events and handle all of them,
+ * then drop the clients whose deadline expired and
+ * update the gauges of the metrics. If "max_wait" isn't
+ * negative, it doesn't wait for more than "max_wait"
+ * milliseconds.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::handle_events(int max_wait)
+{
+    int timeout = timers.timeout(now);
+    if (max_wait >= 0 && (timeout < 0 || timeout > max_wait))
+        timeout = max_wait;
+
+    batch_count = evloop.wait_batch(batch, MAX_BATCH, timeout);
+    now_ns = monotonic_ns();
+    now = now_ns / 1000000;
+
+    for (batch_cursor = 0; batch_cursor < batch_count; batch_cursor++)
+        handle_single_event(batch[batch_cursor]);
+
+    batch_count = 0;
+    batch_cursor = 0;
+
+    timers.advance(now, [this](Timer* timer) {
+        #if defined(__linux__) && defined(HTTP_COROUTINES)
+        // Deadline of a handler's "Wait". Sleeps are over,
+        // waits for a socket timed out.
+        if (!pool.owned((Client*) timer->data)) {
+            Wait* wait = (Wait*) timer->data;
+            wait->wake(wait->sock == nullptr);
+            return;
+        }
+        #endif
+        remove_client((Client*) timer->data);
+    });
+
+    metrics_.active_clients.set(pool.currently_allocated_count());
+    metrics_.queue_depth.set(queue.size());
+    metrics_.buffer_bytes_held.set(slab.stats().bytes_held);
+    metrics_.buffer_bytes_in_use.set(slab.stats().bytes_in_use);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::handle_single_event(Event event)
 {
     if (event.data == nullptr)
         return; // Event isn't relative to a socket
     
     if (event.data == this)
         accept_incoming_connections();
+    #ifdef __linux__
+    else if (workers && event.data == workers)
+        handle_completed_jobs();
+    #endif
+    #if defined(__linux__) && defined(HTTP_COROUTINES)
+    else if (!pool.owned((Client*) event.data)) {
+        // A handler waits for this socket
+        Wait* wait = (Wait*) event.data;
+        wait->wake(event.type != Event::FAILURE);
+    }
+    #endif
     else {
         Client* client = (Client*) event.data;
         assert(pool.allocated(client));
-        switch (event.type) {
-            case Event::FAILURE: remove_client(client); break;
-            case Event::RECV: handle_client_data_and_queue_if_candidate(client); break;
-            case Event::SEND: flush_buffered_bytes_to_client_and_close_if_done(client); break;
+
+        if (event.type == Event::FAILURE) {
+            remove_client(client);
+            return;
         }
+
+        // Both flags may be set at the same time. Input
+        // is handled first since it may remove the client.
+        if (event.type & Event::RECV)
+            if (!handle_client_data_and_queue_if_candidate(client))
+                return;
+
+        // The event may have been fetched before the target's
+        // interest in SEND was removed (see "wait_for_body"),
+        // and a response that can't be flushed yet may still
+        // change, like its "Content-Length" placeholder.
+        bool can_send = client != target || response.can_flush();
+        if ((event.type & Event::SEND) && can_send)
+            if (!flush_buffered_bytes_to_client_and_close_if_done(client))
+                return;
+
+        update_timer(client);
     }
 }
 
-template <int N>
-void Server<N>::status(int code)
+template <int N, template <int> class L>
+void Server<N, L>::common_header(const char *name, const char *value)
 {
-    if (state == NOTARGET)
+    common.add(name, value);
+}
+
+/*
+ * Replace the buffered body of the target's response by
+ * a compressed version of it, if the client accepts one
+ * and it's worth it (see "ServerConfig::compression_level").
+ */
+template <int N, template <int> class L>
+void Server<N, L>::compress_response()
+{
+    if (!response.can_encode() || response.body_length() < config.compression_min_length)
         return;
-    
-    assert(target);
 
-    if (state != STATUS)
-        return; // "status" called twice
+    // Other clients may get another variant
+    response.insert_header("Vary", "Accept-Encoding");
 
-    char buf[256];
-    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", code, status_text(code));
-    assert(len > 0);
+    Encoding encoding = accepted_encoding(*target_request);
+    if (encoding == Encoding::IDENTITY)
+        return;
 
-    // No need to check for errors. We'll do it
-    // when "reply" is called.
-    target->out.write(buf, len);
-    
-    state = HEADERS;
+    int len = response.body_length();
+    compress_input.resize(len);
+    if (!response.copy_body(&compress_input[0]))
+        return;
+
+    if (SharedBlob *blob = compressor.compress(encoding, compress_input.data(), len)) {
+        response.encode_body(blob, encoding);
+        blob->unref();
+    }
 }
 
-template <int N>
-void Server<N>::header(const char *name, const char *value)
+template <int N, template <int> class L>
+void Server<N, L>::cache(int ttl_ms)
 {
-    if (state == NOTARGET)
+    if (!response.active() || target_request == nullptr)
         return;
-    
-    if (state == STATUS)
-        // Header added before a status, so first
-        // add a 200 for correctness sake
-        status(200);
-
-    if (state == CONTENT)
-        // Can't add a header after the start of
-        // the response's body.
+
+    if (response_cache.make_key(*target_request, cache_key))
+        response.cache(ttl_ms);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::cache_vary(H name)
+{
+    response_cache.vary(name);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::status(int code)
+{
+    response.status(code);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::header(const char *name, const char *value)
+{
+    response.header(name, value);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::content_length(int64_t len)
+{
+    response.content_length(len);
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::write(const char *str, int len)
+{
+    response.write(str, len);
+    apply_backpressure();
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::write_ref(const char *ptr, int len, ReleaseFunc release, void *arg)
+{
+    response.write_ref(ptr, len, release, arg);
+    apply_backpressure();
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::write_shared(SharedBlob *blob)
+{
+    response.write_shared(blob);
+    apply_backpressure();
+}
+
+/*
+ * If the output of the target grew past the response
+ * window, stream the response and handle events until
+ * the output was fully sent.
+ *
+ * Waiting for all of it, instead of just enough to go
+ * below the window, lets the output chain start over
+ * from the beginning of its memory (see "OutputChain::
+ * advance"), so it never grows past the window plus
+ * the size of one write.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::apply_backpressure()
+{
+    if (config.response_window <= 0 || !response.active())
         return;
 
-    assert(state == HEADERS);
-    
-    // Make sure that the caller isn't writing
-    // a header that must be added automatically
-    // by this class.
-    // TODO: Make the check case-insensitive.
-    if (!strcmp(name, "Content-Length"))
+    if (target->out.length() <= config.response_window || target->out.failed())
         return;
 
-    if (!strcmp(name, "Connection")) {
-        if (!strcmp(value, "Close"))
-            keep_alive = 0;
-        else
-            keep_alive = 1;
+    if (!response.stream())
         return;
+
+    if (!streaming) {
+        evloop.remove_events(target->sock, Event::RECV);
+        streaming = true;
+    }
+
+    while (response.active() && target->out.length() > 0) {
+        evloop.add_events(target->sock, Event::SEND);
+        update_timer(target);
+        handle_events();
     }
-    
-    target->out.write(name);
-    target->out.write(": ");
-    target->out.write(value);
-    target->out.write("\r\n");
 }
 
-template <int N>
-void Server<N>::write(const char *str, int len)
+#ifndef _WIN32
+template <int N, template <int> class L>
+bool Server<N, L>::serve_file(const Request& req, const char *path)
 {
-    if (len < 0) len = strlen(str);
+    if (!response.active())
+        return false;
 
-    if (state == NOTARGET)
-        return;
-    
-    assert(target);
-    
-    if (state == STATUS)
-        status(200);
-
-    // If this is the first time we append to the
-    // body of the response, append special headers
-    if (state == HEADERS) {
-
-        // This is the start of the response body, so
-        // add any special header and the empty line
-        // separator.
-
-        if (keep_alive == -1) keep_alive = 1;
-
-        // If the user wants to keep the connection alive
-        // (or didn't specify it) then check first if it's
-        // reasonable given the server's state.
-        int num_clients = pool.currently_allocated_count();
-        int max_clients = N;
-        int num_served  = target->num_served;
-        if (!should_keep_alive(num_clients, max_clients, num_served))
-            keep_alive = false;
-
-        switch (keep_alive) {
-            case  0: target->out.write("Connection: Close\r\n"); break;
-            case  1: target->out.write("Connection: Keep-Alive\r\n"); break;
-        }
+    OpenFile *file = files.open(path);
+    if (file == nullptr)
+        return false;
+
+    int64_t size  = file->size();
+    int64_t first = 0;
+    int64_t last  = size - 1;
 
-        // Append the Content-Length header with an empty value.
-        // When the response content is known we'll fill the value in.
-        target->out.write("Content-Length: ");
-        offset_content_length = target->out.length();
-        target->out.write("         \r\n"); // This is exactly 9 spaces before the \r\n
+    ByteRange range = ByteRange::NONE;
+    Slice value;
+    if (req.get(H::Range, value))
+        range = parse_byte_range(value, size, first, last);
 
-        // Write an empty line
-        target->out.write("\r\n");
+    // Segments of the output chain are at most this long
+    if (range != ByteRange::UNSATISFIABLE && last - first + 1 > INT_MAX) {
+        file->unref();
+        return false;
+    }
 
-        offset_content = target->out.length();
-        state = CONTENT;
+    char buf[128];
+    switch (range) {
+
+        case ByteRange::UNSATISFIABLE:
+        response.status(416);
+        snprintf(buf, sizeof(buf), "bytes */%lld", (long long) size);
+        response.header("Content-Range", buf);
+        break;
+
+        case ByteRange::SATISFIABLE:
+        response.status(206);
+        snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld", (long long) first, (long long) last, (long long) size);
+        response.header("Content-Range", buf);
+        response.header("Content-Type", mime_type(path));
+        response.write_file(file, first, last - first + 1);
+        break;
+
+        case ByteRange::NONE:
+        response.status(200);
+        response.header("Accept-Ranges", "bytes");
+        response.header("Content-Type", mime_type(path));
+        response.write_file(file, 0, size);
+        break;
     }
 
-    target->out.write(str, len);
+    file->unref();
+    return true;
 }
 
-template <int N>
-void Server<N>::send()
+template <int N, template <int> class L>
+bool Server<N, L>::serve_directory(const Request& req, const char *root)
 {
-    if (state == NOTARGET)
+    char path[1024];
+    if (!resolve_path(root, req.url.path, path, sizeof(path)))
+        return false;
+    return serve_file(req, path);
+}
+#endif
+
+template <int N, template <int> class L>
+void Server<N, L>::send()
+{
+    if (target_removed) {
+        // The client was dropped while the response was streamed
+        free_client(target);
+        target = nullptr;
+        target_removed = false;
+        streaming = false;
+        req_bytes = -1;
+        reset_body();
+        return;
+    }
+
+    if (!response.active())
         return;
 
     assert(target);
 
-    // Make sure the previous response parts are written
-    write("");
+    if (config.compression_level > 0)
+        compress_response();
+
+    // The rest of the body would have to be received and
+    // dropped before the next request
+    if (body_pending && body_streamed)
+        response.close_connection();
+
+    // Complete the response, filling in the
+    // Content-Length header.
+    bool keep_alive = response.finish();
+
+    CachedResponse cached;
+    if (response.take_cached(cached))
+        response_cache.insert(cache_key, cached, now);
 
     if (target->out.failed()) {
 
@@ -588,117 +2146,462 @@ void Server<N>::send()
 
     } else {
 
-        // Update the Content-Length header's vale now
-        // that we know the content's length.
-        int content_length = target->out.length() - offset_content;
-        
-        char buf[32];
-        int len = snprintf(buf, sizeof(buf), "%d", content_length);
-        assert(len < 10);
-
-        target->out.overwrite(offset_content_length, buf, len);
-
-        // Tell the eventloop that we're interested in output 
-        // events for this client.
-        evloop.add_events(target->sock, Event::SEND);
+        // Without batches, the eventloop writes the output
+        // when the socket is ready.
+        if (config.pipeline_batch == 0)
+            evloop.add_events(target->sock, Event::SEND);
 
         // If the connection isn't marked as reusable, mark it
         // to be closed when the output buffer is flushed and
         // stop listening for input data.
-        // NOTE: "keep_alive" can't be -1 at this point because
-        //       it was set to either 0 or 1 when writing the
-        //       "Connection" header.
-        if (keep_alive == 0) {
+        if (!keep_alive) {
             target->close_when_flushed = true;
             evloop.remove_events(target->sock, Event::RECV);
-        }
+        } else if (streaming || body_streamed)
+            evloop.add_events(target->sock, Event::RECV);
 
         // Now that the request was served, we can remove it
         // from the input buffer.
         target->in.consume(req_bytes);
 
+        // Bytes of the next request may have been received
+        target->request_start = target->in.length() > 0 ? now : 0;
+
+        target->num_served++;
+        record_response(target->head_time);
+
+        Client* served = target;
+        target = nullptr;
+
         // If the connection is keep-alive, pipelining is allowed
         // so check if an other request is pending and if it is,
-        // put the client back into the queue.
-        if (keep_alive && target->in.contains("\r\n\r\n")) {
+        // put the client back into the queue. If its head is
+        // invalid the client is removed. Requests with a cached
+        // response are answered first.
+        bool alive = !keep_alive || parse_head(served);
+        while (alive && keep_alive && request_received(served) && send_internal_response(served))
+            alive = parse_head(served);
+
+        if (alive) {
+
             // We know that the client isn't already in the queue
-            // because we just popped and served it.
-            queue.push(target);
-            target->queued = true;
+            // because we just popped and served it. Its next request
+            // is served right away, unless its batch is over.
+            bool next = keep_alive && request_received(served);
+            if (next && served->batch + 1 < config.pipeline_batch) {
+                served->batch++;
+                queue.push_front(served);
+                served->queued = true;
+                update_timer(served);
+            } else {
+                if (next) {
+                    queue.push(served);
+                    served->queued = true;
+                }
+                served->batch = 0;
+                if (config.pipeline_batch == 0 || flush_output(served))
+                    update_timer(served);
+            }
         }
-
-        target->num_served++;
     }
 
-    state = NOTARGET;
     target = nullptr;
-    keep_alive = -1;
+    streaming = false;
     req_bytes = -1;
+    reset_body();
 }
 
-template <int N>
-const char* Server<N>::status_text(int code)
-{
-    switch(code) {
-
-        case 100: return "Continue";
-        case 101: return "Switching Protocols";
-        case 102: return "Processing";
-
-        case 200: return "OK";
-        case 201: return "Created";
-        case 202: return "Accepted";
-        case 203: return "Non-Authoritative Information";
-        case 204: return "No Content";
-        case 205: return "Reset Content";
-        case 206: return "Partial Content";
-        case 207: return "Multi-Status";
-        case 208: return "Already Reported";
-
-        case 300: return "Multiple Choices";
-        case 301: return "Moved Permanently";
-        case 302: return "Found";
-        case 303: return "See Other";
-        case 304: return "Not Modified";
-        case 305: return "Use Proxy";
-        case 306: return "Switch Proxy";
-        case 307: return "Temporary Redirect";
-        case 308: return "Permanent Redirect";
-
-        case 400: return "Bad Request";
-        case 401: return "Unauthorized";
-        case 402: return "Payment Required";
-        case 403: return "Forbidden";
-        case 404: return "Not Found";
-        case 405: return "Method Not Allowed";
-        case 406: return "Not Acceptable";
-        case 407: return "Proxy Authentication Required";
-        case 408: return "Request Timeout";
-        case 409: return "Conflict";
-        case 410: return "Gone";
-        case 411: return "Length Required";
-        case 412: return "Precondition Failed";
-        case 413: return "Request Entity Too Large";
-        case 414: return "Request-URI Too Long";
-        case 415: return "Unsupported Media Type";
-        case 416: return "Requested Range Not Satisfiable";
-        case 417: return "Expectation Failed";
-        case 418: return "I'm a teapot";
-        case 420: return "Enhance your calm";
-        case 422: return "Unprocessable Entity";
-        case 426: return "Upgrade Required";
-        case 429: return "Too many requests";
-        case 431: return "Request Header Fields Too Large";
-        case 449: return "Retry With";
-        case 451: return "Unavailable For Legal Reasons";
-
-        case 500: return "Internal Server Error";
-        case 501: return "Not Implemented";
-        case 502: return "Bad Gateway";
-        case 503: return "Service Unavailable";
-        case 504: return "Gateway Timeout";
-        case 505: return "HTTP Version Not Supported";
-        case 509: return "Bandwidth Limit Exceeded";
-    }
-    return "???";
+#ifdef __linux__
+
+template <int N, template <int> class L>
+template <typename Handler>
+bool Server<N, L>::serve(int num_workers, Handler handler)
+{
+    if (!start_workers(num_workers, handler))
+        return false;
+
+    for (;;)
+        serve_step(-1);
+
+    return true;
 }
+
+template <int N, template <int> class L>
+template <typename Handler>
+bool Server<N, L>::start_workers(int num_workers, Handler handler)
+{
+    if (!socket_.active() || workers)
+        return false;
+
+    workers = new (std::nothrow) WorkerPool<MAX_JOBS>();
+    if (workers == nullptr)
+        return false;
+
+    if (!workers->start(num_workers, handler, &common)
+     || !evloop.add(workers->completion_socket(), Event::RECV, workers)) {
+        std::clog << "Couldn't start the worker threads\n";
+        delete workers;
+        workers = nullptr;
+        return false;
+    }
+    return true;
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::serve_step(int timeout_ms)
+{
+    #ifdef HTTP_COROUTINES
+    assert(workers || async_handler);
+    #else
+    assert(workers);
+    #endif
+    handle_events(timeout_ms);
+    dispatch_candidates();
+    #ifdef HTTP_COROUTINES
+    finish_calls();
+    #endif
+}
+
+/*
+ * Hand all complete requests of the candidates to
+ * the worker threads.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::dispatch_candidates()
+{
+    while (!queue.empty()) {
+
+        Client* candidate;
+        queue.pop(candidate);
+        candidate->queued = false;
+        assert(pool.allocated(candidate));
+
+        // Dispatch all pipelined requests of this client
+        // that were fully received.
+        for (;;) {
+
+            // If the previous request can't be followed by others,
+            // drop any bytes that came after it.
+            Job* last = candidate->jobs_tail;
+            if (candidate->close_when_flushed || (last && !last->allow_keep_alive))
+                break;
+
+            Job* job = allocate_job();
+            if (job == nullptr) {
+                // All jobs are in flight. Put the client back in
+                // the queue, we'll try again when some complete.
+                queue.push(candidate);
+                candidate->queued = true;
+                return;
+            }
+
+            int total_len = take_request(candidate, job->req);
+
+            // The request refers to the client's input buffer, which
+            // will be reused for the following requests, so make the
+            // job hold a copy.
+            const char *base = candidate->in.content();
+            job->in.write(base, total_len);
+            if (job->in.failed()) {
+                release_job(job);
+                remove_client(candidate);
+                break;
+            }
+            job->req.rebase(base, total_len, job->in.content());
+            candidate->in.consume(total_len);
+            candidate->request_start = candidate->in.length() > 0 ? now : 0;
+
+            job->allow_keep_alive = keep_alive_allowed(candidate, job->req);
+            job->head_time = candidate->head_time;
+            candidate->num_served++;
+
+            job->client = candidate;
+            if (candidate->jobs_tail)
+                candidate->jobs_tail->next = job;
+            else
+                candidate->jobs_head = job;
+            candidate->jobs_tail = job;
+
+            // Metrics requests that follow requests in flight
+            // are answered here, their response waits in the
+            // job for its turn.
+            if (is_metrics_request(job->req)) {
+                job->keep_alive = write_metrics(job->out, job->allow_keep_alive);
+                job->done = true;
+            } else
+                submit_job(job);
+
+            // The connection will be closed after this response,
+            // so there's no point in reading more.
+            if (!job->allow_keep_alive) {
+                evloop.remove_events(candidate->sock, Event::RECV);
+                break;
+            }
+
+            if (!parse_head(candidate) || !request_received(candidate))
+                break;
+        }
+
+        // Unless it was removed
+        if (pool.allocated(candidate)) {
+            if (candidate->jobs_head && candidate->jobs_head->done)
+                append_completed_responses(candidate);
+            else
+                update_timer(candidate);
+        }
+    }
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::handle_completed_jobs()
+{
+    workers->clear_completion_signal();
+
+    while (Job* job = workers->pop_completed()) {
+
+        job->done = true;
+
+        Client* client = job->client;
+        if (client == nullptr) {
+            // The client was removed while the
+            // request was being handled.
+            workers->release(job);
+            continue;
+        }
+
+        append_completed_responses(client);
+    }
+}
+
+/*
+ * Move the responses of completed jobs to the output
+ * buffer of the client, stopping at the first one that
+ * is still in flight to preserve the requests' order.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::append_completed_responses(Client* client)
+{
+    bool appended = false;
+    bool keep_alive = true;
+
+    while (client->jobs_head && client->jobs_head->done) {
+
+        Job* job = client->jobs_head;
+        client->jobs_head = job->next;
+        if (client->jobs_head == nullptr)
+            client->jobs_tail = nullptr;
+
+        bool failed = job->out.failed();
+        if (!failed) {
+            client->out.append(job->out);
+            record_response(job->head_time);
+        }
+
+        if (job->cached.blob && response_cache.make_key(job->req, lookup_key))
+            response_cache.insert(lookup_key, job->cached, now);
+
+        keep_alive = job->keep_alive;
+        release_job(job);
+
+        if (failed) {
+            remove_client(client);
+            return;
+        }
+
+        appended = true;
+
+        if (!keep_alive)
+            break;
+    }
+
+    if (client->out.failed()) {
+        remove_client(client);
+        return;
+    }
+
+    if (!keep_alive) {
+        // Responses to the requests that followed
+        // this one are dropped.
+        drop_jobs(client);
+        client->close_when_flushed = true;
+        client->rejected = false;
+        evloop.remove_events(client->sock, Event::RECV);
+    }
+
+    // The request after the last job was invalid
+    if (client->rejected && client->jobs_head == nullptr) {
+        client->out.write(BAD_REQUEST);
+        client->rejected = false;
+        appended = true;
+    }
+
+    if (appended) {
+        if (config.pipeline_batch == 0)
+            evloop.add_events(client->sock, Event::SEND);
+        else if (!flush_output(client))
+            return;
+    }
+
+    update_timer(client);
+}
+
+/*
+ * Detach the client from its jobs. The ones that are
+ * still in flight will be released when they complete.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::drop_jobs(Client* client)
+{
+    Job* job = client->jobs_head;
+    while (job) {
+        Job* next = job->next;
+        if (job->done)
+            release_job(job);
+        #ifdef HTTP_COROUTINES
+        else if (workers == nullptr && !((Call*) job)->task.done()) {
+            // The handler is suspended, destroying its
+            // frames cancels what it waits for.
+            release_job(job);
+        }
+        #endif
+        else
+            job->client = nullptr;
+        job = next;
+    }
+    client->jobs_head = nullptr;
+    client->jobs_tail = nullptr;
+}
+
+template <int N, template <int> class L>
+Job* Server<N, L>::allocate_job()
+{
+    #ifdef HTTP_COROUTINES
+    if (workers == nullptr) {
+        char *mem = slab.allocate(BufferSlab::block_size(sizeof(Call)));
+        if (mem == nullptr)
+            return nullptr;
+        Call* call = new (mem) Call();
+        call->server = this;
+        num_calls++;
+        return call;
+    }
+    #endif
+    return workers->allocate();
+}
+
+template <int N, template <int> class L>
+void Server<N, L>::release_job(Job* job)
+{
+    #ifdef HTTP_COROUTINES
+    if (workers == nullptr) {
+        Call* call = (Call*) job;
+        call->~Call();
+        slab.release((char*) call, BufferSlab::block_size(sizeof(Call)));
+        num_calls--;
+        return;
+    }
+    #endif
+    workers->release(job);
+}
+
+/*
+ * Start handling the request of a job that was
+ * allocated by "allocate_job".
+ */
+template <int N, template <int> class L>
+void Server<N, L>::submit_job(Job* job)
+{
+    #ifdef HTTP_COROUTINES
+    if (workers == nullptr) {
+        Call* call = (Call*) job;
+        call->response.begin(call->out, call->allow_keep_alive, &common);
+        call->task = async_handler(call->req, call->response);
+        if (call->task.valid())
+            call->task.start(call_done, call);
+        else {
+            // The frame couldn't be allocated
+            call->response.status(503);
+            call_done(call);
+        }
+        return;
+    }
+    #endif
+    workers->submit(job);
+}
+
+#ifdef HTTP_COROUTINES
+
+template <int N, template <int> class L>
+template <typename Handler>
+bool Server<N, L>::serve_async(Handler handler)
+{
+    if (!start_async(handler))
+        return false;
+
+    for (;;)
+        serve_step(-1);
+
+    return true;
+}
+
+template <int N, template <int> class L>
+template <typename Handler>
+bool Server<N, L>::start_async(Handler handler)
+{
+    if (!socket_.active() || workers || async_handler)
+        return false;
+
+    async_handler = handler;
+
+    // Frames are allocated from the server's slab, even
+    // those of the tasks awaited by the handlers.
+    frame_slab = &frames;
+    return true;
+}
+
+/*
+ * Called when the handler of a call completes. The call
+ * may be resumed from within the handling of an event or
+ * from another handler, so it's only queued here.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::call_done(void *arg)
+{
+    Call* call = (Call*) arg;
+    call->server->finished_calls.push_back(call);
+}
+
+/*
+ * Move the responses of the handlers that completed
+ * to the output buffers of their clients.
+ */
+template <int N, template <int> class L>
+void Server<N, L>::finish_calls()
+{
+    // A call is only released once it's marked as done,
+    // so the ones in the list stay valid while it's read.
+    for (size_t i = 0; i < finished_calls.size(); i++) {
+
+        Call* call = finished_calls[i];
+        call->done = true;
+        call->keep_alive = call->response.finish();
+        call->response.take_cached(call->cached);
+
+        Client* client = call->client;
+        if (client == nullptr) {
+            // The client was removed while the
+            // handler was running.
+            release_job(call);
+            continue;
+        }
+
+        append_completed_responses(client);
+    }
+    finished_calls.clear();
+}
+
+#endif /* HTTP_COROUTINES */
+
+#endif /* __linux__ */
+
+#endif /* SERVER_HPP */
@@ -0,0 +1,181 @@
+#ifndef SHARDED_HPP
+#define SHARDED_HPP
+
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "server.hpp"
+
+/*
+ * Runs a number of independent "Server" instances, each on
+ * its own thread pinned to a core. Every shard listens on the
+ * same address through its own SO_REUSEPORT socket, so the
+ * kernel spreads incoming connections between them and no
+ * state is shared between threads.
+ *
+ * Usage:
+ *
+ *     ShardedServer<1024> server;
+ *     server.run(8080, nullptr, 4, [](Server<1024>& shard, Request& req) {
+ *         shard.status(200);
+ *         shard.write("Hello, world!");
+ *         shard.send();
+ *     });
+ *
+ * The handler is called on every shard's thread, so it must
+ * be safe to call concurrently. Requests for
+ * "ServerConfig::metrics_path" get the sum of the metrics
+ * of all shards.
+ */
+template <int MAX_CLIENTS, template <int> class Loop = EventLoop>
+class ShardedServer {
+
+public:
+
+    typedef Server<MAX_CLIENTS, Loop> Shard;
+
+    // Every shard is created with the given configuration
+    ShardedServer(const ServerConfig& config_ = ServerConfig())
+    {
+        config = config_;
+    }
+
+    ~ShardedServer()
+    {
+        for (Shard *shard : shards)
+            delete shard;
+    }
+
+    ShardedServer(ShardedServer&) = delete;
+    ShardedServer& operator=(ShardedServer&) = delete;
+
+    /*
+     * Start "num_shards" servers listening on "addr" and
+     * "port" (see "Server::listen") and serve requests with
+     * "handler" until the process is terminated. If
+     * "num_shards" isn't positive, one shard per core the
+     * process may run on is started.
+     *
+     * The handler is called as "handler(shard, request)" and
+     * must respond using the shard's "status", "header",
+     * "write" and "send" methods.
+     *
+     * Returns false if the shards couldn't be started.
+     */
+    template <typename Handler>
+    bool run(int port, const char *addr, int num_shards, Handler handler);
+
+    int shard_count() const
+    {
+        return (int) shards.size();
+    }
+
+    /*
+     * Metrics of the shards, which can be written out with
+     * "MetricsRegistry::write_prometheus"
+     */
+    const MetricsRegistry& metrics() const
+    {
+        return registry;
+    }
+
+private:
+
+    ServerConfig config;
+
+    std::vector<Shard*> shards;
+
+    MetricsRegistry registry;
+
+    // Cores the process is allowed to run on, which may be
+    // fewer than the machine has (because of "taskset" or a
+    // container's cpuset) and not numbered from 0.
+    static std::vector<int> allowed_cores()
+    {
+        std::vector<int> cores;
+        #ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            for (int i = 0; i < CPU_SETSIZE; i++)
+                if (CPU_ISSET(i, &set))
+                    cores.push_back(i);
+        #endif
+        if (cores.empty()) {
+            int n = (int) std::thread::hardware_concurrency();
+            if (n <= 0)
+                n = 1;
+            for (int i = 0; i < n; i++)
+                cores.push_back(i);
+        }
+        return cores;
+    }
+
+    static void pin_to_core(int core)
+    {
+        #ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            std::clog << "Couldn't pin shard to core " << core << "\n";
+        #else
+        (void) core;
+        #endif
+    }
+
+    template <typename Handler>
+    static void serve(Shard *shard, int core, Handler handler)
+    {
+        pin_to_core(core);
+        for (;;) {
+            Request req;
+            shard->wait(req);
+            handler(*shard, req);
+        }
+    }
+};
+
+template <int N, template <int> class L>
+template <typename Handler>
+bool ShardedServer<N, L>::run(int port, const char *addr, int num_shards, Handler handler)
+{
+    if (!shards.empty())
+        return false; // Already running
+
+    std::vector<int> cores = allowed_cores();
+    if (num_shards <= 0)
+        num_shards = (int) cores.size();
+
+    // Create all listening sockets before starting any
+    // thread so that failures are reported to the caller.
+    for (int i = 0; i < num_shards; i++) {
+        Shard *shard = new (std::nothrow) Shard(config);
+        if (shard == nullptr || !shard->listen(port, addr, true)) {
+            delete shard;
+            for (Shard *started : shards)
+                delete started;
+            shards.clear();
+            registry.clear();
+            return false;
+        }
+        shards.push_back(shard);
+        registry.add(&shard->metrics());
+        shard->report_metrics_to(&registry);
+    }
+
+    // Shards are assigned to the allowed cores round-robin
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_shards; i++)
+        threads.emplace_back(serve<Handler>, shards[i], cores[i % cores.size()], handler);
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    return true;
+}
+
+#endif /* SHARDED_HPP */
@@ -0,0 +1,160 @@
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+#include <new>
+#include <cstdint>
+#include <cassert>
+
+/*
+ * Statistics of a "BufferSlab"
+ */
+struct SlabStats {
+    uint64_t hits;   // Allocations served from a free list
+    uint64_t misses; // Allocations that went to the system allocator
+    int64_t  bytes_held;   // Bytes in the free lists
+    int64_t  bytes_in_use; // Bytes handed out and not yet released
+
+    double hit_rate() const
+    {
+        uint64_t total = hits + misses;
+        return total ? (double) hits / total : 0;
+    }
+};
+
+/*
+ * Allocator of buffer memory with power-of-two size classes.
+ * Released blocks are kept in a free list per class and
+ * handed out again, so clients that come and go don't hit
+ * the system allocator for every buffer.
+ *
+ * At most "max_held" bytes are kept in the free lists. The
+ * blocks released past that limit, and those larger than
+ * the largest class, are freed right away.
+ *
+ * The slab isn't thread-safe.
+ */
+class BufferSlab {
+
+public:
+
+    static const int MIN_BLOCK = 256;
+    static const int NUM_CLASSES = 13; // Up to 1 MiB
+
+    BufferSlab(int64_t max_held_ = 16 * 1024 * 1024)
+    {
+        max_held = max_held_;
+        for (int i = 0; i < NUM_CLASSES; i++)
+            free_lists[i] = nullptr;
+        stats_.hits = 0;
+        stats_.misses = 0;
+        stats_.bytes_held = 0;
+        stats_.bytes_in_use = 0;
+    }
+
+    ~BufferSlab()
+    {
+        for (int i = 0; i < NUM_CLASSES; i++)
+            while (FreeBlock *block = free_lists[i]) {
+                free_lists[i] = block->next;
+                delete[] (char*) block;
+            }
+    }
+
+    BufferSlab(BufferSlab&) = delete;
+    BufferSlab& operator=(BufferSlab&) = delete;
+
+    /*
+     * Round "min" up to the size of the block that would
+     * be allocated for it.
+     */
+    static int block_size(int min)
+    {
+        int size = MIN_BLOCK;
+        while (size < min) {
+            if (size > INT32_MAX / 2)
+                return -1;
+            size *= 2;
+        }
+        return size;
+    }
+
+    /*
+     * Allocate a block of exactly "size" bytes, which must
+     * be a value returned by "block_size". Returns null if
+     * the allocation failed.
+     */
+    char *allocate(int size)
+    {
+        assert(size == block_size(size));
+
+        int index = class_index(size);
+        if (index >= 0 && free_lists[index]) {
+            FreeBlock *block = free_lists[index];
+            free_lists[index] = block->next;
+            stats_.hits++;
+            stats_.bytes_held -= size;
+            stats_.bytes_in_use += size;
+            return (char*) block;
+        }
+
+        char *mem = new (std::nothrow) char[size];
+        if (mem) {
+            stats_.misses++;
+            stats_.bytes_in_use += size;
+        }
+        return mem;
+    }
+
+    /*
+     * Release a block returned by "allocate". "size" must
+     * be the one it was allocated with.
+     */
+    void release(char *mem, int size)
+    {
+        if (mem == nullptr)
+            return;
+
+        stats_.bytes_in_use -= size;
+
+        int index = class_index(size);
+        if (index < 0 || stats_.bytes_held + size > max_held) {
+            delete[] mem;
+            return;
+        }
+
+        FreeBlock *block = (FreeBlock*) mem;
+        block->next = free_lists[index];
+        free_lists[index] = block;
+        stats_.bytes_held += size;
+    }
+
+    const SlabStats& stats() const
+    {
+        return stats_;
+    }
+
+private:
+
+    // Released blocks are linked through their first bytes
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    FreeBlock *free_lists[NUM_CLASSES];
+
+    int64_t max_held;
+
+    SlabStats stats_;
+
+    // Index of the class of blocks of "size" bytes, or -1
+    // if they're too big to be cached.
+    static int class_index(int size)
+    {
+        int index = 0;
+        while ((MIN_BLOCK << index) < size)
+            index++;
+        return index < NUM_CLASSES ? index : -1;
+    }
+};
+
+#endif /* SLAB_HPP */
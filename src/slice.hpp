@@ -3,18 +3,19 @@
 
 #include <cstdint>
 #include <cstring>
+#include <cassert>
 #include <ostream>
 
 struct Slice {
 
-	const char *str;
-	intptr_t    off;
-	intptr_t    len;
+	// Members are initialized in place rather than by calling
+	// "whipe" so that arrays of slices, like the headers of a
+	// request, are cleared with wide stores.
+	const char *str = nullptr;
+	intptr_t    off = 0;
+	intptr_t    len = 0;
 
-	Slice()
-	{
-		whipe();
-	}
+	Slice() = default;
 
     Slice(const char *str2, int len2)
     {
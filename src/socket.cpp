@@ -4,10 +4,13 @@
 
 std::ostream& operator<<(std::ostream& os, Event::Type const& type)
 {
-    switch (type) {
-        case Event::FAILURE: os << "FAILURE"; break;
-        case Event::RECV:    os << "RECV";    break;
-        case Event::SEND:    os << "SEND";    break;
+    // Events returned by "wait_batch" may have more than one flag set
+    if (type == Event::FAILURE)
+        os << "FAILURE";
+    else {
+        if (type & Event::RECV) os << "RECV";
+        if (type == (Event::RECV | Event::SEND)) os << "|";
+        if (type & Event::SEND) os << "SEND";
     }
     os << " (" << (int) type << ")";
     return os;
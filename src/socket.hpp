@@ -1,7 +1,11 @@
 #ifndef SOCKET_HPP
 #define SOCKET_HPP
 
+#include <cstdint>
+#include <cstring>
+#include <cassert>
 #include <ostream>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -19,6 +23,11 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define POLL poll
@@ -28,6 +37,38 @@
 #define EINVAL_2      EINVAL
 #endif
 
+/*
+ * Number of system calls issued by sockets and event loops
+ * on the calling thread. It's only used for statistics, so
+ * that the I/O cost of a request can be measured.
+ */
+inline thread_local uint64_t syscall_count = 0;
+
+/*
+ * Memory region used for scatter-gather writes
+ * (see "Socket::writev"). Use "make_iovec" to fill
+ * it in since the fields differ between platforms.
+ */
+#ifdef _WIN32
+typedef WSABUF IoVec;
+inline IoVec make_iovec(const char *ptr, int len)
+{
+    IoVec vec;
+    vec.buf = (CHAR*) ptr;
+    vec.len = len;
+    return vec;
+}
+#else
+typedef struct iovec IoVec;
+inline IoVec make_iovec(const char *ptr, int len)
+{
+    IoVec vec;
+    vec.iov_base = (void*) ptr;
+    vec.iov_len  = len;
+    return vec;
+}
+#endif
+
 struct SocketSubsystem {
     SocketSubsystem()
     {
@@ -65,6 +106,7 @@ private:
         unsigned long not_value = !value;
         return ioctlsocket(fd, FIONBIO, &not_value) != SOCKET_ERROR;
         #else
+        syscall_count += 2;
         int flags = fcntl(fd, F_GETFL);
         if (flags == -1)
             return false;
@@ -126,15 +168,25 @@ public:
     {
         if (!active()) return false;
 
-        int accepted = ::accept(fd_, nullptr, nullptr);
+        #ifdef __linux__
+        // Get a non-blocking socket with a single syscall
+        syscall_count++;
+        int accepted = ::accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (accepted < 0)
             return false;
+        #else
+        syscall_count++;
+        SOCKET accepted = ::accept(fd_, nullptr, nullptr);
+        if (accepted == INVALID_SOCKET)
+            return false;
 
         if (!set_blocking(accepted, false)) {
             CLOSESOCKET(accepted);
             return false;
         }
-        
+        #endif
+
+
         dst = accepted;
         return true;
     }
@@ -143,6 +195,7 @@ public:
     {
         if (!active()) return -1;
 
+        syscall_count++;
         int res = recv(fd_, dst, max, 0);
         if (res < 0) {
             int code = get_last_error();
@@ -158,6 +211,7 @@ public:
     int write(char *src, int num)
     {
         if (!active()) return -1;
+        syscall_count++;
         int res = send(fd_, src, num, 0);
         if (res < 0) {
             int code = get_last_error();
@@ -169,8 +223,88 @@ public:
         assert(res >= 0);
         return res;
     }
+
+    // Write the "count" regions of "vecs" in order with a
+    // single system call. Like "write", it returns the
+    // number of bytes sent, which may be less than the
+    // total, or one of the error codes.
+    int writev(const IoVec *vecs, int count)
+    {
+        if (!active()) return -1;
+        syscall_count++;
+        #ifdef _WIN32
+        DWORD sent;
+        if (WSASend(fd_, (LPWSABUF) vecs, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            int code = get_last_error();
+            if (code == EWOULDBLOCK_2)
+                return WOULD_BLOCK;
+            return OTHER_ERROR;
+        }
+        int res = sent;
+        #else
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = (struct iovec*) vecs;
+        msg.msg_iovlen = count;
+        int res = sendmsg(fd_, &msg, 0);
+        if (res < 0) {
+            int code = get_last_error();
+            if (code == EWOULDBLOCK_2 || code == EAGAIN_2)
+                return WOULD_BLOCK;
+            else
+                return OTHER_ERROR;
+        }
+        #endif
+        assert(res >= 0);
+        return res;
+    }
     
-    bool start_server(int port, const char *addr)
+    #ifndef _WIN32
+    // Send "num" bytes of the file "file_fd" starting at
+    // "offset". On Linux the bytes go straight from the page
+    // cache to the socket. Elsewhere they're read in chunks.
+    // Returns like "write".
+    int send_file(int file_fd, int64_t offset, int num)
+    {
+        if (!active()) return -1;
+
+        #ifdef __linux__
+        off_t off = offset;
+        syscall_count++;
+        int res = sendfile(fd_, file_fd, &off, num);
+        #else
+        char buf[1 << 16];
+        syscall_count++;
+        int res = pread(file_fd, buf, std::min(num, (int) sizeof(buf)), offset);
+        if (res <= 0)
+            return OTHER_ERROR; // Truncated file or read error
+        syscall_count++;
+        res = send(fd_, buf, res, 0);
+        #endif
+
+        if (res < 0) {
+            int code = get_last_error();
+            if (code == EWOULDBLOCK_2 || code == EAGAIN_2)
+                return WOULD_BLOCK;
+            else
+                return OTHER_ERROR;
+        }
+        return res;
+    }
+    #endif
+
+    // If "reuse_port" is true, other sockets may bind to
+    // the same address and port (using the same option) and
+    // the kernel will distribute incoming connections between
+    // them.
+    //
+    // "backlog" is the maximum number of connections waiting
+    // to be accepted. If "defer_accept" is positive, the kernel
+    // will only report a connection once the client sent some
+    // data or "defer_accept" seconds have passed (only supported
+    // on Linux, ignored elsewhere).
+    bool start_server(int port, const char *addr, bool reuse_port=false,
+                      int backlog=512, int defer_accept=0)
     {
         if (active()) return false;
 
@@ -209,6 +343,20 @@ public:
         int v = 1;
         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*) &v, sizeof(int));
 
+        if (reuse_port) {
+            #ifdef SO_REUSEPORT
+            if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*) &v, sizeof(int))) {
+                std::clog << "Couldn't set SO_REUSEPORT\n";
+                CLOSESOCKET(fd);
+                return false;
+            }
+            #else
+            std::clog << "SO_REUSEPORT isn't supported on this platform\n";
+            CLOSESOCKET(fd);
+            return false;
+            #endif
+        }
+
         struct sockaddr_in full_addr_buf;
         full_addr_buf.sin_family = AF_INET;
         full_addr_buf.sin_port   = htons(port);
@@ -220,7 +368,13 @@ public:
             return false;
         }
 
-        int backlog = 32;
+        #ifdef TCP_DEFER_ACCEPT
+        if (defer_accept > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char*) &defer_accept, sizeof(int)))
+            std::clog << "Couldn't set TCP_DEFER_ACCEPT\n";
+        #else
+        (void) defer_accept;
+        #endif
+
         if (listen(fd, backlog)) {
             std::cout << "Couldn't start listening on " << addr << ":" << port << "\n";
             CLOSESOCKET(fd);
@@ -233,6 +387,11 @@ public:
 
 };
 
+/*
+ * Event reported by an event loop. Events returned by
+ * "wait_batch" may have both the RECV and SEND bits set
+ * in "type".
+ */
 struct Event {
     enum Type {
         FAILURE = 0,
@@ -258,8 +417,15 @@ struct Event {
     friend std::ostream& operator<<(std::ostream& os, Event const& event);
 };
 
+/*
+ * Event loop based on "poll" (or "WSAPoll" on Windows). Every
+ * wakeup scans the whole descriptor array, so the cost of each
+ * event grows with the number of registered sockets. On Linux
+ * the epoll-based loop in "epoll.hpp" should be preferred (see
+ * "evloop.hpp").
+ */
 template <int N>
-class EventLoop {
+class PollEventLoop {
     void         *ptrs[N];
     struct pollfd bufs[N];
     int count;
@@ -281,15 +447,26 @@ class EventLoop {
         return out;
     }
 
+    // Convert a "revents" mask into the combined event
+    // type reported by "wait_batch". Masks with only error
+    // flags are reported as FAILURE.
+    static Event::Type convert_revents(int revents)
+    {
+        int type = 0;
+        if (revents & POLLIN)  type |= Event::RECV;
+        if (revents & POLLOUT) type |= Event::SEND;
+        return (Event::Type) type;
+    }
+
 public:
 
-    EventLoop()
+    PollEventLoop()
     {
         count = 0;
         cursor = 0;
     }
 
-    ~EventLoop()
+    ~PollEventLoop()
     {
     }
     
@@ -320,7 +497,11 @@ public:
         int i = find_socket_index(sock);
         if (i < 0) return; // Not found
 
-        bufs[i].events &= ~convert_event_flags(events);
+        // Buffered events that weren't reported yet are
+        // dropped too, so that the change takes effect
+        // right away.
+        bufs[i].events  &= ~convert_event_flags(events);
+        bufs[i].revents &= ~convert_event_flags(events);
     }
     
     bool remove(const Socket& sock)
@@ -340,6 +521,33 @@ public:
         return true;
     }
 
+    /*
+     * I/O on the registered sockets: accept a connection from
+     * "listener", move received bytes into the buffer "dst"
+     * (up to "limit") or send the output chain "chain". They
+     * return like "Socket::accept", "Buffer::write" and
+     * "OutputChain::flush". This loop only reports readiness
+     * so they perform the system calls right away, but a
+     * completion-based loop may have done the I/O already
+     * (see "UringEventLoop").
+     */
+    bool accept(Socket& listener, Socket& dst)
+    {
+        return listener.accept(dst);
+    }
+
+    template <typename B>
+    bool recv(Socket& sock, B& dst, int limit)
+    {
+        return dst.write(sock, limit);
+    }
+
+    template <typename C>
+    int send(Socket& sock, C& chain)
+    {
+        return chain.flush(sock);
+    }
+
     // Move the cursor forward until a struct
     // with some reported events is found. If
     // no such structs exists, then "cursor"
@@ -357,6 +565,7 @@ public:
         // If no more buffers have events, poll for more events
         while (cursor == count) {
 
+            syscall_count++;
             int n = POLL(bufs, count, -1);
             if (n < 0)
                 return Event(Event::FAILURE);
@@ -396,6 +605,68 @@ public:
         revents = 0;
         return Event(Event::FAILURE, ptr);
     }
+
+    /*
+     * Descriptor that becomes readable when some events are
+     * ready, for embedding the loop in another one, or -1 if
+     * there's none. The poll loop has none since it's just an
+     * array of descriptors.
+     */
+    int fd() const
+    {
+        return -1;
+    }
+
+    /*
+     * True iff events were received but not reported yet,
+     * in which case "wait_batch" returns without waiting.
+     */
+    bool pending() const
+    {
+        for (int i = cursor; i < count; i++)
+            if (bufs[i].revents)
+                return true;
+        return false;
+    }
+
+    /*
+     * Store in "out" up to "max" events returned by a single
+     * wakeup. Unlike "wait", RECV and SEND readiness of the
+     * same socket is reported by a single event with both
+     * flags set.
+     *
+     * If no event is available, wait up to "timeout_ms"
+     * milliseconds for one (forever if it's negative).
+     *
+     * Returns the number of events, which is 0 if the timeout
+     * expired, or -1 on failure.
+     */
+    int wait_batch(Event* out, int max, int timeout_ms)
+    {
+        skip();
+
+        if (cursor == count) {
+
+            syscall_count++;
+            int n = POLL(bufs, count, timeout_ms);
+            if (n < 0)
+                return -1;
+
+            cursor = 0;
+            skip();
+        }
+
+        int num = 0;
+        while (cursor < count && num < max) {
+            auto& revents = bufs[cursor].revents;
+            if (revents) {
+                out[num++] = Event(convert_revents(revents), ptrs[cursor]);
+                revents = 0;
+            }
+            cursor++;
+        }
+        return num;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,327 @@
+#ifndef TIMERS_HPP
+#define TIMERS_HPP
+
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+
+/*
+ * Current time of a monotonic clock, in milliseconds
+ */
+inline uint64_t monotonic_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Same clock in nanoseconds
+ */
+inline uint64_t monotonic_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * A deadline scheduled in a "TimerWheel". It's meant to
+ * be embedded in the structure it's relative to, which
+ * can be reached through "data".
+ */
+struct Timer {
+
+    void *data;
+
+    // Fields managed by the wheel
+    Timer *prev;
+    Timer *next;
+    uint64_t deadline;
+    int  level;
+    int  slot;
+    bool active;
+
+    Timer()
+    {
+        data = nullptr;
+        prev = nullptr;
+        next = nullptr;
+        deadline = 0;
+        level = 0;
+        slot = 0;
+        active = false;
+    }
+
+    Timer(Timer&) = delete;
+    Timer& operator=(Timer&) = delete;
+};
+
+/*
+ * Hierarchical timing wheel with a resolution of one
+ * millisecond.
+ *
+ * Each level has 64 slots. A slot of level 0 holds the
+ * timers that expire at a given millisecond, a slot of
+ * level 1 those that expire in a given 64 ms window and
+ * so on. Timers are placed at the lowest level that can
+ * tell their deadline apart from the current time, and
+ * are moved to the lower levels as time advances.
+ *
+ * Timers beyond the top level's current window (about two
+ * years) are kept in a list until that window ends.
+ *
+ * Scheduling and cancelling are O(1). Advancing the time
+ * only visits the slots that hold timers, so long idle
+ * periods are cheap, and the nearest deadline can be found
+ * in O(levels) to be used as the event loop's timeout.
+ */
+class TimerWheel {
+
+public:
+
+    TimerWheel(uint64_t now=0)
+    {
+        current = now;
+        count = 0;
+        far = nullptr;
+        for (int i = 0; i < LEVELS; i++) {
+            occupied[i] = 0;
+            for (int j = 0; j < SLOTS; j++)
+                slots[i][j] = nullptr;
+        }
+    }
+
+    TimerWheel(TimerWheel&) = delete;
+    TimerWheel& operator=(TimerWheel&) = delete;
+
+    /*
+     * Schedule "timer" to expire at "deadline". If it was
+     * already scheduled, the previous deadline is dropped.
+     * Deadlines in the past expire at the next "advance".
+     */
+    void set(Timer *timer, uint64_t deadline)
+    {
+        if (timer->active)
+            cancel(timer);
+
+        timer->deadline = deadline;
+        insert(timer);
+    }
+
+    void cancel(Timer *timer)
+    {
+        if (!timer->active)
+            return;
+
+        if (timer->prev)
+            timer->prev->next = timer->next;
+        else if (timer->level == LEVELS) {
+            assert(far == timer);
+            far = timer->next;
+        } else {
+            int level = timer->level;
+            int slot  = timer->slot;
+            assert(slots[level][slot] == timer);
+            slots[level][slot] = timer->next;
+            if (timer->next == nullptr)
+                occupied[level] &= ~(1ULL << slot);
+        }
+
+        if (timer->next)
+            timer->next->prev = timer->prev;
+
+        timer->prev = nullptr;
+        timer->next = nullptr;
+        timer->active = false;
+        count--;
+    }
+
+    /*
+     * Number of scheduled timers
+     */
+    int size() const
+    {
+        return count;
+    }
+
+    /*
+     * Milliseconds from "now" until the wheel needs to be
+     * advanced, or -1 if no timers are scheduled. This may
+     * be earlier than the nearest deadline when timers need
+     * to be moved to a lower level.
+     */
+    int timeout(uint64_t now) const
+    {
+        uint64_t next = next_tick();
+        if (next == NEVER)
+            return -1;
+        if (next <= now)
+            return 0;
+        if (next - now > INT_MAX)
+            return INT_MAX;
+        return next - now;
+    }
+
+    /*
+     * Move the time forward to "now" and call "callback(timer)"
+     * for each timer that expired, in order of deadline. The
+     * timer is no longer scheduled when the callback runs, so
+     * it may schedule it again. Callbacks may also schedule or
+     * cancel other timers.
+     */
+    template <typename Callback>
+    void advance(uint64_t now, Callback callback)
+    {
+        while (count > 0) {
+
+            uint64_t next = next_tick();
+            if (next > now)
+                break;
+
+            current = next;
+
+            // A new window of the top level started, so the
+            // timers that were beyond it may fit now.
+            if (far && (current & WINDOW_MASK) == 0) {
+                Timer *list = far;
+                far = nullptr;
+                reinsert(list);
+            }
+
+            // Move the timers of the higher levels whose window
+            // starts now to the lower levels. Timers are only
+            // pulled to a lower level so this converges.
+            for (int level = LEVELS-1; level > 0; level--) {
+                int slot = (current >> (BITS * level)) & (SLOTS - 1);
+                bool window_starts_now = (current & ((1ULL << (BITS * level)) - 1)) == 0;
+                if (window_starts_now && (occupied[level] & (1ULL << slot))) {
+                    Timer *list = slots[level][slot];
+                    slots[level][slot] = nullptr;
+                    occupied[level] &= ~(1ULL << slot);
+                    reinsert(list);
+                }
+            }
+
+            // Fire the timers of the current millisecond
+            int slot = current & (SLOTS - 1);
+            while (Timer *timer = slots[0][slot]) {
+                cancel(timer);
+                callback(timer);
+            }
+        }
+
+        if (now > current)
+            current = now;
+    }
+
+private:
+
+    static const int BITS   = 6;
+    static const int SLOTS  = 1 << BITS;
+    static const int LEVELS = 6; // About two years per window
+
+    static const uint64_t NEVER = UINT64_MAX;
+
+    // Bits of the time covered by a window of the top level
+    static const uint64_t WINDOW_MASK = (1ULL << (BITS * LEVELS)) - 1;
+
+    uint64_t current; // Time the wheel was last advanced to
+    int count;
+
+    Timer   *slots[LEVELS][SLOTS];
+    uint64_t occupied[LEVELS]; // Bit i is set iff slot i holds timers
+
+    // Timers that expire after the current window of the top
+    // level. Their level is set to LEVELS.
+    Timer *far;
+
+    void reinsert(Timer *list)
+    {
+        while (list) {
+            Timer *timer = list;
+            list = list->next;
+            timer->prev = nullptr;
+            timer->next = nullptr;
+            timer->active = false;
+            count--;
+            insert(timer);
+        }
+    }
+
+    void insert(Timer *timer)
+    {
+        // Timers are placed relative to the current time.
+        // Past deadlines expire at the next tick.
+        uint64_t tick = timer->deadline;
+        if (tick < current)
+            tick = current;
+
+        timer->prev   = nullptr;
+        timer->active = true;
+        count++;
+
+        if ((tick & ~WINDOW_MASK) != (current & ~WINDOW_MASK)) {
+            timer->level = LEVELS;
+            timer->slot  = 0;
+            timer->next  = far;
+            if (far)
+                far->prev = timer;
+            far = timer;
+            return;
+        }
+
+        // The level is given by the highest group of bits where
+        // the tick differs from the current time.
+        uint64_t diff = tick ^ current;
+        int level = 0;
+        while ((diff >> (BITS * (level + 1))) != 0)
+            level++;
+        assert(level < LEVELS);
+
+        int slot = (tick >> (BITS * level)) & (SLOTS - 1);
+
+        timer->level = level;
+        timer->slot  = slot;
+        timer->next  = slots[level][slot];
+        if (timer->next)
+            timer->next->prev = timer;
+        slots[level][slot] = timer;
+        occupied[level] |= 1ULL << slot;
+    }
+
+    // Earliest time at which some timer expires or needs
+    // to be moved to a lower level.
+    //
+    // Since timers are placed relative to the current time,
+    // the occupied slots of a level all come after the one
+    // of the current time (or at it, for level 0) within the
+    // same window of the upper level.
+    uint64_t next_tick() const
+    {
+        if (count == 0)
+            return NEVER;
+
+        uint64_t result = NEVER;
+        if (far)
+            result = (current | WINDOW_MASK) + 1;
+
+        for (int level = 0; level < LEVELS; level++) {
+
+            if (occupied[level] == 0)
+                continue;
+
+            int shift = BITS * level;
+            int slot  = __builtin_ctzll(occupied[level]);
+
+            uint64_t window = current & ~((1ULL << (shift + BITS)) - 1);
+            uint64_t tick = window + ((uint64_t) slot << shift);
+            assert(tick >= current);
+
+            if (tick < result)
+                result = tick;
+        }
+        return result;
+    }
+};
+
+#endif /* TIMERS_HPP */
@@ -0,0 +1,1355 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#ifdef __linux__
+
+#include <new>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "socket.hpp"
+#include "epoll.hpp"
+#include "output.hpp"
+
+/*
+ * Event loop based on io_uring. It has the same interface
+ * of the other event loops, but readiness is requested with
+ * one-shot IORING_OP_POLL_ADD submissions instead of being
+ * registered with separate system calls.
+ *
+ * Registration changes ("add", "add_events" and
+ * "remove_events") only write submission queue entries, which
+ * are handed to the kernel by the same "io_uring_enter" call
+ * that waits for completions. "remove" submits right away,
+ * since the socket stays open while requests refer to it.
+ *
+ * The poll requests are re-armed after each completion, which
+ * makes the loop level-triggered like the other ones.
+ *
+ * Sockets whose I/O goes through the loop's "accept", "recv"
+ * and "send" switch to completion-based I/O the first time
+ * one of them is used:
+ *
+ *   - A listening socket gets a multishot IORING_OP_ACCEPT,
+ *     so the kernel accepts connections as they arrive and
+ *     "accept" only pops their descriptors.
+ *
+ *   - A connected socket gets a multishot IORING_OP_RECV that
+ *     picks its buffers from a group handed to the kernel with
+ *     IORING_OP_PROVIDE_BUFFERS. "recv" copies the received
+ *     bytes into the caller's buffer and gives the buffers
+ *     back with the next submission. While none are left, the
+ *     socket is read with system calls instead.
+ *
+ *   - "send" queues the output chain. Queued chains become
+ *     IORING_OP_SENDMSG submissions which are handed to the
+ *     kernel together, by the "io_uring_enter" that waits for
+ *     completions.
+ *
+ * RECV events are then reported while received bytes (or the
+ * end of the stream) are held by the loop and SEND events when
+ * a queued send completed. A keep-alive request costs the
+ * wakeup that delivers it plus the one that submits its
+ * response, where the epoll loop also needs a "recv", a
+ * "send" and an "epoll_ctl" each time SEND events are turned
+ * on and off.
+ *
+ * If the kernel doesn't support io_uring (or it's disabled)
+ * the loop transparently falls back to "EpollEventLoop". If
+ * it's too old for the multishot requests, those sockets keep
+ * using readiness and system calls.
+ */
+template <int N>
+class UringEventLoop {
+
+    // Kind of request, stored in its user data
+    enum Op : uint8_t { OP_POLL, OP_ACCEPT, OP_RECV, OP_SEND };
+
+    // How the I/O of a socket is performed
+    enum Mode : uint8_t { MODE_POLL, MODE_ACCEPT, MODE_RECV };
+
+    struct Entry {
+        void        *ptr;
+        OutputChain *chain;     // Chain of the queued or submitted send
+        uint32_t events;        // Requested poll mask
+        uint32_t armed_events;  // Mask of the poll request in flight, or 0 if none is
+        uint32_t generation;    // Changes every time the poll request in flight is dropped
+        uint32_t instance;      // Changes when the socket is removed. Tags the other requests.
+        int      ready_slot;    // Index of the socket's events in "ready", or -1
+        int      chunks_head;   // First and last provided buffer with received bytes
+        int      chunks_tail;   // not copied by "recv" yet, or -1
+        int      accepted_head; // First and last descriptor accepted by the kernel
+        int      accepted_tail; // and not popped by "accept" yet, or -1
+        int      next_accepted; // Link of an accepted descriptor in the list above
+        int      send_limit;    // Bytes of "chain" the queued send may write
+        int      sent;          // Bytes sent since the last call to "send"
+        uint8_t  mode;
+        bool     active;
+        bool     queued;        // The descriptor is in the "rearm" list
+        bool     multishot;     // A multishot accept or receive is in flight
+        bool     cancelled;     // ...and it was asked to stop
+        bool     direct;        // Reads with system calls since the provided buffers ran out
+        uint32_t direct_mark;   // Value of "buf_returns" when they did
+        bool     eof;           // Receiving ended because of the peer's shutdown or a failure
+        bool     send_queued;   // The descriptor is in the "sends" list
+        bool     send_blocked;  // The last send would have blocked
+    };
+
+    struct Ready {
+        void    *ptr;
+        uint32_t revents;
+        int      fd;
+    };
+
+    static const int SEND_IOVECS = 32; // Regions of a single send
+    static const int SEND_BATCH  = 32; // Sends submitted before waiting for them
+
+    // Memory referenced by a SENDMSG submission, which must
+    // stay valid until it completes.
+    struct SendSlot {
+        struct msghdr msg;
+        IoVec vecs[SEND_IOVECS];
+    };
+
+    // Size of each provided buffer and ID of their group
+    static const int BUF_SIZE  = 4096;
+    static const int BUF_GROUP = 0;
+
+    // Completions of POLL_REMOVE and ASYNC_CANCEL requests
+    // have this user data and are ignored.
+    static const uint64_t CANCEL_TAG = ~0ULL;
+
+    // Bits of the generation or instance number stored
+    // in the user data
+    static const uint32_t TAG_MASK = (1U << 24) - 1;
+
+    // Used when io_uring isn't available
+    EpollEventLoop<N> *fallback;
+
+    int ring_fd;
+
+    void  *sq_ring_ptr;
+    void  *cq_ring_ptr;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned  sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned to_submit; // Queued entries not yet handed to the kernel
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers. Buffer "i" starts at "buf_base + i *
+    // BUF_SIZE". While it holds received bytes, they're the
+    // "chunk_len[i]" at offset "chunk_off[i]", and the next
+    // buffer of the same socket is "chunk_next[i]".
+    char    *buf_base;
+    int      buf_count;
+    int      buf_free;     // Buffers owned by the kernel
+    uint32_t buf_returns;  // Buffers given back so far
+    bool     skip_success; // Give them back without completions
+    int     *chunk_off;
+    int     *chunk_len;
+    int     *chunk_next;
+
+    // Set when the kernel doesn't support a multishot request
+    bool accept_unsupported;
+    bool recv_unsupported;
+
+    Entry *entries;
+    int    num_entries; // Capacity of "entries"
+
+    int count; // Number of registered sockets
+
+    // Descriptors whose requests must be brought up to
+    // date before blocking again.
+    int rearm[N];
+    int num_rearm;
+
+    // Descriptors with a queued send
+    int sends[N];
+    int num_sends;
+    int sends_in_flight;
+    SendSlot send_slots[SEND_BATCH];
+
+    // Each socket has at most one slot
+    Ready ready[N];
+    int num_ready;
+    int cursor;
+
+    static uint32_t convert_event_flags(int in)
+    {
+        uint32_t out = 0;
+        if (in & Event::RECV) out |= POLLIN;
+        if (in & Event::SEND) out |= POLLOUT;
+        return out;
+    }
+
+    static uint64_t make_user_data(int fd, Op op, uint32_t tag)
+    {
+        return ((uint64_t) (tag & TAG_MASK) << 40) | ((uint64_t) op << 32) | (uint32_t) fd;
+    }
+
+    bool setup()
+    {
+        unsigned depth = 2 * N;
+        if (depth > 4096) depth = 4096;
+
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+        if (ring_fd < 0)
+            return false;
+
+        // Timeouts are passed to "io_uring_enter" directly,
+        // which requires Linux 5.11.
+        if (!(params.features & IORING_FEAT_EXT_ARG))
+            return false;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+        sq_ring_ptr = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring_ptr == MAP_FAILED) {
+            sq_ring_ptr = nullptr;
+            return false;
+        }
+
+        if (single_mmap)
+            cq_ring_ptr = sq_ring_ptr;
+        else {
+            cq_ring_ptr = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring_ptr == MAP_FAILED) {
+                cq_ring_ptr = nullptr;
+                return false;
+            }
+        }
+
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            sqes = nullptr;
+            return false;
+        }
+
+        char *sq = (char*) sq_ring_ptr;
+        sq_head  = (unsigned*) (sq + params.sq_off.head);
+        sq_tail  = (unsigned*) (sq + params.sq_off.tail);
+        sq_mask  = (unsigned*) (sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*) (sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+
+        char *cq = (char*) cq_ring_ptr;
+        cq_head = (unsigned*) (cq + params.cq_off.head);
+        cq_tail = (unsigned*) (cq + params.cq_off.tail);
+        cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+        cqes    = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+        // Buffers given back don't need a completion
+        // (Linux 5.17)
+        skip_success = params.features & IORING_FEAT_CQE_SKIP;
+        return true;
+    }
+
+    // Hand the provided buffers to the kernel. Without them
+    // sockets are read with "recv".
+    bool setup_buffers()
+    {
+        // Two per socket, as a power of two
+        buf_count = 64;
+        while (buf_count < 2 * N && buf_count < 1024)
+            buf_count *= 2;
+
+        chunk_off  = new (std::nothrow) int[buf_count];
+        chunk_len  = new (std::nothrow) int[buf_count];
+        chunk_next = new (std::nothrow) int[buf_count];
+        if (!chunk_off || !chunk_len || !chunk_next)
+            return false;
+
+        void *base = mmap(nullptr, (size_t) buf_count * BUF_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return false;
+        buf_base = (char*) base;
+
+        // All of them at once. This is the only completion
+        // expected at this point.
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe.fd = buf_count;
+        sqe.addr = (uint64_t) (uintptr_t) buf_base;
+        sqe.len = BUF_SIZE;
+        sqe.off = 0;
+        sqe.buf_group = BUF_GROUP;
+        push(sqe);
+        if (enter(to_submit, 1, IORING_ENTER_GETEVENTS) < 0)
+            return false;
+
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        int res = cqes[head & *cq_mask].res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        if (res < 0)
+            return false;
+
+        buf_free = buf_count;
+        return true;
+    }
+
+    void teardown()
+    {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring_ptr && cq_ring_ptr != sq_ring_ptr) munmap(cq_ring_ptr, cq_ring_size);
+        if (sq_ring_ptr) munmap(sq_ring_ptr, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+        sqes = nullptr;
+        sq_ring_ptr = nullptr;
+        cq_ring_ptr = nullptr;
+        ring_fd = -1;
+    }
+
+    void teardown_buffers()
+    {
+        if (buf_base) munmap(buf_base, (size_t) buf_count * BUF_SIZE);
+        delete[] chunk_off;
+        delete[] chunk_len;
+        delete[] chunk_next;
+        buf_base = nullptr;
+        chunk_off = nullptr;
+        chunk_len = nullptr;
+        chunk_next = nullptr;
+    }
+
+    // Make buffer "bid" available to the kernel again. It
+    // is by the next "io_uring_enter", before the requests
+    // queued after it.
+    void give_back(int bid)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe.fd = 1;
+        sqe.addr = (uint64_t) (uintptr_t) (buf_base + (size_t) bid * BUF_SIZE);
+        sqe.len = BUF_SIZE;
+        sqe.off = bid;
+        sqe.buf_group = BUF_GROUP;
+        if (skip_success)
+            sqe.flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe.user_data = CANCEL_TAG;
+        push(sqe);
+        buf_free++;
+        buf_returns++;
+    }
+
+    int enter(unsigned submit, unsigned min_complete, unsigned flags)
+    {
+        syscall_count++;
+        int res = syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, nullptr, 0);
+        if (res >= 0)
+            to_submit -= res;
+        return res;
+    }
+
+    // Append an entry to the submission queue. It will be
+    // handed to the kernel at the next "enter" call.
+    void push(const struct io_uring_sqe& sqe)
+    {
+        unsigned tail = *sq_tail;
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+        if (tail - head == sq_entries) {
+            // Queue is full. Flush it without waiting.
+            enter(to_submit, 0, 0);
+        }
+
+        unsigned index = tail & *sq_mask;
+        sqes[index] = sqe;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+    }
+
+    void push_poll_add(int fd, uint32_t events, uint64_t user_data)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.fd = fd;
+        sqe.poll32_events = events;
+        sqe.user_data = user_data;
+        push(sqe);
+    }
+
+    void push_poll_remove(uint64_t target)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_REMOVE;
+        sqe.fd = -1;
+        sqe.addr = target;
+        sqe.user_data = CANCEL_TAG;
+        push(sqe);
+    }
+
+    void push_cancel(uint64_t target)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.addr = target;
+        sqe.user_data = CANCEL_TAG;
+        push(sqe);
+    }
+
+    void push_multishot(int fd, Op op, uint32_t instance)
+    {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.fd = fd;
+        sqe.user_data = make_user_data(fd, op, instance);
+        if (op == OP_ACCEPT) {
+            sqe.opcode = IORING_OP_ACCEPT;
+            sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        } else {
+            sqe.opcode = IORING_OP_RECV;
+            sqe.ioprio = IORING_RECV_MULTISHOT;
+            sqe.flags = IOSQE_BUFFER_SELECT;
+            sqe.buf_group = BUF_GROUP;
+        }
+        push(sqe);
+    }
+
+    // Remember to bring the requests of "fd" up to date
+    // before blocking
+    void queue(int fd)
+    {
+        Entry& entry = entries[fd];
+        if (!entry.queued) {
+            rearm[num_rearm++] = fd;
+            entry.queued = true;
+        }
+    }
+
+    // Add "revents" to the events of "fd" to be reported
+    void mark_ready(int fd, uint32_t revents)
+    {
+        Entry& entry = entries[fd];
+        if (entry.ready_slot < 0) {
+            assert(num_ready < N);
+            entry.ready_slot = num_ready++;
+            ready[entry.ready_slot].ptr = entry.ptr;
+            ready[entry.ready_slot].revents = 0;
+            ready[entry.ready_slot].fd = fd;
+        }
+        ready[entry.ready_slot].revents |= revents;
+    }
+
+    // Make the poll request in flight for "fd" match "mask"
+    void sync_poll(int fd, uint32_t mask)
+    {
+        Entry& entry = entries[fd];
+        if (entry.armed_events == mask)
+            return;
+
+        if (entry.armed_events) {
+            // Changing the mask of a request in flight isn't
+            // possible on every kernel, so drop it and make
+            // a new one. Its completion will be recognized
+            // as stale by the generation number.
+            push_poll_remove(make_user_data(fd, OP_POLL, entry.generation));
+            entry.generation++;
+            entry.armed_events = 0;
+        }
+
+        if (mask) {
+            push_poll_add(fd, mask, make_user_data(fd, OP_POLL, entry.generation));
+            entry.armed_events = mask;
+        }
+    }
+
+    // Start or stop the multishot request of "fd". A stopped
+    // request is only started again after its last completion
+    // arrived, since until then it may still deliver data.
+    void sync_multishot(int fd, bool wanted, Op op)
+    {
+        Entry& entry = entries[fd];
+        if (wanted && !entry.multishot) {
+            push_multishot(fd, op, entry.instance);
+            entry.multishot = true;
+            entry.cancelled = false;
+        } else if (!wanted && entry.multishot && !entry.cancelled) {
+            push_cancel(make_user_data(fd, op, entry.instance));
+            entry.cancelled = true;
+        }
+    }
+
+    // Make the requests in flight for "fd" match what the
+    // user asked for. What was accepted or received is
+    // reported again, since the loop is level-triggered.
+    void sync(int fd)
+    {
+        Entry& entry = entries[fd];
+        if (!entry.active)
+            return;
+
+        uint32_t mask = entry.events;
+
+        if (entry.mode == MODE_ACCEPT && !accept_unsupported) {
+            bool wanted = entry.events & POLLIN;
+            if (wanted && entry.accepted_head >= 0)
+                mark_ready(fd, POLLIN);
+            sync_multishot(fd, wanted, OP_ACCEPT);
+            mask &= ~POLLIN;
+        }
+
+        if (entry.mode == MODE_RECV) {
+
+            // Go back to the provided buffers once half of
+            // them are available again. At least one must have
+            // been given back since they ran out, or a wrong
+            // count would make the receive fail right away.
+            if (entry.direct && !recv_unsupported && 2 * buf_free >= buf_count
+             && entry.direct_mark != buf_returns)
+                entry.direct = false;
+
+            bool wanted = (entry.events & POLLIN) && !entry.eof;
+            if ((entry.events & POLLIN) && (entry.chunks_head >= 0 || entry.eof))
+                mark_ready(fd, POLLIN);
+            sync_multishot(fd, wanted && !entry.direct, OP_RECV);
+            if (!entry.direct || entry.eof)
+                mask &= ~POLLIN;
+
+            // Reported when the send completes
+            if (entry.send_queued)
+                mask &= ~POLLOUT;
+        }
+
+        sync_poll(fd, mask);
+    }
+
+    void rearm_all()
+    {
+        for (int i = 0; i < num_rearm; i++) {
+            int fd = rearm[i];
+            entries[fd].queued = false;
+            sync(fd);
+        }
+        num_rearm = 0;
+    }
+
+    // Turn the queued sends into submissions
+    bool push_sends()
+    {
+        int used = 0;
+        for (int i = 0; i < num_sends; i++) {
+
+            int fd = sends[i];
+            Entry& entry = entries[fd];
+            assert(entry.active && entry.send_queued);
+            entry.send_queued = false;
+
+            SendSlot& slot = send_slots[used];
+            int total;
+            int num_vecs = entry.chain->gather(slot.vecs, SEND_IOVECS, entry.send_limit, total);
+            if (num_vecs == 0) {
+                // The chain was cleared or starts with a file
+                // now, which "send" writes by itself.
+                entry.chain = nullptr;
+                mark_ready(fd, POLLOUT);
+                continue;
+            }
+
+            memset(&slot.msg, 0, sizeof(slot.msg));
+            slot.msg.msg_iov    = (struct iovec*) slot.vecs;
+            slot.msg.msg_iovlen = num_vecs;
+
+            // Non-blocking sends are performed as they're
+            // submitted and complete within the same call,
+            // whether the socket has space or not. Blocking
+            // ones could complete at any later time, when
+            // the chain may have changed.
+            struct io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_SENDMSG;
+            sqe.fd = fd;
+            sqe.addr = (uint64_t) (uintptr_t) &slot.msg;
+            sqe.len = 1;
+            sqe.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+            sqe.user_data = make_user_data(fd, OP_SEND, entry.instance);
+            push(sqe);
+            sends_in_flight++;
+
+            // The slots can only be reused once the sends
+            // referring to them completed
+            if (++used == SEND_BATCH) {
+                if (!settle_sends())
+                    return false;
+                used = 0;
+            }
+        }
+        num_sends = 0;
+        return true;
+    }
+
+    // Wait until the submitted sends completed
+    bool settle_sends()
+    {
+        while (sends_in_flight > 0) {
+            if (enter(to_submit, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                return false;
+            reap();
+        }
+        return true;
+    }
+
+    void handle_poll(int fd, const struct io_uring_cqe& cqe, uint32_t tag)
+    {
+        Entry& entry = entries[fd];
+
+        // Drop completions relative to requests that
+        // were replaced
+        if ((entry.generation & TAG_MASK) != tag)
+            return;
+
+        entry.armed_events = 0;
+        queue(fd);
+
+        uint32_t revents = cqe.res < 0 ? POLLERR : (uint32_t) cqe.res;
+        if (revents & POLLOUT)
+            entry.send_blocked = false;
+        if (revents)
+            mark_ready(fd, revents);
+    }
+
+    void handle_accept(int fd, const struct io_uring_cqe& cqe)
+    {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            entries[fd].multishot = false;
+            queue(fd);
+        }
+
+        if (cqe.res == -EINVAL) {
+            // Multishot accepts aren't supported. The
+            // listener is polled from now on.
+            accept_unsupported = true;
+            mark_ready(fd, POLLIN);
+            return;
+        }
+
+        if (cqe.res < 0)
+            return;
+
+        int accepted = cqe.res;
+        if (!ensure_entry(accepted)) {
+            close(accepted);
+            return;
+        }
+
+        // The table may have moved
+        Entry& entry = entries[fd];
+        entries[accepted].next_accepted = -1;
+        if (entry.accepted_tail < 0)
+            entry.accepted_head = accepted;
+        else
+            entries[entry.accepted_tail].next_accepted = accepted;
+        entry.accepted_tail = accepted;
+
+        if (entry.events & POLLIN)
+            mark_ready(fd, POLLIN);
+    }
+
+    void handle_recv(int fd, const struct io_uring_cqe& cqe)
+    {
+        Entry& entry = entries[fd];
+
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            entry.multishot = false;
+            queue(fd);
+        }
+
+        if (cqe.res > 0) {
+            assert(cqe.flags & IORING_CQE_F_BUFFER);
+            int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            chunk_off[bid]  = 0;
+            chunk_len[bid]  = cqe.res;
+            chunk_next[bid] = -1;
+            if (entry.chunks_tail < 0)
+                entry.chunks_head = bid;
+            else
+                chunk_next[entry.chunks_tail] = bid;
+            entry.chunks_tail = bid;
+        } else {
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+                give_back(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+            if (cqe.res == -ENOBUFS) {
+                // All buffers hold bytes of some socket. Read
+                // this one directly until they're given back.
+                entry.direct = true;
+                entry.direct_mark = buf_returns;
+                return;
+            }
+
+            if (cqe.res == -EINVAL) {
+                // Multishot receives aren't supported
+                recv_unsupported = true;
+                entry.direct = true;
+                return;
+            }
+
+            if (cqe.res == -ECANCELED)
+                return;
+
+            // The peer shut the connection down or it failed
+            entry.eof = true;
+        }
+
+        if (entry.events & POLLIN)
+            mark_ready(fd, POLLIN);
+    }
+
+    void handle_send(int fd, const struct io_uring_cqe& cqe)
+    {
+        Entry& entry = entries[fd];
+        OutputChain *chain = entry.chain;
+        entry.chain = nullptr;
+        if (chain == nullptr)
+            return;
+
+        if (cqe.res == -EAGAIN) {
+            // Wait until the socket is writable
+            entry.send_blocked = true;
+            queue(fd);
+            return;
+        }
+
+        if (cqe.res > 0) {
+            chain->consume(cqe.res);
+            entry.sent += cqe.res;
+        } else
+            chain->mark_failed();
+
+        mark_ready(fd, POLLOUT);
+    }
+
+    // Handle the available completions, moving the events
+    // they produce to the "ready" array.
+    void reap()
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+
+            struct io_uring_cqe cqe = cqes[head & *cq_mask];
+            head++;
+
+            if (cqe.user_data == CANCEL_TAG)
+                continue;
+
+            int      fd  = (int) (uint32_t) cqe.user_data;
+            Op       op  = (Op) ((cqe.user_data >> 32) & 0xff);
+            uint32_t tag = (uint32_t) (cqe.user_data >> 40);
+
+            if (op == OP_SEND)
+                sends_in_flight--;
+
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+                buf_free--;
+
+            // Drop completions relative to sockets that were
+            // removed, releasing what they hold. Those of
+            // poll requests are checked by "handle_poll".
+            if (fd >= num_entries || !entries[fd].active
+             || (op != OP_POLL && (entries[fd].instance & TAG_MASK) != tag)) {
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                    give_back(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (op == OP_ACCEPT && cqe.res >= 0)
+                    close(cqe.res);
+                continue;
+            }
+
+            switch (op) {
+                case OP_POLL:   handle_poll(fd, cqe, tag); break;
+                case OP_ACCEPT: handle_accept(fd, cqe); break;
+                case OP_RECV:   handle_recv(fd, cqe); break;
+                case OP_SEND:   handle_send(fd, cqe); break;
+            }
+        }
+
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    Entry* find_entry(const Socket& sock)
+    {
+        int fd = sock.fd_;
+        if (fd < 0 || fd >= num_entries || !entries[fd].active)
+            return nullptr;
+        return &entries[fd];
+    }
+
+    bool ensure_entry(int fd)
+    {
+        if (fd < num_entries)
+            return true;
+
+        int new_size = num_entries > 0 ? 2 * num_entries : 1024;
+        while (new_size <= fd)
+            new_size *= 2;
+
+        Entry *new_entries = new (std::nothrow) Entry[new_size];
+        if (new_entries == nullptr)
+            return false;
+
+        if (num_entries > 0)
+            memcpy(new_entries, entries, num_entries * sizeof(Entry));
+        for (int i = num_entries; i < new_size; i++) {
+            new_entries[i].active = false;
+            new_entries[i].queued = false;
+            new_entries[i].generation = 0;
+            new_entries[i].instance = 0;
+            new_entries[i].ready_slot = -1;
+        }
+
+        delete[] entries;
+        entries = new_entries;
+        num_entries = new_size;
+        return true;
+    }
+
+    // Release what the loop holds for the socket "fd"
+    void release(int fd)
+    {
+        Entry& entry = entries[fd];
+
+        while (entry.chunks_head >= 0) {
+            int bid = entry.chunks_head;
+            entry.chunks_head = chunk_next[bid];
+            give_back(bid);
+        }
+        entry.chunks_tail = -1;
+
+        while (entry.accepted_head >= 0) {
+            int accepted = entry.accepted_head;
+            entry.accepted_head = entries[accepted].next_accepted;
+            close(accepted);
+        }
+        entry.accepted_tail = -1;
+
+        if (entry.queued) {
+            for (int i = 0; i < num_rearm; i++)
+                if (rearm[i] == fd) {
+                    rearm[i] = rearm[--num_rearm];
+                    break;
+                }
+            entry.queued = false;
+        }
+
+        if (entry.send_queued) {
+            for (int i = 0; i < num_sends; i++)
+                if (sends[i] == fd) {
+                    sends[i] = sends[--num_sends];
+                    break;
+                }
+            entry.send_queued = false;
+        }
+        entry.chain = nullptr;
+    }
+
+    void skip()
+    {
+        while (cursor < num_ready && ready[cursor].revents == 0)
+            cursor++;
+    }
+
+    // Submit the queued requests and wait until at least
+    // one completion is available or "timeout_ms" expires.
+    bool submit_and_wait(int timeout_ms)
+    {
+        if (timeout_ms == 0) {
+            if (to_submit == 0)
+                return true;
+            return enter(to_submit, 0, 0) >= 0;
+        }
+
+        if (timeout_ms < 0)
+            return enter(to_submit, 1, IORING_ENTER_GETEVENTS) >= 0
+                || errno == EINTR;
+
+        struct __kernel_timespec ts;
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+
+        syscall_count++;
+        int res = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+        if (res < 0)
+            return errno == ETIME || errno == EINTR;
+        to_submit -= res;
+        return true;
+    }
+
+    // Make sure the "ready" array holds unreported events,
+    // waiting for them up to "timeout_ms" milliseconds. It
+    // may return with no events if the timeout expired or
+    // the completions were all stale. Returns false on
+    // failure.
+    bool fill(int timeout_ms)
+    {
+        skip();
+        if (cursor < num_ready)
+            return true;
+
+        for (int i = 0; i < num_ready; i++)
+            entries[ready[i].fd].ready_slot = -1;
+        num_ready = 0;
+        cursor = 0;
+
+        rearm_all();
+        if (!push_sends())
+            return false;
+
+        // Completions may already be available
+        reap();
+
+        if (!submit_and_wait(num_ready > 0 ? 0 : timeout_ms))
+            return false;
+        reap();
+
+        // The chains can't change until their sends
+        // completed
+        if (!settle_sends())
+            return false;
+
+        skip();
+        return true;
+    }
+
+    static Event::Type convert_revents(uint32_t revents)
+    {
+        int type = 0;
+        if (revents & POLLIN)  type |= Event::RECV;
+        if (revents & POLLOUT) type |= Event::SEND;
+        return (Event::Type) type;
+    }
+
+public:
+
+    UringEventLoop()
+    {
+        fallback = nullptr;
+        ring_fd = -1;
+        sq_ring_ptr = nullptr;
+        cq_ring_ptr = nullptr;
+        sqes = nullptr;
+        to_submit = 0;
+        buf_base = nullptr;
+        buf_count = 0;
+        buf_free = 0;
+        buf_returns = 0;
+        skip_success = false;
+        chunk_off = nullptr;
+        chunk_len = nullptr;
+        chunk_next = nullptr;
+        accept_unsupported = false;
+        recv_unsupported = false;
+        entries = nullptr;
+        num_entries = 0;
+        count = 0;
+        num_rearm = 0;
+        num_sends = 0;
+        sends_in_flight = 0;
+        num_ready = 0;
+        cursor = 0;
+
+        if (!setup()) {
+            teardown();
+            fallback = new (std::nothrow) EpollEventLoop<N>();
+            return;
+        }
+
+        if (!setup_buffers()) {
+            teardown_buffers();
+            recv_unsupported = true;
+        }
+    }
+
+    ~UringEventLoop()
+    {
+        for (int i = 0; i < num_entries; i++)
+            if (entries[i].active)
+                release(i);
+
+        // Closing the ring cancels the requests in flight,
+        // so the buffers can be unmapped afterwards.
+        teardown();
+        teardown_buffers();
+        delete[] entries;
+        delete fallback;
+    }
+
+    UringEventLoop(UringEventLoop&) = delete;
+    UringEventLoop& operator=(UringEventLoop&) = delete;
+
+    // Returns true iff the loop is using io_uring and
+    // didn't fall back to epoll.
+    bool using_io_uring() const
+    {
+        return ring_fd >= 0;
+    }
+
+    bool add(const Socket& sock, int events, void *ptr=nullptr)
+    {
+        if (fallback) return fallback->add(sock, events, ptr);
+
+        if (ring_fd < 0 || count == N)
+            return false;
+
+        int fd = sock.fd_;
+        if (fd < 0 || !ensure_entry(fd))
+            return false;
+
+        Entry& entry = entries[fd];
+        if (entry.active)
+            return false; // Already registered
+
+        entry.ptr = ptr;
+        entry.chain = nullptr;
+        entry.events = convert_event_flags(events);
+        entry.armed_events = 0;
+        entry.ready_slot = -1;
+        entry.chunks_head = -1;
+        entry.chunks_tail = -1;
+        entry.accepted_head = -1;
+        entry.accepted_tail = -1;
+        entry.send_limit = 0;
+        entry.sent = 0;
+        entry.mode = MODE_POLL;
+        entry.active = true;
+        entry.multishot = false;
+        entry.cancelled = false;
+        entry.direct = recv_unsupported;
+        entry.eof = false;
+        entry.send_queued = false;
+        entry.send_blocked = false;
+        count++;
+
+        // The request is made before blocking, when it's
+        // known whether "accept" or "recv" are used.
+        queue(fd);
+        return true;
+    }
+
+    void add_events(const Socket& sock, int events)
+    {
+        if (fallback) { fallback->add_events(sock, events); return; }
+
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr) return; // Not found
+
+        entry->events |= convert_event_flags(events);
+        queue(sock.fd_);
+    }
+
+    void remove_events(const Socket& sock, int events)
+    {
+        if (fallback) { fallback->remove_events(sock, events); return; }
+
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr) return; // Not found
+
+        uint32_t flags = convert_event_flags(events);
+        entry->events &= ~flags;
+        queue(sock.fd_);
+
+        // Events that weren't reported yet lose the flags
+        // too, including the POLLOUT of a completed send
+        if (entry->ready_slot >= 0)
+            ready[entry->ready_slot].revents &= ~flags;
+    }
+
+    bool remove(const Socket& sock)
+    {
+        if (fallback) return fallback->remove(sock);
+
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr) return false; // Not found
+
+        int fd = sock.fd_;
+        if (entry->armed_events)
+            push_poll_remove(make_user_data(fd, OP_POLL, entry->generation));
+        if (entry->multishot && !entry->cancelled)
+            push_cancel(make_user_data(fd, entry->mode == MODE_ACCEPT ? OP_ACCEPT : OP_RECV, entry->instance));
+
+        release(fd);
+
+        // Drop buffered events relative to this socket
+        if (entry->ready_slot >= 0)
+            ready[entry->ready_slot].revents = 0;
+        entry->ready_slot = -1;
+
+        // Completions of its requests are stale from now on
+        entry->generation++;
+        entry->instance++;
+        entry->armed_events = 0;
+        entry->multishot = false;
+        entry->active = false;
+        count--;
+
+        // Requests in flight hold a reference to the socket,
+        // which would keep the connection open after it's
+        // closed until the next wait.
+        if (to_submit > 0)
+            enter(to_submit, 0, 0);
+        return true;
+    }
+
+    /*
+     * See "PollEventLoop::accept". Once the kernel accepts
+     * the connections of "listener", it pops them.
+     */
+    bool accept(Socket& listener, Socket& dst)
+    {
+        if (fallback || accept_unsupported)
+            return listener.accept(dst);
+
+        Entry *entry = find_entry(listener);
+        if (entry == nullptr)
+            return listener.accept(dst);
+
+        if (entry->mode != MODE_ACCEPT) {
+            // Connections waiting in the backlog are
+            // accepted as soon as the request is submitted
+            entry->mode = MODE_ACCEPT;
+            queue(listener.fd_);
+            return false;
+        }
+
+        int fd = entry->accepted_head;
+        if (fd < 0)
+            return false;
+
+        entry->accepted_head = entries[fd].next_accepted;
+        if (entry->accepted_head < 0)
+            entry->accepted_tail = -1;
+        else
+            queue(listener.fd_); // Report the others again
+
+        dst = Socket(fd);
+        return true;
+    }
+
+    /*
+     * See "PollEventLoop::recv". Once the kernel receives
+     * into the provided buffers, it copies from those.
+     */
+    bool recv(Socket& sock, Buffer& dst, int limit)
+    {
+        if (fallback)
+            return dst.write(sock, limit);
+
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr)
+            return dst.write(sock, limit);
+
+        int fd = sock.fd_;
+        if (entry->mode != MODE_RECV) {
+            // Bytes that are already there complete the
+            // request as soon as it's submitted
+            entry->mode = MODE_RECV;
+            queue(fd);
+            if (!entry->direct)
+                return false;
+        }
+
+        while (entry->chunks_head >= 0 && dst.length() < limit) {
+
+            int bid = entry->chunks_head;
+            int num = std::min(chunk_len[bid], limit - dst.length());
+            dst.write(buf_base + (size_t) bid * BUF_SIZE + chunk_off[bid], num);
+            if (dst.failed())
+                return false;
+
+            chunk_off[bid] += num;
+            chunk_len[bid] -= num;
+            if (chunk_len[bid] == 0) {
+                entry->chunks_head = chunk_next[bid];
+                if (entry->chunks_head < 0)
+                    entry->chunks_tail = -1;
+                give_back(bid);
+            }
+        }
+
+        if (entry->chunks_head >= 0) {
+            queue(fd); // Report the rest again
+            return false;
+        }
+
+        if (entry->eof)
+            return dst.length() < limit;
+
+        if (entry->direct) {
+            queue(fd); // It may go back to the provided buffers
+            return dst.write(sock, limit);
+        }
+        return false;
+    }
+
+    /*
+     * See "PollEventLoop::send". The bytes the chain holds
+     * now are sent by the next "wait" or "wait_batch", which
+     * report a SEND event once they were. Returns the number
+     * of bytes sent since the previous call. The chain must
+     * stay alive until then or until the socket is removed.
+     */
+    int send(Socket& sock, OutputChain& chain)
+    {
+        if (fallback)
+            return chain.flush(sock);
+
+        Entry *entry = find_entry(sock);
+        if (entry == nullptr || entry->mode != MODE_RECV)
+            return chain.flush(sock);
+
+        int sent = entry->sent;
+        entry->sent = 0;
+
+        if (chain.failed() || chain.length() == 0 || entry->send_blocked)
+            return sent;
+
+        if (entry->send_queued) {
+            entry->send_limit = chain.length();
+            return sent;
+        }
+
+        // Files are sent with "sendfile"
+        IoVec vec;
+        int total;
+        if (chain.gather(&vec, 1, 1, total) == 0)
+            return sent + chain.flush(sock);
+
+        entry->chain = &chain;
+        entry->send_limit = chain.length();
+        entry->send_queued = true;
+        sends[num_sends++] = sock.fd_;
+        queue(sock.fd_);
+        return sent;
+    }
+
+    Event wait()
+    {
+        if (fallback) return fallback->wait();
+
+        while (cursor == num_ready || ready[cursor].revents == 0)
+            if (!fill(-1))
+                return Event(Event::FAILURE);
+        assert(cursor < num_ready);
+
+        void* ptr = ready[cursor].ptr;
+        uint32_t& revents = ready[cursor].revents;
+        assert(revents != 0);
+
+        if (revents & POLLIN) {
+            revents &= ~POLLIN;
+            return Event(Event::RECV, ptr);
+        }
+
+        if (revents & POLLOUT) {
+            revents &= ~POLLOUT;
+            return Event(Event::SEND, ptr);
+        }
+
+        revents = 0;
+        return Event(Event::FAILURE, ptr);
+    }
+
+    /*
+     * The ring's descriptor, which is readable while there
+     * are completions to reap.
+     */
+    int fd() const
+    {
+        if (fallback) return fallback->fd();
+        return ring_fd;
+    }
+
+    /*
+     * Registration changes, re-arms and queued sends are only
+     * handed to the kernel by "wait_batch", so until then they
+     * count as pending too. Otherwise the ring's descriptor
+     * may never become readable.
+     */
+    bool pending() const
+    {
+        if (fallback) return fallback->pending();
+
+        if (to_submit > 0 || num_rearm > 0 || num_sends > 0)
+            return true;
+        for (int i = cursor; i < num_ready; i++)
+            if (ready[i].revents)
+                return true;
+        return false;
+    }
+
+    /*
+     * See "PollEventLoop::wait_batch".
+     */
+    int wait_batch(Event* out, int max, int timeout_ms)
+    {
+        if (fallback) return fallback->wait_batch(out, max, timeout_ms);
+
+        // Completions relative to removed sockets don't
+        // produce events, so when blocking forever keep
+        // going until something is actually ready.
+        do {
+            if (!fill(timeout_ms))
+                return -1;
+        } while (timeout_ms < 0 && cursor == num_ready);
+
+        int num = 0;
+        while (cursor < num_ready && num < max) {
+            uint32_t revents = ready[cursor].revents;
+            if (revents) {
+                out[num++] = Event(convert_revents(revents), ready[cursor].ptr);
+                ready[cursor].revents = 0;
+            }
+            cursor++;
+        }
+        return num;
+    }
+};
+
+#endif /* __linux__ */
+#endif /* URING_HPP */
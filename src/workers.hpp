@@ -0,0 +1,261 @@
+#ifndef WORKERS_HPP
+#define WORKERS_HPP
+
+#ifdef __linux__
+
+#include <new>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "pool.hpp"
+#include "parse.hpp"
+#include "buffer.hpp"
+#include "output.hpp"
+#include "response.hpp"
+#include "atomic_queue.hpp"
+
+struct Client;
+
+/*
+ * A request handed by the I/O thread to a worker thread,
+ * along with the response the worker builds for it.
+ */
+struct Job {
+
+    // Fields only accessed by the I/O thread
+
+    Client *client; // Client that sent the request, or null if it was
+                    // removed while the job was in flight.
+
+    Job *next; // Next job of the same client, in request order
+
+    bool done; // The worker completed the job but its response
+               // wasn't moved to the client's output yet.
+
+    // Fields set by the I/O thread before the job is
+    // submitted and only read by the worker
+
+    Buffer  in;  // Copy of the request's bytes
+    Request req; // Request parsed from "in"
+
+    bool allow_keep_alive;
+    uint64_t head_time; // See "Client::head_time"
+
+    // Fields set by the worker
+
+    OutputChain out; // Serialized response
+    bool keep_alive;
+    CachedResponse cached; // Copy of the response to be cached, if the handler asked for it
+
+    Job()
+    {
+        client = nullptr;
+        next = nullptr;
+        done = false;
+        allow_keep_alive = false;
+        head_time = 0;
+        keep_alive = false;
+    }
+
+    ~Job()
+    {
+        if (cached.blob)
+            cached.blob->unref();
+    }
+};
+
+/*
+ * Pool of threads that run the user's handler on requests
+ * parsed by the I/O thread.
+ *
+ * Jobs are passed to the workers and back through bounded
+ * lock-free queues. Idle workers sleep on a semaphore-mode
+ * eventfd that counts the pending jobs. Workers signal
+ * completions with a second eventfd that the I/O thread
+ * registers in its event loop.
+ *
+ * Jobs are allocated and released only by the I/O thread.
+ */
+template <int MAX_JOBS>
+class WorkerPool {
+
+public:
+
+    typedef std::function<void(Request&, Response&)> Handler;
+
+    WorkerPool()
+    {
+        pending_fd = -1;
+        common = nullptr;
+        stopping = false;
+        signaled = false;
+    }
+
+    ~WorkerPool()
+    {
+        stopping = true;
+        if (pending_fd >= 0) {
+            // Wake up every worker
+            uint64_t n = threads.size();
+            if (n > 0 && ::write(pending_fd, &n, sizeof(n)) < 0)
+                std::clog << "Couldn't wake up the workers\n";
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+        if (pending_fd >= 0)
+            close(pending_fd);
+    }
+
+    WorkerPool(WorkerPool&) = delete;
+    WorkerPool& operator=(WorkerPool&) = delete;
+
+    // The "common" headers are added to every response
+    // and must not change while the workers run.
+    bool start(int num_workers, Handler handler_, const CommonHeaders *common_=nullptr)
+    {
+        if (!threads.empty() || num_workers <= 0)
+            return false;
+
+        pending_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+        if (pending_fd < 0)
+            return false;
+
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+            return false;
+        completion = Socket(fd);
+
+        handler = handler_;
+        common = common_;
+        for (int i = 0; i < num_workers; i++)
+            threads.emplace_back(&WorkerPool::work, this);
+        return true;
+    }
+
+    // Descriptor that becomes readable when some jobs
+    // complete. It must be registered in the I/O thread's
+    // event loop for RECV events.
+    const Socket& completion_socket() const
+    {
+        return completion;
+    }
+
+    // Returns null if MAX_JOBS are already in flight
+    Job* allocate()
+    {
+        return jobs.allocate();
+    }
+
+    void release(Job* job)
+    {
+        jobs.deallocate(job);
+    }
+
+    void submit(Job* job)
+    {
+        // Can't fail since the queue can hold all jobs
+        bool pushed = pending.push(job);
+        assert(pushed);
+        (void) pushed;
+
+        uint64_t one = 1;
+        syscall_count++;
+        if (::write(pending_fd, &one, sizeof(one)) < 0)
+            std::clog << "Couldn't signal a pending job\n";
+    }
+
+    // Must be called by the I/O thread when the completion
+    // socket is readable, before popping completed jobs.
+    void clear_completion_signal()
+    {
+        uint64_t n;
+        syscall_count++;
+        if (::read(completion.fd_, &n, sizeof(n)) < 0 && errno != EAGAIN)
+            std::clog << "Couldn't read the completion counter\n";
+
+        // Workers completing a job from now on need to
+        // signal it again. This is an exchange rather than
+        // a store so that it synchronizes with the last
+        // worker that set the flag, making its job visible
+        // to "pop_completed".
+        signaled.exchange(false, std::memory_order_acq_rel);
+    }
+
+    // Returns null when no more completed jobs are available
+    Job* pop_completed()
+    {
+        Job *job;
+        if (!completed.pop(job))
+            return nullptr;
+        return job;
+    }
+
+private:
+
+    Pool<Job, MAX_JOBS> jobs;
+
+    AtomicQueue<Job*, MAX_JOBS> pending;
+    AtomicQueue<Job*, MAX_JOBS> completed;
+
+    int pending_fd; // Semaphore counting the jobs in "pending"
+
+    Socket completion; // Written by workers when jobs complete
+
+    // True if a worker already signaled the completion
+    // socket and the I/O thread didn't clear it yet. This
+    // avoids one write per completed job when the I/O
+    // thread is busy.
+    std::atomic<bool> signaled;
+
+    std::atomic<bool> stopping;
+
+    Handler handler;
+
+    const CommonHeaders *common;
+
+    std::vector<std::thread> threads;
+
+    void work()
+    {
+        for (;;) {
+
+            uint64_t n;
+            if (::read(pending_fd, &n, sizeof(n)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            if (stopping)
+                return;
+
+            Job *job;
+            if (!pending.pop(job))
+                continue;
+
+            Response response;
+            response.begin(job->out, job->allow_keep_alive, common);
+            handler(job->req, response);
+            job->keep_alive = response.finish();
+            response.take_cached(job->cached);
+
+            bool pushed = completed.push(job);
+            assert(pushed);
+            (void) pushed;
+
+            if (!signaled.exchange(true, std::memory_order_acq_rel)) {
+                uint64_t one = 1;
+                if (::write(completion.fd_, &one, sizeof(one)) < 0)
+                    std::clog << "Couldn't signal a completed job\n";
+            }
+        }
+    }
+};
+
+#endif /* __linux__ */
+#endif /* WORKERS_HPP */
@@ -0,0 +1,81 @@
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/atomic_queue.hpp"
+
+int main()
+{
+    {
+        AtomicQueue<int, 2> q;
+        int x;
+        test(q.pop(x) == false);
+        test(q.push(10) == true);
+        test(q.push(4) == true);
+        test(q.push(7) == false);
+        test(q.pop(x) == true);
+        test(x == 10);
+        test(q.pop(x) == true);
+        test(x == 4);
+        test(q.pop(x) == false);
+    }
+
+    {
+        AtomicQueue<int, 4> q;
+        int x;
+
+        // Go around the ring a few times
+        for (int i = 0; i < 10; i++) {
+            test(q.push(3*i+0) == true);
+            test(q.push(3*i+1) == true);
+            test(q.push(3*i+2) == true);
+            test(q.pop(x) == true && x == 3*i+0);
+            test(q.pop(x) == true && x == 3*i+1);
+            test(q.pop(x) == true && x == 3*i+2);
+            test(q.pop(x) == false);
+        }
+
+        test(q.push(1) && q.push(2) && q.push(3) && q.push(4));
+        test(q.push(5) == false);
+    }
+
+    {
+        // Many producers and consumers. Every pushed value
+        // must be popped exactly once.
+        constexpr int THREADS = 4;
+        constexpr int PER_THREAD = 100000;
+
+        AtomicQueue<int, 64> q;
+        std::atomic<long> sum(0);
+        std::atomic<int>  popped(0);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < PER_THREAD; i++)
+                    while (!q.push(t * PER_THREAD + i))
+                        std::this_thread::yield();
+            });
+            threads.emplace_back([&]() {
+                while (popped < THREADS * PER_THREAD) {
+                    int x;
+                    if (q.pop(x)) {
+                        sum += x;
+                        popped++;
+                    } else
+                        std::this_thread::yield();
+                }
+            });
+        }
+        for (std::thread& t : threads)
+            t.join();
+
+        long n = (long) THREADS * PER_THREAD;
+        test(popped == n);
+        test(sum == n * (n - 1) / 2);
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
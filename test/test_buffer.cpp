@@ -0,0 +1,162 @@
+#include <string>
+#include <random>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/buffer.hpp"
+
+static std::string contents(Buffer& buffer)
+{
+    return std::string(buffer.content(), buffer.length());
+}
+
+int main()
+{
+    {
+        Buffer buffer;
+        buffer.write("GET / HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n");
+        test(buffer.seek("\r\n\r\n") == 14);
+        test(buffer.seek("nope") == -1);
+
+        Slice head = buffer.slice_until("\r\n\r\n", true);
+        test(head.len == 18);
+
+        buffer.consume(18);
+        test(buffer.length() == 19);
+        test(buffer.seek("\r\n\r\n") == 15);
+        test(buffer.slice(4, 6) == "/b");
+        test(buffer.slice(0, 20).len == 0);
+
+        buffer.consume(19);
+        test(buffer.length() == 0);
+        test(buffer.head == 0 && buffer.used == 0);
+    }
+
+    {
+        // A head received in pieces, with the terminator split
+        // between two writes, is found where it ends
+        Buffer buffer;
+        std::string head = "GET / HTTP/1.1\r\nHost: x\r\n" + std::string(5000, 'a') + "\r\n\r\n";
+        size_t i = 0;
+        while (i + 3 < head.size()) {
+            buffer.write(head.data() + i, 3);
+            i += 3;
+            test(buffer.seek("\r\n\r\n") == -1);
+        }
+        test(buffer.scanned > 4000);
+        buffer.write(head.data() + i, head.size() - i);
+        test(buffer.seek("\r\n\r\n") == (int) head.size() - 4);
+
+        // The search restarts after the consumed request
+        buffer.write("GET /b HTTP/1.1\r\n\r\n");
+        buffer.consume(head.size());
+        test(buffer.seek("\r\n\r\n") == 15);
+        buffer.consume(4);
+        test(buffer.seek("\r\n\r\n") == 11);
+    }
+
+    {
+        // The vectorized searches agree with the portable one
+        // at every alignment and starting offset
+        std::mt19937 rng(1);
+        const char alphabet[] = "\r\n\r\na";
+        for (int round = 0; round < 2000; round++) {
+            int len = rng() % 100;
+            std::string str(len, 'a');
+            for (char& c : str)
+                c = alphabet[rng() % 5];
+            int from = len > 0 ? rng() % len : 0;
+
+            int expected = -1;
+            for (int k = from; k + 4 <= len; k++)
+                if (!str.compare(k, 4, "\r\n\r\n")) {
+                    expected = k;
+                    break;
+                }
+            test(find_crlfcrlf(str.data(), from, len) == expected);
+            test(find_crlfcrlf_scalar(str.data(), from, len) == expected);
+            #ifdef SCAN_X86
+            test(find_crlfcrlf_sse2(str.data(), from, len) == expected);
+            if (__builtin_cpu_supports("avx2"))
+                test(find_crlfcrlf_avx2(str.data(), from, len) == expected);
+            #endif
+        }
+    }
+
+    {
+        // Contents are moved to the front only when the tail
+        // runs out of space, and preserved when that happens.
+        Buffer buffer;
+        std::string expected;
+        char chunk[100];
+        for (int i = 0; i < 1000; i++) {
+            for (int j = 0; j < 100; j++)
+                chunk[j] = 'a' + (i + j) % 26;
+            buffer.write(chunk, sizeof(chunk));
+            expected.append(chunk, sizeof(chunk));
+
+            char dst[90];
+            int n = buffer.read(dst, sizeof(dst));
+            test(n == 90 && !memcmp(dst, expected.data(), n));
+            expected.erase(0, n);
+            test(contents(buffer) == expected);
+        }
+        test(buffer.size <= 32768);
+    }
+
+    {
+        Buffer buffer;
+        buffer.write("xxabc");
+        buffer.consume(2);
+        buffer.overwrite(1, "B", 1);
+        test(contents(buffer) == "aBc");
+        buffer.overwrite(2, "CD", 2);
+        test(buffer.failed());
+    }
+
+    {
+        // Drained buffers give their memory back to the slab
+        // and the next buffer reuses it
+        BufferSlab slab;
+        Buffer a;
+        a.use_slab(&slab);
+        a.write("hello");
+        char *mem = a.data;
+        test(slab.stats().misses == 1 && slab.stats().bytes_in_use == 256);
+        a.consume(5);
+        test(a.data == nullptr && a.size == 0);
+        test(slab.stats().bytes_held == 256 && slab.stats().bytes_in_use == 0);
+
+        Buffer b;
+        b.use_slab(&slab);
+        b.write("world");
+        test(b.data == mem && slab.stats().hits == 1);
+        test(contents(b) == "world");
+
+        // Growing moves to a block of the next class
+        std::string big(1000, 'x');
+        b.write(big.data(), big.size());
+        test(b.size == 1024 && contents(b) == "world" + big);
+        test(slab.stats().bytes_in_use == 1024);
+    }
+
+    {
+        // Blocks past "max_held" are freed right away
+        BufferSlab slab(512);
+        char *a = slab.allocate(256);
+        char *b = slab.allocate(256);
+        char *c = slab.allocate(256);
+        slab.release(a, 256);
+        slab.release(b, 256);
+        slab.release(c, 256);
+        test(slab.stats().bytes_held == 512);
+        test(BufferSlab::block_size(1) == 256 && BufferSlab::block_size(257) == 512);
+
+        // Blocks larger than the largest class aren't kept
+        int huge = BufferSlab::block_size(4 << 20);
+        slab.release(slab.allocate(huge), huge);
+        test(slab.stats().bytes_held == 512 && slab.stats().bytes_in_use == 0);
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include <string>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/cache.hpp"
+#include "../src/response.hpp"
+
+static std::string blob_text(const CachedResponse& cached)
+{
+    return std::string(cached.blob->data(), cached.blob->length());
+}
+
+int main()
+{
+    {
+        // Pending bytes are copied across segments, but
+        // not from files
+        SharedBlob *blob = SharedBlob::create("shared", 6);
+
+        OutputChain chain;
+        chain.write("head ");
+        chain.write_shared(blob);
+        chain.write(" tail");
+
+        char buf[16];
+        test(chain.copy(0, buf, 16) && std::string(buf, 16) == "head shared tail");
+        test(chain.copy(3, buf, 5) && std::string(buf, 5) == "d sha");
+        test(chain.copy(11, buf, 5) && std::string(buf, 5) == " tail");
+        test(chain.copy(4, buf, 0));
+
+        blob->unref();
+    }
+
+    {
+        // A buffered response is copied with the keep-alive
+        // "Connection" line, even if it closed the connection
+        OutputChain chain;
+        chain.write("previous response");
+
+        Response res;
+        res.begin(chain, false);
+        res.cache(1000);
+        res.status(200);
+        res.header("Content-Type", "text/plain");
+        res.write("Hello, ");
+        res.write("world!");
+        test(!res.finish());
+
+        CachedResponse cached;
+        test(res.take_cached(cached));
+        test(!res.take_cached(cached));
+        test(cached.ttl == 1000);
+
+        std::string head = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+        test(cached.split == (int) head.size());
+        std::string rest = "Content-Length: 13        \r\n\r\nHello, world!";
+        test(blob_text(cached) == head + "Connection: Keep-Alive\r\n" + rest);
+
+        // Copies have the "Connection" line of the request
+        // they answer
+        OutputChain out;
+        Response::write_cached(out, cached, true);
+        Response::write_cached(out, cached, false);
+        std::string both(out.length(), '\0');
+        test(out.copy(0, &both[0], both.size()));
+        test(both == blob_text(cached) + head + "Connection: Close\r\n" + rest);
+        out.clear();
+        cached.blob->unref();
+    }
+
+    {
+        // Responses with a declared length aren't copied
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true);
+        res.cache(1000);
+        res.status(200);
+        res.content_length(2);
+        res.write("ok");
+        res.finish();
+
+        CachedResponse cached;
+        test(!res.take_cached(cached));
+    }
+
+    {
+        // Keys depend on the path, the query and the
+        // varying headers
+        ResponseCache cache;
+        cache.vary(H::AcceptEncoding);
+
+        auto key = [&](const char *src, std::string& key) {
+            Request req;
+            test(req.parse(src, strlen(src)));
+            return cache.make_key(req, key);
+        };
+
+        std::string a, b, c, d;
+        test(key("GET /x?q=1 HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n", a));
+        test(key("GET /x?q=1 HTTP/1.1\r\nHost: h\r\naccept-encoding: gzip\r\n\r\n", b));
+        test(key("GET /x?q=1 HTTP/1.1\r\n\r\n", c));
+        test(key("GET /x HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n", d));
+        test(a == b);
+        test(a != c);
+        test(a != d);
+        test(!key("POST /x?q=1 HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n", a));
+    }
+
+    {
+        // Entries expire and are evicted from the least
+        // recently used
+        ResponseCache cache(1000);
+
+        auto insert = [&](const std::string& key, int len, int ttl, uint64_t now) {
+            CachedResponse cached;
+            cached.blob = SharedBlob::create(std::string(len, 'x').data(), len);
+            cached.ttl = ttl;
+            cache.insert(key, cached, now);
+            test(cached.blob == nullptr);
+        };
+
+        insert("/a", 200, 100, 0);
+        test(cache.find("/a", 99) != nullptr);
+        test(cache.find("/a", 100) == nullptr);
+        test(cache.empty() && cache.size() == 0);
+        test(cache.hits == 1 && cache.misses == 1);
+
+        insert("/a", 200, 100, 0);
+        insert("/b", 200, 100, 0);
+        test(cache.find("/a", 0) != nullptr); // "/b" is now the least recently used
+        insert("/c", 200, 100, 0);
+        test(cache.find("/b", 0) == nullptr);
+        test(cache.find("/a", 0) != nullptr);
+        test(cache.find("/c", 0) != nullptr);
+
+        // Too large, or not to be cached at all
+        insert("/d", 1000, 100, 0);
+        insert("/e", 10, 0, 0);
+        test(cache.find("/d", 0) == nullptr);
+        test(cache.find("/e", 0) == nullptr);
+
+        // A blob stays valid after its entry is evicted
+        const CachedResponse *cached = cache.find("/a", 0);
+        SharedBlob *blob = cached->blob;
+        blob->ref();
+        cache.clear();
+        test(cache.empty() && cache.size() == 0);
+        test(blob->length() == 200 && blob->data()[199] == 'x');
+        blob->unref();
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
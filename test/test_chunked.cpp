@@ -0,0 +1,83 @@
+#include <string>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/chunked.hpp"
+
+// Decode "src" feeding it "step" bytes at a time into a
+// destination of "room" bytes. Returns false if the body
+// is invalid or incomplete. Bytes after the body are left
+// in "rest".
+static bool decode(const std::string& src, int step, int room, std::string& body, std::string& rest)
+{
+    ChunkedDecoder decoder;
+    char dst[64];
+    body.clear();
+
+    std::string pending;
+    size_t fed = 0;
+    while (!decoder.done()) {
+
+        if (pending.empty()) {
+            if (fed == src.size())
+                return false; // Incomplete
+            pending = src.substr(fed, step);
+            fed += pending.size();
+        }
+
+        int copied;
+        int used = decoder.decode(pending.data(), pending.size(), dst, room, copied);
+        if (used < 0)
+            return false;
+        body.append(dst, copied);
+        pending.erase(0, used);
+    }
+
+    rest = pending + src.substr(fed);
+    return true;
+}
+
+int main()
+{
+    std::string body, rest;
+
+    const char *valid = "5\r\nhello\r\n1A;name=value\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\nTrailer: x\r\n\r\nNEXT";
+
+    // Whole input, or split at every position, with a
+    // destination of any size
+    for (int step = 1; step <= 100; step += 11)
+        for (int room = 1; room <= 64; room *= 4) {
+            test(decode(valid, step, room, body, rest));
+            test(body == "helloabcdefghijklmnopqrstuvwxyz");
+            test(rest == "NEXT");
+        }
+
+    // Empty body
+    test(decode("0\r\n\r\n", 1, 64, body, rest));
+    test(body.empty() && rest.empty());
+
+    // Upper case sizes and whitespace before an extension
+    test(decode("A \r\n0123456789\r\n0\r\n\r\n", 3, 64, body, rest));
+    test(body == "0123456789");
+
+    // Incomplete
+    test(!decode("5\r\nhel", 2, 64, body, rest));
+    test(!decode("0\r\n", 2, 64, body, rest));
+
+    // Invalid
+    test(!decode("\r\nhello\r\n0\r\n\r\n", 1, 64, body, rest));      // Missing size
+    test(!decode("x\r\n", 1, 64, body, rest));                       // Not hex
+    test(!decode("5\nhello\r\n0\r\n\r\n", 1, 64, body, rest));        // Bare \n
+    test(!decode("5\r\nhelloX\r\n0\r\n\r\n", 1, 64, body, rest));     // Longer data
+    test(!decode("1000000000000000\r\n", 1, 64, body, rest));         // Size too big
+
+    // Once it failed, the decoder stays failed
+    ChunkedDecoder decoder;
+    char dst[8];
+    int copied;
+    test(decoder.decode("x", 1, dst, sizeof(dst), copied) < 0);
+    test(decoder.failed());
+    test(decoder.decode("0\r\n\r\n", 5, dst, sizeof(dst), copied) < 0);
+
+    std::cout << "Passed\n";
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include <string>
+#include <random>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/compress.hpp"
+#include "../src/response.hpp"
+
+static Encoding negotiate(const char *accept)
+{
+    std::string src = "GET / HTTP/1.1\r\n";
+    if (accept) {
+        src += "Accept-Encoding: ";
+        src += accept;
+        src += "\r\n";
+    }
+    src += "\r\n";
+
+    Request req;
+    test(req.parse(src.data(), src.size()));
+    return accepted_encoding(req);
+}
+
+static bool compressible(const char *type)
+{
+    return compressible_type(type, strlen(type));
+}
+
+// Decompress a gzip or zlib stream
+static std::string inflate_blob(SharedBlob *blob)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    test(inflateInit2(&stream, 15 + 32) == Z_OK); // Detect the format
+
+    std::string result;
+    char buf[4096];
+    stream.next_in  = (Bytef*) blob->data();
+    stream.avail_in = blob->length();
+    int res;
+    do {
+        stream.next_out  = (Bytef*) buf;
+        stream.avail_out = sizeof(buf);
+        res = inflate(&stream, Z_NO_FLUSH);
+        test(res == Z_OK || res == Z_STREAM_END);
+        result.append(buf, sizeof(buf) - stream.avail_out);
+    } while (res != Z_STREAM_END);
+
+    inflateEnd(&stream);
+    return result;
+}
+
+static std::string pending(const OutputChain& chain)
+{
+    std::string result(chain.length(), '\0');
+    test(chain.copy(0, &result[0], result.size()));
+    return result;
+}
+
+int main()
+{
+    {
+        // Negotiation
+        test(negotiate(nullptr) == Encoding::IDENTITY);
+        test(negotiate("gzip") == Encoding::GZIP);
+        test(negotiate("deflate, gzip") == Encoding::GZIP);
+        test(negotiate("GZIP;q=0.5, deflate") == Encoding::DEFLATE);
+        test(negotiate("gzip;q=0, deflate;q=0") == Encoding::IDENTITY);
+        test(negotiate("gzip; q=0.000") == Encoding::IDENTITY);
+        test(negotiate("gzip; q=0.001") == Encoding::GZIP);
+        test(negotiate("br, x-gzip;q=1.0") == Encoding::GZIP);
+        test(negotiate("br") == Encoding::IDENTITY);
+        test(negotiate("*") == Encoding::GZIP);
+        test(negotiate("*;q=0.5, gzip;q=0") == Encoding::DEFLATE);
+        test(negotiate("identity, gzipx") == Encoding::IDENTITY);
+    }
+
+    {
+        // Content types
+        test(compressible("text/html; charset=utf-8"));
+        test(compressible("application/json"));
+        test(compressible("Image/SVG+xml"));
+        test(!compressible("image/png"));
+        test(!compressible(" video/mp4"));
+        test(!compressible("font/woff2"));
+        test(!compressible("application/gzip"));
+        test(!compressible(""));
+    }
+
+    {
+        // Chains can be truncated inside or between segments
+        int released = 0;
+        OutputChain chain;
+        chain.write("head ");
+        chain.write_ref("borrowed ", 9, [](void *arg) { (*(int*) arg)++; }, &released);
+        chain.write("tail");
+
+        chain.truncate(16);
+        test(pending(chain) == "head borrowed ta");
+        chain.truncate(8);
+        test(released == 0);
+        test(pending(chain) == "head bor");
+        chain.truncate(5);
+        test(released == 1);
+        chain.write("more");
+        test(pending(chain) == "head more");
+        chain.truncate(0);
+        test(chain.length() == 0);
+    }
+
+    {
+        // Bodies are compressed once, then found in the cache
+        std::string body;
+        for (int i = 0; i < 200; i++)
+            body += "{\"id\": " + std::to_string(i) + ", \"name\": \"item\"},";
+
+        Compressor compressor(6);
+        SharedBlob *gzip = compressor.compress(Encoding::GZIP, body.data(), body.size());
+        test(gzip != nullptr);
+        test(gzip->length() < (int) body.size() / 4);
+        test((unsigned char) gzip->data()[0] == 0x1f); // Gzip magic bytes
+        test(inflate_blob(gzip) == body);
+
+        SharedBlob *again = compressor.compress(Encoding::GZIP, body.data(), body.size());
+        test(again == gzip);
+        test(compressor.hits == 1 && compressor.misses == 1);
+
+        SharedBlob *deflate = compressor.compress(Encoding::DEFLATE, body.data(), body.size());
+        test(deflate != nullptr && deflate != gzip);
+        test(inflate_blob(deflate) == body);
+        test(compressor.misses == 2);
+
+        // Random bytes don't shrink, which is remembered
+        std::mt19937 rng(1);
+        std::string noise(4096, '\0');
+        for (char& c : noise)
+            c = rng();
+        test(compressor.compress(Encoding::GZIP, noise.data(), noise.size()) == nullptr);
+        test(compressor.compress(Encoding::GZIP, noise.data(), noise.size()) == nullptr);
+        test(compressor.hits == 2 && compressor.misses == 3);
+
+        gzip->unref();
+        again->unref();
+        deflate->unref();
+        compressor.clear();
+        test(compressor.size() == 0);
+    }
+
+    {
+        // The buffered body of a response is replaced
+        OutputChain chain;
+        chain.write("previous response");
+
+        Response res;
+        res.begin(chain, true);
+        res.status(200);
+        res.header("Content-Type", "text/plain");
+        res.write("Hello, ");
+        res.write("world!");
+        test(res.can_encode());
+        test(res.body_length() == 13);
+
+        char body[13];
+        test(res.copy_body(body) && std::string(body, 13) == "Hello, world!");
+
+        SharedBlob *blob = SharedBlob::create("HELLO", 5);
+        test(res.insert_header("Vary", "Accept-Encoding"));
+        test(res.encode_body(blob, Encoding::GZIP));
+        test(!res.can_encode());
+        test(res.finish());
+        blob->unref();
+
+        test(pending(chain) == "previous response"
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: Keep-Alive\r\n"
+            "Vary: Accept-Encoding\r\nContent-Encoding: gzip\r\n"
+            "Content-Length: 5         \r\n\r\nHELLO");
+    }
+
+    {
+        // Only buffered bodies of a compressible type,
+        // that aren't encoded yet, can be replaced
+        OutputChain chain;
+        Response res;
+
+        res.begin(chain, true);
+        res.header("Content-Type", "image/png");
+        res.write("x");
+        test(!res.can_encode());
+        res.finish();
+
+        res.begin(chain, true);
+        res.header("Content-Type", "text/plain");
+        res.header("Content-Encoding", "br");
+        res.write("x");
+        test(!res.can_encode());
+        res.finish();
+
+        res.begin(chain, true);
+        res.header("Content-Type", "text/plain");
+        res.content_length(1);
+        res.write("x");
+        test(!res.can_encode());
+        test(!res.insert_header("Vary", "Accept-Encoding"));
+        res.finish();
+
+        res.begin(chain, true);
+        res.header("Content-Type", "text/plain");
+        res.write("x");
+        res.stream();
+        test(!res.can_encode());
+        res.finish();
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
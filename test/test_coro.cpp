@@ -0,0 +1,150 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/coro.hpp"
+
+static Task<int> add(int a, int b)
+{
+    co_return a + b;
+}
+
+static Task<std::string> concat(const char *a, const char *b)
+{
+    std::string result = a;
+    result += b;
+    co_return result;
+}
+
+static Task<int> sum(int n)
+{
+    // Each child completes without suspending
+    int total = 0;
+    for (int i = 0; i < n; i++)
+        total += co_await add(i, 1);
+    co_return total;
+}
+
+static Task<void> wait_and_log(Trigger& trigger, std::vector<int>& log, int id, int times)
+{
+    for (int i = 0; i < times; i++) {
+        co_await trigger.wait();
+        log.push_back(id);
+    }
+}
+
+static Task<void> nested_wait(Trigger& trigger, std::vector<int>& log, int id)
+{
+    co_await wait_and_log(trigger, log, id, 1);
+    log.push_back(-id);
+}
+
+static void count_done(void *arg)
+{
+    (*(int*) arg)++;
+}
+
+int main()
+{
+    {
+        // Values are returned through nested tasks
+        int done = 0;
+        Task<int> task = sum(1000);
+        test(task.valid() && !task.done());
+        task.start(count_done, &done);
+        test(task.done() && done == 1);
+
+        int result = 0;
+        auto run = [&]() -> Task<void> {
+            result = co_await sum(10);
+            std::string text = co_await concat("Hello, ", "world!");
+            test(text == "Hello, world!");
+        };
+        Task<void> outer = run();
+        outer.start();
+        test(outer.done() && result == 55);
+    }
+
+    {
+        // Waiters are resumed in order, by the notification
+        // that follows their wait
+        Trigger trigger;
+        std::vector<int> log;
+        int done = 0;
+
+        Task<void> a = wait_and_log(trigger, log, 1, 2);
+        Task<void> b = nested_wait(trigger, log, 2);
+        a.start(count_done, &done);
+        b.start(count_done, &done);
+        test(trigger.waiting() == 2 && log.empty());
+
+        trigger.notify();
+        test((log == std::vector<int>{1, 2, -2}));
+        test(b.done() && !a.done() && done == 1);
+        test(trigger.waiting() == 1);
+
+        trigger.notify();
+        test((log == std::vector<int>{1, 2, -2, 1}));
+        test(a.done() && done == 2);
+
+        trigger.notify();
+        test(log.size() == 4);
+    }
+
+    {
+        // Destroying a suspended task removes its waiter
+        Trigger trigger;
+        std::vector<int> log;
+        {
+            Task<void> a = nested_wait(trigger, log, 1);
+            a.start();
+            Task<void> b = nested_wait(trigger, log, 2);
+            b.start();
+            test(trigger.waiting() == 2);
+            a = Task<void>();
+            test(trigger.waiting() == 1);
+        }
+        test(trigger.waiting() == 0);
+        trigger.notify();
+        test(log.empty());
+    }
+
+    {
+        // Frames come from the slab while one is set, and
+        // are given back to it when they're destroyed
+        BufferSlab slab;
+        frame_slab = &slab;
+        {
+            Trigger trigger;
+            std::vector<int> log;
+            std::vector<Task<void>> tasks;
+            for (int i = 0; i < 1000; i++) {
+                tasks.push_back(nested_wait(trigger, log, i));
+                tasks.back().start();
+            }
+            test(trigger.waiting() == 1000);
+            test(slab.stats().bytes_in_use > 0);
+            trigger.notify();
+            test(log.size() == 2000);
+        }
+        test(slab.stats().bytes_in_use == 0);
+        uint64_t misses = slab.stats().misses;
+
+        Task<int> task = sum(100);
+        frame_slab = nullptr;
+        task.start();
+        test(task.done());
+        test(slab.stats().misses == misses && slab.stats().hits > 0);
+
+        // Frames allocated from the heap are freed there
+        Task<int> heap = add(1, 2);
+        test(slab.stats().bytes_in_use > 0);
+        task = Task<int>();
+        test(slab.stats().bytes_in_use == 0);
+        heap.start();
+        test(heap.done());
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/files.hpp"
+
+static ByteRange range(const char *value, int64_t size, int64_t& first, int64_t& last)
+{
+    return parse_byte_range(Slice(value, strlen(value)), size, first, last);
+}
+
+static bool resolves(const char *path, const char *expected)
+{
+    char dst[64];
+    if (!resolve_path("/srv/", Slice(path, strlen(path)), dst, sizeof(dst)))
+        return expected == nullptr;
+    return expected && !strcmp(dst, expected);
+}
+
+int main()
+{
+    {
+        int64_t first, last;
+        test(range("bytes=0-9", 100, first, last) == ByteRange::SATISFIABLE && first == 0 && last == 9);
+        test(range("bytes=90-", 100, first, last) == ByteRange::SATISFIABLE && first == 90 && last == 99);
+        test(range("bytes=90-500", 100, first, last) == ByteRange::SATISFIABLE && first == 90 && last == 99);
+        test(range("bytes=-10", 100, first, last) == ByteRange::SATISFIABLE && first == 90 && last == 99);
+        test(range("bytes=-500", 100, first, last) == ByteRange::SATISFIABLE && first == 0 && last == 99);
+        test(range("bytes=100-", 100, first, last) == ByteRange::UNSATISFIABLE);
+        test(range("bytes=-0", 100, first, last) == ByteRange::UNSATISFIABLE);
+        test(range("bytes=0-", 0, first, last) == ByteRange::UNSATISFIABLE);
+        test(range("bytes=5-1", 100, first, last) == ByteRange::NONE);
+        test(range("bytes=0-1,5-6", 100, first, last) == ByteRange::NONE);
+        test(range("bytes=-", 100, first, last) == ByteRange::NONE);
+        test(range("items=0-1", 100, first, last) == ByteRange::NONE);
+        test(range("bytes=99999999999999999999-", 100, first, last) == ByteRange::NONE);
+    }
+
+    {
+        test(resolves("/a.txt", "/srv/a.txt"));
+        test(resolves("/dir/", "/srv/dir/index.html"));
+        test(resolves("/", "/srv/index.html"));
+        test(resolves("/a%20b", "/srv/a b"));
+        test(resolves("/..a/b.", "/srv/..a/b."));
+        test(resolves("/../etc/passwd", nullptr));
+        test(resolves("/a/..", nullptr));
+        test(resolves("/a/./b", nullptr));
+        test(resolves("/%2e%2e/x", nullptr));
+        test(resolves("/a%2fb", nullptr));
+        test(resolves("/a%00", nullptr));
+        test(resolves("/a%4", nullptr));
+        test(resolves("a.txt", nullptr));
+        test(resolves("/a-very-long-path-that-does-not-fit-in-the-destination-buffer", nullptr));
+    }
+
+    {
+        // Evicted files stay open while referenced
+        char path[] = "/tmp/test_files_XXXXXX";
+        int fd = mkstemp(path);
+        test(fd >= 0);
+        test(write(fd, "abc", 3) == 3);
+        close(fd);
+
+        FileCache cache(1);
+        OpenFile *file = cache.open(path);
+        test(file && file->size() == 3);
+        test(cache.size() == 1);
+        test(cache.open("/nonexistent") == nullptr);
+
+        OpenFile *again = cache.open(path);
+        test(again == file);
+        again->unref();
+
+        test(cache.open("/") == nullptr); // Not a regular file
+
+        char buf[3];
+        test(pread(file->fd(), buf, 3, 0) == 3 && !memcmp(buf, "abc", 3));
+        file->unref();
+        unlink(path);
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <string>
+#include <random>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/metrics.hpp"
+
+static bool contains(const std::string& text, const char *line)
+{
+    return text.find(line) != std::string::npos;
+}
+
+int main()
+{
+    // Small values have a bucket each
+    for (int i = 0; i < Histogram::SUB_BUCKETS; i++) {
+        test(Histogram::index(i) == i);
+        test(Histogram::lower_bound(i) == (uint64_t) i);
+        test(Histogram::upper_bound(i) == (uint64_t) i + 1);
+    }
+
+    {
+        // Buckets are contiguous and every value falls
+        // within the bounds of its own
+        bool ok = true;
+        for (int i = 0; i + 1 < Histogram::NUM_BUCKETS; i++)
+            if (Histogram::upper_bound(i) != Histogram::lower_bound(i+1))
+                ok = false;
+        test(ok);
+
+        std::mt19937_64 rng(1);
+        for (int i = 0; i < 100000; i++) {
+            uint64_t value = rng() >> (rng() % 64);
+            if (value >> Histogram::MAX_BITS)
+                continue;
+            int b = Histogram::index(value);
+            if (b < 0 || b >= Histogram::NUM_BUCKETS || value < Histogram::lower_bound(b) || value >= Histogram::upper_bound(b))
+                ok = false;
+
+            // The relative error is at most 1/SUB_BUCKETS
+            uint64_t width = Histogram::upper_bound(b) - Histogram::lower_bound(b);
+            if (width > 1 && width * Histogram::SUB_BUCKETS > Histogram::lower_bound(b))
+                ok = false;
+        }
+        test(ok);
+
+        // Huge values go to the last bucket
+        test(Histogram::index(1ULL << Histogram::MAX_BITS) == Histogram::NUM_BUCKETS - 1);
+        test(Histogram::index(UINT64_MAX) == Histogram::NUM_BUCKETS - 1);
+        test(Histogram::upper_bound(Histogram::NUM_BUCKETS - 1) == 1ULL << Histogram::MAX_BITS);
+    }
+
+    {
+        Histogram h;
+        test(h.count() == 0 && h.percentile(0.5) == 0);
+
+        for (int i = 1; i <= 1000; i++)
+            h.record(i * 1000);
+        test(h.count() == 1000);
+        test(h.sum() == 500500000);
+
+        uint64_t p50 = h.percentile(0.5);
+        uint64_t p99 = h.percentile(0.99);
+        test(p50 >= 500000 && p50 < 500000 * 9 / 8);
+        test(p99 >= 990000 && p99 < 990000 * 9 / 8);
+        test(h.percentile(1) >= 1000000);
+
+        Histogram other;
+        other.record(5);
+        other.merge(h);
+        test(other.count() == 1001);
+        test(other.sum() == 500500005);
+        test(other.percentile(0) == 5);
+    }
+
+    {
+        ServerMetrics a, b;
+        a.accepted.add(3);
+        b.accepted.add();
+        a.parse_failures.add();
+        a.active_clients.set(2);
+        b.active_clients.set(5);
+        a.response_time.record(50000);     // 50 us
+        b.response_time.record(2000000);   // 2 ms
+        b.response_time.record(20000000000ULL); // 20 s
+
+        MetricsRegistry registry;
+        registry.add(&a);
+        registry.add(&b);
+
+        std::string text;
+        registry.write_prometheus(text);
+
+        test(contains(text, "# TYPE http_connections_accepted_total counter\nhttp_connections_accepted_total 4\n"));
+        test(contains(text, "\nhttp_parse_failures_total 1\n"));
+        test(contains(text, "\nhttp_keep_alive_refused_total 0\n"));
+        test(contains(text, "# TYPE http_active_clients gauge\nhttp_active_clients 7\n"));
+        test(contains(text, "# TYPE http_response_time_seconds histogram\n"));
+
+        // Cumulative counts, each value under the first
+        // bound past the end of its bucket
+        test(contains(text, "http_response_time_seconds_bucket{le=\"5e-05\"} 0\n"));
+        test(contains(text, "http_response_time_seconds_bucket{le=\"0.0001\"} 1\n"));
+        test(contains(text, "http_response_time_seconds_bucket{le=\"0.0025\"} 2\n"));
+        test(contains(text, "http_response_time_seconds_bucket{le=\"10\"} 2\n"));
+        test(contains(text, "http_response_time_seconds_bucket{le=\"+Inf\"} 3\n"));
+        test(contains(text, "http_response_time_seconds_count 3\n"));
+        test(contains(text, "http_response_time_seconds_sum 20.002050000\n"));
+
+        // Every line is a comment or a sample
+        bool ok = text.back() == '\n';
+        size_t start = 0;
+        while (start < text.size()) {
+            size_t end = text.find('\n', start);
+            std::string line = text.substr(start, end - start);
+            if (line.empty() || (line[0] != '#' && line.find(' ') == std::string::npos))
+                ok = false;
+            start = end + 1;
+        }
+        test(ok);
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
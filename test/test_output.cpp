@@ -0,0 +1,323 @@
+#include <string>
+#include <iostream>
+#include <sys/socket.h>
+#include "test_utils.hpp"
+#include "../src/output.hpp"
+#include "../src/response.hpp"
+
+static int released = 0;
+
+static void release(void *arg)
+{
+    released += *(int*) arg;
+}
+
+// Read everything that is available on "fd"
+static std::string drain(int fd)
+{
+    std::string result;
+    char buf[4096];
+    int n;
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        result.append(buf, n);
+    return result;
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        std::cout << "Couldn't create a socket pair\n";
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    Socket sock(fds[0]);
+
+    {
+        // Segments of all kinds are sent in order
+        int one = 1;
+        SharedBlob *blob = SharedBlob::create("shared", 6);
+        test(blob != nullptr);
+
+        OutputChain chain;
+        chain.write("head ");
+        chain.write_ref("borrowed ", 9, release, &one);
+        chain.write_shared(blob);
+        chain.write(" tail");
+        test(chain.length() == 25);
+
+        released = 0;
+        test(chain.flush(sock) == 25);
+        test(chain.length() == 0);
+        test(released == 1);
+        test(drain(fds[1]) == "head borrowed shared tail");
+
+        blob->unref();
+    }
+
+    {
+        // Owned bytes can be overwritten until they're flushed
+        OutputChain chain;
+        chain.write("Content-Length: ");
+        int off = chain.owned_length();
+        chain.write("  \r\n");
+        chain.write_ref("xy", 2);
+        chain.overwrite_owned(off, "2", 1);
+        chain.flush(sock);
+        test(drain(fds[1]) == "Content-Length: 2 \r\nxy");
+    }
+
+    {
+        // Partial writes resume from where they stopped and
+        // release the borrowed memory only once it's sent.
+        static char big[1 << 20];
+        memset(big, 'x', sizeof(big));
+
+        int one = 1;
+        released = 0;
+
+        OutputChain chain;
+        chain.write("a");
+        chain.write_ref(big, sizeof(big), release, &one);
+        chain.write("b");
+
+        int total = 0;
+        std::string received;
+        while (chain.length() > 0) {
+            int sent = chain.flush(sock);
+            test(!chain.failed());
+            total += sent;
+            test(released == (chain.length() > 1 ? 0 : 1));
+            received += drain(fds[1]);
+        }
+        received += drain(fds[1]);
+
+        test(total == (int) sizeof(big) + 2);
+        test(released == 1);
+        test(received.size() == sizeof(big) + 2);
+        test(received.front() == 'a' && received.back() == 'b');
+    }
+
+    {
+        // Dropping or moving a chain releases or transfers
+        // its segments.
+        int one = 1;
+        released = 0;
+
+        {
+            OutputChain chain;
+            chain.write_ref("abc", 3, release, &one);
+        }
+        test(released == 1);
+
+        OutputChain src, dst;
+        dst.write("1");
+        src.write("2");
+        src.write_ref("3", 1, release, &one);
+        dst.append(src);
+        test(src.length() == 0);
+        test(dst.length() == 3);
+        test(released == 1);
+
+        dst.flush(sock);
+        test(released == 2);
+        test(drain(fds[1]) == "123");
+    }
+
+    {
+        // File segments are sent between memory segments
+        char path[] = "/tmp/test_output_XXXXXX";
+        int fd = mkstemp(path);
+        test(fd >= 0);
+        test(write(fd, "0123456789", 10) == 10);
+        close(fd);
+
+        OpenFile *file = OpenFile::open(path);
+        test(file != nullptr);
+        unlink(path);
+
+        OutputChain chain;
+        chain.write("[");
+        chain.write_file(file, 2, 5);
+        chain.write("]");
+        file->unref();
+
+        test(chain.flush(sock) == 7);
+        test(drain(fds[1]) == "[23456]");
+    }
+
+    {
+        // Bytes can be inserted inside or between owned
+        // segments, also after a partial flush, but not
+        // inside other segments.
+        OutputChain chain;
+        chain.write("acf");
+        chain.write_ref("gh", 2);
+        test(chain.insert(1, "b", 1));
+        test(chain.insert(3, "de", 2));
+        test(chain.insert(8, "!", 1));
+        test(!chain.insert(7, "?", 1));
+        test(chain.length() == 9);
+        test(chain.flush(sock) == 9);
+        test(drain(fds[1]) == "abcdefgh!");
+    }
+
+    {
+        // Responses are buffered and framed with their length
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true);
+        res.status(200);
+        res.write("hello");
+        test(res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 5         \r\n\r\nhello");
+    }
+
+    {
+        // A response with a declared length can be sent as
+        // it's written. Bytes past the length are dropped.
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true);
+        res.status(200);
+        res.content_length(4);
+        res.write("ab");
+        test(res.stream());
+        chain.flush(sock);
+        res.write("cde");
+        test(res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 4\r\n\r\nabcd");
+
+        // Writing less closes the connection
+        res.begin(chain, true);
+        res.status(200);
+        res.content_length(4);
+        res.write("ab");
+        test(!res.finish());
+        chain.clear();
+    }
+
+    {
+        // Streaming a response without a declared length
+        // switches to the chunked encoding. What was written
+        // before becomes the first chunk.
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true);
+        res.status(200);
+        res.write("ab");
+        res.write_ref("cde", 3);
+        test(res.stream());
+        chain.flush(sock);
+        res.write("fghijklmnopqrstuvwxyz");
+        test(res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 200 OK\r\nConnection: Keep-Alive\r\nTransfer-Encoding: chunked\r\n\r\n"
+                              "5\r\nabcde\r\n15\r\nfghijklmnopqrstuvwxyz\r\n0\r\n\r\n");
+
+        // Without the chunked encoding, the body ends with
+        // the connection
+        res.begin(chain, true);
+        res.disable_chunked();
+        res.status(200);
+        res.write("ab");
+        test(res.stream());
+        chain.flush(sock);
+        res.write("cde");
+        test(!res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 200 OK\r\nConnection: Close" + std::string(33, ' ') + "\r\n\r\nabcde");
+
+        // Unless it's not streamed
+        res.begin(chain, true);
+        res.disable_chunked();
+        res.status(200);
+        res.write("ab");
+        test(res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 2         \r\n\r\nab");
+    }
+
+    {
+        // The connection can be closed after the body was
+        // written, unless the head may have been sent
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true);
+        res.status(200);
+        res.write("ab");
+        res.close_connection();
+        test(!res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 200 OK\r\nConnection: Close     \r\nContent-Length: 2         \r\n\r\nab");
+
+        res.begin(chain, true);
+        res.status(200);
+        res.content_length(2);
+        res.write("ab");
+        res.close_connection();
+        test(!res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 2\r\n\r\nab");
+    }
+
+    {
+        // Dates are formatted as in RFC 7231
+        char date[30] = {};
+        format_http_date(784111777, date);
+        test(!strcmp(date, "Sun, 06 Nov 1994 08:49:37 GMT"));
+        format_http_date(951782400, date);
+        test(!strcmp(date, "Tue, 29 Feb 2000 00:00:00 GMT"));
+
+        DateCache cache;
+        test(!memcmp(cache.line(784111777), "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", DateCache::LINE_LEN));
+        test(!memcmp(cache.line(784111778), "Date: Sun, 06 Nov 1994 08:49:38 GMT\r\n", DateCache::LINE_LEN));
+    }
+
+    {
+        // Status lines come from the table, or are formatted
+        // for the codes out of it
+        test(STATUS_LINES.find(99) == nullptr && STATUS_LINES.find(600) == nullptr);
+        const StatusLine *line = STATUS_LINES.find(404);
+        test(std::string(line->text, line->len) == "HTTP/1.1 404 Not Found\r\n");
+
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true);
+        res.status(299);
+        test(res.finish());
+        res.begin(chain, true);
+        res.status(99);
+        res.header("connection", "close");
+        test(!res.finish());
+        chain.flush(sock);
+        test(drain(fds[1]) == "HTTP/1.1 299 ???\r\nConnection: Keep-Alive\r\nContent-Length: 0         \r\n\r\n"
+                              "HTTP/1.1 99 ???\r\nConnection: Close\r\nContent-Length: 0         \r\n\r\n");
+    }
+
+    {
+        // Common headers follow the status line
+        CommonHeaders common;
+        common.add("Server", "test");
+        common.date = true;
+
+        OutputChain chain;
+        Response res;
+        res.begin(chain, true, &common);
+        res.header("X-A", "b");
+        res.write("x");
+        test(res.finish());
+        chain.flush(sock);
+
+        std::string result = drain(fds[1]);
+        test(result.compare(0, 23, "HTTP/1.1 200 OK\r\nDate: ") == 0);
+        test(result.compare(17 + DateCache::LINE_LEN, std::string::npos,
+            "Server: test\r\nX-A: b\r\nConnection: Keep-Alive\r\nContent-Length: 1         \r\n\r\nx") == 0);
+    }
+
+    close(fds[1]);
+    std::cout << "Passed\n";
+    return 0;
+}
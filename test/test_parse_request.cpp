@@ -0,0 +1,256 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/parse.hpp"
+
+struct Expected {
+    bool valid;
+    std::vector<std::string> names;
+    std::vector<std::string> values;
+    std::string error;
+};
+
+// Header section parsed one byte at a time, as the
+// tokenizer did before it was vectorized
+static Expected reference(const std::string& src, size_t off)
+{
+    Expected res;
+    res.valid = false;
+
+    auto consume = [&](const char *lit) {
+        size_t n = strlen(lit);
+        if (src.compare(off, n, lit) || off + n > src.size())
+            return false;
+        off += n;
+        return true;
+    };
+
+    if (!consume("\r\n")) {
+        do {
+            size_t start = off;
+            while (off < src.size() && src[off] != ':')
+                off++;
+            std::string name = src.substr(start, off - start);
+
+            if (!consume(":")) {
+                res.error = "Missing ':' after header name";
+                return res;
+            }
+
+            start = off;
+            while (off < src.size() && src[off] != '\r')
+                off++;
+            res.names.push_back(name);
+            res.values.push_back(src.substr(start, off - start));
+
+            if (!consume("\r\n")) {
+                res.error = "Missing CRLF after header body";
+                return res;
+            }
+        } while (!consume("\r\n"));
+    }
+
+    if (off != src.size()) {
+        res.error = "Bad characters after empty line";
+        return res;
+    }
+    res.valid = true;
+    return res;
+}
+
+static void check(const std::string& head)
+{
+    const char line[] = "GET /index.html HTTP/1.1\r\n";
+    std::string src = line + head;
+
+    Expected expected = reference(src, sizeof(line)-1);
+
+    Request req;
+    ParseError error;
+    error.text[0] = '\0';
+    bool valid = req.parse(src.data(), src.size(), error);
+
+    test(valid == expected.valid);
+    if (!valid) {
+        test(expected.error == error.text);
+        return;
+    }
+
+    int total = expected.names.size();
+    test(req.count == std::min(total, MAX_REQUEST_HEADERS));
+    test(req.ignored_count == total - req.count);
+    for (int i = 0; i < req.count; i++) {
+        const Header& h = req.headers[i];
+        test(h.name.str == src.data() && h.value.str == src.data());
+        test(src.compare(h.name.off, h.name.len, expected.names[i]) == 0);
+        test(src.compare(h.value.off, h.value.len, expected.values[i]) == 0);
+    }
+
+    // A copy holds the same headers
+    Request copy(req);
+    test(copy.count == req.count && copy.ignored_count == req.ignored_count);
+    test(copy.has(H::Host) == req.has(H::Host));
+    for (int i = 0; i < copy.count; i++) {
+        const Header& a = copy.headers[i];
+        const Header& b = req.headers[i];
+        test(a.name.off == b.name.off && a.name.len == b.name.len);
+        test(a.value.off == b.value.off && a.value.len == b.value.len);
+    }
+}
+
+int main()
+{
+    check("\r\n");
+    check("Host: example.com\r\n\r\n");
+    check("Host: a:b:c\r\nX-Empty:\r\n\r\n");
+    check("Host example.com\r\n\r\n");
+    check("Host: example.com\r\n");
+    check("Host: example.com\r\n\r\nbody");
+    check("Host: example.com\n\r\n");
+    check("Na\rme: value\r\n\r\n");
+
+    // Delimiters around the 64 byte blocks
+    for (int pad = 0; pad < 200; pad++) {
+        check(std::string(pad, 'n') + ": value\r\n\r\n");
+        check("Name: " + std::string(pad, 'v') + "\r\nOther: x\r\n\r\n");
+        check("Name: " + std::string(pad, 'v') + "\r");
+        check("Name: " + std::string(pad, 'v'));
+    }
+
+    // Well-formed heads with many headers of random lengths
+    std::mt19937 rng(1);
+    for (int round = 0; round < 500; round++) {
+        std::string head;
+        int count = rng() % 40;
+        for (int i = 0; i < count; i++) {
+            head += std::string(1 + rng() % 20, 'a' + i % 26) + ":";
+            head += std::string(rng() % 100, ' ' + rng() % 26) + "\r\n";
+        }
+        head += "\r\n";
+        check(head);
+    }
+
+    // Random bytes made mostly of delimiters
+    const char alphabet[] = ":\r\n a";
+    for (int round = 0; round < 5000; round++) {
+        std::string head(rng() % 150, ' ');
+        for (char& c : head)
+            c = alphabet[rng() % 5];
+        if (rng() % 2)
+            head += "\r\n\r\n";
+        check(head);
+    }
+
+    // Framing of the body
+    {
+        Request req;
+        auto parse = [&](const std::string& src) { req = Request(); return req.parse(src.data(), src.size()); };
+        test(parse("POST / HTTP/1.1\r\nContent-Length: 5000000000\r\nExpect: 100-Continue\r\n\r\n"));
+        test(req.content_length() == 5000000000);
+        test(req.expects_continue());
+        test(!req.chunked());
+
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, Chunked \r\n\r\n"));
+        test(req.chunked());
+        test(!req.expects_continue());
+
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n"));
+        test(!req.chunked() && req.bad_transfer_encoding());
+
+        // The last coding must be chunked
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\nContent-Length: 3\r\n\r\n"));
+        test(!req.chunked() && req.bad_transfer_encoding());
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding:\r\n\r\n"));
+        test(!req.chunked() && req.bad_transfer_encoding());
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked;x=1\r\n\r\n"));
+        test(req.chunked() && !req.bad_transfer_encoding());
+        test(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\n"));
+        test(!req.chunked() && !req.bad_transfer_encoding());
+
+        // Every header counts, in order
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n"));
+        test(req.chunked() && !req.bad_transfer_encoding());
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n\r\n"));
+        test(!req.chunked() && req.bad_transfer_encoding());
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\ntransfer-encoding: chunked\r\n\r\n"));
+        test(!req.chunked() && req.bad_transfer_encoding());
+        test(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, , \r\n\r\n"));
+        test(req.chunked());
+
+        // Both framings
+        test(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n"));
+        test(req.chunked() && req.has(H::ContentLength) && req.transfer == Request::TRANSFER_CHUNKED);
+
+        // Framing headers can't be dropped past the limit
+        std::string head = "POST / HTTP/1.1\r\n";
+        for (int i = 0; i < MAX_REQUEST_HEADERS; i++)
+            head += "X: y\r\n";
+        test(!parse(head + "Transfer-Encoding: gzip\r\n\r\n"));
+        test(!parse(head + "Content-Length: 3\r\n\r\n"));
+        test(parse(head + "Accept: */*\r\n\r\n"));
+    }
+
+    // Index of the known headers
+    {
+        Request req;
+        auto parse = [&](const std::string& src) { req = Request(); return req.parse(src.data(), src.size()); };
+        auto get = [&](H name) {
+            Slice value;
+            if (!req.get(name, value))
+                return std::string("<missing>");
+            return std::string(value.str + value.off, value.len);
+        };
+
+        test(parse("GET / HTTP/1.1\r\nhOST:  example.com \r\nX-Other: 1\r\nCONTENT-LENGTH: 12\r\n"
+                   "If-None-Match: \"abc\"\r\nIf-Modified-Since: never\r\nCookie: a=b\r\n"
+                   "Host: second.com\r\nContent-Lengthy: 5\r\n\r\n"));
+        test(get(H::Host) == "example.com");
+        test(get(H::IfNoneMatch) == "\"abc\"");
+        test(get(H::IfModifiedSince) == "never");
+        test(get(H::Cookie) == "a=b");
+        test(get(H::AcceptEncoding) == "<missing>");
+        test(req.has(H::ContentLength) && !req.has(H::Range));
+        test(req.content_length() == 12);
+
+        Slice value;
+        test(req.find_header("content-length", value) && value.len == 2);
+        test(req.find_header("x-other", value) && value.len == 1);
+        test(!req.find_header("Accept", value));
+
+        // Conflicting or malformed lengths
+        test(parse("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n"));
+        test(req.content_length() == 5);
+        test(parse("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n"));
+        test(req.content_length() == -1);
+        test(parse("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n"));
+        test(req.content_length() == -1);
+
+        // Connection options
+        test(parse("GET / HTTP/1.1\r\n\r\n"));
+        test(req.connection == 0);
+        test(parse("GET / HTTP/1.1\r\nConnection: Keep-Alive, Upgrade\r\nconnection: CLOSE\r\n\r\n"));
+        test(req.connection == (Request::CONNECTION_CLOSE | Request::CONNECTION_KEEP_ALIVE | Request::CONNECTION_UPGRADE));
+        test(parse("GET / HTTP/1.1\r\nConnection: closed,keep\r\n\r\n"));
+        test(req.connection == 0);
+
+        // Protocol version
+        test(parse("GET / HTTP/1.1\r\n\r\n") && req.minor_version == 1);
+        test(parse("GET / HTTP/1.0\r\n\r\n") && req.minor_version == 0);
+        test(parse("GET / HTTP/1\r\n\r\n") && req.minor_version == 0);
+        test(!parse("GET / HTTP/2.0\r\n\r\n"));
+
+        // Headers past the limit aren't indexed
+        std::string head = "GET / HTTP/1.1\r\n";
+        for (int i = 0; i < MAX_REQUEST_HEADERS; i++)
+            head += "X: y\r\n";
+        head += "Host: late\r\n\r\n";
+        test(parse(head));
+        test(!req.has(H::Host) && req.ignored_count == 1);
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}
@@ -105,5 +105,36 @@ int main()
         test(q.pop(x) == false);
     }
 
+    {
+        Queue<int, 4> q;
+        int x;
+
+        // Items pushed at the front are popped first,
+        // also when the head wraps around
+        test(q.push(1) == true);
+        test(q.push_front(2) == true);
+        test(q.push(3) == true);
+        test(q.push_front(4) == true);
+        test(q.push_front(5) == false);
+        test(q.size() == 4);
+
+        test(q.pop(x) == true && x == 4);
+        test(q.pop(x) == true && x == 2);
+        test(q.pop(x) == true && x == 1);
+        test(q.pop(x) == true && x == 3);
+        test(q.empty() == true);
+
+        // Removed items leave no hole
+        test(q.push(1) == true);
+        test(q.push(2) == true);
+        test(q.push(3) == true);
+        test(q.remove(2) == true);
+        test(q.remove(2) == false);
+        test(q.size() == 2);
+        test(q.pop(x) == true && x == 1);
+        test(q.pop(x) == true && x == 3);
+        test(q.pop(x) == false);
+    }
+
     std::cout << "Passed\n";
 }
\ No newline at end of file
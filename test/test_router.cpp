@@ -0,0 +1,134 @@
+#include <string>
+#include <cstring>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/router.hpp"
+
+static Slice slice(const std::string& str)
+{
+    return Slice(str.data(), str.size());
+}
+
+static std::string str(Slice s)
+{
+    return std::string(s.str + s.off, s.len);
+}
+
+// Route "path" and return the handler, or the status
+// code if no handler was found. Captures are stored in
+// "params" and refer to "path".
+static int route(const Router<int>& router, Method method, const char *path, RouteParams& params)
+{
+    const int *handler;
+    int status = router.find(method, Slice(path, strlen(path)), handler, params);
+    return status == 200 ? *handler : status;
+}
+
+static int route(const Router<int>& router, Method method, const char *path)
+{
+    RouteParams params;
+    return route(router, method, path, params);
+}
+
+constexpr Route<int> table[] = {
+    { GET,  "/",                     1 },
+    { GET,  "/users",                2 },
+    { GET,  "/users/new",            3 },
+    { GET,  "/users/:id",            4 },
+    { POST, "/users/:id",            5 },
+    { GET,  "/users/:id/posts/:post", 6 },
+    { GET,  "/user",                 7 },
+    { GET,  "/static/*path",         8 },
+    { POST, "/users/new/:x",         9 },
+    { GET,  "/u/:a/x",               10 },
+    { GET,  "/u/*rest",              11 },
+};
+static_assert(valid_routes(table), "Invalid route table");
+
+static_assert(valid_route_pattern("/a/:b/*c"), "");
+static_assert(!valid_route_pattern("a"), "Must start with /");
+static_assert(!valid_route_pattern("/a:b"), "Capture in the middle of a segment");
+static_assert(!valid_route_pattern("/:"), "Missing name");
+static_assert(!valid_route_pattern("/*a/b"), "Wildcard not last");
+static_assert(!valid_route_pattern("/:a:b"), "");
+
+int main()
+{
+    Router<int> router(table);
+    RouteParams params;
+    Slice value;
+
+    // Static routes, including prefixes of each other
+    test(route(router, GET, "/") == 1);
+    test(route(router, GET, "/users") == 2);
+    test(route(router, GET, "/user") == 7);
+    test(route(router, GET, "/users/new") == 3);
+    test(route(router, GET, "/use") == 404);
+    test(route(router, GET, "/users/") == 404);
+    test(route(router, GET, "") == 404);
+
+    // Captures
+    const char *path = "/users/42/posts/hello";
+    test(route(router, GET, path, params) == 6);
+    test(params.count == 2);
+    test(params.get("id", value) && str(value) == "42");
+    test(value.str == path); // Not a copy
+    test(params.get("post", value) && str(value) == "hello");
+    test(!params.get("other", value));
+
+    test(route(router, GET, "/users/7", params) == 4);
+    test(params.get("id", value) && str(value) == "7");
+    test(route(router, POST, "/users/7", params) == 5);
+    test(route(router, GET, "/users/7/posts/") == 404);
+    test(route(router, GET, "/users/7/posts") == 404);
+
+    test(route(router, GET, "/static/css/main.css", params) == 8);
+    test(params.get("path", value) && str(value) == "css/main.css");
+    test(route(router, GET, "/static/", params) == 8);
+    test(params.get("path", value) && str(value) == "");
+    test(route(router, GET, "/static") == 404);
+
+    // Captures of a path that isn't at the start of its buffer
+    std::string head = "GET /users/99 HTTP/1.1";
+    Slice sub = slice(head);
+    sub.off = 4;
+    sub.len = 9;
+    const int *handler;
+    test(router.find(GET, sub, handler, params) == 200 && *handler == 4);
+    test(params.get("id", value) && str(value) == "99");
+
+    // A static edge that leads nowhere falls back to a capture
+    test(route(router, POST, "/users/new", params) == 5);
+    test(params.get("id", value) && str(value) == "new");
+    test(route(router, POST, "/users/new/1", params) == 9);
+    test(params.count == 1 && params.get("x", value) && str(value) == "1");
+    test(route(router, GET, "/u/a/x", params) == 10);
+    test(route(router, GET, "/u/a/y", params) == 11);
+    test(params.count == 1 && params.get("rest", value) && str(value) == "a/y");
+
+    // Wrong method
+    test(route(router, POST, "/users") == 405);
+    test(route(router, POST, "/static/a") == 405);
+
+    // Conflicts
+    test(!router.add(GET, "/users/:id", 0));
+    test(!router.add(GET, "/users/new/:y", 0)); // Other names
+    test(!router.add(GET, "bad", 0));
+    test(router.add(POST, "/users", 12));
+    test(route(router, POST, "/users") == 12);
+
+    // Many routes
+    Router<int> big;
+    for (int i = 0; i < 500; i++) {
+        std::string pattern = "/api/v1/resource" + std::to_string(i) + "/:id";
+        test(big.add(GET, pattern.c_str(), i));
+    }
+    for (int i = 0; i < 500; i += 7) {
+        std::string path = "/api/v1/resource" + std::to_string(i) + "/x";
+        test(route(big, GET, path.c_str()) == i);
+    }
+    test(route(big, GET, "/api/v1/resource500/x") == 404);
+
+    std::cout << "Passed\n";
+    return 0;
+}
@@ -0,0 +1,696 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sys/wait.h>
+#include "../src/server.hpp"
+#include "../bench/bench_utils.hpp"
+#include "test_utils.hpp" // After <atomic>, whose "atomic_flag::test" clashes with the macro
+
+// Answer the requests received within "ms" milliseconds
+template <typename S>
+static void pump(S& server, int ms)
+{
+    uint64_t deadline = monotonic_ms() + ms;
+    for (uint64_t now; (now = monotonic_ms()) < deadline; ) {
+        Request req;
+        if (server.try_wait(req, deadline - now)) {
+            server.status(200);
+            server.write("hello");
+            server.send();
+        }
+    }
+}
+
+// Serve until the server dropped its last client. Returns
+// the milliseconds it took, or -1 after "max_ms".
+template <typename S>
+static int time_until_dropped(S& server, int max_ms)
+{
+    uint64_t start = monotonic_ms();
+    do {
+        pump(server, 5);
+        if (server.metrics().active_clients.get() == 0)
+            return monotonic_ms() - start;
+    } while (monotonic_ms() - start < (uint64_t) max_ms);
+    return -1;
+}
+
+// Check that "fd" was closed by the peer, reading up to
+// "max" bytes that were still on their way
+static bool closed_by_peer(int fd, size_t max=0)
+{
+    char buf[65536];
+    size_t total = 0;
+    int n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        total += n;
+        if (total > max)
+            return false;
+    }
+    return n == 0;
+}
+
+static std::string str(const Slice& s)
+{
+    return std::string(s.str + s.off, s.len);
+}
+
+static void send_all(int fd, const std::string& data)
+{
+    test(send(fd, data.data(), data.size(), 0) == (int) data.size());
+}
+
+// What the handler of "serve" saw of a request
+struct Seen {
+    std::string path;
+    std::string body;      // As returned by "read_body"
+    std::string req_body;  // As found in "req.body"
+};
+
+// Serve requests for "ms" milliseconds, collecting the bytes
+// sent back on "fd". Requests for "/cached" are cached, those
+// for "/refuse" are answered without reading their body and
+// the others with their path and body.
+template <typename S>
+static std::string serve(S& server, int fd, int ms, std::vector<Seen> *seen=nullptr)
+{
+    std::string received;
+    uint64_t deadline = monotonic_ms() + ms;
+    while (monotonic_ms() < deadline) {
+
+        Request req;
+        if (server.try_wait(req, 5)) {
+            Seen s;
+            s.path = str(req.url.path);
+            s.req_body = str(req.body);
+            if (s.path != "/refuse") {
+                char buf[7];
+                int n;
+                while ((n = server.read_body(buf, sizeof(buf))) > 0)
+                    s.body.append(buf, n);
+            }
+
+            server.status(s.path == "/refuse" ? 413 : 200);
+            server.write((s.path + ":" + s.body).c_str());
+            if (s.path == "/cached")
+                server.cache(60000);
+            server.send();
+            if (seen)
+                seen->push_back(s);
+        }
+
+        char buf[4096];
+        int n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            received.append(buf, n);
+    }
+    return received;
+}
+
+static int count(const std::string& text, const std::string& part)
+{
+    int n = 0;
+    for (size_t i = text.find(part); i != std::string::npos; i = text.find(part, i + 1))
+        n++;
+    return n;
+}
+
+template <template <int> class Loop>
+static void test_requests(int port)
+{
+    ServerConfig config;
+    config.max_buffered_body = 16;
+    config.keep_alive_requests = 1000;
+    config.date_header = false;
+    config.metrics_path = "/metrics";
+
+    auto *server = new Server<16, Loop>(config);
+    test(server->listen(port, "127.0.0.1"));
+
+    int fd = connect_to(port);
+    test(fd >= 0);
+
+    {
+        // A request arriving in pieces is returned once, when
+        // its body is complete
+        std::vector<Seen> seen;
+        const char *pieces[] = { "POST /pie", "ces HTTP/1.1\r\nHost: x\r\nContent-Le", "ngth: 3\r\n\r\nab", "c" };
+        std::string received;
+        for (const char *piece : pieces) {
+            send_all(fd, piece);
+            received += serve(*server, fd, 20, &seen);
+        }
+        test(seen.size() == 1);
+        test(seen[0].path == "/pieces");
+        test(seen[0].req_body == "abc" && seen[0].body == "abc");
+        test(received == "HTTP/1.1 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 11        \r\n\r\n/pieces:abc");
+    }
+
+    {
+        // Pipelined requests are served in order. Those of the
+        // same connection are returned in a row.
+        int other = connect_to(port);
+        test(other >= 0);
+        send_all(fd, "GET /1 HTTP/1.1\r\n\r\nGET /2 HTTP/1.1\r\n\r\nGET /3 HTTP/1.1\r\n\r\n");
+        send_all(other, "GET /other HTTP/1.1\r\n\r\n");
+        usleep(10000);
+
+        std::vector<Seen> seen;
+        std::string received = serve(*server, fd, 50, &seen);
+        test(seen.size() == 4);
+        int first = seen[0].path == "/other" ? 1 : 0;
+        test(seen[first].path == "/1" && seen[first+1].path == "/2" && seen[first+2].path == "/3");
+        size_t p1 = received.find("/1:"), p2 = received.find("/2:"), p3 = received.find("/3:");
+        test(p1 != std::string::npos && p1 < p2 && p2 != std::string::npos && p2 < p3 && p3 != std::string::npos);
+        test(read_response(other));
+        close(other);
+    }
+
+    {
+        // Bodies longer than "max_buffered_body" or chunked
+        // are read as they arrive
+        std::vector<Seen> seen;
+        std::string body(100, 'b');
+        send_all(fd, "POST /long HTTP/1.1\r\nContent-Length: 100\r\n\r\n" + body);
+        send_all(fd, "POST /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                     "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n");
+        send_all(fd, "POST /short HTTP/1.1\r\nContent-Length: 5\r\n\r\nshort");
+        std::string received = serve(*server, fd, 50, &seen);
+        test(seen.size() == 3);
+        test(seen[0].path == "/long" && seen[0].body == body && seen[0].req_body.empty());
+        test(seen[1].path == "/chunked" && seen[1].body == "hello world" && seen[1].req_body.empty());
+        test(seen[2].path == "/short" && seen[2].body == "short" && seen[2].req_body == "short");
+        test(count(received, "HTTP/1.1 200 OK") == 3);
+    }
+
+    {
+        // The client is told to send a buffered body as soon
+        // as the head is received
+        std::vector<Seen> seen;
+        send_all(fd, "POST /continue HTTP/1.1\r\nContent-Length: 4\r\nExpect: 100-continue\r\n\r\n");
+        test(serve(*server, fd, 20, &seen) == "HTTP/1.1 100 Continue\r\n\r\n");
+        test(seen.empty());
+        send_all(fd, "body");
+        std::string received = serve(*server, fd, 20, &seen);
+        test(seen.size() == 1 && seen[0].body == "body");
+        test(received.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+    }
+
+    {
+        // A streamed body is asked for by "read_body". The
+        // client sends it once told to.
+        pid_t pid = fork();
+        if (pid == 0) {
+            char buf[64];
+            int n = recv(fd, buf, sizeof(buf), 0);
+            if (n > 0 && std::string(buf, n) == "HTTP/1.1 100 Continue\r\n\r\n")
+                send_all(fd, std::string(50, 'c'));
+            exit(0);
+        }
+        std::vector<Seen> seen;
+        send_all(fd, "POST /stream HTTP/1.1\r\nContent-Length: 50\r\nExpect: 100-continue\r\n\r\n");
+        std::string received = serve(*server, fd, 100, &seen);
+        waitpid(pid, nullptr, 0);
+        test(seen.size() == 1 && seen[0].body == std::string(50, 'c'));
+        test(received.find("/stream:ccc") != std::string::npos);
+    }
+
+    {
+        // A request that is cached is answered by the event loop
+        std::vector<Seen> seen;
+        send_all(fd, "GET /cached HTTP/1.1\r\n\r\n");
+        std::string first = serve(*server, fd, 20, &seen);
+        send_all(fd, "GET /cached HTTP/1.1\r\n\r\nGET /cached HTTP/1.1\r\n\r\n");
+        std::string hits = serve(*server, fd, 20, &seen);
+        test(seen.size() == 1);
+        test(first.find("/cached:") != std::string::npos);
+        test(hits == first + first);
+    }
+
+    {
+        // So are the metrics
+        std::vector<Seen> seen;
+        send_all(fd, "GET /metrics HTTP/1.1\r\n\r\n");
+        std::string received = serve(*server, fd, 20, &seen);
+        test(seen.empty());
+        test(received.find("\nhttp_connections_accepted_total 2\n") != std::string::npos);
+        test(received.find("\nhttp_parse_failures_total 0\n") != std::string::npos);
+    }
+
+    {
+        // A body that isn't read when the response is sent
+        // closes the connection. The client was never told
+        // to send it.
+        send_all(fd, "POST /refuse HTTP/1.1\r\nContent-Length: 50\r\nExpect: 100-continue\r\n\r\n");
+        std::string received = serve(*server, fd, 20);
+        test(received.compare(0, 12, "HTTP/1.1 413") == 0);
+        test(received.find("100 Continue") == std::string::npos);
+        test(received.find("Connection: Close") != std::string::npos);
+        test(closed_by_peer(fd));
+    }
+
+    close(fd);
+    delete server;
+}
+
+// Removing interest in an event drops it from the events
+// that were received but not reported yet
+template <template <int> class Loop>
+static void test_remove_events(int port)
+{
+    Socket listener;
+    test(listener.start_server(port, "127.0.0.1"));
+
+    Socket a(connect_to(port)), b(connect_to(port));
+    int tag_a, tag_b;
+    Loop<4> loop;
+    test(loop.add(a, Event::SEND, &tag_a));
+    test(loop.add(b, Event::SEND, &tag_b));
+
+    // Both sockets are writable, so reporting one event
+    // leaves the other buffered
+    Event event;
+    usleep(10000);
+    test(loop.wait_batch(&event, 1, 1000) == 1);
+    test(event.type == Event::SEND);
+    bool first_a = event.data == &tag_a;
+    loop.remove_events(first_a ? b : a, Event::SEND);
+
+    void *removed = first_a ? &tag_b : &tag_a;
+    for (int i = 0; i < 3; i++) {
+        int n = loop.wait_batch(&event, 1, 0);
+        test(n >= 0);
+        test(n == 0 || event.data != removed);
+    }
+}
+
+// A response that can't be sent before it's complete isn't
+// flushed while its handler waits for the request's body,
+// even if the output of the previous response is pending.
+template <template <int> class Loop>
+static void test_pending_output(int port)
+{
+    static char big[8 << 20];
+    memset(big, 'x', sizeof(big));
+
+    ServerConfig config;
+    config.max_buffered_body = 16;
+    config.response_window = 0;
+    config.date_header = false;
+
+    auto *server = new Server<16, Loop>(config);
+    test(server->listen(port, "127.0.0.1"));
+
+    int fd = connect_to(port);
+    test(fd >= 0);
+
+    const std::string tail = "/stream:" + std::string(50, 'c');
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Read part of the first response, then send the
+        // body of the second request and read the rest
+        std::string received;
+        char buf[65536];
+        int n;
+        uint64_t start = monotonic_ms();
+        while (monotonic_ms() - start < 30)
+            if ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+                received.append(buf, n);
+        send_all(fd, std::string(50, 'c'));
+        while (monotonic_ms() - start < 2000 && received.size() < sizeof(big) + tail.size())
+            if ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+                received.append(buf, n);
+        size_t second = received.find("HTTP/1.1 200 OK", sizeof(big));
+        size_t head_end = received.find("\r\n\r\n", second);
+        bool ok = second != std::string::npos && head_end != std::string::npos
+            && received.find("Content-Length: 58 ", second) < head_end
+            && received.compare(received.size() - tail.size(), tail.size(), tail) == 0;
+        exit(ok ? 0 : 1);
+    }
+
+    send_all(fd, "GET /big HTTP/1.1\r\n\r\n"
+                 "POST /stream HTTP/1.1\r\nContent-Length: 50\r\n\r\n");
+
+    int status = -1;
+    uint64_t start = monotonic_ms();
+    while (waitpid(pid, &status, WNOHANG) == 0 && monotonic_ms() - start < 3000) {
+        Request req;
+        if (!server->try_wait(req, 5))
+            continue;
+        server->status(200);
+        if (str(req.url.path) == "/big")
+            server->write_ref(big, sizeof(big));
+        else {
+            server->write("/stream:");
+            char buf[16];
+            int n;
+            while ((n = server->read_body(buf, sizeof(buf))) > 0)
+                server->write(buf, n);
+        }
+        server->send();
+    }
+    test(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    close(fd);
+    delete server;
+}
+
+#ifdef __linux__
+// Handler of the workers. It sleeps as many milliseconds as
+// the number at the start of the path, and paths containing
+// "close" close the connection.
+static void handle_job(Request& req, Response& res)
+{
+    std::string path = str(req.url.path);
+    usleep(atoi(path.c_str() + 1) * 1000);
+    res.status(200);
+    res.write(("<" + path + ">").c_str());
+    if (path.find("close") != std::string::npos)
+        res.close_connection();
+}
+
+// Like "serve" but through the workers. "closed" is set if
+// the server closed "fd".
+template <typename S>
+static std::string serve_steps(S& server, int fd, int ms, bool *closed=nullptr)
+{
+    std::string received;
+    uint64_t deadline = monotonic_ms() + ms;
+    while (monotonic_ms() < deadline) {
+        server.serve_step(5);
+
+        char buf[4096];
+        int n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            received.append(buf, n);
+        if (n == 0 && closed)
+            *closed = true;
+    }
+    return received;
+}
+
+template <template <int> class Loop>
+static void test_workers(int port)
+{
+    ServerConfig config;
+    config.keep_alive_requests = 1000;
+    config.date_header = false;
+
+    auto *server = new Server<16, Loop>(config);
+    test(server->listen(port, "127.0.0.1"));
+    test(server->start_workers(4, handle_job));
+
+    {
+        // Responses to pipelined requests are sent in the order
+        // of the requests even if they complete in reverse
+        int fd = connect_to(port);
+        test(fd >= 0);
+        send_all(fd, "GET /60 HTTP/1.1\r\n\r\nGET /40 HTTP/1.1\r\n\r\n"
+                     "GET /20 HTTP/1.1\r\n\r\nGET /0 HTTP/1.1\r\n\r\n");
+        std::string received = serve_steps(*server, fd, 200);
+        test(count(received, "HTTP/1.1 200 OK") == 4);
+        size_t p60 = received.find("</60>"), p40 = received.find("</40>");
+        size_t p20 = received.find("</20>"), p0  = received.find("</0>");
+        test(p60 < p40 && p40 < p20 && p20 < p0 && p0 != std::string::npos);
+        close(fd);
+    }
+
+    {
+        // The jobs of a client that went away are dropped
+        // when they complete
+        uint64_t responses = server->metrics().response_time.count();
+        int fd = connect_to(port);
+        test(fd >= 0);
+        send_all(fd, "GET /50 HTTP/1.1\r\n\r\nGET /0 HTTP/1.1\r\n\r\n");
+        serve_steps(*server, fd, 20);
+        close(fd);
+        int other = connect_to(port);
+        test(other >= 0);
+        serve_steps(*server, other, 100);
+        test(server->metrics().active_clients.get() == 1);
+        test(server->metrics().response_time.count() == responses);
+
+        // The server still responds
+        send_all(other, "GET /0 HTTP/1.1\r\n\r\n");
+        test(serve_steps(*server, other, 50).find("</0>") != std::string::npos);
+        close(other);
+    }
+
+    {
+        // A response that closes the connection drops those
+        // of the requests that follow, even completed ones
+        int fd = connect_to(port);
+        test(fd >= 0);
+        send_all(fd, "GET /40-close HTTP/1.1\r\n\r\nGET /0 HTTP/1.1\r\n\r\n");
+        bool closed = false;
+        std::string received = serve_steps(*server, fd, 150, &closed);
+        test(closed);
+        test(count(received, "HTTP/1.1 200 OK") == 1);
+        test(received.find("</40-close>") != std::string::npos);
+        test(received.find("Connection: Close") != std::string::npos);
+        test(received.find("</0>") == std::string::npos);
+        close(fd);
+    }
+
+    {
+        // An invalid request is answered with a 400 after
+        // the responses of the previous ones
+        int fd = connect_to(port);
+        test(fd >= 0);
+        send_all(fd, "GET /30 HTTP/1.1\r\n\r\nnot a request\r\n\r\n");
+        bool closed = false;
+        std::string received = serve_steps(*server, fd, 150, &closed);
+        test(closed);
+        size_t ok = received.find("</30>"), bad = received.find("HTTP/1.1 400 Bad Request");
+        test(ok != std::string::npos && bad != std::string::npos && ok < bad);
+        close(fd);
+    }
+
+    delete server;
+}
+#endif
+
+#if defined(__linux__) && defined(HTTP_COROUTINES)
+// Socket awaited by the "/readable" handlers
+static Socket *wake_socket;
+
+// Number of coroutine handlers whose frame was destroyed,
+// whether they completed or not
+static int frames_destroyed;
+
+struct FrameGuard {
+    ~FrameGuard() { frames_destroyed++; }
+};
+
+// Handler of "serve_async". "/sleep/N" sleeps N milliseconds,
+// "/readable" waits up to 50 milliseconds for "wake_socket"
+// and "/forever" doesn't complete.
+template <typename S>
+static Task<void> handle_call(S& server, Request& req, Response& res)
+{
+    FrameGuard guard;
+    std::string path = str(req.url.path);
+    bool ok = true;
+    if (path.compare(0, 7, "/sleep/") == 0)
+        ok = co_await server.sleep(atoi(path.c_str() + 7));
+    else if (path == "/readable")
+        ok = co_await server.readable(*wake_socket, 50);
+    else if (path == "/forever")
+        co_await server.sleep(60000);
+    res.status(200);
+    res.write(("<" + path + (ok ? ":ok>" : ":failed>")).c_str());
+}
+
+template <template <int> class Loop>
+static void test_async(int port)
+{
+    ServerConfig config;
+    config.keep_alive_requests = 1000;
+    config.date_header = false;
+
+    auto *server = new Server<16, Loop>(config);
+    test(server->listen(port, "127.0.0.1"));
+    test(server->start_async([server](Request& req, Response& res) {
+        return handle_call(*server, req, res);
+    }));
+
+    int fd = connect_to(port);
+    test(fd >= 0);
+
+    {
+        // A handler sleeping doesn't block the server, and
+        // responses are sent in the order of the requests
+        send_all(fd, "GET /sleep/40 HTTP/1.1\r\n\r\nGET /sleep/0 HTTP/1.1\r\n\r\n");
+        test(serve_steps(*server, fd, 20).empty());
+        test(server->pending_handlers() == 2);
+        std::string received = serve_steps(*server, fd, 60);
+        size_t p40 = received.find("</sleep/40:ok>"), p0 = received.find("</sleep/0:ok>");
+        test(p40 < p0 && p0 != std::string::npos);
+        test(server->pending_handlers() == 0);
+    }
+
+    {
+        // A handler waits for a socket, until it times out
+        // or the socket is readable
+        int pair[2];
+        test(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+        Socket wake(pair[0]);
+        wake_socket = &wake;
+
+        send_all(fd, "GET /readable HTTP/1.1\r\n\r\n");
+        test(serve_steps(*server, fd, 100).find("</readable:failed>") != std::string::npos);
+
+        send_all(fd, "GET /readable HTTP/1.1\r\n\r\n");
+        test(serve_steps(*server, fd, 10).empty());
+        test(write(pair[1], "x", 1) == 1);
+        test(serve_steps(*server, fd, 20).find("</readable:ok>") != std::string::npos);
+        close(pair[1]);
+    }
+
+    {
+        // A handler whose client went away is destroyed
+        // where it's suspended
+        int destroyed = frames_destroyed;
+        send_all(fd, "GET /forever HTTP/1.1\r\n\r\n");
+        test(serve_steps(*server, fd, 20).empty());
+        test(server->pending_handlers() == 1);
+        test(frames_destroyed == destroyed);
+        close(fd);
+        serve_steps(*server, -1, 20);
+        test(server->pending_handlers() == 0);
+        test(frames_destroyed == destroyed + 1);
+        test(server->metrics().active_clients.get() == 0);
+    }
+
+    // The frames went back to the slab, and were reused
+    test(server->frame_stats().bytes_in_use == 0);
+    test(server->frame_stats().hits > 0);
+
+    delete server;
+}
+#endif
+
+template <template <int> class Loop>
+static void test_timeouts(int port)
+{
+    ServerConfig config;
+    config.idle_timeout = 100;
+    config.request_timeout = 150;
+    config.write_timeout = 200;
+    config.response_window = 0;
+
+    auto *server = new Server<16, Loop>(config);
+    test(server->listen(port, "127.0.0.1"));
+
+    {
+        // Nothing received after the connection
+        int fd = connect_to(port);
+        test(fd >= 0);
+        pump(*server, 20);
+        test(server->metrics().active_clients.get() == 1);
+        int elapsed = time_until_dropped(*server, 1000);
+        test(elapsed >= 150 - 20 - 10 && elapsed < 1000);
+        test(closed_by_peer(fd));
+        close(fd);
+    }
+
+    {
+        // Request received too slowly
+        int fd = connect_to(port);
+        test(fd >= 0);
+        const char partial[] = "GET / HTTP/1.1\r\nHost: loc";
+        test(send(fd, partial, sizeof(partial)-1, 0) > 0);
+        int elapsed = time_until_dropped(*server, 1000);
+        test(elapsed >= 150 - 10 && elapsed < 1000);
+        test(closed_by_peer(fd));
+        close(fd);
+    }
+
+    {
+        // Nothing received after a response
+        int fd = connect_to(port);
+        test(fd >= 0);
+        const char request[] = "GET / HTTP/1.1\r\n\r\n";
+        test(send(fd, request, sizeof(request)-1, 0) > 0);
+
+        Request req;
+        test(server->try_wait(req, 1000));
+        server->status(200);
+        server->write("hello");
+        server->send();
+        pump(*server, 1);
+        test(read_response(fd));
+
+        int elapsed = time_until_dropped(*server, 1000);
+        test(elapsed >= 100 - 10 && elapsed < 1000);
+        test(closed_by_peer(fd));
+        close(fd);
+    }
+
+    {
+        // Response not read by the client. The output that
+        // wasn't sent yet is dropped with the connection.
+        static char big[16 << 20];
+        memset(big, 'x', sizeof(big));
+
+        int fd = connect_to(port);
+        test(fd >= 0);
+        const char request[] = "GET / HTTP/1.1\r\n\r\n";
+        test(send(fd, request, sizeof(request)-1, 0) > 0);
+
+        Request req;
+        test(server->try_wait(req, 1000));
+        server->status(200);
+        server->write_ref(big, sizeof(big));
+        server->send();
+
+        int elapsed = time_until_dropped(*server, 1000);
+        test(elapsed >= 200 - 10 && elapsed < 1000);
+        test(closed_by_peer(fd, sizeof(big) - 1));
+        close(fd);
+    }
+
+    delete server;
+}
+
+int main()
+{
+    test_requests<PollEventLoop>(8311);
+    #ifdef __linux__
+    test_requests<EpollEventLoop>(8312);
+    test_requests<UringEventLoop>(8313);
+    #endif
+
+    test_remove_events<PollEventLoop>(8331);
+    #ifdef __linux__
+    test_remove_events<EpollEventLoop>(8332);
+    test_remove_events<UringEventLoop>(8333);
+    #endif
+
+    test_pending_output<PollEventLoop>(8321);
+    #ifdef __linux__
+    test_pending_output<EpollEventLoop>(8322);
+    test_pending_output<UringEventLoop>(8323);
+    #endif
+
+    #ifdef __linux__
+    test_workers<PollEventLoop>(8341);
+    test_workers<EpollEventLoop>(8342);
+    test_workers<UringEventLoop>(8343);
+    #endif
+
+    #if defined(__linux__) && defined(HTTP_COROUTINES)
+    test_async<PollEventLoop>(8351);
+    test_async<EpollEventLoop>(8352);
+    test_async<UringEventLoop>(8353);
+    #endif
+
+    test_timeouts<PollEventLoop>(8301);
+    #ifdef __linux__
+    test_timeouts<EpollEventLoop>(8302);
+    test_timeouts<UringEventLoop>(8303);
+    #endif
+
+    std::cout << "Passed\n";
+    return 0;
+}
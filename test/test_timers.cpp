@@ -0,0 +1,126 @@
+#include <vector>
+#include <random>
+#include <iostream>
+#include "test_utils.hpp"
+#include "../src/timers.hpp"
+
+int main()
+{
+    {
+        TimerWheel wheel(1000);
+        Timer a, b, c;
+        test(wheel.timeout(1000) == -1);
+
+        wheel.set(&a, 1010);
+        wheel.set(&b, 1005);
+        wheel.set(&c, 5000);
+        test(wheel.size() == 3);
+        test(wheel.timeout(1000) == 5);
+
+        std::vector<Timer*> fired;
+        auto collect = [&](Timer *t) { fired.push_back(t); };
+
+        wheel.advance(1004, collect);
+        test(fired.empty());
+
+        wheel.advance(1010, collect);
+        test(fired.size() == 2 && fired[0] == &b && fired[1] == &a);
+        test(!a.active && !b.active && c.active);
+
+        wheel.cancel(&c);
+        test(wheel.size() == 0);
+        wheel.advance(10000, collect);
+        test(fired.size() == 2);
+
+        // Deadlines in the past expire at the next advance
+        wheel.set(&a, 0);
+        test(wheel.timeout(10000) == 0);
+        wheel.advance(10000, collect);
+        test(fired.size() == 3 && fired[2] == &a);
+
+        // Deadlines beyond the wheel's range are kept
+        wheel.set(&a, UINT64_MAX);
+        wheel.advance(1ULL << 40, collect);
+        test(fired.size() == 3 && a.active);
+        wheel.cancel(&a);
+    }
+
+    {
+        // Compare with a naive implementation using
+        // random deadlines and jumps of the clock.
+        constexpr int NUM = 500;
+        std::mt19937_64 rng(1);
+
+        uint64_t now = 123456789;
+        TimerWheel wheel(now);
+        std::vector<Timer> timers(NUM);
+        std::vector<uint64_t> expected(NUM, 0); // 0 means not scheduled
+
+        for (int i = 0; i < NUM; i++)
+            timers[i].data = (void*) (intptr_t) i;
+
+        bool ok = true;
+        for (int round = 0; round < 20000; round++) {
+
+            int i = rng() % NUM;
+            switch (rng() % 4) {
+
+                case 0:
+                case 1:
+                {
+                    uint64_t range[] = {10, 100, 5000, 300000, 100000000};
+                    uint64_t deadline = now + rng() % range[rng() % 5];
+                    wheel.set(&timers[i], deadline);
+                    expected[i] = deadline;
+                    break;
+                }
+
+                case 2:
+                wheel.cancel(&timers[i]);
+                expected[i] = 0;
+                break;
+
+                case 3:
+                {
+                    uint64_t range[] = {1, 50, 1000, 200000};
+                    uint64_t next = now + rng() % range[rng() % 4];
+
+                    uint64_t last = 0;
+                    wheel.advance(next, [&](Timer *t) {
+                        int j = (int) (intptr_t) t->data;
+                        if (expected[j] == 0 || expected[j] > next || expected[j] < last)
+                            ok = false;
+                        last = expected[j];
+                        expected[j] = 0;
+                    });
+                    now = next;
+
+                    // Everything that is due must have fired
+                    for (int j = 0; j < NUM; j++)
+                        if (expected[j] != 0 && expected[j] <= now)
+                            ok = false;
+                    break;
+                }
+            }
+
+            // The timeout never overshoots the nearest deadline
+            uint64_t nearest = UINT64_MAX;
+            int count = 0;
+            for (int j = 0; j < NUM; j++)
+                if (expected[j]) {
+                    count++;
+                    if (expected[j] < nearest)
+                        nearest = expected[j];
+                }
+            int timeout = wheel.timeout(now);
+            if (count != wheel.size())
+                ok = false;
+            if (count == 0 ? timeout != -1 : (timeout < 0 || now + timeout > nearest))
+                ok = false;
+        }
+        test(ok);
+    }
+
+    std::cout << "Passed\n";
+    return 0;
+}